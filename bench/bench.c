@@ -0,0 +1,445 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Microbenchmarks for the packet decoding hot path.  Each function
+   is timed on a fixed corpus of synthetic packets, after a warm-up
+   run, and the median and minimum of several runs are reported.
+   Usage: bench [NAME...], where NAME selects benchmarks by prefix. */
+
+#include "config.h"
+#include "dns.h"
+#include "forward.h"
+#include "ipv4.h"
+
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+#include <x86intrin.h>
+#define HAVE_CYCLES 1
+#endif
+
+#define RUNS 7
+/* Number of timed runs per benchmark, after one warm-up run. */
+
+#define RUN_NANOSECONDS 20000000ULL
+/* Target duration of a single run. */
+
+#define CORPUS_REPEAT 64
+/* Number of copies of each packet in a corpus, so that the loop
+   overhead is amortized. */
+
+typedef struct
+{
+  const char *name;
+  char data[1500];
+  size_t length;                /* whole IP packet */
+  ipv4_header_t ip;             /* decoded header, even if invalid */
+} packet_t;
+/* A corpus packet.  The UDP header starts at offset 20, and the DNS
+   header at offset 28. */
+
+static packet_t corpus[8];
+static unsigned corpus_count;
+
+static volatile unsigned long sink;
+/* Prevents the compiler from discarding the results. */
+
+/* Stores the UDP checksum of PACKET. */
+static void
+set_udp_checksum (packet_t *packet)
+{
+  unsigned char *p = (unsigned char *)packet->data;
+  size_t length = packet->length - 20;
+  uint16_t checksum;
+
+  p[26] = 0;
+  p[27] = 0;
+  checksum = ipv4_checksum_reference
+    (packet->data + 20, length,
+     ipv4_pseudo_header_checksum (&packet->ip, length));
+  if (checksum == 0)
+    checksum = 0xFFFF;
+  p[26] = checksum >> 8;
+  p[27] = checksum;
+}
+
+/* Appends a UDP packet with a DNS payload of PAYLOAD bytes (at least
+   12) to the corpus, with the DNS header flags FLAGS. */
+static packet_t *
+add_packet (const char *name, unsigned payload, uint16_t flags,
+            uint16_t ancount)
+{
+  packet_t *packet = corpus + corpus_count++;
+  unsigned char *p = (unsigned char *)packet->data;
+  uint16_t checksum;
+  unsigned j;
+
+  packet->name = name;
+  packet->length = 28 + payload;
+  memset (p, 0, packet->length);
+
+  /* IPv4 header: 192.0.2.53 -> 198.51.100.1, UDP. */
+  p[0] = 0x45;
+  p[2] = packet->length >> 8;
+  p[3] = packet->length;
+  p[8] = 64;
+  p[9] = 17;
+  memcpy (p + 12, "\xC0\x00\x02\x35\xC6\x33\x64\x01", 8);
+  checksum = ipv4_checksum_reference (packet->data, 20, 0);
+  p[10] = checksum >> 8;
+  p[11] = checksum;
+  if (!ipv4_header_decode (packet->data, packet->length, &packet->ip))
+    abort ();
+
+  /* UDP header, port 53 -> 1024. */
+  p[20] = 0;
+  p[21] = 53;
+  p[22] = 1024 >> 8;
+  p[23] = 1024 & 0xFF;
+  p[24] = (8 + payload) >> 8;
+  p[25] = 8 + payload;
+
+  /* DNS header and some payload which looks like compressed
+     resource records. */
+  p[28] = 0x12;
+  p[29] = 0x34;
+  p[30] = flags >> 8;
+  p[31] = flags;
+  p[33] = 1;
+  p[34] = ancount >> 8;
+  p[35] = ancount;
+  for (j = 40; j < packet->length; ++j)
+    p[j] = j * 7;
+
+  set_udp_checksum (packet);
+  return packet;
+}
+
+/* Appends a UDP packet with the DNS message MESSAGE (LENGTH bytes) to
+   the corpus. */
+static void
+add_message (const char *name, const char *message, size_t length)
+{
+  packet_t *packet = add_packet (name, length, 0, 0);
+
+  memcpy (packet->data + 28, message, length);
+  set_udp_checksum (packet);
+}
+
+static const char resolver_answer[] =
+  "\x12\x34\x81\x80\x00\x01\x00\x04\x00\x02\x00\x03"
+  "\x03" "www" "\x07" "example" "\x03" "com" "\x00" "\x00\x01\x00\x01"
+  "\xc0\x0c" "\x00\x05\x00\x01\x00\x00\x0e\x10\x00\x06" "\x03" "web" "\xc0\x10"
+  "\xc0\x2d" "\x00\x01\x00\x01\x00\x00\x00\x3c\x00\x04" "\xc0\x00\x02\x01"
+  "\xc0\x2d" "\x00\x01\x00\x01\x00\x00\x00\x3c\x00\x04" "\xc0\x00\x02\x02"
+  "\xc0\x2d" "\x00\x01\x00\x01\x00\x00\x00\x3c\x00\x04" "\xc0\x00\x02\x03"
+  "\xc0\x10" "\x00\x02\x00\x01\x00\x01\x51\x80\x00\x06" "\x03" "ns1" "\xc0\x10"
+  "\xc0\x10" "\x00\x02\x00\x01\x00\x01\x51\x80\x00\x06" "\x03" "ns2" "\xc0\x10"
+  "\xc0\x6f" "\x00\x01\x00\x01\x00\x01\x51\x80\x00\x04" "\xc0\x00\x02\x35"
+  "\xc0\x81" "\x00\x01\x00\x01\x00\x01\x51\x80\x00\x04" "\xc0\x00\x02\x36"
+  "\x00" "\x00\x29\x10\x00\x00\x00\x00\x00\x00\x00";
+/* A recursive resolver's answer, with a CNAME, compressed names and
+   an EDNS record. */
+
+static void
+build_corpus (void)
+{
+  packet_t *packet;
+
+  add_packet ("answer", 120, 0x8400, 2);
+  add_packet ("large-answer", 480, 0x8400, 12);
+  add_packet ("question", 40, 0x0100, 0);
+
+  packet = add_packet ("bad-ip-checksum", 120, 0x8400, 2);
+  packet->data[10] ^= 0x55;
+
+  packet = add_packet ("bad-udp-checksum", 120, 0x8400, 2);
+  packet->data[27] ^= 0x55;
+
+  add_packet ("overlong", 1200, 0x8400, 40);
+
+  add_message ("resolver-answer", resolver_answer,
+               sizeof (resolver_answer) - 1);
+}
+
+/* The benchmarks.  Each processes CORPUS_REPEAT copies of PACKET and
+   returns a value derived from the results. */
+
+static unsigned long
+bench_ipv4_header_decode (const packet_t *packet)
+{
+  unsigned long result = 0;
+  ipv4_header_t header;
+  unsigned j;
+
+  for (j = 0; j < CORPUS_REPEAT; ++j)
+    result += ipv4_header_decode (packet->data, packet->length, &header);
+  return result;
+}
+
+static unsigned long
+bench_udp_header_decode (const packet_t *packet)
+{
+  unsigned long result = 0;
+  udp_header_t header;
+  unsigned j;
+
+  for (j = 0; j < CORPUS_REPEAT; ++j)
+    result += udp_header_decode (packet->data + 20, packet->length - 20,
+                                 &packet->ip, &header);
+  return result;
+}
+
+static unsigned long
+bench_ipv4_checksum (const packet_t *packet)
+{
+  unsigned long result = 0;
+  uint32_t start = ipv4_pseudo_header_checksum (&packet->ip,
+                                                packet->length - 20);
+  unsigned j;
+
+  for (j = 0; j < CORPUS_REPEAT; ++j)
+    result += ipv4_checksum (packet->data + 20, packet->length - 20, start);
+  return result;
+}
+
+static unsigned long
+bench_dns_header_decode (const packet_t *packet)
+{
+  unsigned long result = 0;
+  dns_header_t header;
+  unsigned j;
+
+  for (j = 0; j < CORPUS_REPEAT; ++j)
+    result += dns_header_decode (packet->data + 28, packet->length - 28,
+                                 &header);
+  return result;
+}
+
+static unsigned long
+bench_dns_parse (const packet_t *packet)
+{
+  const char *message = packet->data + 28;
+  size_t length = packet->length - 28;
+  unsigned long result = 0;
+  dns_header_t header;
+  dns_parser_t parser;
+  dns_rr_t rr;
+  unsigned j;
+
+  for (j = 0; j < CORPUS_REPEAT; ++j)
+    if (dns_header_decode (message, length, &header))
+      {
+        dns_parser_init (&parser, message, length, &header);
+        while (dns_parser_next (&parser, &rr) > 0)
+          result += rr.type + rr.rdlength;
+      }
+  return result;
+}
+
+/* Like bench_dns_parse, but decodes the owner names as well. */
+static unsigned long
+bench_dns_name_decode (const packet_t *packet)
+{
+  const char *message = packet->data + 28;
+  size_t length = packet->length - 28;
+  unsigned char name[DNS_NAME_MAX];
+  unsigned long result = 0;
+  dns_header_t header;
+  dns_parser_t parser;
+  dns_rr_t rr;
+  unsigned j;
+
+  for (j = 0; j < CORPUS_REPEAT; ++j)
+    if (dns_header_decode (message, length, &header))
+      {
+        dns_parser_init (&parser, message, length, &header);
+        while (dns_parser_next (&parser, &rr) > 0)
+          {
+            size_t offset = rr.name;
+
+            result += dns_name_decode (message, length, &offset, name);
+          }
+      }
+  return result;
+}
+
+static unsigned long
+bench_forward_decode_encode (const packet_t *packet)
+{
+  static forward_t record;
+  unsigned long result = 0;
+  size_t length;
+  ipv4_t source;
+  unsigned j;
+
+  for (j = 0; j < CORPUS_REPEAT; ++j)
+    if (forward_decode_encode (packet->data, packet->length, &record,
+                               &length, &source))
+      result += length;
+  return result;
+}
+
+static unsigned long
+bench_forward_decode (const packet_t *packet)
+{
+  static forward_t header;
+  unsigned long result = 0;
+  size_t header_length, payload_length;
+  ipv4_t source;
+  unsigned j;
+
+  for (j = 0; j < CORPUS_REPEAT; ++j)
+    if (forward_decode (packet->data, packet->length, &header,
+                        &header_length, &payload_length, &source))
+      result += payload_length;
+  return result;
+}
+
+static const struct
+{
+  const char *name;
+  unsigned long (*run) (const packet_t *);
+} benchmarks[] =
+  {
+    { "ipv4_header_decode", bench_ipv4_header_decode },
+    { "udp_header_decode", bench_udp_header_decode },
+    { "ipv4_checksum", bench_ipv4_checksum },
+    { "dns_header_decode", bench_dns_header_decode },
+    { "dns_parse", bench_dns_parse },
+    { "dns_name_decode", bench_dns_name_decode },
+    { "forward_decode", bench_forward_decode },
+    { "forward_decode_encode", bench_forward_decode_encode },
+  };
+
+static uint64_t
+now_nanoseconds (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t
+now_cycles (void)
+{
+#ifdef HAVE_CYCLES
+  return __rdtsc ();
+#else
+  return 0;
+#endif
+}
+
+static int
+compare_doubles (const void *left, const void *right)
+{
+  double l = *(const double *)left;
+  double r = *(const double *)right;
+
+  return l < r ? -1 : l > r;
+}
+
+/* Times RUN on PACKET and prints a result line. */
+static void
+measure (const char *name, unsigned long (*run) (const packet_t *),
+         const packet_t *packet)
+{
+  double nanoseconds[RUNS];
+  double cycles[RUNS];
+  unsigned long iterations = 1;
+  unsigned long j;
+  unsigned k;
+  double packets;
+
+  /* Warm-up, which also determines the number of iterations per
+     run. */
+  for (;;)
+    {
+      uint64_t start = now_nanoseconds ();
+
+      for (j = 0; j < iterations; ++j)
+        sink += run (packet);
+      if (now_nanoseconds () - start >= RUN_NANOSECONDS / 4)
+        break;
+      iterations *= 2;
+    }
+  iterations *= 4;
+  packets = (double)iterations * CORPUS_REPEAT;
+
+  for (k = 0; k < RUNS; ++k)
+    {
+      uint64_t start = now_nanoseconds ();
+      uint64_t start_cycles = now_cycles ();
+
+      for (j = 0; j < iterations; ++j)
+        sink += run (packet);
+      cycles[k] = (now_cycles () - start_cycles) / packets;
+      nanoseconds[k] = (now_nanoseconds () - start) / packets;
+    }
+  qsort (nanoseconds, RUNS, sizeof (nanoseconds[0]), compare_doubles);
+  qsort (cycles, RUNS, sizeof (cycles[0]), compare_doubles);
+
+  printf ("%-22s %-17s %9.2f %9.2f %12.0f", name, packet->name,
+          nanoseconds[RUNS / 2], nanoseconds[0],
+          1e9 / nanoseconds[RUNS / 2]);
+#ifdef HAVE_CYCLES
+  printf (" %11.3f\n", cycles[RUNS / 2] / packet->length);
+#else
+  printf (" %11s\n", "-");
+#endif
+}
+
+/* Returns nonzero if NAME is selected by the command line
+   arguments. */
+static int
+selected (int argc, char **argv, const char *name)
+{
+  int j;
+
+  if (argc <= 1)
+    return 1;
+  for (j = 1; j < argc; ++j)
+    if (strncmp (name, argv[j], strlen (argv[j])) == 0)
+      return 1;
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  unsigned j, k;
+
+  build_corpus ();
+
+  printf ("%-22s %-17s %9s %9s %12s %11s\n", "benchmark", "packet",
+          "ns/packet", "min", "packets/s", "cycles/byte");
+  for (j = 0; j < sizeof (benchmarks) / sizeof (benchmarks[0]); ++j)
+    if (selected (argc, argv, benchmarks[j].name))
+      for (k = 0; k < corpus_count; ++k)
+        measure (benchmarks[j].name, benchmarks[j].run, corpus + k);
+#ifdef HAVE_CYCLES
+  puts ("(cycles are TSC reference cycles; ns/packet is the median of "
+        "the runs)");
+#endif
+  return 0;
+}
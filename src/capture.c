@@ -17,30 +17,158 @@
  */
 
 #include "capture.h"
+#include "capture_file.h"
+#include "capture_ring.h"
+#include "capture_xdp.h"
+#include "checkpoint.h"
 #include "log.h"
 #include "ipv4.h"
 #include "forward.h"
+#include "link.h"
+#include "option.h"
+#include "sender.h"
 
+#include <errno.h>
 #include <pcap.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef HAVE_LINUX_IF_PACKET_H
+#include <linux/if_packet.h>
+#include <sys/socket.h>
+#endif
+
 static const char* capture_interface;
 static const char* capture_filter;
 /* Stores the strings passed on the command line. */
 
-static pcap_t *pcap = 0;
-static char pcap_errbuf[PCAP_ERRBUF_SIZE];
-static struct bpf_program pcap_filter;
+struct capture_worker
+{
+  unsigned index;
+
+  pcap_t *pcap;
+  char pcap_errbuf[PCAP_ERRBUF_SIZE];
+  struct bpf_program pcap_filter;
+  link_decoder_t pcap_link_decoder; /* strips the link layer header */
+  unsigned pcap_dropped;        /* last value of ps_drop */
+  /* Interface to libpcap. */
+
+  capture_ring_t *ring;
+  /* State of the ring capture method. */
+
+  queue_t *queues[FORWARD_MAX_TARGETS];
+  forward_channel_t channels[FORWARD_MAX_TARGETS];
+  /* Records are handed to the sender threads through QUEUES (one per
+     forward target).  If the sender threads are disabled, they are
+     sent over CHANNELS directly. */
+
+  time_t last_stats;
+  unsigned packets_received;
+  unsigned bytes_received;
+  unsigned packets_forwarded;
+  unsigned bytes_forwarded;
+  unsigned packets_dropped;
+  /* These counters are only incremented, and only by the thread
+     running the worker.  The checkpoint code computes differences. */
+};
+
+static capture_worker_t workers[CAPTURE_MAX_WORKERS];
+static unsigned worker_count = 1;
+
+static int fanout_type = -1;
+/* The PACKET_FANOUT mode used if there are several workers. */
+
 static void callback (u_char *closure, const struct pcap_pkthdr *header, const u_char *packet);
 /* Interface to libpcap. */
 
-static unsigned pcap_link_layer;
-/* Length of the link layer header. */
+static void open_and_wait (capture_worker_t *worker, unsigned *retries);
+/* Tries to open the capture device.  Waits in case of failure. */
+
+static pthread_mutex_t compile_lock = PTHREAD_MUTEX_INITIALIZER;
+/* pcap_compile is not reentrant in older libpcap versions. */
 
-static void open_and_wait (void);
-/* Tries to open the pcap library.  Waits in case of failure. */
+static enum { METHOD_PCAP, METHOD_RING, METHOD_XDP, METHOD_FILE } capture_method = METHOD_PCAP;
+/* The capture method selected with capture_set_method (or
+   capture_read_file). */
+
+void
+capture_set_method (const char *spec)
+{
+  char *copy = strdup (spec);
+  char *options = strchr (copy, ',');
+
+  if (options)
+    *options++ = 0;
+
+  if (strcmp (copy, "pcap") == 0)
+    {
+      if (options)
+        log_fatal ("The pcap capture method does not take any options.");
+      capture_method = METHOD_PCAP;
+    }
+  else if (strcmp (copy, "ring") == 0)
+    {
+      capture_ring_configure (options);
+      capture_method = METHOD_RING;
+    }
+  else if (strcmp (copy, "xdp") == 0)
+    {
+      capture_xdp_configure (options);
+      capture_method = METHOD_XDP;
+    }
+  else
+    log_fatal ("Unknown capture method '%s'.", copy);
+}
+
+void
+capture_read_file (const char *spec)
+{
+  capture_file_configure (strdup (spec));
+  capture_method = METHOD_FILE;
+}
+
+void
+capture_set_workers (const char *spec)
+{
+  char *copy = strdup (spec);
+  char *options = strchr (copy, ',');
+  char *name, *value;
+
+  if (options)
+    *options++ = 0;
+
+  worker_count = option_unsigned ("-w", copy);
+  if (worker_count == 0 || worker_count > CAPTURE_MAX_WORKERS)
+    log_fatal ("The number of workers must be between 1 and %u.",
+               CAPTURE_MAX_WORKERS);
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+  fanout_type = PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG;
+  while (option_next (&options, &name, &value))
+    if (strcmp (name, "fanout") == 0)
+      {
+        if (value && strcmp (value, "hash") == 0)
+          fanout_type = PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG;
+        else if (value && strcmp (value, "cpu") == 0)
+          fanout_type = PACKET_FANOUT_CPU;
+        else if (value && strcmp (value, "rollover") == 0)
+          fanout_type = PACKET_FANOUT_ROLLOVER;
+        else
+          log_fatal ("Fanout mode must be 'hash', 'cpu' or 'rollover'.");
+      }
+    else
+      option_unknown ("-w", name);
+#else
+  if (worker_count > 1)
+    log_fatal ("Multiple workers require PACKET_FANOUT (Linux only).");
+  while (option_next (&options, &name, &value))
+    option_unknown ("-w", name);
+#endif
+}
 
 void
 capture_open (const char *interface, const char *filter)
@@ -49,58 +177,203 @@ capture_open (const char *interface, const char *filter)
   capture_filter = filter;
 }
 
+int
+capture_fanout_argument (int *argument)
+{
+  if (worker_count == 1)
+    return 0;
+  /* The group ID only has to be unique on this host.  The value is
+     negative if PACKET_FANOUT_FLAG_DEFRAG is set. */
+  *argument = (getpid () & 0xffff) | ((unsigned)fanout_type << 16);
+  return 1;
+}
+
 static time_t last_checkpoint;
 unsigned capture_log_interval = 3600;
-static unsigned packets_received = 0;
-static unsigned bytes_received = 0;
-static unsigned packets_forwarded = 0;
-static unsigned bytes_forwarded = 0;
-static unsigned packets_dropped = 0;
+
+static void *run_worker (void *);
 
 void
 capture_run (void)
 {
+  unsigned j, k;
+
   time (&last_checkpoint);
 
+  if (worker_count > 1 && capture_method == METHOD_XDP)
+    log_fatal ("The xdp capture method does not support multiple workers.");
+  if (worker_count > 1 && capture_method == METHOD_FILE)
+    log_fatal ("Reading from a file does not support multiple workers.");
+
+  for (j = 0; j < worker_count; ++j)
+    {
+      workers[j].index = j;
+      for (k = 0; k < forward_target_count (); ++k)
+        if (sender_enabled ())
+          workers[j].queues[k] = sender_attach (k);
+        else
+          forward_channel_init (workers[j].channels + k, k);
+      if (capture_method == METHOD_RING)
+        workers[j].ring = capture_ring_new ();
+    }
+  if (sender_enabled ())
+    sender_start ();
+
+  /* The calling thread runs the first worker. */
+  for (j = 1; j < worker_count; ++j)
+    {
+      pthread_t thread;
+      int result = pthread_create (&thread, 0, run_worker, workers + j);
+
+      if (result != 0)
+        log_fatal ("Could not start capture worker: %s.", strerror (result));
+    }
+  run_worker (workers);
+}
+
+/* Sends all records which are still pending, for WORKER. */
+static void
+finish (capture_worker_t *worker)
+{
+  unsigned j;
+
+  if (worker->queues[0])
+    sender_stop ();
+  else
+    for (j = 0; j < forward_target_count (); ++j)
+      forward_flush (worker->channels + j);
+}
+
+static void *
+run_worker (void *closure)
+{
+  capture_worker_t *worker = closure;
+  unsigned retries = 0;
+
   /* Try to open the device.  Continue if capturing failes by
      reopening the device. */
   for (;;)
     {
-      open_and_wait ();
+      open_and_wait (worker, &retries);
 
-      if (pcap_loop (pcap, -1, callback, 0)  == -1)
-        log_warn ("Capture loop terminated: %s.", pcap_geterr (pcap));
+      if (capture_method == METHOD_RING)
+        {
+          capture_ring_run (worker->ring, worker);
+          log_warn ("Capture loop terminated");
+        }
+      else if (capture_method == METHOD_XDP)
+        {
+          capture_xdp_run (worker);
+          log_warn ("Capture loop terminated");
+        }
+      else if (capture_method == METHOD_FILE)
+        {
+          capture_file_run (worker);
+          finish (worker);
+          capture_file_report ();
+          exit (0);
+        }
       else
-        log_warn ("Capture loop terminated");
+        {
+          int result;
+
+          /* With a read timeout, pcap_dispatch returns periodically,
+             so that pending records can be flushed. */
+          do
+            {
+              result = pcap_dispatch (worker->pcap, -1, callback, (u_char *)worker);
+              capture_idle (worker);
+            }
+          while (result >= 0);
+
+          if (result == -1)
+            log_warn ("Capture loop terminated: %s.", pcap_geterr (worker->pcap));
+          else
+            log_warn ("Capture loop terminated");
+        }
     }
+  return 0;
+}
+
+int
+capture_compile (struct bpf_program *program, int link_type,
+                 const char *filter, int first)
+{
+  pcap_t *dead;
+  int result = 0;
+
+  pthread_mutex_lock (&compile_lock);
+  dead = pcap_open_dead (link_type, 65535);
+  if (dead == 0)
+    log_fatal ("Could not allocate pcap handle for filter compilation.");
+  if (pcap_compile (dead, program, (char *)link_filter (link_type, filter),
+                    1, 0) == -1)
+    {
+      if (first)
+        log_fatal ("Could not compile filter program '%s': %s.",
+                   filter, pcap_geterr (dead));
+      log_warn ("Could not compile filter program '%s': %s.",
+                filter, pcap_geterr (dead));
+      result = -1;
+    }
+  pcap_close (dead);
+  pthread_mutex_unlock (&compile_lock);
+  return result;
 }
 
 static
-void open_and_wait (void)
+void open_and_wait (capture_worker_t *worker, unsigned *retries)
 {
   /* Count the number of retries.  During the first call, a filter
      expression error is fatal. */
-  static unsigned retries = 0;
-#define LOG_MAYBE_FATAL(X) do { if (retries == 1) log_fatal X; else log_warn X; sleep (5); } while (0)
+#define LOG_MAYBE_FATAL(X) do { if (*retries == 1) log_fatal X; else log_warn X; sleep (5); } while (0)
+
+  ++*retries;
+
+  if (capture_method == METHOD_RING)
+    {
+      while (capture_ring_open (worker->ring, capture_interface, capture_filter,
+                                *retries == 1) < 0)
+        sleep (5);
+      return;
+    }
+  if (capture_method == METHOD_XDP)
+    {
+      while (capture_xdp_open (capture_interface, capture_filter,
+                               *retries == 1) < 0)
+        sleep (5);
+      return;
+    }
+  if (capture_method == METHOD_FILE)
+    {
+      capture_file_open (capture_filter);
+      return;
+    }
 
-  ++retries;
   for (;;) {
+    int result;
+#ifdef HAVE_LINUX_IF_PACKET_H
+    int fanout;
+#endif
 
     /* Close the pcap interface if it is not already open. */
-    if (pcap != 0)
+    if (worker->pcap != 0)
       {
-        pcap_close (pcap);
-        pcap_freecode (&pcap_filter);
-        pcap = 0;
+        pcap_close (worker->pcap);
+        pcap_freecode (&worker->pcap_filter);
+        worker->pcap = 0;
       }
 
     /* Open the device.  Try again until success. */
-    pcap = pcap_open_live (capture_interface, 65535, 1, 0, pcap_errbuf);
-    if (UNLIKELY (pcap == 0)) {
+    worker->pcap = pcap_open_live (capture_interface, 65535, 1,
+                                   capture_idle_timeout () > 0
+                                   ? capture_idle_timeout () : 0,
+                                   worker->pcap_errbuf);
+    if (UNLIKELY (worker->pcap == 0)) {
       if (capture_interface)
-        log_warn ("Could not open capture device '%s': %s.", capture_interface, pcap_errbuf);
+        log_warn ("Could not open capture device '%s': %s.", capture_interface, worker->pcap_errbuf);
       else
-        log_warn ("Could not open capture device: %s.", pcap_errbuf);
+        log_warn ("Could not open capture device: %s.", worker->pcap_errbuf);
 
       /* Sleep a bit so that our busy-waiting approach does not really
          hurt. */
@@ -110,86 +383,242 @@ void open_and_wait (void)
 
     /* Now try to set the filter expression.  Here, a failure is fatal
        if we are trying for the first time. */
-    if (pcap_compile (pcap, &pcap_filter, (char *)capture_filter, 1, 0) == -1)
+    pthread_mutex_lock (&compile_lock);
+    result = pcap_compile (worker->pcap, &worker->pcap_filter,
+                           (char *)link_filter (pcap_datalink (worker->pcap),
+                                                capture_filter), 1, 0);
+    pthread_mutex_unlock (&compile_lock);
+    if (result == -1)
       {
-        LOG_MAYBE_FATAL (("Could not compile filter program '%s': %s.", capture_filter, pcap_geterr (pcap)));
+        LOG_MAYBE_FATAL (("Could not compile filter program '%s': %s.", capture_filter, pcap_geterr (worker->pcap)));
         continue;
       }
-    if (pcap_setfilter (pcap, &pcap_filter) == -1)
+    if (pcap_setfilter (worker->pcap, &worker->pcap_filter) == -1)
       {
-        LOG_MAYBE_FATAL (("Could not apply filter programs '%s': %s.", capture_filter, pcap_geterr (pcap)));
+        LOG_MAYBE_FATAL (("Could not apply filter programs '%s': %s.", capture_filter, pcap_geterr (worker->pcap)));
         continue;
       }
 
-    /* Determine the link layer type and the number of bytes in the header. */
-    switch (pcap_datalink(pcap))
+#ifdef HAVE_LINUX_IF_PACKET_H
+    /* Join the fanout group, so that the kernel distributes the
+       packets among the workers. */
+    if (capture_fanout_argument (&fanout))
       {
-      case DLT_EN10MB:
-        pcap_link_layer = 14;
-        break;
-
-      case DLT_LINUX_SLL:
-        pcap_link_layer = 16;
-        break;
+        if (setsockopt (pcap_fileno (worker->pcap), SOL_PACKET, PACKET_FANOUT,
+                        &fanout, sizeof (fanout)) < 0)
+          {
+            log_warn ("Could not join packet fanout group: %s.", strerror (errno));
+            sleep (5);
+            continue;
+          }
+      }
+#endif
 
-      default:
+    /* Select the decoder for the link layer header. */
+    worker->pcap_link_decoder = link_decoder (pcap_datalink (worker->pcap));
+    if (worker->pcap_link_decoder == 0)
+      {
 #ifdef HAVE_PCAP_DATALINK_VAL_TO_NAME
-        log_fatal ("Could not determine link layer header length for %s (%d).",
-                   pcap_datalink_val_to_name(pcap_datalink(pcap)), pcap_datalink(pcap));
+        log_fatal ("Unsupported link layer type %s (%d).",
+                   pcap_datalink_val_to_name(pcap_datalink(worker->pcap)), pcap_datalink(worker->pcap));
 #else
-        log_fatal ("Could not determine link layer header length for link type %d.",
-                   pcap_datalink(pcap));
+        log_fatal ("Unsupported link layer type %d.",
+                   pcap_datalink(worker->pcap));
 #endif
       }
 
     /* No packets have been dropped so far. */
-    packets_dropped = 0;
+    worker->pcap_dropped = 0;
 
     /* We have successfully set up the capture process. */
     break;
   }
 }
 
+static struct bpf_program user_filter;
+static int user_filter_compiled = 0;
+/* Filter program for capture methods which cannot apply the filter
+   in the kernel. */
+
+int
+capture_filter_compile (const char *filter, int first)
+{
+  if (user_filter_compiled)
+    {
+      pcap_freecode (&user_filter);
+      user_filter_compiled = 0;
+    }
+  if (capture_compile (&user_filter, DLT_EN10MB, filter, first) < 0)
+    return -1;
+  user_filter_compiled = 1;
+  return 0;
+}
+
+int
+capture_filter_match (const char *packet, size_t length)
+{
+  return bpf_filter (user_filter.bf_insns, (const u_char *)packet,
+                     length, length) != 0;
+}
+
 static void
 callback (u_char *closure, const struct pcap_pkthdr *header, const u_char *packet)
 {
-  /* Check that we have capture enough bytes to cover the link layer
-     header. */
+  capture_worker_t *worker = (capture_worker_t *)closure;
   size_t size = header->caplen;
-  if (UNLIKELY (size < pcap_link_layer))
+  const char *ip;
+
+  /* Skip the link layer header, and discard frames which are
+     truncated or do not carry IP. */
+  ip = worker->pcap_link_decoder ((const char *)packet, &size);
+  if (UNLIKELY (ip == 0))
     return;
-  SKIP_BUFFER (packet, size, pcap_link_layer);
 
-  ++packets_received;
-  bytes_received += size;
+  capture_packet (worker, ip, size, header->ts.tv_sec);
+}
 
-  /* Parse the packet and forward it if necessary. */
-  if (forward_process ((const char *)packet, size))
-    {
-      ++packets_forwarded;
-      bytes_forwarded += size;
-    }
+/* Adds the packets dropped by the kernel since the last call to the
+   counters of WORKER. */
+static void
+update_dropped (capture_worker_t *worker)
+{
+  struct pcap_stat ps;
 
-  /* Write a log checkpoint if the timeout has passed. */
-  if (header->ts.tv_sec > last_checkpoint + capture_log_interval)
+  if (capture_method == METHOD_RING)
+    worker->packets_dropped += capture_ring_dropped (worker->ring);
+  else if (capture_method == METHOD_XDP)
+    worker->packets_dropped += capture_xdp_dropped ();
+  else if (worker->pcap && pcap_stats (worker->pcap, &ps) == 0)
     {
-      struct pcap_stat ps;
-
-      pcap_stats (pcap, &ps);
-      syslog (LOG_INFO, "%u packets/%u bytes received, "
-              "%u packets/%u bytes forwarded, %u packets dropped",
-              packets_received, bytes_received,
-              packets_forwarded, bytes_forwarded,
-              (unsigned)(ps.ps_drop - packets_dropped));
-
-      last_checkpoint = header->ts.tv_sec;
-      packets_received = bytes_received = 0;
-      packets_forwarded = bytes_forwarded = 0;
+      worker->packets_dropped += ps.ps_drop - worker->pcap_dropped;
 #ifdef __linux__
       /* On Linux, the dropped packet count is automatically reset. */
-      packets_dropped = 0;
+      worker->pcap_dropped = 0;
 #else
-      packets_dropped = ps.ps_drop;
+      worker->pcap_dropped = ps.ps_drop;
 #endif
     }
 }
+
+#define COUNTERS 5
+/* Number of counters in capture_worker_t. */
+
+/* Copies the counters of WORKER to RESULT. */
+static void
+read_counters (const capture_worker_t *worker, unsigned *result)
+{
+  result[0] = __atomic_load_n (&worker->packets_received, __ATOMIC_RELAXED);
+  result[1] = __atomic_load_n (&worker->bytes_received, __ATOMIC_RELAXED);
+  result[2] = __atomic_load_n (&worker->packets_forwarded, __ATOMIC_RELAXED);
+  result[3] = __atomic_load_n (&worker->bytes_forwarded, __ATOMIC_RELAXED);
+  result[4] = __atomic_load_n (&worker->packets_dropped, __ATOMIC_RELAXED);
+}
+
+/* Writes a checkpoint log entry with the activity since the previous
+   one. */
+static void
+write_checkpoint (void)
+{
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  static unsigned last[CAPTURE_MAX_WORKERS][COUNTERS];
+  unsigned received[CAPTURE_MAX_WORKERS];
+  unsigned totals[COUNTERS];
+  checkpoint_t checkpoint;
+  unsigned j, k;
+
+  pthread_mutex_lock (&lock);
+
+  memset (totals, 0, sizeof (totals));
+  for (j = 0; j < worker_count; ++j)
+    {
+      unsigned current[COUNTERS];
+
+      read_counters (workers + j, current);
+      for (k = 0; k < COUNTERS; ++k)
+        {
+          totals[k] += current[k] - last[j][k];
+          if (k == 0)
+            received[j] = current[k] - last[j][k];
+          last[j][k] = current[k];
+        }
+    }
+
+  checkpoint.length = 0;
+  checkpoint_printf (&checkpoint, "%u packets/%u bytes received, "
+                     "%u packets/%u bytes forwarded, %u packets dropped",
+                     totals[0], totals[1], totals[2], totals[3], totals[4]);
+  if (worker_count > 1)
+    {
+      checkpoint_printf (&checkpoint, ", per worker:");
+      for (j = 0; j < worker_count; ++j)
+        checkpoint_printf (&checkpoint, "%s%u", j ? "/" : " ", received[j]);
+      checkpoint_printf (&checkpoint, " packets");
+    }
+  checkpoint_report (&checkpoint);
+  syslog (LOG_INFO, "%s", checkpoint.text);
+
+  pthread_mutex_unlock (&lock);
+}
+
+int
+capture_idle_timeout (void)
+{
+  /* The sender thread flushes expired records on its own. */
+  if (sender_enabled ())
+    return -1;
+  return forward_idle_timeout ();
+}
+
+void
+capture_idle (capture_worker_t *worker)
+{
+  unsigned j;
+
+  if (worker->queues[0] == 0)
+    for (j = 0; j < forward_target_count (); ++j)
+      forward_flush_expired (worker->channels + j);
+}
+
+int
+capture_packet (capture_worker_t *worker, const char *packet, size_t size, time_t now)
+{
+  time_t last;
+  int forwarded = 0;
+
+  ++worker->packets_received;
+  worker->bytes_received += size;
+
+  /* Parse the packet and forward it if necessary. */
+  if (worker->queues[0])
+    {
+      if (forward_enqueue (worker->queues, packet, size))
+        {
+          ++worker->packets_forwarded;
+          worker->bytes_forwarded += size;
+          sender_wake ();
+          forwarded = 1;
+        }
+    }
+  else if (forward_process (worker->channels, packet, size))
+    {
+      ++worker->packets_forwarded;
+      worker->bytes_forwarded += size;
+      forwarded = 1;
+    }
+
+  /* Sample the kernel drop counters at most once per second. */
+  if (UNLIKELY (now != worker->last_stats))
+    {
+      worker->last_stats = now;
+      update_dropped (worker);
+
+      /* Write a log checkpoint if the timeout has passed.  If there
+         are several workers, the first one to notice writes it. */
+      last = __atomic_load_n (&last_checkpoint, __ATOMIC_RELAXED);
+      if (now > last + capture_log_interval
+          && __atomic_compare_exchange_n (&last_checkpoint, &last, now, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        write_checkpoint ();
+    }
+  return forwarded;
+}
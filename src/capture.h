@@ -21,6 +21,33 @@
 
 #include "config.h"
 
+#include <time.h>
+
+#define CAPTURE_MAX_WORKERS 64
+/* Upper limit for the number of capture workers. */
+
+typedef struct capture_worker capture_worker_t;
+/* A capture worker, which runs in its own thread and uses its own
+   capture socket and queue to the sender thread. */
+
+void capture_set_method (const char *spec);
+/* Selects the capture method.  SPEC is "pcap" (the default), "ring"
+   or "xdp", optionally followed by a comma and a list of method-specific
+   options.  Terminates the program on error. */
+
+void capture_read_file (const char *spec);
+/* Reads packets from a pcap or pcapng file instead of capturing
+   them, and terminates the program at the end of the file.  SPEC is
+   the file name, optionally followed by ",speed=S" (see
+   capture_file_configure).  Terminates the program on error. */
+
+void capture_set_workers (const char *spec);
+/* Sets the number of capture workers.  SPEC is a number, optionally
+   followed by ",fanout=MODE", where MODE is "hash" (the default),
+   "cpu" or "rollover".  The workers join a PACKET_FANOUT group, so
+   that the kernel distributes the packets among them.  Terminates
+   the program on error. */
+
 void capture_open (const char *interface, const char *filter);
 /* Opens INTERFACE, with filter expression FILTER.  Note that
    INTERFACE and FILTER are usually not checked immediately.
@@ -30,6 +57,43 @@ void capture_open (const char *interface, const char *filter);
 void capture_run (void);
 /* Starts capturing (and forwarding) packets. */
 
+int capture_packet (capture_worker_t *worker, const char *packet, size_t length, time_t now);
+/* Called by the capture methods for each PACKET captured by WORKER.
+   PACKET starts at the network layer header.  NOW is the capture
+   timestamp, used to schedule checkpoint log entries.  Returns
+   nonzero if the packet has been forwarded. */
+
+int capture_idle_timeout (void);
+/* Returns the maximum time (in milliseconds) capture methods may
+   block waiting for packets before calling capture_idle, or -1 if
+   they may block indefinitely. */
+
+void capture_idle (capture_worker_t *worker);
+/* Performs periodic work for WORKER, such as flushing records which
+   have been held back for too long. */
+
+int capture_fanout_argument (int *argument);
+/* If there are several workers, stores the PACKET_FANOUT socket
+   option value which capture sockets have to use in *ARGUMENT and
+   returns nonzero.  Returns zero if there is only one worker. */
+
+struct bpf_program;
+int capture_compile (struct bpf_program *program, int link_type,
+                     const char *filter, int first);
+/* Compiles FILTER for the DLT_ link type LINK_TYPE and stores the
+   result in PROGRAM.  Returns 0 on success, and -1 on failure (after
+   logging a message).  If FIRST is true, a failure is fatal.  Can be
+   called from multiple threads. */
+
+int capture_filter_compile (const char *filter, int first);
+/* Compiles FILTER for use with capture_filter_match, for Ethernet
+   frames.  Returns 0 on success, and -1 on failure (after logging a
+   message).  If FIRST is true, a failure is fatal. */
+
+int capture_filter_match (const char *packet, size_t length);
+/* Returns nonzero if the Ethernet frame at PACKET matches the filter
+   compiled by capture_filter_compile. */
+
 extern unsigned capture_log_interval;
 /* After capture_log_interval seconds have elapsed, a new log entry is
    created. */
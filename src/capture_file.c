@@ -0,0 +1,594 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "capture_file.h"
+#include "capture.h"
+#include "forward.h"
+#include "link.h"
+#include "log.h"
+#include "option.h"
+#include "sender.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pcap.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *file_name;
+static double file_speed;
+/* Set by capture_file_configure.  A speed of zero means that
+   packets are not paced. */
+
+static const unsigned char *file_data;
+static size_t file_length;
+/* The memory-mapped file. */
+
+static int file_pcapng;
+static int file_swapped;
+/* File format, and whether the byte order differs from ours.  For
+   pcapng, the byte order is determined per section. */
+
+typedef struct
+{
+  link_decoder_t decoder;       /* null if the link type is unsupported */
+  uint64_t resolution;          /* timestamp units per second */
+  struct bpf_program filter;
+} interface_t;
+/* A capture interface.  Classic pcap files have just one. */
+
+static interface_t *interfaces;
+static unsigned interface_count;
+static unsigned interface_allocated;
+static const char *interface_filter;
+/* If INTERFACE_FILTER is a null pointer, no filter is compiled. */
+
+typedef void (*handler_t) (void *closure, const interface_t *interface,
+                           const unsigned char *packet, size_t length,
+                           size_t wire_length, uint64_t timestamp);
+/* Called for each packet in the file, including the link layer
+   header.  TIMESTAMP is in nanoseconds since the epoch. */
+
+enum
+  {
+    FILE_DROP_TRUNCATED,        /* truncated packet record */
+    FILE_DROP_NOT_IP,           /* truncated link layer header, or not IP */
+    FILE_DROP_LINK_TYPE,        /* unsupported link layer */
+    FILE_DROP_FILTER,           /* rejected by the filter expression */
+    FILE_DROP_REASONS
+  };
+
+static const char *const file_drop_reasons[FILE_DROP_REASONS] =
+  {
+    "truncated",
+    "not IP",
+    "unsupported link type",
+    "filtered",
+  };
+
+static unsigned long packets_read;
+static unsigned long bytes_read;
+static unsigned long packets_forwarded;
+static unsigned long file_drops[FILE_DROP_REASONS];
+static struct timespec started;
+/* Statistics for capture_file_report. */
+
+#define PCAP_MAGIC_MICRO 0xa1b2c3d4
+#define PCAP_MAGIC_NANO 0xa1b23c4d
+#define PCAPNG_SECTION 0x0A0D0D0A
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4D
+#define PCAPNG_INTERFACE 1
+#define PCAPNG_PACKET 2
+#define PCAPNG_SIMPLE_PACKET 3
+#define PCAPNG_ENHANCED_PACKET 6
+#define PCAPNG_OPTION_TSRESOL 9
+/* Constants from the pcap and pcapng file formats. */
+
+void
+capture_file_configure (char *spec)
+{
+  char *options = strchr (spec, ',');
+  char *name, *value;
+
+  if (options)
+    *options++ = 0;
+  if (*spec == 0)
+    log_fatal ("Missing file name for -r.");
+  file_name = spec;
+
+  while (option_next (&options, &name, &value))
+    if (strcmp (name, "speed") == 0)
+      {
+        char *end;
+
+        if (value && strcmp (value, "max") == 0)
+          file_speed = 0;
+        else
+          {
+            if (value == 0)
+              log_fatal ("Missing value for speed.");
+            file_speed = strtod (value, &end);
+            if (*end || !(file_speed > 0))
+              log_fatal ("Speed must be 'max' or a positive number.");
+          }
+      }
+    else
+      option_unknown ("-r", name);
+}
+
+static uint16_t
+get16 (const unsigned char *p)
+{
+  uint16_t value;
+
+  memcpy (&value, p, sizeof (value));
+  return file_swapped ? __builtin_bswap16 (value) : value;
+}
+
+static uint32_t
+get32 (const unsigned char *p)
+{
+  uint32_t value;
+
+  memcpy (&value, p, sizeof (value));
+  return file_swapped ? __builtin_bswap32 (value) : value;
+}
+
+/* Adds an interface with the link type LINK_TYPE (a LINKTYPE_ value
+   from the file) and RESOLUTION timestamp units per second. */
+static void
+add_interface (unsigned link_type, uint64_t resolution)
+{
+  interface_t *interface;
+  int dlt = link_type;
+
+  if (interface_count == interface_allocated)
+    {
+      interface_allocated = interface_allocated ? 2 * interface_allocated : 4;
+      interfaces = realloc (interfaces,
+                            interface_allocated * sizeof (*interfaces));
+      if (interfaces == 0)
+        log_fatal ("Out of memory.");
+    }
+  interface = interfaces + interface_count++;
+  interface->resolution = resolution;
+
+  /* The pcap LINKTYPE_ value of raw IP differs from the DLT_ value. */
+  if (link_type == 101)
+    dlt = DLT_RAW;
+  interface->decoder = link_decoder (dlt);
+  if (interface->decoder == 0)
+    {
+      log_warn ("Skipping packets with unsupported link type %u.", link_type);
+      return;
+    }
+  if (interface_filter)
+    capture_compile (&interface->filter, dlt, interface_filter, 1);
+}
+
+int
+capture_file_detect (const char *data, size_t length)
+{
+  uint32_t magic;
+
+  if (length < 4)
+    return 0;
+  memcpy (&magic, data, sizeof (magic));
+  return magic == PCAPNG_SECTION
+    || magic == PCAP_MAGIC_MICRO || magic == PCAP_MAGIC_NANO
+    || magic == __builtin_bswap32 (PCAP_MAGIC_MICRO)
+    || magic == __builtin_bswap32 (PCAP_MAGIC_NANO);
+}
+
+/* Maps FILE_NAME into memory and reads the file header.  Previously
+   mapped files are unmapped first. */
+static void
+map_file (void)
+{
+  struct stat st;
+  int fd;
+  uint32_t magic;
+  unsigned j;
+
+  if (file_data)
+    munmap ((void *)file_data, file_length);
+  if (interface_filter)
+    for (j = 0; j < interface_count; ++j)
+      if (interfaces[j].decoder)
+        pcap_freecode (&interfaces[j].filter);
+  interface_count = 0;
+  file_pcapng = 0;
+
+  fd = open (file_name, O_RDONLY);
+  if (fd < 0)
+    log_fatal ("Could not open '%s': %s.", file_name, strerror (errno));
+  if (fstat (fd, &st) < 0)
+    log_fatal ("Could not stat '%s': %s.", file_name, strerror (errno));
+  file_length = st.st_size;
+  if (file_length < 24)
+    log_fatal ("File '%s' is too short.", file_name);
+  file_data = mmap (0, file_length, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (file_data == MAP_FAILED)
+    log_fatal ("Could not map '%s': %s.", file_name, strerror (errno));
+  close (fd);
+  madvise ((void *)file_data, file_length, MADV_SEQUENTIAL);
+
+  memcpy (&magic, file_data, sizeof (magic));
+  if (!capture_file_detect ((const char *)file_data, file_length))
+    log_fatal ("File '%s' is not in pcap or pcapng format.", file_name);
+  if (magic == PCAPNG_SECTION)
+    {
+      /* Interfaces are described by blocks inside the file. */
+      file_pcapng = 1;
+      return;
+    }
+
+  file_swapped = magic != PCAP_MAGIC_MICRO && magic != PCAP_MAGIC_NANO;
+
+  /* The upper bits of the link type field carry FCS information. */
+  add_interface (get32 (file_data + 20) & 0xFFFF,
+                 get32 (file_data) == PCAP_MAGIC_NANO
+                 ? 1000000000 : 1000000);
+}
+
+void
+capture_file_open (const char *filter)
+{
+  interface_filter = filter;
+  map_file ();
+}
+
+/* Returns the time in nanoseconds since the epoch, given TICKS in
+   the timestamp units of INTERFACE. */
+static uint64_t
+to_nanoseconds (const interface_t *interface, uint64_t ticks)
+{
+  uint64_t seconds = ticks / interface->resolution;
+  uint64_t fraction = ticks % interface->resolution;
+
+  return seconds * 1000000000ULL
+    + (uint64_t)((double)fraction * 1e9 / interface->resolution);
+}
+
+static uint64_t
+elapsed_nanoseconds (const struct timespec *since)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) * 1000000000ULL
+    + now.tv_nsec - since->tv_nsec;
+}
+
+/* Sleeps until the packet with the timestamp TIMESTAMP (in
+   nanoseconds) is due, based on the first packet and the selected
+   speed.  Pending records are flushed while waiting. */
+static void
+pace (capture_worker_t *worker, uint64_t timestamp)
+{
+  static uint64_t first;
+  static struct timespec first_processed;
+  static int have_first;
+  uint64_t due, now;
+
+  if (!have_first)
+    {
+      first = timestamp;
+      clock_gettime (CLOCK_MONOTONIC, &first_processed);
+      have_first = 1;
+      return;
+    }
+  if (timestamp <= first)
+    return;
+  due = (uint64_t)((timestamp - first) / file_speed);
+
+  while ((now = elapsed_nanoseconds (&first_processed)) < due)
+    {
+      int timeout = capture_idle_timeout ();
+      uint64_t delay = due - now;
+      struct timespec ts;
+
+      if (timeout <= 0)
+        timeout = 100;
+      if (delay > timeout * 1000000ULL)
+        delay = timeout * 1000000ULL;
+      ts.tv_sec = delay / 1000000000ULL;
+      ts.tv_nsec = delay % 1000000000ULL;
+      nanosleep (&ts, 0);
+      capture_idle (worker);
+    }
+}
+
+/* Processes a single packet, captured on INTERFACE (a handler_t).
+   CLOSURE is the capture worker. */
+static void
+process (void *closure, const interface_t *interface,
+         const unsigned char *packet, size_t length, size_t wire_length,
+         uint64_t timestamp)
+{
+  capture_worker_t *worker = closure;
+  const char *ip;
+
+  ++packets_read;
+  bytes_read += length;
+
+  if (UNLIKELY (interface->decoder == 0))
+    {
+      ++file_drops[FILE_DROP_LINK_TYPE];
+      return;
+    }
+  if (interface_filter
+      && !bpf_filter (interface->filter.bf_insns, packet, wire_length, length))
+    {
+      ++file_drops[FILE_DROP_FILTER];
+      return;
+    }
+
+  ip = interface->decoder ((const char *)packet, &length);
+  if (UNLIKELY (ip == 0))
+    {
+      ++file_drops[FILE_DROP_NOT_IP];
+      return;
+    }
+
+  if (file_speed > 0)
+    pace (worker, timestamp);
+  if (capture_packet (worker, ip, length, time (0)))
+    ++packets_forwarded;
+
+  /* Flush records which have been waiting for too long, and replay
+     spooled records, as a live capture method would. */
+  if ((packets_read & 4095) == 0)
+    capture_idle (worker);
+}
+
+/* Calls HANDLER for the records of a classic pcap file. */
+static void
+run_pcap (handler_t handler, void *closure)
+{
+  size_t offset = 24;
+
+  while (file_length - offset >= 16)
+    {
+      const unsigned char *header = file_data + offset;
+      uint32_t length = get32 (header + 8);
+
+      offset += 16;
+      if (length > file_length - offset)
+        {
+          log_warn ("File '%s' ends with a truncated packet.", file_name);
+          ++file_drops[FILE_DROP_TRUNCATED];
+          return;
+        }
+      handler (closure, interfaces, file_data + offset, length,
+               get32 (header + 12),
+               to_nanoseconds (interfaces,
+                               (uint64_t)get32 (header)
+                               * interfaces->resolution + get32 (header + 4)));
+      offset += length;
+    }
+}
+
+/* Parses the options of an interface description block (BODY, with
+   LENGTH bytes), and returns the timestamp resolution. */
+static uint64_t
+interface_resolution (const unsigned char *body, size_t length)
+{
+  size_t offset = 8;
+
+  while (offset + 4 <= length)
+    {
+      unsigned code = get16 (body + offset);
+      unsigned option_length = get16 (body + offset + 2);
+
+      offset += 4;
+      if (code == 0 || option_length > length - offset)
+        break;
+      if (code == PCAPNG_OPTION_TSRESOL && option_length >= 1)
+        {
+          unsigned exponent = body[offset] & 0x7F;
+          uint64_t resolution = 1;
+
+          if (body[offset] & 0x80)
+            {
+              if (exponent < 64)
+                return 1ULL << exponent;
+            }
+          else if (exponent <= 19)
+            {
+              while (exponent--)
+                resolution *= 10;
+              return resolution;
+            }
+          log_fatal ("Unsupported timestamp resolution in '%s'.", file_name);
+        }
+      offset += (option_length + 3) & ~3u;
+    }
+  return 1000000;
+}
+
+/* Calls HANDLER for the packet blocks of a pcapng file. */
+static void
+run_pcapng (handler_t handler, void *closure)
+{
+  size_t offset = 0;
+  unsigned section_interfaces = 0;
+
+  while (file_length - offset >= 12)
+    {
+      const unsigned char *block = file_data + offset;
+      const unsigned char *body = block + 8;
+      uint32_t type, length;
+      const interface_t *interface;
+      uint32_t captured;
+
+      memcpy (&type, block, sizeof (type));
+      if (type == PCAPNG_SECTION)
+        {
+          uint32_t order;
+
+          /* Each section has its own byte order and interfaces. */
+          memcpy (&order, body, sizeof (order));
+          if (order == PCAPNG_BYTE_ORDER)
+            file_swapped = 0;
+          else if (order == __builtin_bswap32 (PCAPNG_BYTE_ORDER))
+            file_swapped = 1;
+          else
+            log_fatal ("Invalid pcapng section header in '%s'.", file_name);
+          section_interfaces = interface_count;
+        }
+      type = get32 (block);
+      length = get32 (block + 4);
+      if (length < 12 || length % 4 != 0 || length > file_length - offset)
+        {
+          log_warn ("File '%s' ends with a truncated or invalid block.",
+                    file_name);
+          ++file_drops[FILE_DROP_TRUNCATED];
+          return;
+        }
+      offset += length;
+      length -= 12;             /* the body length */
+
+      switch (type)
+        {
+        case PCAPNG_INTERFACE:
+          if (length < 8)
+            log_fatal ("Invalid pcapng interface block in '%s'.", file_name);
+          add_interface (get16 (body), interface_resolution (body, length));
+          break;
+
+        case PCAPNG_ENHANCED_PACKET:
+        case PCAPNG_PACKET:
+          if (length < 20)
+            break;
+          if (type == PCAPNG_PACKET)
+            captured = get16 (body);
+          else
+            captured = get32 (body);
+          if (captured >= interface_count - section_interfaces)
+            log_fatal ("Packet for unknown interface in '%s'.", file_name);
+          interface = interfaces + section_interfaces + captured;
+          captured = get32 (body + 12);
+          if (captured > length - 20)
+            {
+              ++file_drops[FILE_DROP_TRUNCATED];
+              break;
+            }
+          handler (closure, interface, body + 20, captured, get32 (body + 16),
+                   to_nanoseconds (interface,
+                                   ((uint64_t)get32 (body + 4) << 32)
+                                   | get32 (body + 8)));
+          break;
+
+        case PCAPNG_SIMPLE_PACKET:
+          /* No timestamp, and always the first interface. */
+          if (length < 4 || interface_count == section_interfaces)
+            break;
+          interface = interfaces + section_interfaces;
+          captured = get32 (body);
+          if (captured > length - 4)
+            captured = length - 4;
+          handler (closure, interface, body + 4, captured, get32 (body),
+                   0);
+          break;
+        }
+    }
+}
+
+void
+capture_file_run (capture_worker_t *worker)
+{
+  clock_gettime (CLOCK_MONOTONIC, &started);
+  if (file_pcapng)
+    run_pcapng (process, worker);
+  else
+    run_pcap (process, worker);
+}
+
+typedef struct
+{
+  capture_file_callback_t callback;
+  void *closure;
+} each_closure_t;
+
+/* Strips the link layer header and passes the packet to the callback
+   of capture_file_each (a handler_t). */
+static void
+each_packet (void *closure, const interface_t *interface,
+             const unsigned char *packet, size_t length, size_t wire_length,
+             uint64_t timestamp)
+{
+  each_closure_t *each = closure;
+  const char *ip;
+
+  (void)wire_length;
+  (void)timestamp;
+  if (interface->decoder == 0)
+    return;
+  ip = interface->decoder ((const char *)packet, &length);
+  if (ip != 0)
+    each->callback (each->closure, ip, length);
+}
+
+void
+capture_file_each (const char *name, capture_file_callback_t callback,
+                   void *closure)
+{
+  each_closure_t each;
+
+  each.callback = callback;
+  each.closure = closure;
+  file_name = name;
+  interface_filter = 0;
+  map_file ();
+  if (file_pcapng)
+    run_pcapng (each_packet, &each);
+  else
+    run_pcap (each_packet, &each);
+}
+
+void
+capture_file_report (void)
+{
+  double seconds = elapsed_nanoseconds (&started) / 1e9;
+  unsigned j;
+
+  if (seconds <= 0)
+    seconds = 1e-9;
+  printf ("%lu packets/%lu bytes read in %.3f seconds\n",
+          packets_read, bytes_read, seconds);
+  printf ("%.0f packets/s, %.0f bytes/s\n",
+          packets_read / seconds, bytes_read / seconds);
+  printf ("%lu packets forwarded\n", packets_forwarded);
+  for (j = 0; j < FILE_DROP_REASONS; ++j)
+    if (file_drops[j])
+      printf ("%lu packets dropped: %s\n", file_drops[j], file_drop_reasons[j]);
+  for (j = 0; j < FORWARD_DROP_REASONS; ++j)
+    if (forward_drops[j])
+      printf ("%u packets dropped: %s\n", forward_drops[j],
+              forward_drop_reason (j));
+  if (sender_enabled () && sender_dropped ())
+    printf ("%u records dropped: queue full\n", sender_dropped ());
+  fflush (stdout);
+}
@@ -0,0 +1,63 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef CAPTURE_FILE_H
+#define CAPTURE_FILE_H
+
+#include "config.h"
+#include "capture.h"
+
+/* Offline input from pcap and pcapng files.  The file is mapped into
+   memory, and every packet is passed to capture_packet, exactly like
+   captured packets.  This is used to replay recorded traffic against
+   a collector, and to measure throughput. */
+
+void capture_file_configure (char *spec);
+/* Parses SPEC, the file name, optionally followed by ",speed=S".
+   With S = "max" (the default), packets are processed as fast as
+   possible.  Otherwise, S is a positive number, and the packets are
+   paced according to their timestamps, S times faster than real
+   time.  Terminates the program on error. */
+
+void capture_file_open (const char *filter);
+/* Maps the file and checks its header.  FILTER is applied to each
+   packet.  Terminates the program on error. */
+
+void capture_file_run (capture_worker_t *worker);
+/* Passes all packets in the file to capture_packet, on behalf of
+   WORKER, and returns at the end of the file. */
+
+void capture_file_report (void);
+/* Prints the throughput and the number of packets dropped (per
+   reason) to standard output.  Called after all records have been
+   sent. */
+
+int capture_file_detect (const char *data, size_t length);
+/* Returns nonzero if the LENGTH bytes at DATA start with a pcap or
+   pcapng file header. */
+
+typedef void (*capture_file_callback_t) (void *closure, const char *packet, size_t length);
+
+void capture_file_each (const char *name, capture_file_callback_t callback, void *closure);
+/* Calls CALLBACK for each packet in the pcap or pcapng file NAME,
+   with the link layer header removed, in the order of the file.
+   Packets are not filtered, but packets which are shorter than the
+   link layer header are skipped.  Used by the test mode.  Terminates the
+   program on error. */
+
+#endif /* CAPTURE_FILE_H */
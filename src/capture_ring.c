@@ -0,0 +1,382 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "capture_ring.h"
+#include "capture.h"
+#include "checkpoint.h"
+#include "log.h"
+#include "option.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+
+#include <pcap.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+static unsigned ring_block_size = 1 << 20;
+static unsigned ring_block_count = 64;
+static unsigned ring_retire_timeout = 100;
+/* Ring geometry.  The retire timeout (in milliseconds) bounds the
+   latency added by partially filled blocks. */
+
+#define RING_FRAME_SIZE 2048
+/* Nominal frame size.  TPACKET_V3 packs frames of variable length
+   into the blocks, but the kernel still checks the frame count. */
+
+struct capture_ring
+{
+  int fd;
+  char *memory;
+  size_t length;
+  unsigned current;
+  /* Index of the next block we expect the kernel to hand over. */
+
+  unsigned blocks_losing;
+  /* Number of blocks which the kernel marked with TP_STATUS_LOSING.
+     Only incremented by the worker owning the ring. */
+};
+
+static capture_ring_t *rings[CAPTURE_MAX_WORKERS];
+static unsigned ring_count;
+/* All rings, for the checkpoint reporter. */
+
+static void ring_report (checkpoint_t *);
+static void ring_close (capture_ring_t *);
+
+void
+capture_ring_configure (char *options)
+{
+  char *name, *value;
+
+  while (option_next (&options, &name, &value))
+    if (strcmp (name, "block-size") == 0)
+      ring_block_size = option_size (name, value);
+    else if (strcmp (name, "blocks") == 0)
+      ring_block_count = option_unsigned (name, value);
+    else if (strcmp (name, "timeout") == 0)
+      ring_retire_timeout = option_unsigned (name, value);
+    else
+      option_unknown ("ring", name);
+
+  if (ring_block_size == 0 || ring_block_size % getpagesize () != 0)
+    log_fatal ("Ring block size must be a multiple of the page size.");
+  if (ring_block_size % RING_FRAME_SIZE != 0)
+    log_fatal ("Ring block size must be a multiple of the frame size (%u).",
+               (unsigned)RING_FRAME_SIZE);
+  if (ring_block_count == 0)
+    log_fatal ("Ring block count must be positive.");
+
+  checkpoint_register (ring_report);
+}
+
+capture_ring_t *
+capture_ring_new (void)
+{
+  capture_ring_t *ring = calloc (1, sizeof (*ring));
+
+  if (ring == 0)
+    log_fatal ("Out of memory.");
+  ring->fd = -1;
+  rings[ring_count++] = ring;
+  return ring;
+}
+
+int
+capture_ring_open (capture_ring_t *ring, const char *interface, const char *filter, int first)
+{
+  int version = TPACKET_V3;
+  int fanout;
+  struct tpacket_req3 req;
+  struct sockaddr_ll sll;
+  struct sock_fprog fprog;
+  struct bpf_program program;
+  unsigned ifindex = 0;
+
+  ring_close (ring);
+
+  if (interface)
+    {
+      ifindex = if_nametoindex (interface);
+      if (ifindex == 0)
+        {
+          log_warn ("Could not open capture device '%s': %s.",
+                    interface, strerror (errno));
+          return -1;
+        }
+    }
+
+  /* The protocol is set by bind below, so that no packets are
+     queued before the filter is in place. */
+  ring->fd = socket (AF_PACKET, SOCK_DGRAM, 0);
+  if (ring->fd < 0)
+    {
+      log_warn ("Could not create packet socket: %s.", strerror (errno));
+      return -1;
+    }
+
+  /* With SOCK_DGRAM, the kernel strips the link layer header, so the
+     filter is compiled for raw IP packets. */
+  if (capture_compile (&program, DLT_RAW, filter, first) < 0)
+    goto error_out;
+  fprog.len = program.bf_len;
+  fprog.filter = (struct sock_filter *)program.bf_insns;
+  if (setsockopt (ring->fd, SOL_SOCKET, SO_ATTACH_FILTER,
+                  &fprog, sizeof (fprog)) < 0)
+    {
+      log_warn ("Could not apply filter program '%s': %s.",
+                filter, strerror (errno));
+      pcap_freecode (&program);
+      goto error_out;
+    }
+  pcap_freecode (&program);
+
+  if (setsockopt (ring->fd, SOL_PACKET, PACKET_VERSION,
+                  &version, sizeof (version)) < 0)
+    {
+      log_warn ("Could not select TPACKET_V3: %s.", strerror (errno));
+      goto error_out;
+    }
+
+  memset (&req, 0, sizeof (req));
+  req.tp_block_size = ring_block_size;
+  req.tp_block_nr = ring_block_count;
+  req.tp_frame_size = RING_FRAME_SIZE;
+  req.tp_frame_nr = (ring_block_size / RING_FRAME_SIZE) * ring_block_count;
+  req.tp_retire_blk_tov = ring_retire_timeout;
+  if (setsockopt (ring->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof (req)) < 0)
+    {
+      log_warn ("Could not allocate packet ring (%u blocks of %u bytes): %s.",
+                ring_block_count, ring_block_size, strerror (errno));
+      goto error_out;
+    }
+
+  ring->length = (size_t)ring_block_size * ring_block_count;
+  ring->memory = mmap (0, ring->length, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_LOCKED, ring->fd, 0);
+  if (ring->memory == MAP_FAILED)
+    {
+      /* MAP_LOCKED fails if RLIMIT_MEMLOCK is too low. */
+      ring->memory = mmap (0, ring->length, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, ring->fd, 0);
+      if (ring->memory == MAP_FAILED)
+        {
+          log_warn ("Could not map packet ring: %s.", strerror (errno));
+          ring->memory = 0;
+          goto error_out;
+        }
+    }
+  ring->current = 0;
+
+  memset (&sll, 0, sizeof (sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons (ETH_P_ALL);
+  sll.sll_ifindex = ifindex;
+  if (bind (ring->fd, (struct sockaddr *)&sll, sizeof (sll)) < 0)
+    {
+      log_warn ("Could not bind packet socket: %s.", strerror (errno));
+      goto error_out;
+    }
+
+  if (capture_fanout_argument (&fanout)
+      && setsockopt (ring->fd, SOL_PACKET, PACKET_FANOUT,
+                     &fanout, sizeof (fanout)) < 0)
+    {
+      log_warn ("Could not join packet fanout group: %s.", strerror (errno));
+      goto error_out;
+    }
+
+  if (interface)
+    {
+      struct packet_mreq mreq;
+
+      memset (&mreq, 0, sizeof (mreq));
+      mreq.mr_ifindex = ifindex;
+      mreq.mr_type = PACKET_MR_PROMISC;
+      if (setsockopt (ring->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                      &mreq, sizeof (mreq)) < 0)
+        log_warn ("Could not enable promiscuous mode on '%s': %s.",
+                  interface, strerror (errno));
+    }
+
+  /* Discard the statistics accumulated during setup. */
+  capture_ring_dropped (ring);
+  return 0;
+
+ error_out:
+  ring_close (ring);
+  return -1;
+}
+
+static void
+ring_close (capture_ring_t *ring)
+{
+  if (ring->memory)
+    {
+      munmap (ring->memory, ring->length);
+      ring->memory = 0;
+    }
+  if (ring->fd >= 0)
+    {
+      close (ring->fd);
+      ring->fd = -1;
+    }
+}
+
+/* Processes all packets in BLOCK and returns it to the kernel. */
+static void
+ring_walk_block (capture_ring_t *ring, capture_worker_t *worker,
+                 struct tpacket_block_desc *block)
+{
+  const char *frame = (const char *)block + block->hdr.bh1.offset_to_first_pkt;
+  unsigned count = block->hdr.bh1.num_pkts;
+
+  if (UNLIKELY (block->hdr.bh1.block_status & TP_STATUS_LOSING))
+    ++ring->blocks_losing;
+
+  while (count--)
+    {
+      const struct tpacket3_hdr *header = (const struct tpacket3_hdr *)frame;
+
+      capture_packet (worker, frame + header->tp_net, header->tp_snaplen,
+                      header->tp_sec);
+      frame += header->tp_next_offset;
+    }
+
+  __atomic_store_n (&block->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                    __ATOMIC_RELEASE);
+}
+
+void
+capture_ring_run (capture_ring_t *ring, capture_worker_t *worker)
+{
+  struct pollfd pfd;
+
+  pfd.fd = ring->fd;
+  pfd.events = POLLIN | POLLERR;
+
+  for (;;)
+    {
+      struct tpacket_block_desc *block = (struct tpacket_block_desc *)
+        (ring->memory + (size_t)ring->current * ring_block_size);
+
+      if (__atomic_load_n (&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE)
+          & TP_STATUS_USER)
+        {
+          ring_walk_block (ring, worker, block);
+          if (++ring->current == ring_block_count)
+            ring->current = 0;
+          continue;
+        }
+
+      /* Wait for the kernel to retire the next block. */
+      capture_idle (worker);
+      pfd.revents = 0;
+      if (poll (&pfd, 1, capture_idle_timeout ()) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          log_warn ("Could not poll packet socket: %s.", strerror (errno));
+          return;
+        }
+      if (UNLIKELY (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)))
+        {
+          int error = 0;
+          socklen_t length = sizeof (error);
+
+          getsockopt (ring->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+          log_warn ("Packet socket error: %s.", strerror (error));
+          return;
+        }
+    }
+}
+
+unsigned
+capture_ring_dropped (capture_ring_t *ring)
+{
+  struct tpacket_stats_v3 stats;
+  socklen_t length = sizeof (stats);
+
+  /* The kernel resets the counters on each read. */
+  if (ring->fd < 0
+      || getsockopt (ring->fd, SOL_PACKET, PACKET_STATISTICS,
+                     &stats, &length) < 0)
+    return 0;
+  return stats.tp_drops;
+}
+
+static void
+ring_report (checkpoint_t *checkpoint)
+{
+  static unsigned last;
+  unsigned total = 0;
+  unsigned j;
+
+  for (j = 0; j < ring_count; ++j)
+    total += __atomic_load_n (&rings[j]->blocks_losing, __ATOMIC_RELAXED);
+  checkpoint_printf (checkpoint, ", %u ring blocks losing", total - last);
+  last = total;
+}
+
+#else /* !HAVE_LINUX_IF_PACKET_H */
+
+void
+capture_ring_configure (char *options)
+{
+  (void)options;
+  log_fatal ("The ring capture method is only available on Linux.");
+}
+
+capture_ring_t *
+capture_ring_new (void)
+{
+  return 0;
+}
+
+int
+capture_ring_open (capture_ring_t *ring, const char *interface, const char *filter, int first)
+{
+  (void)ring; (void)interface; (void)filter; (void)first;
+  return -1;
+}
+
+void
+capture_ring_run (capture_ring_t *ring, capture_worker_t *worker)
+{
+  (void)ring; (void)worker;
+}
+
+unsigned
+capture_ring_dropped (capture_ring_t *ring)
+{
+  (void)ring;
+  return 0;
+}
+
+#endif /* HAVE_LINUX_IF_PACKET_H */
@@ -0,0 +1,56 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef CAPTURE_RING_H
+#define CAPTURE_RING_H
+
+#include "config.h"
+#include "capture.h"
+
+/* Packet capture using a memory-mapped TPACKET_V3 block ring on a
+   Linux AF_PACKET socket.  Whole blocks of frames are handed to
+   userspace at once and processed in place, without copying. */
+
+void capture_ring_configure (char *options);
+/* Parses the ring parameters in OPTIONS (a comma-separated list, see
+   option_next), which may be a null pointer.  Terminates the program
+   on error. */
+
+typedef struct capture_ring capture_ring_t;
+/* The state of a single ring socket. */
+
+capture_ring_t *capture_ring_new (void);
+/* Allocates the state for a ring socket (which is initially closed).
+   Terminates the program on error. */
+
+int capture_ring_open (capture_ring_t *ring, const char *interface, const char *filter, int first);
+/* Creates the ring socket, attaches the compiled FILTER and binds it
+   to INTERFACE (all interfaces if INTERFACE is a null pointer).
+   Returns 0 on success, and -1 on failure (after logging a message).
+   If FIRST is true, an invalid filter expression is fatal.  The
+   socket joins the fanout group given by capture_fanout_argument. */
+
+void capture_ring_run (capture_ring_t *ring, capture_worker_t *worker);
+/* Passes captured packets to capture_packet, on behalf of WORKER.
+   Returns when the socket reports an error. */
+
+unsigned capture_ring_dropped (capture_ring_t *ring);
+/* Returns the number of packets dropped by the kernel since the
+   previous call. */
+
+#endif /* CAPTURE_RING_H */
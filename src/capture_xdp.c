@@ -0,0 +1,556 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "capture_xdp.h"
+#include "capture.h"
+#include "log.h"
+#include "option.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined (HAVE_LINUX_IF_XDP_H) && defined (HAVE_LINUX_BPF_H)
+
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+static unsigned xdp_queue = 0;
+static unsigned xdp_frames = 4096;
+static unsigned xdp_frame_size = 2048;
+static unsigned xdp_batch = 64;
+static int xdp_native = 0;
+static int xdp_zerocopy = 0;
+static int xdp_hugepages = 0;
+/* Settings from the command line.  The number of frames must be a
+   power of two because the same value is used for the ring sizes. */
+
+#define XDP_LINK_LAYER 14
+/* The XDP program only redirects Ethernet frames carrying IPv4 or
+   IPv6. */
+
+typedef struct
+{
+  uint32_t *producer;
+  uint32_t *consumer;
+  void *ring;
+  uint32_t mask;
+  void *map;
+  size_t map_length;
+} xdp_ring_t;
+/* One of the rings shared with the kernel. */
+
+static int xsk_fd = -1;
+static int xsk_map_fd = -1;
+static int xdp_prog_fd = -1;
+static int xdp_link_fd = -1;
+static char *umem;
+static size_t umem_length;
+static xdp_ring_t rx_ring;
+static xdp_ring_t fill_ring;
+static xdp_ring_t completion_ring;
+
+static struct xdp_statistics xdp_last_stats;
+/* Kernel statistics at the last call to capture_xdp_dropped. */
+
+static void xdp_close (void);
+
+void
+capture_xdp_configure (char *options)
+{
+  char *name, *value;
+
+  while (option_next (&options, &name, &value))
+    if (strcmp (name, "queue") == 0)
+      xdp_queue = option_unsigned (name, value);
+    else if (strcmp (name, "frames") == 0)
+      xdp_frames = option_unsigned (name, value);
+    else if (strcmp (name, "frame-size") == 0)
+      xdp_frame_size = option_size (name, value);
+    else if (strcmp (name, "batch") == 0)
+      xdp_batch = option_unsigned (name, value);
+    else if (strcmp (name, "mode") == 0)
+      {
+        if (value && strcmp (value, "skb") == 0)
+          xdp_native = 0;
+        else if (value && strcmp (value, "native") == 0)
+          xdp_native = 1;
+        else
+          log_fatal ("XDP mode must be 'skb' or 'native'.");
+      }
+    else if (strcmp (name, "zerocopy") == 0)
+      xdp_zerocopy = 1;
+    else if (strcmp (name, "hugepages") == 0)
+      xdp_hugepages = 1;
+    else
+      option_unknown ("xdp", name);
+
+  if (xdp_frames < 64 || (xdp_frames & (xdp_frames - 1)) != 0)
+    log_fatal ("The number of XDP frames must be a power of two (at least 64).");
+  if (xdp_frame_size != 2048 && xdp_frame_size != 4096)
+    log_fatal ("The XDP frame size must be 2048 or 4096.");
+  if (xdp_batch == 0)
+    log_fatal ("The XDP batch size must be positive.");
+  if (xdp_zerocopy && !xdp_native)
+    log_fatal ("XDP zero-copy mode requires mode=native.");
+}
+
+static int
+sys_bpf (int cmd, union bpf_attr *attr)
+{
+  return syscall (__NR_bpf, cmd, attr, sizeof (*attr));
+}
+
+/* Helpers for assembling eBPF instructions. */
+
+#define INSN(CODE, DST, SRC, OFF, IMM) \
+  { (CODE), (DST), (SRC), (OFF), (IMM) }
+#define LDX(SIZE, DST, SRC, OFF) \
+  INSN (BPF_LDX | BPF_MEM | (SIZE), DST, SRC, OFF, 0)
+#define MOV64_REG(DST, SRC) INSN (BPF_ALU64 | BPF_MOV | BPF_X, DST, SRC, 0, 0)
+#define MOV64_IMM(DST, IMM) INSN (BPF_ALU64 | BPF_MOV | BPF_K, DST, 0, 0, IMM)
+#define ALU64_IMM(OP, DST, IMM) INSN (BPF_ALU64 | (OP) | BPF_K, DST, 0, 0, IMM)
+#define ALU64_REG(OP, DST, SRC) INSN (BPF_ALU64 | (OP) | BPF_X, DST, SRC, 0, 0)
+#define JMP_IMM(OP, DST, IMM, OFF) INSN (BPF_JMP | (OP) | BPF_K, DST, 0, OFF, IMM)
+#define JMP_REG(OP, DST, SRC, OFF) INSN (BPF_JMP | (OP) | BPF_X, DST, SRC, OFF, 0)
+#define LD_MAP_FD(DST, FD) \
+  INSN (BPF_LD | BPF_DW | BPF_IMM, DST, BPF_PSEUDO_MAP_FD, 0, FD), \
+  INSN (0, 0, 0, 0, 0)
+#define CALL(FUNC) INSN (BPF_JMP | BPF_CALL, 0, 0, 0, FUNC)
+#define EXIT() INSN (BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/* Loads the XDP program which redirects UDP packets with source or
+   destination port 53 to the socket registered for the receive queue
+   in xsk_map_fd.  IPv6 packets are only redirected if UDP directly
+   follows the fixed header; packets with extension headers take the
+   regular network stack path.  Returns the program file descriptor,
+   or -1. */
+static int
+xdp_load_program (void)
+{
+  /* Offsets of the Ethernet type, IPv4 protocol, IPv6 next header and
+     UDP ports.  The port offsets are relative to the end of the IP
+     header. */
+  const int16_t ethertype = 12, version_length = 14, protocol = 23;
+  const int16_t next_header = XDP_LINK_LAYER + 6;
+  const int16_t source_port = XDP_LINK_LAYER, destination_port = XDP_LINK_LAYER + 2;
+  const int32_t ip = htons (0x0800), ip6 = htons (0x86DD), port = htons (53);
+
+  struct bpf_insn program[] = {
+    /* r6 = ctx, r2 = data, r3 = data_end */
+    MOV64_REG (BPF_REG_6, BPF_REG_1),
+    LDX (BPF_W, BPF_REG_2, BPF_REG_1, offsetof (struct xdp_md, data)),
+    LDX (BPF_W, BPF_REG_3, BPF_REG_1, offsetof (struct xdp_md, data_end)),
+    /* Ethernet header plus minimal IPv4 header. */
+    MOV64_REG (BPF_REG_4, BPF_REG_2),
+    ALU64_IMM (BPF_ADD, BPF_REG_4, XDP_LINK_LAYER + 20),
+    JMP_REG (BPF_JGT, BPF_REG_4, BPF_REG_3, 27),
+    LDX (BPF_H, BPF_REG_5, BPF_REG_2, ethertype),
+    JMP_IMM (BPF_JNE, BPF_REG_5, ip6, 7),
+    /* IPv6: fixed header, followed by UDP. */
+    MOV64_REG (BPF_REG_4, BPF_REG_2),
+    ALU64_IMM (BPF_ADD, BPF_REG_4, XDP_LINK_LAYER + 40),
+    JMP_REG (BPF_JGT, BPF_REG_4, BPF_REG_3, 22),
+    LDX (BPF_B, BPF_REG_5, BPF_REG_2, next_header),
+    JMP_IMM (BPF_JNE, BPF_REG_5, 17, 20),
+    ALU64_IMM (BPF_ADD, BPF_REG_2, 40),
+    JMP_IMM (BPF_JA, 0, 0, 7),
+    /* IPv4 */
+    JMP_IMM (BPF_JNE, BPF_REG_5, ip, 17),
+    LDX (BPF_B, BPF_REG_5, BPF_REG_2, protocol),
+    JMP_IMM (BPF_JNE, BPF_REG_5, 17, 15),
+    /* Skip the IPv4 header (including options). */
+    LDX (BPF_B, BPF_REG_5, BPF_REG_2, version_length),
+    ALU64_IMM (BPF_AND, BPF_REG_5, 0x0f),
+    ALU64_IMM (BPF_LSH, BPF_REG_5, 2),
+    ALU64_REG (BPF_ADD, BPF_REG_2, BPF_REG_5),
+    /* UDP ports */
+    MOV64_REG (BPF_REG_4, BPF_REG_2),
+    ALU64_IMM (BPF_ADD, BPF_REG_4, XDP_LINK_LAYER + 8),
+    JMP_REG (BPF_JGT, BPF_REG_4, BPF_REG_3, 8),
+    LDX (BPF_H, BPF_REG_5, BPF_REG_2, source_port),
+    JMP_IMM (BPF_JEQ, BPF_REG_5, port, 2),
+    LDX (BPF_H, BPF_REG_5, BPF_REG_2, destination_port),
+    JMP_IMM (BPF_JNE, BPF_REG_5, port, 4),
+    /* return bpf_redirect_map (xsk_map, ctx->rx_queue_index, XDP_PASS) */
+    LDX (BPF_W, BPF_REG_2, BPF_REG_6, offsetof (struct xdp_md, rx_queue_index)),
+    LD_MAP_FD (BPF_REG_1, xsk_map_fd),
+    JMP_IMM (BPF_JA, 0, 0, 2),
+    /* Not a DNS packet. */
+    MOV64_IMM (BPF_REG_0, XDP_PASS),
+    EXIT (),
+    MOV64_IMM (BPF_REG_3, XDP_PASS),
+    CALL (BPF_FUNC_redirect_map),
+    EXIT (),
+  };
+  static char verifier_log[4096];
+  union bpf_attr attr;
+  int fd;
+
+  memset (&attr, 0, sizeof (attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns = (uintptr_t)program;
+  attr.insn_cnt = sizeof (program) / sizeof (program[0]);
+  attr.license = (uintptr_t)"GPL";
+  attr.log_buf = (uintptr_t)verifier_log;
+  attr.log_size = sizeof (verifier_log);
+  attr.log_level = 1;
+  memcpy (attr.prog_name, "dnslogger", sizeof ("dnslogger"));
+
+  verifier_log[0] = 0;
+  fd = sys_bpf (BPF_PROG_LOAD, &attr);
+  if (fd < 0)
+    log_warn ("Could not load XDP program: %s.  %s",
+              strerror (errno), verifier_log);
+  return fd;
+}
+
+/* Maps the ring at OFFSET with ENTRIES descriptors of SIZE bytes,
+   using the offsets in OFFSETS.  Returns -1 on error. */
+static int
+xdp_map_ring (xdp_ring_t *ring, const struct xdp_ring_offset *offsets,
+              unsigned entries, size_t size, off_t offset)
+{
+  ring->map_length = offsets->desc + entries * size;
+  ring->map = mmap (0, ring->map_length, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, xsk_fd, offset);
+  if (ring->map == MAP_FAILED)
+    {
+      ring->map = 0;
+      log_warn ("Could not map AF_XDP ring: %s.", strerror (errno));
+      return -1;
+    }
+  ring->producer = (uint32_t *)((char *)ring->map + offsets->producer);
+  ring->consumer = (uint32_t *)((char *)ring->map + offsets->consumer);
+  ring->ring = (char *)ring->map + offsets->desc;
+  ring->mask = entries - 1;
+  return 0;
+}
+
+static void
+xdp_unmap_ring (xdp_ring_t *ring)
+{
+  if (ring->map)
+    munmap (ring->map, ring->map_length);
+  ring->map = 0;
+}
+
+int
+capture_xdp_open (const char *interface, const char *filter, int first)
+{
+  union bpf_attr attr;
+  struct xdp_umem_reg reg;
+  struct xdp_mmap_offsets offsets;
+  struct sockaddr_xdp sxdp;
+  socklen_t length;
+  unsigned ifindex;
+  uint32_t key;
+  uint64_t *fill;
+  unsigned j;
+
+  xdp_close ();
+
+  if (interface == 0)
+    log_fatal ("The xdp capture method requires an interface (-i).");
+  ifindex = if_nametoindex (interface);
+  if (ifindex == 0)
+    {
+      log_warn ("Could not open capture device '%s': %s.",
+                interface, strerror (errno));
+      return -1;
+    }
+
+  if (capture_filter_compile (filter, first) < 0)
+    return -1;
+
+  /* Socket and UMEM.  Each frame holds exactly one packet. */
+  xsk_fd = socket (AF_XDP, SOCK_RAW, 0);
+  if (xsk_fd < 0)
+    {
+      log_warn ("Could not create AF_XDP socket: %s.", strerror (errno));
+      return -1;
+    }
+
+  umem_length = (size_t)xdp_frames * xdp_frame_size;
+  umem = mmap (0, umem_length, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE
+               | (xdp_hugepages ? MAP_HUGETLB : 0), -1, 0);
+  if (umem == MAP_FAILED)
+    {
+      log_warn ("Could not allocate %lu bytes of UMEM%s: %s.",
+                (unsigned long)umem_length,
+                xdp_hugepages ? " on huge pages" : "", strerror (errno));
+      umem = 0;
+      goto error_out;
+    }
+
+  memset (&reg, 0, sizeof (reg));
+  reg.addr = (uintptr_t)umem;
+  reg.len = umem_length;
+  reg.chunk_size = xdp_frame_size;
+  reg.headroom = 0;
+  if (setsockopt (xsk_fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof (reg)) < 0
+      || setsockopt (xsk_fd, SOL_XDP, XDP_UMEM_FILL_RING,
+                     &xdp_frames, sizeof (xdp_frames)) < 0
+      || setsockopt (xsk_fd, SOL_XDP, XDP_UMEM_COMPLETION_RING,
+                     &xdp_frames, sizeof (xdp_frames)) < 0
+      || setsockopt (xsk_fd, SOL_XDP, XDP_RX_RING,
+                     &xdp_frames, sizeof (xdp_frames)) < 0)
+    {
+      log_warn ("Could not set up AF_XDP rings: %s.", strerror (errno));
+      goto error_out;
+    }
+
+  length = sizeof (offsets);
+  if (getsockopt (xsk_fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &length) < 0)
+    {
+      log_warn ("Could not determine AF_XDP ring offsets: %s.",
+                strerror (errno));
+      goto error_out;
+    }
+  if (xdp_map_ring (&rx_ring, &offsets.rx, xdp_frames,
+                    sizeof (struct xdp_desc), XDP_PGOFF_RX_RING) < 0
+      || xdp_map_ring (&fill_ring, &offsets.fr, xdp_frames,
+                       sizeof (uint64_t), XDP_UMEM_PGOFF_FILL_RING) < 0
+      || xdp_map_ring (&completion_ring, &offsets.cr, xdp_frames,
+                       sizeof (uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) < 0)
+    goto error_out;
+
+  /* Hand all frames to the kernel. */
+  fill = fill_ring.ring;
+  for (j = 0; j < xdp_frames; ++j)
+    fill[j] = (uint64_t)j * xdp_frame_size;
+  __atomic_store_n (fill_ring.producer, xdp_frames, __ATOMIC_RELEASE);
+
+  memset (&sxdp, 0, sizeof (sxdp));
+  sxdp.sxdp_family = AF_XDP;
+  sxdp.sxdp_ifindex = ifindex;
+  sxdp.sxdp_queue_id = xdp_queue;
+  sxdp.sxdp_flags = xdp_zerocopy ? XDP_ZEROCOPY : XDP_COPY;
+  if (bind (xsk_fd, (struct sockaddr *)&sxdp, sizeof (sxdp)) < 0)
+    {
+      log_warn ("Could not bind AF_XDP socket to '%s' queue %u: %s.",
+                interface, xdp_queue, strerror (errno));
+      goto error_out;
+    }
+
+  /* The map which connects receive queues to sockets. */
+  memset (&attr, 0, sizeof (attr));
+  attr.map_type = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size = sizeof (uint32_t);
+  attr.value_size = sizeof (uint32_t);
+  attr.max_entries = xdp_queue + 1;
+  xsk_map_fd = sys_bpf (BPF_MAP_CREATE, &attr);
+  if (xsk_map_fd < 0)
+    {
+      log_warn ("Could not create XSKMAP: %s.", strerror (errno));
+      goto error_out;
+    }
+
+  key = xdp_queue;
+  memset (&attr, 0, sizeof (attr));
+  attr.map_fd = xsk_map_fd;
+  attr.key = (uintptr_t)&key;
+  attr.value = (uintptr_t)&xsk_fd;
+  if (sys_bpf (BPF_MAP_UPDATE_ELEM, &attr) < 0)
+    {
+      log_warn ("Could not register AF_XDP socket: %s.", strerror (errno));
+      goto error_out;
+    }
+
+  xdp_prog_fd = xdp_load_program ();
+  if (xdp_prog_fd < 0)
+    goto error_out;
+
+  /* A BPF link detaches the program automatically when the process
+     exits. */
+  memset (&attr, 0, sizeof (attr));
+  attr.link_create.prog_fd = xdp_prog_fd;
+  attr.link_create.target_ifindex = ifindex;
+  attr.link_create.attach_type = BPF_XDP;
+  attr.link_create.flags = xdp_native ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+  xdp_link_fd = sys_bpf (BPF_LINK_CREATE, &attr);
+  if (xdp_link_fd < 0)
+    {
+      log_warn ("Could not attach XDP program to '%s': %s.",
+                interface, strerror (errno));
+      goto error_out;
+    }
+
+  /* Discard the statistics accumulated during setup. */
+  capture_xdp_dropped ();
+  return 0;
+
+ error_out:
+  xdp_close ();
+  return -1;
+}
+
+static void
+xdp_close (void)
+{
+  if (xdp_link_fd >= 0)
+    close (xdp_link_fd);
+  if (xdp_prog_fd >= 0)
+    close (xdp_prog_fd);
+  if (xsk_map_fd >= 0)
+    close (xsk_map_fd);
+  xdp_unmap_ring (&rx_ring);
+  xdp_unmap_ring (&fill_ring);
+  xdp_unmap_ring (&completion_ring);
+  if (xsk_fd >= 0)
+    close (xsk_fd);
+  if (umem)
+    munmap (umem, umem_length);
+  xdp_link_fd = xdp_prog_fd = xsk_map_fd = xsk_fd = -1;
+  umem = 0;
+  memset (&xdp_last_stats, 0, sizeof (xdp_last_stats));
+}
+
+void
+capture_xdp_run (capture_worker_t *worker)
+{
+  const struct xdp_desc *descs = rx_ring.ring;
+  uint64_t *fill = fill_ring.ring;
+  const uint64_t frame_mask = ~(uint64_t)(xdp_frame_size - 1);
+  struct pollfd pfd;
+
+  pfd.fd = xsk_fd;
+  pfd.events = POLLIN;
+
+  for (;;)
+    {
+      uint32_t consumer = *rx_ring.consumer;
+      uint32_t available
+        = __atomic_load_n (rx_ring.producer, __ATOMIC_ACQUIRE) - consumer;
+      uint32_t fill_producer;
+      time_t now;
+      unsigned j;
+
+      if (available == 0)
+        {
+          capture_idle (worker);
+          pfd.revents = 0;
+          if (poll (&pfd, 1, capture_idle_timeout ()) < 0)
+            {
+              if (errno == EINTR)
+                continue;
+              log_warn ("Could not poll AF_XDP socket: %s.", strerror (errno));
+              return;
+            }
+          if (UNLIKELY (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)))
+            {
+              log_warn ("AF_XDP socket error.");
+              return;
+            }
+          continue;
+        }
+
+      if (available > xdp_batch)
+        available = xdp_batch;
+
+      /* AF_XDP does not provide timestamps, so the whole batch is
+         stamped with the current time. */
+      time (&now);
+
+      /* Every frame is returned to the fill ring right after it has
+         been processed.  Since the fill ring can hold all frames,
+         there is always room. */
+      fill_producer = *fill_ring.producer;
+      for (j = 0; j < available; ++j)
+        {
+          const struct xdp_desc *desc = descs + ((consumer + j) & rx_ring.mask);
+          const char *packet = umem + desc->addr;
+          size_t size = desc->len;
+
+          if (LIKELY (size >= XDP_LINK_LAYER)
+              && capture_filter_match (packet, size))
+            capture_packet (worker, packet + XDP_LINK_LAYER, size - XDP_LINK_LAYER, now);
+
+          fill[(fill_producer + j) & fill_ring.mask] = desc->addr & frame_mask;
+        }
+
+      __atomic_store_n (rx_ring.consumer, consumer + available,
+                        __ATOMIC_RELEASE);
+      __atomic_store_n (fill_ring.producer, fill_producer + available,
+                        __ATOMIC_RELEASE);
+    }
+}
+
+unsigned
+capture_xdp_dropped (void)
+{
+  struct xdp_statistics stats;
+  socklen_t length = sizeof (stats);
+  unsigned result;
+
+  if (xsk_fd < 0
+      || getsockopt (xsk_fd, SOL_XDP, XDP_STATISTICS, &stats, &length) < 0)
+    return 0;
+
+  /* Unlike PACKET_STATISTICS, these counters are not reset. */
+  result = (stats.rx_dropped - xdp_last_stats.rx_dropped)
+    + (stats.rx_ring_full - xdp_last_stats.rx_ring_full)
+    + (stats.rx_fill_ring_empty_descs - xdp_last_stats.rx_fill_ring_empty_descs);
+  xdp_last_stats = stats;
+  return result;
+}
+
+#else /* !HAVE_LINUX_IF_XDP_H */
+
+void
+capture_xdp_configure (char *options)
+{
+  (void)options;
+  log_fatal ("The xdp capture method is only available on Linux.");
+}
+
+int
+capture_xdp_open (const char *interface, const char *filter, int first)
+{
+  (void)interface; (void)filter; (void)first;
+  return -1;
+}
+
+void
+capture_xdp_run (capture_worker_t *worker)
+{
+}
+
+unsigned
+capture_xdp_dropped (void)
+{
+  return 0;
+}
+
+#endif /* HAVE_LINUX_IF_XDP_H */
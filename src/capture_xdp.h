@@ -0,0 +1,49 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef CAPTURE_XDP_H
+#define CAPTURE_XDP_H
+
+#include "config.h"
+#include "capture.h"
+
+/* Packet capture using an AF_XDP socket.  A small XDP program
+   redirects UDP port 53 traffic into a UMEM ring shared with this
+   process; all other traffic continues to the network stack. */
+
+void capture_xdp_configure (char *options);
+/* Parses the AF_XDP parameters in OPTIONS (a comma-separated list,
+   see option_next), which may be a null pointer.  Terminates the
+   program on error. */
+
+int capture_xdp_open (const char *interface, const char *filter, int first);
+/* Loads and attaches the XDP program on INTERFACE and creates the
+   AF_XDP socket.  FILTER is applied to the redirected packets in
+   userspace.  Returns 0 on success, and -1 on failure (after logging
+   a message).  If FIRST is true, an invalid filter expression is
+   fatal. */
+
+void capture_xdp_run (capture_worker_t *worker);
+/* Passes captured packets to capture_packet, in batches, on behalf of
+   WORKER.  Returns when the socket reports an error. */
+
+unsigned capture_xdp_dropped (void);
+/* Returns the number of packets dropped by the kernel since the
+   previous call. */
+
+#endif /* CAPTURE_XDP_H */
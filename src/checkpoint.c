@@ -0,0 +1,159 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "checkpoint.h"
+#include "log.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CACHE_LINE 64
+
+static checkpoint_reporter_t reporters[16];
+static unsigned reporter_count;
+
+void
+checkpoint_printf (checkpoint_t *checkpoint, const char *format, ...)
+{
+  va_list ap;
+  size_t avail = sizeof (checkpoint->text) - checkpoint->length;
+  int result;
+
+  va_start (ap, format);
+  result = vsnprintf (checkpoint->text + checkpoint->length, avail, format, ap);
+  va_end (ap);
+
+  if (result < 0)
+    return;
+  if ((size_t)result >= avail)
+    checkpoint->length = sizeof (checkpoint->text) - 1;
+  else
+    checkpoint->length += result;
+}
+
+void
+checkpoint_register (checkpoint_reporter_t reporter)
+{
+  if (reporter_count == sizeof (reporters) / sizeof (reporters[0]))
+    log_fatal ("Too many checkpoint reporters.");
+  reporters[reporter_count++] = reporter;
+}
+
+void
+checkpoint_report (checkpoint_t *checkpoint)
+{
+  unsigned j;
+
+  for (j = 0; j < reporter_count; ++j)
+    reporters[j] (checkpoint);
+}
+
+static pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Protects the THREADS lists of all counters. */
+
+checkpoint_thread_t *
+checkpoint_thread (checkpoint_counters_t *counters)
+{
+  checkpoint_thread_t *local;
+  size_t size = (sizeof (*local) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+
+  /* Aligned, so that the counters of different threads do not share a
+     cache line. */
+  if (posix_memalign ((void **)&local, CACHE_LINE, size) != 0)
+    log_fatal ("Out of memory.");
+  memset (local, 0, size);
+  pthread_mutex_lock (&counters_lock);
+  local->next = counters->threads;
+  counters->threads = local;
+  pthread_mutex_unlock (&counters_lock);
+  return local;
+}
+
+/* Stores the sums of the first COUNT counters of COUNTERS over all
+   threads in TOTALS. */
+static void
+sum (const checkpoint_counters_t *counters, unsigned long *totals,
+     unsigned count)
+{
+  const checkpoint_thread_t *local;
+  unsigned j;
+
+  memset (totals, 0, count * sizeof (*totals));
+  pthread_mutex_lock (&counters_lock);
+  for (local = counters->threads; local; local = local->next)
+    for (j = 0; j < count; ++j)
+      totals[j] += __atomic_load_n (local->counts + j, __ATOMIC_RELAXED);
+  pthread_mutex_unlock (&counters_lock);
+}
+
+unsigned long
+checkpoint_counter (const checkpoint_counters_t *counters, unsigned j)
+{
+  unsigned long totals[CHECKPOINT_COUNTERS];
+
+  sum (counters, totals, j + 1);
+  return totals[j];
+}
+
+void
+checkpoint_deltas (checkpoint_counters_t *counters, unsigned long *deltas,
+                   unsigned count)
+{
+  unsigned long totals[CHECKPOINT_COUNTERS];
+  unsigned j;
+
+  sum (counters, totals, count);
+  for (j = 0; j < count; ++j)
+    {
+      deltas[j] = totals[j] - counters->last[j];
+      counters->last[j] = totals[j];
+    }
+}
+
+static uint64_t
+monotonic_nanoseconds (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t (*clock_function) (void) = monotonic_nanoseconds;
+
+uint64_t
+checkpoint_now (void)
+{
+  return clock_function ();
+}
+
+uint32_t
+checkpoint_seconds (void)
+{
+  return clock_function () / 1000000000;
+}
+
+void
+checkpoint_set_clock (uint64_t (*clock) (void))
+{
+  clock_function = clock;
+}
@@ -0,0 +1,113 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "config.h"
+#include "ansidecl.h"
+
+#define CHECKPOINT_TEXT 8192
+
+typedef struct
+{
+  char text[CHECKPOINT_TEXT];
+  size_t length;
+} checkpoint_t;
+/* Accumulates the text of a single checkpoint log entry.  The worst
+   case is about 6k: the packet counters of 64 workers, the
+   subsystems, and a target and a spool entry (about 300 characters
+   together) for each of 16 forward targets. */
+
+void checkpoint_printf (checkpoint_t *checkpoint, const char *format, ...) ATTRIBUTE_PRINTF_2;
+/* Appends text to CHECKPOINT.  Excess text is silently discarded. */
+
+typedef void (*checkpoint_reporter_t) (checkpoint_t *checkpoint);
+/* A reporter appends the statistics of a subsystem to CHECKPOINT.
+   Each reporter is responsible for resetting its own counters.  The
+   appended text should start with ", ". */
+
+void checkpoint_register (checkpoint_reporter_t reporter);
+/* Adds REPORTER to the list of reporters.  Terminates the program if
+   too many reporters are registered. */
+
+void checkpoint_report (checkpoint_t *checkpoint);
+/* Invokes all registered reporters on CHECKPOINT, in order of
+   registration. */
+
+#define CHECKPOINT_COUNTERS 8
+
+typedef struct checkpoint_thread
+{
+  unsigned long counts[CHECKPOINT_COUNTERS];
+  struct checkpoint_thread *next;
+} checkpoint_thread_t;
+/* The counters of a subsystem in one thread.  Each thread writes only
+   its own counters, so that they do not bounce between processors. */
+
+typedef struct
+{
+  checkpoint_thread_t *threads;
+  unsigned long last[CHECKPOINT_COUNTERS];
+} checkpoint_counters_t;
+/* Event counters of a subsystem.  THREADS lists the counters of all
+   threads which have counted an event (protected by a lock in
+   checkpoint.c).  LAST holds the sums at the previous checkpoint. */
+
+checkpoint_thread_t *checkpoint_thread (checkpoint_counters_t *counters);
+/* Allocates the counters of the calling thread and adds them to
+   COUNTERS.  Terminates the program if there is not enough memory. */
+
+#define CHECKPOINT_ADD(COUNTERS, LOCAL, J, N)                           \
+  do                                                                    \
+    {                                                                   \
+      if (UNLIKELY ((LOCAL) == 0))                                      \
+        (LOCAL) = checkpoint_thread (COUNTERS);                         \
+      __atomic_store_n ((LOCAL)->counts + (J), (LOCAL)->counts[J] + (N), \
+                        __ATOMIC_RELAXED);                              \
+    }                                                                   \
+  while (0)
+/* Adds N to counter J of COUNTERS, using the counters of the calling
+   thread in LOCAL (a thread-local pointer, initially null). */
+
+#define CHECKPOINT_COUNT(COUNTERS, LOCAL, J) \
+  CHECKPOINT_ADD (COUNTERS, LOCAL, J, 1)
+/* Increments counter J of COUNTERS (see CHECKPOINT_ADD). */
+
+unsigned long checkpoint_counter (const checkpoint_counters_t *counters,
+                                  unsigned j);
+/* Returns counter J of COUNTERS, summed over all threads since the
+   start of the program. */
+
+void checkpoint_deltas (checkpoint_counters_t *counters,
+                        unsigned long *deltas, unsigned count);
+/* Stores the increase of the first COUNT counters of COUNTERS (summed
+   over all threads) since the previous call in DELTAS.  Called by
+   reporters. */
+
+uint64_t checkpoint_now (void);
+/* Returns the value of the monotonic clock, in nanoseconds. */
+
+uint32_t checkpoint_seconds (void);
+/* Returns the value of the monotonic clock, in seconds. */
+
+void checkpoint_set_clock (uint64_t (*clock) (void));
+/* Replaces the clock (in nanoseconds) behind checkpoint_now and
+   checkpoint_seconds.  For testing. */
+
+#endif /* CHECKPOINT_H */
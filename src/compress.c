@@ -0,0 +1,293 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "compress.h"
+#include "ansidecl.h"
+#include "checkpoint.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+
+#define INITIAL_CAPACITY 65536
+
+#define MAX_OUTPUT (256U << 20)
+/* Limit for the uncompressed data of a frame, so that a decoder is
+   not exhausted by a small frame. */
+
+struct compress
+{
+  z_stream stream;
+  char *buffer;
+  size_t capacity;
+};
+
+struct decompress
+{
+  z_stream stream;
+  char *buffer;
+  size_t capacity;
+};
+
+enum
+  {
+    STAT_IN,
+    STAT_OUT,
+    STAT_CPU,                   /* nanoseconds of thread CPU time */
+    STATS
+  };
+
+static checkpoint_counters_t counters;
+static __thread checkpoint_thread_t *local_counters;
+/* The counters of the calling thread, in COUNTERS. */
+
+int
+compress_available (void)
+{
+  return 1;
+}
+
+/* Makes room for at least one more byte of output in BUFFER, which
+   STREAM is writing to. */
+static void
+grow (z_stream *stream, char **buffer, size_t *capacity)
+{
+  size_t used = (char *)stream->next_out - *buffer;
+
+  *capacity *= 2;
+  *buffer = realloc (*buffer, *capacity);
+  if (*buffer == 0)
+    log_fatal ("Out of memory.");
+  stream->next_out = (Bytef *)*buffer + used;
+  stream->avail_out = *capacity - used;
+}
+
+compress_t *
+compress_new (unsigned level)
+{
+  compress_t *compress = calloc (1, sizeof (*compress));
+
+  if (compress == 0
+      || (compress->buffer = malloc (INITIAL_CAPACITY)) == 0)
+    log_fatal ("Out of memory.");
+  compress->capacity = INITIAL_CAPACITY;
+  /* Raw deflate, without the zlib header and checksum. */
+  if (deflateInit2 (&compress->stream, level, Z_DEFLATED, -15, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK)
+    log_fatal ("Could not initialize the compressor.");
+  return compress;
+}
+
+void
+compress_reset (compress_t *compress)
+{
+  deflateReset (&compress->stream);
+}
+
+static unsigned long
+cpu_nanoseconds (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+const char *
+compress_frame (compress_t *compress, const struct iovec *iov,
+                unsigned count, size_t *length)
+{
+  z_stream *stream = &compress->stream;
+  unsigned long start = cpu_nanoseconds ();
+  unsigned long in = 0;
+  size_t frame_length;
+  unsigned j;
+  int flush;
+
+  /* The length prefix is filled in at the end. */
+  stream->next_out = (Bytef *)compress->buffer + 4;
+  stream->avail_out = compress->capacity - 4;
+  for (j = 0; j < count; ++j)
+    {
+      stream->next_in = iov[j].iov_base;
+      stream->avail_in = iov[j].iov_len;
+      in += iov[j].iov_len;
+      flush = j + 1 == count ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+
+      /* With Z_SYNC_FLUSH, deflate is done when it leaves output
+         space unused. */
+      do
+        {
+          if (stream->avail_out == 0)
+            grow (stream, &compress->buffer, &compress->capacity);
+          if (deflate (stream, flush) == Z_STREAM_ERROR)
+            log_fatal ("Compression failed.");
+        }
+      while (stream->avail_in > 0 || stream->avail_out == 0);
+    }
+
+  *length = (char *)stream->next_out - compress->buffer;
+  frame_length = *length - 4;
+  compress->buffer[0] = frame_length >> 24;
+  compress->buffer[1] = frame_length >> 16;
+  compress->buffer[2] = frame_length >> 8;
+  compress->buffer[3] = frame_length;
+
+  CHECKPOINT_ADD (&counters, local_counters, STAT_IN, in);
+  CHECKPOINT_ADD (&counters, local_counters, STAT_OUT, *length);
+  CHECKPOINT_ADD (&counters, local_counters, STAT_CPU,
+                  cpu_nanoseconds () - start);
+  return compress->buffer;
+}
+
+decompress_t *
+decompress_new (void)
+{
+  decompress_t *decompress = calloc (1, sizeof (*decompress));
+
+  if (decompress == 0
+      || (decompress->buffer = malloc (INITIAL_CAPACITY)) == 0)
+    log_fatal ("Out of memory.");
+  decompress->capacity = INITIAL_CAPACITY;
+  if (inflateInit2 (&decompress->stream, -15) != Z_OK)
+    log_fatal ("Could not initialize the decompressor.");
+  return decompress;
+}
+
+const char *
+decompress_frame (decompress_t *decompress, const char *data, size_t length,
+                  size_t *out_length)
+{
+  z_stream *stream = &decompress->stream;
+  int result;
+
+  stream->next_in = (Bytef *)data;
+  stream->avail_in = length;
+  stream->next_out = (Bytef *)decompress->buffer;
+  stream->avail_out = decompress->capacity;
+  do
+    {
+      if (stream->avail_out == 0)
+        {
+          if (decompress->capacity >= MAX_OUTPUT)
+            return 0;
+          grow (stream, &decompress->buffer, &decompress->capacity);
+        }
+      /* Z_BUF_ERROR means that no progress is possible, which is an
+         error with output space left. */
+      result = inflate (stream, Z_SYNC_FLUSH);
+      if (result != Z_OK
+          && (result != Z_BUF_ERROR || stream->avail_out != 0))
+        return 0;
+    }
+  while (stream->avail_in > 0 || stream->avail_out == 0);
+
+  *out_length = (char *)stream->next_out - decompress->buffer;
+  return decompress->buffer;
+}
+
+static void
+report (checkpoint_t *checkpoint)
+{
+  unsigned long deltas[STATS], in, out;
+
+  checkpoint_deltas (&counters, deltas, STATS);
+  in = deltas[STAT_IN];
+  out = deltas[STAT_OUT];
+  checkpoint_printf (checkpoint, ", compressed %lu to %lu bytes (ratio %.2f, "
+                     "%.1f ms CPU/MB)", in, out,
+                     out ? (double)in / out : 0.0,
+                     in ? (double)deltas[STAT_CPU] / in : 0.0);
+}
+
+void
+compress_init (void)
+{
+  checkpoint_register (report);
+}
+
+void
+compress_statistics (unsigned long *in, unsigned long *out)
+{
+  *in = checkpoint_counter (&counters, STAT_IN);
+  *out = checkpoint_counter (&counters, STAT_OUT);
+}
+
+#else /* !HAVE_ZLIB_H */
+
+/* Without zlib, compression cannot be enabled, so the remaining
+   functions are never called. */
+
+int
+compress_available (void)
+{
+  return 0;
+}
+
+compress_t *
+compress_new (unsigned level)
+{
+  (void)level;
+  log_fatal ("Compression is not supported by this build.");
+  return 0;
+}
+
+void
+compress_reset (compress_t *compress)
+{
+  (void)compress;
+}
+
+const char *
+compress_frame (compress_t *compress, const struct iovec *iov,
+                unsigned count, size_t *length)
+{
+  (void)compress; (void)iov; (void)count; (void)length;
+  return 0;
+}
+
+decompress_t *
+decompress_new (void)
+{
+  log_fatal ("Compression is not supported by this build.");
+  return 0;
+}
+
+const char *
+decompress_frame (decompress_t *decompress, const char *data, size_t length,
+                  size_t *out_length)
+{
+  (void)decompress; (void)data; (void)length; (void)out_length;
+  return 0;
+}
+
+void
+compress_init (void)
+{
+}
+
+void
+compress_statistics (unsigned long *in, unsigned long *out)
+{
+  *in = *out = 0;
+}
+
+#endif /* !HAVE_ZLIB_H */
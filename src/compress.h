@@ -0,0 +1,86 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "config.h"
+
+#include <sys/uio.h>
+
+/* Compressed TCP streams.  A collector which supports compression
+   includes COMPRESS_BANNER_TOKEN in its service banner.  The client
+   then sends a record consisting of COMPRESS_SIGNATURE (with the
+   usual length prefix), followed by frames until the end of the
+   connection.  Each frame is a 32-bit big-endian length, followed by
+   that many bytes of raw deflate data (RFC 1951), which end at a
+   sync flush point.  The deflate stream continues across the frames
+   of a connection, and its uncompressed content is the usual
+   sequence of length-prefixed records.  A collector must discard an
+   incomplete frame at the end of a connection; the client resends
+   its records on the next connection. */
+
+#define COMPRESS_BANNER_TOKEN "compress=deflate"
+#define COMPRESS_SIGNATURE "DNSXFRZ1"
+
+#define COMPRESS_MAX_FRAME (64U << 20)
+/* The longest compressed frame a decoder has to accept. */
+
+int compress_available (void);
+/* Returns nonzero if the program has been built with zlib. */
+
+typedef struct compress compress_t;
+/* The compressor of a connection. */
+
+compress_t *compress_new (unsigned level);
+/* Allocates a compressor with the zlib compression LEVEL (between 1
+   and 9).  Terminates the program on error. */
+
+void compress_reset (compress_t *compress);
+/* Starts a new deflate stream, for a new connection. */
+
+const char *compress_frame (compress_t *compress, const struct iovec *iov,
+                            unsigned count, size_t *length);
+/* Compresses the data in the COUNT iovecs at IOV into a frame (with
+   its length prefix), and stores the frame length in *LENGTH.  The
+   frame is valid until the next call.  Terminates the program on
+   error. */
+
+typedef struct decompress decompress_t;
+/* The decompressor of a connection. */
+
+decompress_t *decompress_new (void);
+/* Allocates a decompressor.  Terminates the program on error. */
+
+const char *decompress_frame (decompress_t *decompress, const char *data,
+                              size_t length, size_t *out_length);
+/* Decompresses the compressed data of a frame (without its length
+   prefix) at DATA (LENGTH bytes).  Returns the uncompressed data and
+   stores its length in *OUT_LENGTH, or returns a null pointer if the
+   frame is invalid.  The data is valid until the next call. */
+
+void compress_init (void);
+/* Registers the checkpoint reporter. */
+
+void compress_statistics (unsigned long *in, unsigned long *out);
+/* Returns the number of bytes compressed and the size of the frames
+   since the start of the program (across all threads).  For
+   testing. */
+
+#endif /* COMPRESS_H */
@@ -0,0 +1,339 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "dedup.h"
+#include "ansidecl.h"
+#include "checkpoint.h"
+#include "dns.h"
+#include "log.h"
+#include "option.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_LINE 64
+
+#define WAYS 8
+/* Number of entries per bucket. */
+
+typedef struct
+{
+  uint32_t fingerprint[WAYS];   /* zero for an empty entry */
+  uint32_t seen[WAYS];          /* time of the last forwarded copy */
+} __attribute__ ((aligned (CACHE_LINE))) bucket_t;
+/* A set of entries which share the low bits of their hash, so that a
+   lookup touches a single cache line. */
+
+typedef struct
+{
+  bucket_t *buckets;
+  uint32_t mask;
+} table_t;
+/* The deduplication table of a thread, allocated on first use. */
+
+unsigned dedup_window = 0;
+static size_t dedup_memory = 1 << 20;
+/* Settings from the command line. */
+
+static __thread table_t *table;
+
+enum
+  {
+    STAT_HITS,
+    STAT_MISSES,
+    STAT_EVICTIONS,
+    STATS
+  };
+
+static checkpoint_counters_t counters;
+static __thread checkpoint_thread_t *local_counters;
+/* The counters of the calling thread, in COUNTERS. */
+
+void
+dedup_configure (const char *spec)
+{
+  char *copy = strdup (spec);
+  char *options = strchr (copy, ',');
+  char *name, *value;
+
+  if (options)
+    *options++ = 0;
+
+  dedup_window = option_unsigned ("-u", copy);
+  while (option_next (&options, &name, &value))
+    if (strcmp (name, "memory") == 0)
+      dedup_memory = option_size (name, value);
+    else
+      option_unknown ("-u", name);
+  free (copy);
+
+  if (dedup_window == 0)
+    log_fatal ("The deduplication window must be at least one second.");
+  if (dedup_memory < sizeof (bucket_t))
+    log_fatal ("Deduplication needs at least %u bytes of memory.",
+               (unsigned)sizeof (bucket_t));
+}
+
+static void
+report (checkpoint_t *checkpoint)
+{
+  unsigned long deltas[STATS];
+
+  checkpoint_deltas (&counters, deltas, STATS);
+  checkpoint_printf (checkpoint, ", deduplication %lu hits/%lu misses/%lu evictions",
+                     deltas[STAT_HITS], deltas[STAT_MISSES],
+                     deltas[STAT_EVICTIONS]);
+}
+
+void
+dedup_init (void)
+{
+  if (dedup_window > 0)
+    checkpoint_register (report);
+}
+
+void
+dedup_statistics (unsigned long *hits, unsigned long *misses,
+                  unsigned long *evictions)
+{
+  *hits = checkpoint_counter (&counters, STAT_HITS);
+  *misses = checkpoint_counter (&counters, STAT_MISSES);
+  *evictions = checkpoint_counter (&counters, STAT_EVICTIONS);
+}
+
+/* Allocates the table of the calling thread, with the largest power
+   of two of buckets which fits into the memory limit. */
+static table_t *
+table_create (void)
+{
+  table_t *t;
+  size_t size = 1;
+
+  while (size * 2 * sizeof (bucket_t) <= dedup_memory)
+    size *= 2;
+
+  t = calloc (1, sizeof (*t));
+  if (t == 0
+      || posix_memalign ((void **)&t->buckets, CACHE_LINE,
+                         size * sizeof (*t->buckets)) != 0)
+    log_fatal ("Out of memory.");
+  memset (t->buckets, 0, size * sizeof (*t->buckets));
+  t->mask = size - 1;
+  return t;
+}
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static inline uint64_t
+hash_byte (uint64_t hash, unsigned char c)
+{
+  return (hash ^ c) * FNV_PRIME;
+}
+
+/* Mixes the bits of X (the splitmix64 finalizer), so that hashes
+   can be combined by addition. */
+static inline uint64_t
+mix (uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xBF58476D1CE4E5B9ULL;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EBULL;
+  x ^= x >> 31;
+  return x;
+}
+
+/* Hashes the domain name at *OFFSET in MESSAGE (LENGTH bytes) into
+   *HASH, in lower case and with compression pointers followed, and
+   advances *OFFSET past it.  Returns zero if the name is invalid. */
+static int
+hash_name (const char *message, size_t length, size_t *offset,
+           uint64_t *hash)
+{
+  unsigned char name[DNS_NAME_MAX];
+  size_t name_length = dns_name_decode (message, length, offset, name);
+  uint64_t h = *hash;
+  size_t j;
+
+  /* Length bytes are below 'A', so they are not changed. */
+  for (j = 0; j < name_length; ++j)
+    {
+      unsigned char c = name[j];
+
+      h = hash_byte (h, c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+    }
+  *hash = h;
+  return name_length != 0;
+}
+
+/* Returns the hash of the resource record RR in MESSAGE (LENGTH
+   bytes), without its TTL, or zero if the record is invalid.  Domain
+   names in the RDATA of common types are hashed like owner names, so
+   that name compression does not matter. */
+static uint64_t
+hash_record (const char *message, size_t length, const dns_rr_t *rr)
+{
+  const unsigned char *data = (const unsigned char *)message;
+  uint64_t h = FNV_OFFSET;
+  size_t p = rr->name, end = rr->rdata + rr->rdlength;
+  unsigned prefix = 0, names = 0, j;
+
+  if (!hash_name (message, length, &p, &h))
+    return 0;
+  h = hash_byte (h, rr->type >> 8);
+  h = hash_byte (h, rr->type);
+  h = hash_byte (h, rr->class >> 8);
+  h = hash_byte (h, rr->class);
+
+  switch (rr->type)
+    {
+    case 2:                     /* NS */
+    case 5:                     /* CNAME */
+    case 12:                    /* PTR */
+    case 39:                    /* DNAME */
+      names = 1;
+      break;
+    case 6:                     /* SOA */
+      names = 2;
+      break;
+    case 15:                    /* MX */
+      prefix = 2;
+      names = 1;
+      break;
+    }
+
+  p = rr->rdata;
+  if (UNLIKELY (p + prefix > end))
+    return 0;
+  for (j = 0; j < prefix; ++j)
+    h = hash_byte (h, data[p++]);
+  for (j = 0; j < names; ++j)
+    if (!hash_name (message, end, &p, &h))
+      return 0;
+  for (; p < end; ++p)
+    h = hash_byte (h, data[p]);
+
+  /* Zero is reserved for errors. */
+  return mix (h) | 1;
+}
+
+/* Stores the hash of the normalized response MESSAGE (LENGTH bytes,
+   at least a header) in *HASH.  Returns zero if the message cannot be
+   parsed. */
+static int
+normalize (const char *message, size_t length, uint64_t *hash)
+{
+  uint64_t h = FNV_OFFSET, records = 0, record;
+  dns_header_t header;
+  dns_parser_t parser;
+  dns_rr_t rr;
+  unsigned section;
+  size_t p;
+  int result;
+
+  if (!dns_header_decode (message, length, &header))
+    return 0;
+  h = hash_byte (h, (header.flags >> 8) & 0x04); /* AA */
+  h = hash_byte (h, header.flags & 0x0F);         /* RCODE */
+
+  /* Without answers, the authority section (the referral, or the SOA
+     record of a negative answer) is compared. */
+  section = DNS_SECTION_ANSWER;
+  if (header.ancount == 0)
+    {
+      section = DNS_SECTION_AUTHORITY;
+      h = hash_byte (h, 1);
+    }
+
+  /* Records are combined by addition, so that their order does not
+     matter. */
+  dns_parser_init (&parser, message, length, &header);
+  while ((result = dns_parser_next (&parser, &rr)) > 0)
+    if (rr.section == DNS_SECTION_QUESTION)
+      {
+        p = rr.name;
+        if (!hash_name (message, length, &p, &h))
+          return 0;
+        h = hash_byte (h, rr.type >> 8);
+        h = hash_byte (h, rr.type);
+        h = hash_byte (h, rr.class >> 8);
+        h = hash_byte (h, rr.class);
+      }
+    else if (rr.section == section)
+      {
+        record = hash_record (message, length, &rr);
+        if (record == 0)
+          return 0;
+        records += record;
+      }
+    else if (rr.section > section)
+      break;
+  if (result < 0)
+    return 0;
+
+  *hash = mix (mix (h) ^ records);
+  return 1;
+}
+
+int
+dedup_check (const char *message, size_t length)
+{
+  table_t *t = table;
+  bucket_t *b;
+  uint64_t hash;
+  uint32_t fingerprint, now;
+  unsigned j, victim = 0;
+
+  if (UNLIKELY (!normalize (message, length, &hash)))
+    return 0;
+  if (UNLIKELY (t == 0))
+    t = table = table_create ();
+  now = checkpoint_seconds ();
+
+  /* The low bits select the bucket, the high bits are stored. */
+  b = t->buckets + (hash & t->mask);
+  fingerprint = (hash >> 32) | 1;
+  for (j = 0; j < WAYS; ++j)
+    {
+      if (b->fingerprint[j] == fingerprint)
+        {
+          if (now - b->seen[j] < dedup_window)
+            {
+              CHECKPOINT_COUNT (&counters, local_counters, STAT_HITS);
+              return 1;
+            }
+          /* The window has passed, so this copy is forwarded. */
+          b->seen[j] = now;
+          CHECKPOINT_COUNT (&counters, local_counters, STAT_MISSES);
+          return 0;
+        }
+      if (b->fingerprint[victim] != 0
+          && (b->fingerprint[j] == 0
+              || now - b->seen[j] > now - b->seen[victim]))
+        victim = j;
+    }
+
+  /* Replace an empty entry, or the oldest one. */
+  if (b->fingerprint[victim] != 0 && now - b->seen[victim] < dedup_window)
+    CHECKPOINT_COUNT (&counters, local_counters, STAT_EVICTIONS);
+  b->fingerprint[victim] = fingerprint;
+  b->seen[victim] = now;
+  CHECKPOINT_COUNT (&counters, local_counters, STAT_MISSES);
+  return 0;
+}
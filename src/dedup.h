@@ -0,0 +1,53 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "config.h"
+
+extern unsigned dedup_window;
+/* The time (in seconds) during which repeated responses are
+   suppressed, or zero if deduplication is disabled (the default). */
+
+void dedup_configure (const char *spec);
+/* Enables deduplication.  SPEC is the window in seconds, optionally
+   followed by ",memory=BYTES" (the size of the table per capture
+   worker).  Terminates the program on error. */
+
+void dedup_init (void);
+/* Registers the checkpoint reporter.  Must be called before the
+   capture workers are started. */
+
+int dedup_check (const char *message, size_t length);
+/* Looks up the DNS response at MESSAGE (LENGTH bytes, with a valid
+   header) in the table of the calling thread.  Returns nonzero if an
+   equivalent response has been seen within the window, and records
+   the response otherwise.  Responses are equivalent if they have the
+   same question, AA flag, response code and answer records (in any
+   order, ignoring TTLs, the message ID and name compression).
+   Without answers, the authority records are compared instead.
+   Responses which cannot be parsed are never duplicates. */
+
+void dedup_statistics (unsigned long *hits, unsigned long *misses,
+                       unsigned long *evictions);
+/* Returns the counters since the start of the program (across all
+   threads).  For testing. */
+
+#endif /* DEDUP_H */
@@ -46,3 +46,141 @@ dns_header_decode (const char *packet, size_t length, dns_header_t *header)
   return header->qdcount < 16 && header->ancount < 1024
     && header->nscount < 1024 && header->adcount < 1024;
 }
+
+void
+dns_parser_init (dns_parser_t *parser, const char *packet, size_t length,
+                 const dns_header_t *header)
+{
+  parser->packet = (const unsigned char *)packet;
+  parser->length = length;
+  parser->offset = sizeof (*header);
+  parser->section = DNS_SECTION_QUESTION;
+  parser->counts[DNS_SECTION_QUESTION] = header->qdcount;
+  parser->counts[DNS_SECTION_ANSWER] = header->ancount;
+  parser->counts[DNS_SECTION_AUTHORITY] = header->nscount;
+  parser->counts[DNS_SECTION_ADDITIONAL] = header->adcount;
+  parser->remaining = header->qdcount;
+}
+
+/* Returns the offset after the name at OFFSET in PACKET (LENGTH
+   bytes), or zero if it is truncated or uses an unknown label
+   type.  Compression pointers are not followed. */
+static inline size_t
+name_skip (const unsigned char *packet, size_t length, size_t offset)
+{
+  for (;;)
+    {
+      unsigned label;
+
+      if (UNLIKELY (offset >= length))
+        return 0;
+      label = packet[offset];
+      if (label == 0)
+        return offset + 1;
+      if (label >= 0xC0)
+        return offset + 2 <= length ? offset + 2 : 0;
+      if (UNLIKELY (label >= 0x40))
+        return 0;
+      offset += label + 1;
+    }
+}
+
+int
+dns_parser_next (dns_parser_t *parser, dns_rr_t *rr)
+{
+  const unsigned char *p = parser->packet;
+  size_t offset;
+
+  while (parser->remaining == 0)
+    {
+      if (parser->section >= DNS_SECTION_ADDITIONAL)
+        return parser->section == DNS_SECTIONS ? -1 : 0;
+      parser->remaining = parser->counts[++parser->section];
+    }
+
+  rr->section = parser->section;
+  rr->name = parser->offset;
+  offset = name_skip (p, parser->length, parser->offset);
+  if (UNLIKELY (offset == 0))
+    goto malformed;
+
+  if (parser->section == DNS_SECTION_QUESTION)
+    {
+      if (UNLIKELY (offset + 4 > parser->length))
+        goto malformed;
+      rr->ttl = 0;
+      rr->rdlength = 0;
+      rr->rdata = offset + 4;
+    }
+  else
+    {
+      if (UNLIKELY (offset + 10 > parser->length))
+        goto malformed;
+      rr->ttl = ((uint32_t)p[offset + 4] << 24) | (p[offset + 5] << 16)
+        | (p[offset + 6] << 8) | p[offset + 7];
+      rr->rdlength = (p[offset + 8] << 8) | p[offset + 9];
+      rr->rdata = offset + 10;
+      if (UNLIKELY (rr->rdata + rr->rdlength > parser->length))
+        goto malformed;
+    }
+  rr->type = (p[offset] << 8) | p[offset + 1];
+  rr->class = (p[offset + 2] << 8) | p[offset + 3];
+
+  parser->offset = rr->rdata + rr->rdlength;
+  --parser->remaining;
+  return 1;
+
+ malformed:
+  /* Make later calls fail, too. */
+  parser->section = DNS_SECTIONS;
+  parser->remaining = 0;
+  return -1;
+}
+
+size_t
+dns_name_decode (const char *packet, size_t length, size_t *offset,
+                 unsigned char *buffer)
+{
+  const unsigned char *p = (const unsigned char *)packet;
+  size_t position = *offset, next = 0, decoded = 0;
+
+  for (;;)
+    {
+      size_t start = position, target;
+      unsigned label;
+
+      /* Find the end of the uncompressed labels at START, and copy
+         them with a single call to memcpy. */
+      for (;;)
+        {
+          if (UNLIKELY (position >= length))
+            return 0;
+          label = p[position];
+          if (label == 0 || label >= 0x40)
+            break;
+          position += label + 1;
+        }
+      if (label == 0)
+        ++position;
+      else if (UNLIKELY (label < 0xC0 || position + 1 >= length))
+        return 0;
+      if (UNLIKELY (decoded + (position - start) > DNS_NAME_MAX))
+        return 0;
+      memcpy (buffer + decoded, p + start, position - start);
+      decoded += position - start;
+      if (label == 0)
+        break;
+
+      target = ((label & 0x3F) << 8) | p[position + 1];
+      /* Pointers must point backwards, so that they cannot form a
+         loop. */
+      if (UNLIKELY (target >= position))
+        return 0;
+      if (next == 0)
+        next = position + 2;
+      position = target;
+    }
+
+  *offset = next ? next : position;
+  return decoded;
+}
@@ -45,4 +45,62 @@ int dns_header_decode (const char *packet, size_t length, dns_header_t *header);
 /* Parses LENGTH bytes at PACKET as a DNS header and stores the result
    at HEADER.  Returns zero on error. */
 
+#define DNS_NAME_MAX 255
+/* The length of the longest domain name in wire format, including the
+   root label. */
+
+enum
+  {
+    DNS_SECTION_QUESTION,
+    DNS_SECTION_ANSWER,
+    DNS_SECTION_AUTHORITY,
+    DNS_SECTION_ADDITIONAL,
+    DNS_SECTIONS
+  };
+
+typedef struct
+{
+  const unsigned char *packet;
+  size_t length;
+  size_t offset;                /* start of the next entry */
+  unsigned section;             /* section of the next entry */
+  unsigned remaining;           /* entries left in SECTION */
+  uint16_t counts[DNS_SECTIONS];
+} dns_parser_t;
+/* Iterates over the entries of a DNS message, without copying or
+   allocating anything. */
+
+typedef struct
+{
+  unsigned section;             /* DNS_SECTION_* */
+  size_t name;                  /* offset of the owner name */
+  uint16_t type;
+  uint16_t class;
+  uint32_t ttl;                 /* zero in the question section */
+  size_t rdata;                 /* offset of the RDATA */
+  uint16_t rdlength;            /* zero in the question section */
+} dns_rr_t;
+/* A question or resource record.  Offsets are relative to the start
+   of the message. */
+
+void dns_parser_init (dns_parser_t *parser, const char *packet,
+                      size_t length, const dns_header_t *header);
+/* Prepares PARSER for the message at PACKET (LENGTH bytes), whose
+   header has been decoded successfully into HEADER. */
+
+int dns_parser_next (dns_parser_t *parser, dns_rr_t *rr);
+/* Stores the next question or resource record in *RR.  Returns 1 on
+   success, 0 after the last entry, and -1 if the message is truncated
+   or malformed (in which case later calls return -1 as well).  Owner
+   names are skipped, but not checked: use dns_name_decode. */
+
+size_t dns_name_decode (const char *packet, size_t length, size_t *offset,
+                        unsigned char *buffer);
+/* Decodes the domain name at *OFFSET in the message at PACKET (LENGTH
+   bytes) into BUFFER (DNS_NAME_MAX bytes), in uncompressed wire
+   format, and advances *OFFSET past the name.  Returns the length of
+   the decoded name, or zero if the name is truncated, too long, uses
+   an unknown label type, or contains a compression pointer which does
+   not point backwards (which rules out pointer loops). */
+
 #endif /* DNS_H */
@@ -16,130 +16,817 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include "checkpoint.h"
+#include "dedup.h"
 #include "dns.h"
 #include "forward.h"
+#include "fragment.h"
+#include "ipv6.h"
 #include "log.h"
+#include "option.h"
+#include "queue.h"
+#include "ratelimit.h"
+#include "spool.h"
+#include "tcp.h"
+#include "tunnel.h"
+#include "zone.h"
 
 #include <errno.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 int forward_authoritative_only = 0;
 int forward_without_answers = 1;
 int forward_over_tcp = 0;
+static unsigned forward_compress_level = 0;
+size_t forward_max_payload = 512;
 
-/* Returns nonzero if the packet should be forwarded. */
-static int
-forward_decode_encode (const char* buffer, size_t length, forward_t *forward, size_t *forward_length)
+__thread unsigned forward_drops[FORWARD_DROP_REASONS];
+
+static const char *const drop_reasons[FORWARD_DROP_REASONS] =
+  {
+    "invalid IP header",
+    "invalid tunnel header",
+    "fragment",
+    "TCP segment",
+    "not UDP or TCP",
+    "invalid UDP header",
+    "invalid DNS header",
+    "question",
+    "no answers",
+    "not authoritative",
+    "overlong",
+    "zone lists",
+    "rate limited",
+    "duplicate",
+    "no target",
+  };
+
+const char *
+forward_drop_reason (unsigned reason)
+{
+  return drop_reasons[reason];
+}
+
+#define DROP(REASON) do { ++forward_drops[FORWARD_DROP_##REASON]; return 0; } while (0)
+/* Counts a discarded packet and returns zero. */
+
+typedef char forward6_fits[sizeof (forward6_t) <= sizeof (forward_t) ? 1 : -1];
+/* Records are encoded in place into forward_t buffers (batches, queue
+   slots and the spool). */
+
+void
+forward_set_max_payload (const char *spec)
+{
+  unsigned long value = option_unsigned ("-M", spec);
+
+  if (value < 512 || value > FORWARD_MAX_PAYLOAD)
+    log_fatal ("The maximum payload must be between 512 and %u bytes.",
+               (unsigned)FORWARD_MAX_PAYLOAD);
+  forward_max_payload = value;
+}
+
+forward_t *
+forward_record_allocate (size_t length)
+{
+  forward_t *record = malloc (length);
+
+  if (record == 0)
+    log_fatal ("Out of memory.");
+  return record;
+}
+
+/* Returns a copy of the large RECORD, which is LENGTH bytes long. */
+static forward_t *
+record_duplicate (const forward_t *record, size_t length)
+{
+  forward_t *copy = forward_record_allocate (length);
+
+  memcpy (copy, record, length);
+  return copy;
+}
+
+static const char *const drop_messages[FORWARD_DROP_REASONS] =
+  {
+    [FORWARD_DROP_QUESTION] = "Dropping question packet",
+    [FORWARD_DROP_NO_ANSWERS] = "Dropping packet without answers",
+    [FORWARD_DROP_NON_AUTHORITATIVE] = "Dropping non-authoritative DNS packet",
+  };
+/* Debug messages for the reasons returned by dns_policy, followed by
+   the addresses.  (dns_header_decode logs its own errors.) */
+
+/* Decodes the DNS header at BUFFER (LENGTH bytes) and checks whether
+   the message should be forwarded.  Returns FORWARD_DROP_REASONS if
+   so, and stores the AA flag in *AUTHORITATIVE.  Otherwise, returns
+   the reason for discarding the message. */
+static inline unsigned
+dns_policy (const char *buffer, size_t length, int *authoritative)
+{
+  dns_header_t dns_header;
+
+  if (UNLIKELY (!dns_header_decode (buffer, length, &dns_header)))
+    return FORWARD_DROP_DNS;
+
+  if (! DNS_ANSWER_P (dns_header))
+    return FORWARD_DROP_QUESTION;
+
+  if (UNLIKELY ((!forward_without_answers) && dns_header.ancount == 0
+                && !DNS_TRUNCATION_P (dns_header)))
+    return FORWARD_DROP_NO_ANSWERS;
+
+  /* If in forward_authoritative_only mode, exit if the packet is not an
+     authoritative answer. */
+  *authoritative = DNS_AUTHORITATIVE_P (dns_header);
+  if (forward_authoritative_only && !*authoritative)
+    return FORWARD_DROP_NON_AUTHORITATIVE;
+
+  return FORWARD_DROP_REASONS;
+}
+
+const char *
+forward_filter (const char *filter)
+{
+  static char buffer[2048];
+  char check4[128], check6[128];
+  unsigned mask = 0x80 | (forward_authoritative_only ? 0x04 : 0);
+
+  /* The checks of dns_policy on the DNS header, which starts 8 bytes
+     into the UDP header (48 bytes into the IPv6 header, without
+     extension headers).  Truncated answers may lack answers. */
+  if (forward_without_answers)
+    {
+      snprintf (check4, sizeof (check4), "udp[10] & 0x%02x = 0x%02x",
+                mask, mask);
+      snprintf (check6, sizeof (check6), "ip6[50] & 0x%02x = 0x%02x",
+                mask, mask);
+    }
+  else
+    {
+      snprintf (check4, sizeof (check4), "udp[10] & 0x%02x = 0x%02x"
+                " and (udp[14:2] != 0 or udp[10] & 0x02 != 0)", mask, mask);
+      snprintf (check6, sizeof (check6), "ip6[50] & 0x%02x = 0x%02x"
+                " and (ip6[54:2] != 0 or ip6[50] & 0x02 != 0)", mask, mask);
+    }
+
+  /* TCP segments, fragments (whose first fragment may carry the DNS
+     header, but the others do not) and IPv6 packets with extension
+     headers are passed unchecked. */
+  if (snprintf (buffer, sizeof (buffer),
+                "(%s) and (not ip or ip[9] != 17 or ip[6:2] & 0x1fff != 0 or (%s))"
+                " and (not ip6 or ip6[6] != 17 or (%s))",
+                filter, check4, check6) >= (int)sizeof (buffer))
+    log_fatal ("Filter expression is too long.");
+  return buffer;
+}
+
+static __thread struct
+{
+  unsigned family;              /* 4 or 6, or zero if there are none */
+  ipv4_header_t ipv4;
+  ipv6_header_t ipv6;
+} segment;
+/* The IP header of the TCP segment whose further messages are
+   returned by forward_decode_next. */
+
+/* Checks the DNS message at PAYLOAD (LENGTH bytes), captured in an
+   IPv6 packet with IP_HEADER, and encodes the record header (see
+   forward_decode). */
+static const char *
+encode6 (const ipv6_header_t *ip_header, const char *payload, size_t length,
+         forward6_t *header, size_t *payload_length, ipv4_t *source)
+{
+  char source_name[IPV6_FORMAT_LENGTH], destination_name[IPV6_FORMAT_LENGTH];
+  int authoritative = 0;
+  unsigned reason;
+  uint32_t words[4];
+
+  reason = dns_policy (payload, length, &authoritative);
+  if (reason != FORWARD_DROP_REASONS)
+    {
+      if (reason != FORWARD_DROP_DNS)
+        log_debug_maybe (("%s (%s -> %s).", drop_messages[reason],
+                          ipv6_format (ip_header->source, source_name),
+                          ipv6_format (ip_header->destination, destination_name)));
+      ++forward_drops[reason];
+      return 0;
+    }
+
+  /* Add the DNSXFR02 protocol signature, or DNSXFR04 for long
+     payloads. */
+  if (UNLIKELY (length > sizeof (header->payload)))
+    {
+      if (length > forward_max_payload)
+        {
+          log_debug_maybe (("Dropping overlong packet (%s -> %s, %u bytes).",
+                            ipv6_format (ip_header->source, source_name),
+                            ipv6_format (ip_header->destination, destination_name),
+                            (unsigned)length));
+          DROP (OVERLONG);
+        }
+      STATIC_MEMCPY (header->signature, FORWARD6_LARGE_SIGNATURE);
+    }
+  else
+    STATIC_MEMCPY (header->signature, FORWARD6_SIGNATURE);
+
+  if (UNLIKELY (zone_file != 0) && zone_check (payload, length))
+    {
+      log_debug_maybe (("Dropping DNS packet because of the zone lists (%s -> %s).",
+                        ipv6_format (ip_header->source, source_name),
+                        ipv6_format (ip_header->destination, destination_name)));
+      DROP (ZONE);
+    }
+
+  memcpy (words, ip_header->source, sizeof (words));
+  if (UNLIKELY (ratelimit_rate != 0) && ratelimit_check (words))
+    {
+      log_debug_maybe (("Dropping rate-limited DNS packet (%s -> %s).",
+                        ipv6_format (ip_header->source, source_name),
+                        ipv6_format (ip_header->destination, destination_name)));
+      DROP (RATE_LIMITED);
+    }
+
+  if (UNLIKELY (dedup_window != 0) && dedup_check (payload, length))
+    {
+      log_debug_maybe (("Dropping duplicate DNS packet (%s -> %s).",
+                        ipv6_format (ip_header->source, source_name),
+                        ipv6_format (ip_header->destination, destination_name)));
+      DROP (DUPLICATE);
+    }
+
+  /* Copy the source IP address only if the AA flag is set, to protect
+     submitter privacy. */
+  if (authoritative)
+    memcpy (header->nameserver, ip_header->source, sizeof (header->nameserver));
+  else
+    memset (header->nameserver, 0, sizeof (header->nameserver));
+
+  *payload_length = length;
+  *source = words[0] ^ words[1] ^ words[2] ^ words[3];
+
+  return payload;
+}
+
+/* Checks the DNS message at PAYLOAD (LENGTH bytes), captured in an
+   IPv4 packet with IP_HEADER, and encodes the record header (see
+   forward_decode). */
+static const char *
+encode4 (const ipv4_header_t *ip_header, const char *payload, size_t length,
+         forward_t *header, size_t *payload_length, ipv4_t *source)
+{
+  int authoritative = 0;
+  unsigned reason;
+
+  reason = dns_policy (payload, length, &authoritative);
+  if (reason != FORWARD_DROP_REASONS)
+    {
+      if (reason != FORWARD_DROP_DNS)
+        log_debug_maybe (("%s (" IPV4_FORMAT " -> " IPV4_FORMAT ").",
+                          drop_messages[reason],
+                          IPV4_FORMAT_ARGS (ip_header->source),
+                          IPV4_FORMAT_ARGS (ip_header->destination)));
+      ++forward_drops[reason];
+      return 0;
+    }
+
+  /* Add the DNSXFR01 protocol signature, or DNSXFR03 for long
+     payloads. */
+  if (UNLIKELY (length > sizeof (header->payload)))
+    {
+      if (length > forward_max_payload)
+        {
+          log_debug_maybe (("Dropping overlong packet (" IPV4_FORMAT " -> " IPV4_FORMAT
+                            ", %u bytes).",
+                            IPV4_FORMAT_ARGS (ip_header->source),
+                            IPV4_FORMAT_ARGS (ip_header->destination),
+                            (unsigned)length));
+          DROP (OVERLONG);
+        }
+      STATIC_MEMCPY (header->signature, FORWARD_LARGE_SIGNATURE);
+    }
+  else
+    STATIC_MEMCPY (header->signature, FORWARD_SIGNATURE);
+
+  if (UNLIKELY (zone_file != 0) && zone_check (payload, length))
+    {
+      log_debug_maybe (("Dropping DNS packet because of the zone lists (" IPV4_FORMAT " -> " IPV4_FORMAT ").",
+                        IPV4_FORMAT_ARGS (ip_header->source),
+                        IPV4_FORMAT_ARGS (ip_header->destination)));
+      DROP (ZONE);
+    }
+
+  if (UNLIKELY (ratelimit_rate != 0))
+    {
+      /* Keyed on the IPv4-mapped IPv6 address. */
+      uint32_t words[4] = { 0, 0, htonl (0xFFFF), htonl (ip_header->source) };
+
+      if (ratelimit_check (words))
+        {
+          log_debug_maybe (("Dropping rate-limited DNS packet (" IPV4_FORMAT " -> " IPV4_FORMAT ").",
+                            IPV4_FORMAT_ARGS (ip_header->source),
+                            IPV4_FORMAT_ARGS (ip_header->destination)));
+          DROP (RATE_LIMITED);
+        }
+    }
+
+  if (UNLIKELY (dedup_window != 0) && dedup_check (payload, length))
+    {
+      log_debug_maybe (("Dropping duplicate DNS packet (" IPV4_FORMAT " -> " IPV4_FORMAT ").",
+                        IPV4_FORMAT_ARGS (ip_header->source),
+                        IPV4_FORMAT_ARGS (ip_header->destination)));
+      DROP (DUPLICATE);
+    }
+
+  /* Copy the source IP address only if the AA flag is set, to protect
+     submitter privacy. */
+  if (authoritative)
+    header->nameserver = htonl (ip_header->source);
+  else
+    header->nameserver = htonl (0);
+
+  *payload_length = length;
+  *source = ip_header->source;
+
+  return payload;
+}
+
+/* Returns the first of the DNS messages extracted from the current
+   TCP segment, starting with MESSAGE (LENGTH bytes, or a null
+   pointer), which passes the DNS policy, and encodes its record
+   header like forward_decode. */
+static const char *
+segment_messages (const char *message, size_t length, forward_t *header,
+                  size_t *header_length, size_t *payload_length,
+                  ipv4_t *source)
+{
+  const char *payload;
+
+  for (; message != 0; message = tcp_next (&length))
+    {
+      if (segment.family == 6)
+        {
+          *header_length = offsetof (forward6_t, payload);
+          payload = encode6 (&segment.ipv6, message, length,
+                             (forward6_t *)header, payload_length, source);
+        }
+      else
+        {
+          *header_length = offsetof (forward_t, payload);
+          payload = encode4 (&segment.ipv4, message, length, header,
+                             payload_length, source);
+        }
+      if (payload != 0)
+        return payload;
+    }
+  segment.family = 0;
+  return 0;
+}
+
+/* Passes the TCP segment at BUFFER (LENGTH bytes, after the IP
+   header) to the stream table, and returns its first message like
+   forward_decode.  The IP header has been stored in SEGMENT. */
+static const char *
+decode_tcp (const char *buffer, size_t length, const unsigned char *source,
+            const unsigned char *destination, forward_t *header,
+            size_t *header_length, size_t *payload_length,
+            ipv4_t *source_address)
+{
+  tcp_header_t tcp_header;
+  const char *message;
+  size_t message_length;
+  int valid;
+
+  if (segment.family == 6)
+    valid = ipv6_tcp_header_decode (buffer, length, &segment.ipv6, &tcp_header);
+  else
+    valid = tcp_header_decode (buffer, length, &segment.ipv4, &tcp_header);
+  if (UNLIKELY (!valid))
+    {
+      segment.family = 0;
+      DROP (STREAM);
+    }
+
+  SKIP_BUFFER (buffer, length, TCP_HEADER_LENGTH (tcp_header));
+  message = tcp_segment (segment.family, source, destination, &tcp_header,
+                         buffer, length, &message_length);
+  if (message == 0)
+    {
+      segment.family = 0;
+      DROP (STREAM);
+    }
+  return segment_messages (message, message_length, header, header_length,
+                           payload_length, source_address);
+}
+
+/* The IPv6 part of forward_decode. */
+static const char *
+decode6 (const char* buffer, size_t length, forward6_t *header,
+         size_t *header_length, size_t *payload_length, ipv4_t *source)
+{
+  ipv6_header_t ip_header;
+  udp_header_t udp_header;
+  char source_name[IPV6_FORMAT_LENGTH], destination_name[IPV6_FORMAT_LENGTH];
+
+  if (UNLIKELY (!ipv6_header_decode (buffer, length, &ip_header)))
+    DROP (IP);
+
+  /* Fragments are held until the datagram is complete. */
+  if (UNLIKELY (ip_header.fragment != 0))
+    {
+      buffer = fragment_ipv6 (buffer, &ip_header, &length);
+      if (buffer == 0)
+        DROP (FRAGMENT);
+      if (!ipv6_header_decode (buffer, length, &ip_header))
+        DROP (IP);
+    }
+  length = IPV6_TOTAL_LENGTH (ip_header);
+
+  if (UNLIKELY (ip_header.protocol != 17))
+    {
+      if (ip_header.protocol == 6)
+        {
+          segment.family = 6;
+          segment.ipv6 = ip_header;
+          SKIP_BUFFER (buffer, length, ip_header.header_length);
+          return decode_tcp (buffer, length, ip_header.source,
+                             ip_header.destination, (forward_t *)header,
+                             header_length, payload_length, source);
+        }
+      log_debug_maybe (("Unexpected IP protocol %u (%s -> %s).",
+                        (unsigned)ip_header.protocol,
+                        ipv6_format (ip_header.source, source_name),
+                        ipv6_format (ip_header.destination, destination_name)));
+      DROP (PROTOCOL);
+    }
+
+  SKIP_BUFFER (buffer, length, ip_header.header_length);
+  if (UNLIKELY (!ipv6_udp_header_decode (buffer, length, &ip_header, &udp_header)))
+    DROP (UDP);
+  length = udp_header.total_length;
+
+  SKIP_BUFFER (buffer, length, UDP_HEADER_LENGTH (udp_header));
+  *header_length = offsetof (forward6_t, payload);
+  return encode6 (&ip_header, buffer, length, header, payload_length, source);
+}
+
+const char *
+forward_decode (const char* buffer, size_t length, forward_t *header,
+                size_t *header_length, size_t *payload_length,
+                ipv4_t *source)
 {
   ipv4_header_t ip_header;
   udp_header_t udp_header;
-  dns_header_t dns_header;
-  int authoritative;
+
+  /* Strip GRE and VXLAN headers if enabled. */
+  if (UNLIKELY (tunnel_depth > 0))
+    {
+      buffer = tunnel_decapsulate (buffer, &length);
+      if (buffer == 0)
+        DROP (TUNNEL);
+    }
+
+  /* IPv6 packets take a separate path, so that the IPv4 path only pays
+     for this test. */
+  if (UNLIKELY (length > 0 && (buffer[0] & 0xF0) == 0x60))
+    return decode6 (buffer, length, (forward6_t *)header, header_length,
+                    payload_length, source);
 
   if (UNLIKELY (!ipv4_header_decode (buffer, length, &ip_header)))
-    return 0;
+    DROP (IP);
+
+  /* The payload lengths below are computed from the total length. */
+  if (UNLIKELY (ip_header.total_length < IPV4_HEADER_LENGTH (ip_header)))
+    {
+      log_debug_maybe (("IP total length %u shorter than the header (" IPV4_FORMAT " -> " IPV4_FORMAT ").",
+                        (unsigned)ip_header.total_length,
+                        IPV4_FORMAT_ARGS (ip_header.source),
+                        IPV4_FORMAT_ARGS (ip_header.destination)));
+      DROP (IP);
+    }
+
+  /* Fragments (more fragments flag or offset) are held until the
+     datagram is complete. */
+  if (UNLIKELY (ip_header.fragmentation_offset & 0x3FFF))
+    {
+      buffer = fragment_ipv4 (buffer, &ip_header, &length);
+      if (buffer == 0)
+        DROP (FRAGMENT);
+      if (!ipv4_header_decode (buffer, length, &ip_header))
+        DROP (IP);
+    }
   length = ip_header.total_length;
 
-  /* Check if we actually have a UDP packet. */
+  /* Check if we actually have a UDP packet.  DNS messages over TCP are
+     extracted from the reassembled stream. */
   if (UNLIKELY (ip_header.protocol != 17))
     {
+      if (ip_header.protocol == 6)
+        {
+          segment.family = 4;
+          segment.ipv4 = ip_header;
+          return decode_tcp (buffer + IPV4_HEADER_LENGTH (ip_header),
+                             length - IPV4_HEADER_LENGTH (ip_header),
+                             (const unsigned char *)buffer + 12,
+                             (const unsigned char *)buffer + 16,
+                             header, header_length, payload_length, source);
+        }
       log_debug_maybe (("Unexpected IP protocol %u (" IPV4_FORMAT " -> " IPV4_FORMAT ").",
                   (unsigned)ip_header.protocol,
                   IPV4_FORMAT_ARGS (ip_header.source),
                   IPV4_FORMAT_ARGS (ip_header.destination)));
-      return 0;
+      DROP (PROTOCOL);
     }
 
   SKIP_BUFFER (buffer, length, IPV4_HEADER_LENGTH (ip_header));
   if (UNLIKELY (!udp_header_decode (buffer, length, &ip_header, &udp_header)))
-    return 0;
+    DROP (UDP);
   length = udp_header.total_length;
 
   SKIP_BUFFER (buffer, length, UDP_HEADER_LENGTH (udp_header));
-  if (UNLIKELY (!dns_header_decode (buffer, length, &dns_header)))
+  *header_length = offsetof (forward_t, payload);
+  return encode4 (&ip_header, buffer, length, header, payload_length, source);
+}
+
+const char *
+forward_decode_next (forward_t *header, size_t *header_length,
+                     size_t *payload_length, ipv4_t *source)
+{
+  const char *message;
+  size_t length;
+
+  if (LIKELY (segment.family == 0))
     return 0;
+  message = tcp_next (&length);
+  return segment_messages (message, length, header, header_length,
+                           payload_length, source);
+}
 
-  if (! DNS_ANSWER_P (dns_header))
+/* Completes the record in *FORWARD, whose header (HEADER_LENGTH
+   bytes) has been encoded by forward_decode, with PAYLOAD
+   (PAYLOAD_LENGTH bytes), and stores its length in *FORWARD_LENGTH.
+   Returns FORWARD, or a newly allocated copy for large records. */
+static forward_t *
+record_complete (forward_t *forward, size_t header_length,
+                 const char *payload, size_t payload_length,
+                 size_t *forward_length)
+{
+  *forward_length = header_length + payload_length;
+  if (UNLIKELY (FORWARD_RECORD_LARGE (*forward_length)))
     {
-      log_debug_maybe (("Dropping question packet (" IPV4_FORMAT " -> " IPV4_FORMAT ").",
-                        IPV4_FORMAT_ARGS (ip_header.source),
-                        IPV4_FORMAT_ARGS (ip_header.destination)));
-      return 0;
-    }
+      forward_t *large = forward_record_allocate (*forward_length);
 
-  if (UNLIKELY ((!forward_without_answers) && dns_header.ancount == 0
-                && !DNS_TRUNCATION_P (dns_header)))
-    {
-      log_debug_maybe (("Dropping packet without answers (" IPV4_FORMAT " -> " IPV4_FORMAT ").",
-                        IPV4_FORMAT_ARGS (ip_header.source),
-                        IPV4_FORMAT_ARGS (ip_header.destination)));
-      return 0;
+      memcpy (large, forward, header_length);
+      forward = large;
     }
+  memcpy ((char *)forward + header_length, payload, payload_length);
+  return forward;
+}
 
-  /* If in forward_authoritative_only mode, exit if the packet is not an
-     authoritative answer. */
-  authoritative = DNS_AUTHORITATIVE_P (dns_header);
-  if (forward_authoritative_only && !authoritative)
+forward_t *
+forward_decode_encode (const char* buffer, size_t length, forward_t *forward, size_t *forward_length, ipv4_t *source)
+{
+  size_t header_length, payload_length;
+  const char *payload = forward_decode (buffer, length, forward, &header_length,
+                                        &payload_length, source);
+
+  if (payload == 0)
+    return 0;
+  return record_complete (forward, header_length, payload, payload_length,
+                          forward_length);
+}
+
+enum route
+{
+  ROUTE_ALL,                    /* all records */
+  ROUTE_AUTHORITATIVE,          /* authoritative answers */
+  ROUTE_NON_AUTHORITATIVE       /* non-authoritative answers */
+};
+
+struct forward_target
+{
+  struct sockaddr_in address;
+  /* The IPv4 address and port of the target to which we forward
+     packets. */
+
+  char name[32];
+  /* The address and port, for log messages and the spool. */
+
+  enum route route;
+  /* Selects the records sent to this target by the route policy. */
+
+  spool_t *spool;
+  /* Records which could not be sent, or a null pointer. */
+
+  forward_channel_t *channels;
+  /* The channels which lead to this target, whose counters are summed
+     for the checkpoint line. */
+};
+
+static forward_target_t targets[FORWARD_MAX_TARGETS];
+static unsigned target_count = 0;
+
+static enum
+{
+  POLICY_REPLICATE,             /* every target receives every record */
+  POLICY_SHARD,                 /* one target, chosen by consistent hashing */
+  POLICY_ROUTE                  /* the first target whose route matches */
+} forward_policy = POLICY_REPLICATE;
+
+static int shard_by_qname = 0;
+/* If true, the shard policy hashes the query name, otherwise the
+   nameserver address. */
+
+#define SHARD_POINTS 64
+/* Number of points on the hash ring per target. */
+
+static struct shard_point
+{
+  uint32_t hash;
+  unsigned target;
+} shard_ring[FORWARD_MAX_TARGETS * SHARD_POINTS];
+/* The consistent hashing ring, sorted by hash value. */
+
+/* The FNV-1a hash, followed by the MurmurHash3 finalizer, so that
+   short keys are spread over the whole ring. */
+static uint32_t
+hash_bytes (const unsigned char *data, size_t length, int fold_case)
+{
+  uint32_t hash = 2166136261U;
+  size_t j;
+
+  for (j = 0; j < length; ++j)
     {
-      log_debug_maybe (("Dropping non-authoritative DNS packet (" IPV4_FORMAT " -> " IPV4_FORMAT ").",
-                        IPV4_FORMAT_ARGS (ip_header.source),
-                        IPV4_FORMAT_ARGS (ip_header.destination)));
-      return 0;
+      unsigned char c = data[j];
+
+      if (fold_case && c >= 'A' && c <= 'Z')
+        c += 'a' - 'A';
+      hash = (hash ^ c) * 16777619U;
     }
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bU;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35U;
+  hash ^= hash >> 16;
+  return hash;
+}
 
-  /* Add the DNSXFR01 protocol signature. */
-  STATIC_MEMCPY (forward->signature, FORWARD_SIGNATURE);
+static int
+compare_points (const void *left, const void *right)
+{
+  uint32_t a = ((const struct shard_point *)left)->hash;
+  uint32_t b = ((const struct shard_point *)right)->hash;
 
-  /* Copy the source IP address only if the AA flag is set, to protect
-     submitter privacy. */
-  if (authoritative)
-    forward->nameserver = htonl (ip_header.source);
-  else
-    forward->nameserver = htonl (0);
+  return a < b ? -1 : a > b;
+}
 
-  /* Guard the call to memcpy below. */
-  if (UNLIKELY (length > sizeof (forward->payload)))
+/* Rebuilds the hash ring after a target has been added.  The points
+   of a target only depend on its address, so adding a target moves
+   only the records which are assigned to it. */
+static void
+shard_ring_build (void)
+{
+  unsigned j, k;
+
+  for (j = 0; j < target_count; ++j)
+    for (k = 0; k < SHARD_POINTS; ++k)
+      {
+        char key[48];
+        int length = snprintf (key, sizeof (key), "%s#%u",
+                               targets[j].name, k);
+
+        shard_ring[j * SHARD_POINTS + k].hash
+          = hash_bytes ((const unsigned char *)key, length, 0);
+        shard_ring[j * SHARD_POINTS + k].target = j;
+      }
+  qsort (shard_ring, target_count * SHARD_POINTS, sizeof (*shard_ring),
+         compare_points);
+}
+
+/* Returns the target responsible for HASH. */
+static unsigned
+shard_lookup (uint32_t hash)
+{
+  unsigned low = 0;
+  unsigned high = target_count * SHARD_POINTS;
+
+  /* Find the first point at or after HASH, wrapping around. */
+  while (low < high)
     {
-      log_debug_maybe (("Dropping overlong packet (" IPV4_FORMAT " -> " IPV4_FORMAT
-                        ", %u bytes).",
-                        IPV4_FORMAT_ARGS (ip_header.source),
-                        IPV4_FORMAT_ARGS (ip_header.destination),
-                        length));
-      return 0;
+      unsigned middle = (low + high) / 2;
+
+      if (shard_ring[middle].hash < hash)
+        low = middle + 1;
+      else
+        high = middle;
     }
+  if (low == target_count * SHARD_POINTS)
+    low = 0;
+  return shard_ring[low].target;
+}
+
+/* Returns the DNS message in RECORD, which is a forward6_t record if
+   it carries the DNSXFR02 or DNSXFR04 signature. */
+static inline const char *
+record_payload (const forward_t *record)
+{
+  if (UNLIKELY (record->signature[7] == FORWARD6_SIGNATURE[7]
+                || record->signature[7] == FORWARD6_LARGE_SIGNATURE[7]))
+    return ((const forward6_t *)record)->payload;
+  return record->payload;
+}
 
-  /* Copy the payload. */
-  memcpy (&forward->payload, buffer, length);
-  *forward_length
-    = sizeof (forward->signature) + sizeof (forward->nameserver) + length;
+/* Hashes the query name of the DNS message PAYLOAD, which is LENGTH
+   bytes long. */
+static uint32_t
+hash_qname (const char *payload, size_t length)
+{
+  const unsigned char *start
+    = (const unsigned char *)payload + sizeof (dns_header_t);
+  const unsigned char *end
+    = (const unsigned char *)payload + length;
+  const unsigned char *p = start;
 
-  return 1;
+  /* Stop at the root label, a compression pointer, or the end of the
+     message. */
+  while (p < end && *p != 0 && *p < 64)
+    p += *p + 1;
+  if (p > end)
+    p = end;
+  return hash_bytes (start, p - start, 1);
 }
 
-static int dnslogger_fd = -1;
-/* File descriptor of the UDP socket leading to the dnslogger server. */
+/* Stores the indexes of the targets which receive the record for the
+   DNS message PAYLOAD (of LENGTH bytes, captured from SOURCE) in
+   INDEXES, and returns their number. */
+static unsigned
+forward_select (const char *payload, size_t length, ipv4_t source,
+                unsigned *indexes)
+{
+  unsigned j;
 
-struct sockaddr_in dnslogger_target;
-/* The IPv4 address and port of the target to which we forward packets. */
+  switch (forward_policy)
+    {
+    case POLICY_REPLICATE:
+      for (j = 0; j < target_count; ++j)
+        indexes[j] = j;
+      return target_count;
+
+    case POLICY_SHARD:
+      if (shard_by_qname)
+        indexes[0] = shard_lookup (hash_qname (payload, length));
+      else
+        indexes[0] = shard_lookup (hash_bytes ((const unsigned char *)&source,
+                                               sizeof (source), 0));
+      return 1;
+
+    case POLICY_ROUTE:
+      {
+        /* The AA bit of the DNS header (see DNS_AUTHORITATIVE_P). */
+        int authoritative = (payload[2] & 0x04) != 0;
+
+        for (j = 0; j < target_count; ++j)
+          if (targets[j].route == ROUTE_ALL
+              || (targets[j].route == ROUTE_AUTHORITATIVE) == authoritative)
+            {
+              indexes[0] = j;
+              return 1;
+            }
+        DROP (NO_TARGET);
+      }
+    }
+  return 0;
+}
 
 void
 forward_target (const char *hostname, uint16_t port)
 {
-  memset (&dnslogger_target, 0, sizeof (dnslogger_target));
-  dnslogger_target.sin_family = AF_INET;
-  dnslogger_target.sin_port = htons (port);
+  forward_target_t *target;
+
+  if (target_count == FORWARD_MAX_TARGETS)
+    log_fatal ("Too many forward targets (at most %u).", FORWARD_MAX_TARGETS);
+  target = targets + target_count;
+
+  memset (&target->address, 0, sizeof (target->address));
+  target->address.sin_family = AF_INET;
+  target->address.sin_port = htons (port);
 
   {
     unsigned a, b, c, d;
     if (sscanf (hostname, "%u.%u.%u.%u", &a, &b, &c, &d) == 4
         && a <= 255 && b <= 255 && c <= 255 && d <= 255)
-      dnslogger_target.sin_addr.s_addr = htonl ((a << 24) + (b << 16) + (c << 8) + d);
+      target->address.sin_addr.s_addr = htonl ((a << 24) + (b << 16) + (c << 8) + d);
     else
       {
         struct hostent *h = gethostbyname (hostname);
@@ -147,9 +834,138 @@ forward_target (const char *hostname, uint16_t port)
         if (h == 0 || h->h_addrtype != AF_INET || *h->h_addr_list == 0)
           log_fatal ("No IPv4 address for host name: %s.", hostname);
 
-        STATIC_MEMCPY (dnslogger_target.sin_addr, *h->h_addr_list);
+        STATIC_MEMCPY (target->address.sin_addr, *h->h_addr_list);
       }
   }
+
+  snprintf (target->name, sizeof (target->name), IPV4_FORMAT ":%hu",
+            IPV4_FORMAT_ARGS (ntohl (target->address.sin_addr.s_addr)),
+            port);
+  target->route = ROUTE_ALL;
+  ++target_count;
+  shard_ring_build ();
+}
+
+void
+forward_add_target (const char *spec)
+{
+  char *copy = strdup (spec);
+  char *options = strchr (copy, ',');
+  char *colon;
+  char *name, *value;
+  enum route route = ROUTE_ALL;
+
+  if (options)
+    *options++ = 0;
+  colon = strrchr (copy, ':');
+  if (colon == 0 || colon == copy)
+    log_fatal ("Forward target '%s' must be HOST:PORT.", copy);
+  *colon = 0;
+
+  while (option_next (&options, &name, &value))
+    if (strcmp (name, "route") == 0)
+      {
+        if (value && strcmp (value, "all") == 0)
+          route = ROUTE_ALL;
+        else if (value && strcmp (value, "aa") == 0)
+          route = ROUTE_AUTHORITATIVE;
+        else if (value && strcmp (value, "non-aa") == 0)
+          route = ROUTE_NON_AUTHORITATIVE;
+        else
+          log_fatal ("Route must be 'all', 'aa' or 'non-aa'.");
+      }
+    else
+      option_unknown ("-c", name);
+
+  {
+    unsigned long port = option_unsigned ("-c", colon + 1);
+
+    if (port == 0 || port > 65535)
+      log_fatal ("Invalid port number '%s'.", colon + 1);
+    forward_target (copy, port);
+  }
+  targets[target_count - 1].route = route;
+  free (copy);
+}
+
+void
+forward_set_policy (const char *spec)
+{
+  char *copy = strdup (spec);
+  char *options = strchr (copy, ',');
+  char *name, *value;
+
+  if (options)
+    *options++ = 0;
+
+  if (strcmp (copy, "replicate") == 0)
+    forward_policy = POLICY_REPLICATE;
+  else if (strcmp (copy, "shard") == 0)
+    forward_policy = POLICY_SHARD;
+  else if (strcmp (copy, "route") == 0)
+    forward_policy = POLICY_ROUTE;
+  else
+    log_fatal ("Unknown forwarding policy '%s'.", copy);
+
+  while (option_next (&options, &name, &value))
+    if (forward_policy == POLICY_SHARD && strcmp (name, "key") == 0)
+      {
+        if (value && strcmp (value, "nameserver") == 0)
+          shard_by_qname = 0;
+        else if (value && strcmp (value, "qname") == 0)
+          shard_by_qname = 1;
+        else
+          log_fatal ("Shard key must be 'nameserver' or 'qname'.");
+      }
+    else
+      option_unknown ("-p", name);
+  free (copy);
+}
+
+unsigned
+forward_target_count (void)
+{
+  return target_count;
+}
+
+/* Adds N to COUNTER of a channel.  Only the thread of the channel
+   writes its counters, so that the workers do not contend for a cache
+   line, but the checkpoint reporter reads them. */
+static inline void
+channel_count (unsigned long *counter, unsigned long n)
+{
+  __atomic_store_n (counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/* Adds the counters of each target (summed over its channels) to the
+   checkpoint line. */
+static void
+report_targets (checkpoint_t *checkpoint)
+{
+  static unsigned long last[FORWARD_MAX_TARGETS][3];
+  unsigned j;
+
+  for (j = 0; j < target_count; ++j)
+    {
+      unsigned long current[3] = {0, 0, 0};
+      const forward_channel_t *channel;
+
+      for (channel = targets[j].channels; channel;
+           channel = channel->next_channel)
+        {
+          current[0] += __atomic_load_n (&channel->records_sent,
+                                         __ATOMIC_RELAXED);
+          current[1] += __atomic_load_n (&channel->bytes_sent,
+                                         __ATOMIC_RELAXED);
+          current[2] += __atomic_load_n (&channel->records_failed,
+                                         __ATOMIC_RELAXED);
+        }
+      checkpoint_printf (checkpoint, ", target %s: %lu records/%lu bytes sent, "
+                         "%lu failed", targets[j].name,
+                         current[0] - last[j][0], current[1] - last[j][1],
+                         current[2] - last[j][2]);
+      memcpy (last[j], current, sizeof (current));
+    }
 }
 
 static struct sockaddr_in forward_source;
@@ -171,15 +987,87 @@ forward_set_source (const char *ip)
     log_fatal ("Invalid IPv4 address: %s", ip);
 }
 
+static void batch_init (forward_channel_t *channel);
+
+void
+forward_channel_init (forward_channel_t *channel, unsigned target)
+{
+  static int registered;
+
+  memset (channel, 0, sizeof (*channel));
+  channel->fd = -1;
+  channel->target = targets + target;
+  channel->datagram_limit = 65535 - 28;
+  batch_init (channel);
+  if (forward_compress_level > 0)
+    {
+      if (!forward_over_tcp)
+        log_fatal ("Compression requires TCP mode (-t).");
+      channel->compress = compress_new (forward_compress_level);
+    }
+
+  /* Channels are set up before capturing starts, from a single
+     thread. */
+  channel->next_channel = channel->target->channels;
+  channel->target->channels = channel;
+  if (spool_enabled () && channel->target->spool == 0)
+    channel->target->spool = spool_open (channel->target->name);
+  if (!registered)
+    {
+      checkpoint_register (report_targets);
+      if (forward_compress_level > 0)
+        compress_init ();
+      registered = 1;
+    }
+}
+
+/* Switches the connection of CHANNEL to a compressed stream if the
+   service BANNER announces support for it (see compress.h).  Returns
+   -1 if the connection failed. */
+static int
+negotiate_compression (forward_channel_t *channel, const char *banner)
+{
+  static const char request[] = "\0\010" COMPRESS_SIGNATURE;
+  size_t written = 0;
+  ssize_t result;
+
+  channel->compressed = 0;
+  if (strstr (banner, COMPRESS_BANNER_TOKEN) == 0)
+    {
+      syslog (LOG_NOTICE, "%s does not support compression",
+              channel->target->name);
+      return 0;
+    }
+
+  /* The length prefix and the signature. */
+  while (written < sizeof (request) - 1)
+    {
+      result = write (channel->fd, request + written,
+                      sizeof (request) - 1 - written);
+      if (result < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          syslog (LOG_ERR, "could not request compression from %s: %s",
+                  channel->target->name, strerror (errno));
+          return -1;
+        }
+      written += result;
+    }
+  compress_reset (channel->compress);
+  channel->compressed = 1;
+  return 0;
+}
+
 int
-forward_open (void)
+forward_open (forward_channel_t *channel)
 {
-  if (dnslogger_fd >= 0)
-    close (dnslogger_fd);
+  if (channel->fd >= 0)
+    close (channel->fd);
 
-  dnslogger_fd
+  channel->fd
     = socket (AF_INET, forward_over_tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
-  if (dnslogger_fd == -1)
+  if (channel->fd == -1)
     {
       syslog (LOG_ERR, "%s socket creation failed: %s.",
               forward_over_tcp ? "TCP" : "UDP", strerror(errno));
@@ -187,7 +1075,7 @@ forward_open (void)
     }
 
   if (forward_source_set)
-    if (bind (dnslogger_fd, (struct sockaddr *)&forward_source,
+    if (bind (channel->fd, (struct sockaddr *)&forward_source,
               sizeof (forward_source)) == -1)
       {
         syslog (LOG_ERR, "Could not bind to source address: %s.",
@@ -195,10 +1083,11 @@ forward_open (void)
         goto error_out;
       }
 
-  if (connect (dnslogger_fd, (struct sockaddr *)&dnslogger_target,
-               sizeof (dnslogger_target)) == -1)
+  if (connect (channel->fd, (struct sockaddr *)&channel->target->address,
+               sizeof (channel->target->address)) == -1)
     {
-      syslog (LOG_ERR, "Could not connect forwarding socket: %s.", strerror(errno));
+      syslog (LOG_ERR, "Could not connect forwarding socket to %s: %s.",
+              channel->target->name, strerror(errno));
       goto error_out;
     }
 
@@ -214,7 +1103,7 @@ forward_open (void)
 
       while (p != end)
         {
-          result = read (dnslogger_fd, p, end - p);
+          result = read (channel->fd, p, end - p);
           if (result < 0)
             {
               syslog (LOG_ERR, "Could not read remote banner: %s.",
@@ -247,10 +1136,10 @@ forward_open (void)
             if (*p < ' ' || *p > '~')
               *p = '.';
 
-          syslog (LOG_NOTICE, "connected to " IPV4_FORMAT ":%hu (TCP): %s",
-                  IPV4_FORMAT_ARGS (htonl (dnslogger_target.sin_addr.s_addr)),
-                  ntohs (dnslogger_target.sin_port),
-                  buf);
+          syslog (LOG_NOTICE, "connected to %s (TCP): %s",
+                  channel->target->name, buf);
+          if (channel->compress && negotiate_compression (channel, buf) < 0)
+            goto error_out;
           return 0;
         }
 
@@ -259,107 +1148,823 @@ forward_open (void)
     }
   else
     {
-      /* UDP mode needs no special setup. */
+      /* Records must fit into a single datagram on the path to the
+         target (without the IPv4 and UDP headers). */
+#ifdef IP_MTU
+      int mtu;
+      socklen_t mtu_length = sizeof (mtu);
 
-      syslog (LOG_NOTICE, "forwarding to " IPV4_FORMAT ":%hu (UDP)",
-              IPV4_FORMAT_ARGS (ntohl (dnslogger_target.sin_addr.s_addr)),
-              ntohs (dnslogger_target.sin_port));
+      if (getsockopt (channel->fd, IPPROTO_IP, IP_MTU, &mtu, &mtu_length) == 0
+          && mtu > 28)
+        channel->datagram_limit = mtu - 28;
+#endif
+
+      syslog (LOG_NOTICE, "forwarding to %s (UDP)", channel->target->name);
       return 0;
     }
 
  error_out:
-  close (dnslogger_fd);
-  dnslogger_fd = -1;
+  close (channel->fd);
+  channel->fd = -1;
   return -1;
 }
 
+/* Returns the value of the monotonic clock, in milliseconds. */
+static unsigned long
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/* Used instead of forceful_open if the spool is enabled: tries to
+   open CHANNEL, but at most once every five seconds.  Returns nonzero
+   if CHANNEL is open. */
+static int
+spool_reconnect (forward_channel_t *channel)
+{
+  unsigned long now = now_ms ();
+
+  if (now < channel->retry)
+    return 0;
+  if (forward_open (channel) == 0)
+    return 1;
+  channel->retry = now + 5000;
+  return 0;
+}
+
 static void
-forceful_open (void)
+forceful_open (forward_channel_t *channel)
 {
   /* Add a delay between opening connections, to avoid flooding the
      target hosts with packets. */
-  while (forward_open () < 0)
+  while (forward_open (channel) < 0)
     sleep (5);
 }
 
-/* Write LENGTH bytes at BUF to STREAM.
-   Returns 0 on success, -1 on failure. */
-static int
-forceful_write (int stream, const void *buf, size_t length)
+static unsigned forward_batch_size = 1;
+static unsigned forward_batch_latency = 10;
+static int forward_batch_size_set = 0;
+
+void
+forward_set_batching (const char *spec)
 {
-  const char *p = buf;
-  const char* end = p + length;
-  ssize_t result;
+  char *copy = strdup (spec);
+  char *options = strchr (copy, ',');
+  char *name, *value;
+
+  if (options)
+    *options++ = 0;
+
+  forward_batch_size = option_unsigned ("-B", copy);
+  if (forward_batch_size == 0 || forward_batch_size > 1024)
+    log_fatal ("The batch size must be between 1 and 1024.");
+  forward_batch_size_set = 1;
+
+  while (option_next (&options, &name, &value))
+    if (strcmp (name, "latency") == 0)
+      forward_batch_latency = option_unsigned (name, value);
+    else
+      option_unknown ("-B", name);
+  free (copy);
+}
+
+void
+forward_set_compression (const char *spec)
+{
+  char *copy = strdup (spec);
+  char *options = strchr (copy, ',');
+  char *name, *value;
+
+  if (options)
+    *options++ = 0;
+
+  if (!compress_available ())
+    log_fatal ("Compression is not supported by this build.");
+  forward_compress_level = option_unsigned ("-z", copy);
+  if (forward_compress_level == 0 || forward_compress_level > 9)
+    log_fatal ("The compression level must be between 1 and 9.");
+
+  while (option_next (&options, &name, &value))
+    if (strcmp (name, "flush") == 0)
+      forward_batch_latency = option_unsigned (name, value);
+    else
+      option_unknown ("-z", name);
+  free (copy);
+
+  /* A frame holds a batch, and single records compress poorly. */
+  if (!forward_batch_size_set)
+    forward_batch_size = 256;
+}
 
-  while (p != end)
+int
+forward_idle_timeout (void)
+{
+  /* The spool is replayed in small steps. */
+  if (spool_enabled ()
+      && (forward_batch_size == 1 || forward_batch_latency > 100))
+    return 100;
+  return forward_batch_size > 1 ? (int)forward_batch_latency : -1;
+}
+
+/* Sets up the batch buffers of CHANNEL.  Records are always
+   collected in the batch, even if the batch size is one.  In TCP
+   mode, the length prefix and the record are written with one system
+   call. */
+static void
+batch_init (forward_channel_t *channel)
+{
+  unsigned j;
+
+  channel->batch = calloc (forward_batch_size, sizeof (*channel->batch));
+  channel->large = calloc (forward_batch_size, sizeof (*channel->large));
+  if (channel->large == 0)
+    log_fatal ("Out of memory.");
+  if (forward_over_tcp)
     {
-      result = write (stream, p, end - p);
-      if (result < 0)
-        return -1;
-      p += result;
+      channel->prefix = calloc (forward_batch_size, sizeof (*channel->prefix));
+      channel->iov = calloc (2 * forward_batch_size, sizeof (*channel->iov));
+      if (channel->batch == 0 || channel->prefix == 0 || channel->iov == 0)
+        log_fatal ("Out of memory.");
+      return;
     }
 
-  return 0;
+  channel->iov = calloc (forward_batch_size, sizeof (*channel->iov));
+#ifdef HAVE_SENDMMSG
+  channel->messages = calloc (forward_batch_size, sizeof (*channel->messages));
+  if (channel->messages == 0)
+    log_fatal ("Out of memory.");
+#endif
+  if (channel->batch == 0 || channel->iov == 0)
+    log_fatal ("Out of memory.");
+
+  for (j = 0; j < forward_batch_size; ++j)
+    {
+      channel->iov[j].iov_base = channel->batch + j;
+#ifdef HAVE_SENDMMSG
+      channel->messages[j].msg_hdr.msg_iov = channel->iov + j;
+      channel->messages[j].msg_hdr.msg_iovlen = 1;
+#endif
+    }
 }
 
-int
-forward_process (const char *buffer, size_t length)
+/* Adds records FIRST to LAST - 1 of the batch in CHANNEL to the
+   counters of its target. */
+static void
+count_sent (forward_channel_t *channel, unsigned first, unsigned last)
 {
-  forward_t fwd;
-  size_t fwd_length = 0;
+  unsigned long bytes = 0;
+  unsigned j;
+
+  for (j = first; j < last; ++j)
+    bytes += forward_over_tcp
+      ? ntohs (channel->prefix[j]) : channel->iov[j].iov_len;
+  channel_count (&channel->records_sent, last - first);
+  channel_count (&channel->bytes_sent, bytes);
+}
+
+/* Returns record J in the batch of CHANNEL. */
+static inline forward_t *
+batch_record (forward_channel_t *channel, unsigned j)
+{
+  if (UNLIKELY (channel->large[j] != 0))
+    return channel->large[j];
+  return channel->batch + j;
+}
+
+/* Frees the large records among the first COUNT records in the batch
+   of CHANNEL, after they have been sent. */
+static void
+batch_release (forward_channel_t *channel, unsigned count)
+{
+  unsigned j;
+
+  for (j = 0; j < count; ++j)
+    if (UNLIKELY (channel->large[j] != 0))
+      {
+        free (channel->large[j]);
+        channel->large[j] = 0;
+      }
+}
+
+/* Points the two iovecs of record J in CHANNEL at its length prefix
+   and its body.  In TCP mode, writev adjusts the iovecs in place
+   after partial writes. */
+static void
+stream_reset_record (forward_channel_t *channel, unsigned j)
+{
+  channel->iov[2 * j].iov_base = channel->prefix + j;
+  channel->iov[2 * j].iov_len = sizeof (*channel->prefix);
+  channel->iov[2 * j + 1].iov_base = batch_record (channel, j);
+  channel->iov[2 * j + 1].iov_len = ntohs (channel->prefix[j]);
+}
 
-  if (LIKELY (forward_decode_encode (buffer, length, &fwd, &fwd_length)))
+/* Compresses the COUNT iovecs at IOV into a frame and writes it to
+   the connection of CHANNEL.  Returns zero if the frame could not be
+   written completely. */
+static int
+frame_write (forward_channel_t *channel, const struct iovec *iov,
+             unsigned count)
+{
+  size_t length, written = 0;
+  const char *frame = compress_frame (channel->compress, iov, count, &length);
+  ssize_t result;
+
+  while (written < length)
     {
-      if (UNLIKELY (dnslogger_fd < 0))
-        forceful_open ();
+      result = write (channel->fd, frame + written, length - written);
+      if (UNLIKELY (result < 0))
+        {
+          if (errno == EINTR)
+            continue;
+          return 0;
+        }
+      written += result;
+    }
+  return 1;
+}
 
-      /* Keep sending packets until successful. */
+/* Writes the first COUNT length-prefixed records in CHANNEL to the
+   TCP connection.  After a failure, the connection is reestablished
+   and the record which was being written is sent again from its
+   beginning, so that the collector never sees a partial record. */
+static void
+stream_flush (forward_channel_t *channel, unsigned count)
+{
+  struct iovec *iov = channel->iov;
+  unsigned total = 2 * count;
+  unsigned pos = 0;
 
-      for (;;)
+  for (;;)
+    {
+      if (UNLIKELY (channel->fd < 0))
         {
-          if (forward_over_tcp)
+          if (spool_enabled ())
             {
-              uint16_t len = htons (fwd_length);
-
-              if (UNLIKELY (forceful_write (dnslogger_fd, &len, 2) < 0))
+              if (!spool_reconnect (channel))
                 {
-                  syslog (LOG_ERR, "could not write record size: %s",
-                        strerror (errno));
-                goto retry;
-              }
+                  unsigned j;
 
-              if (UNLIKELY (forceful_write (dnslogger_fd, &fwd, fwd_length) < 0))
-              {
-                syslog (LOG_ERR, "could not write packet: %s",
-                        strerror (errno));
-                goto retry;
-              }
-
-              return 1;
+                  channel_count (&channel->records_failed, count);
+                  for (j = 0; j < count; ++j)
+                    spool_append (channel->target->spool,
+                                  batch_record (channel, j),
+                                  ntohs (channel->prefix[j]));
+                  return;
+                }
             }
           else
+            forceful_open (channel);
+        }
+
+      if (channel->compressed)
+        {
+          /* The records from POS on form a single frame.  After a
+             failure, the collector discards the incomplete frame, so
+             all of them are sent again. */
+          if (LIKELY (frame_write (channel, iov + pos, total - pos)))
             {
-              /* UDP mode. */
+              count_sent (channel, 0, count);
+              return;
+            }
+          syslog (LOG_ERR, "could not write packet to %s: %s",
+                  channel->target->name, strerror (errno));
+        }
+      else
+        {
+          while (pos < total)
+            {
+              unsigned chunk = total - pos;
+              ssize_t result;
 
-              if (UNLIKELY (send (dnslogger_fd, &fwd, fwd_length, 0) < 0))
+              if (chunk > IOV_MAX)
+                chunk = IOV_MAX;
+              result = writev (channel->fd, iov + pos, chunk);
+              if (UNLIKELY (result < 0))
                 {
-                  syslog (LOG_ERR, "could not write packet: %s",
-                          strerror (errno));
-                  goto retry;
+                  if (errno == EINTR)
+                    continue;
+                  break;
                 }
 
-              log_debug_maybe(("Forwarded %u bytes.", fwd_length));
-              return 1;
+              /* Skip the iovecs which have been written completely,
+                 and adjust a partially written one. */
+              while (result > 0)
+                if ((size_t)result >= iov[pos].iov_len)
+                  result -= iov[pos++].iov_len;
+                else
+                  {
+                    iov[pos].iov_base = (char *)iov[pos].iov_base + result;
+                    iov[pos].iov_len -= result;
+                    result = 0;
+                  }
+            }
+
+          if (LIKELY (pos == total))
+            {
+              count_sent (channel, 0, count);
+              return;
+            }
+
+          syslog (LOG_ERR, "could not write packet to %s: %s",
+                  channel->target->name, strerror (errno));
+
+          /* Rewind to the start of the incomplete record. */
+          pos &= ~1U;
+          stream_reset_record (channel, pos / 2);
+        }
+
+      if (spool_enabled ())
+        {
+          /* Spool the records which have not been written
+             completely, and reconnect later. */
+          unsigned j;
+
+          count_sent (channel, 0, pos / 2);
+          channel_count (&channel->records_failed, count - pos / 2);
+          for (j = pos / 2; j < count; ++j)
+            spool_append (channel->target->spool, batch_record (channel, j),
+                          ntohs (channel->prefix[j]));
+          close (channel->fd);
+          channel->fd = -1;
+          channel->retry = now_ms () + 5000;
+          return;
+        }
+
+      /* We need a delay before the open call so that we won't flood
+         the dnslogger host with packets when the open succeeds, but
+         the first write fails immediately. */
+      sleep (5);
+      forward_open (channel);
+    }
+}
+
+/* Sends the messages FIRST to COUNT - 1 of the batch in CHANNEL.
+   Returns the number of messages sent, or -1 if the first message
+   could not be sent. */
+static int
+batch_send (forward_channel_t *channel, unsigned first, unsigned count)
+{
+#ifdef HAVE_SENDMMSG
+  return sendmmsg (channel->fd, channel->messages + first, count - first, 0);
+#else
+  unsigned j;
+
+  for (j = first; j < count; ++j)
+    if (send (channel->fd, channel->iov[j].iov_base,
+              channel->iov[j].iov_len, 0) < 0)
+      return j == first ? -1 : (int)(j - first);
+  return count - first;
+#endif
+}
+
+/* Sends the first COUNT records in CHANNEL as UDP datagrams.  Records
+   which cannot be sent are dropped, or written to the spool. */
+static void
+datagram_flush (forward_channel_t *channel, unsigned count)
+{
+  unsigned sent = 0;
+  unsigned failed = 0;
+  int error = 0;
+
+  if (UNLIKELY (channel->fd < 0))
+    {
+      if (spool_enabled ())
+        {
+          if (!spool_reconnect (channel))
+            {
+              unsigned j;
+
+              channel_count (&channel->records_failed, count);
+              for (j = 0; j < count; ++j)
+                spool_append (channel->target->spool,
+                              batch_record (channel, j),
+                              channel->iov[j].iov_len);
+              return;
+            }
+        }
+      else
+        forceful_open (channel);
+    }
+
+  while (sent < count)
+    {
+      int result = batch_send (channel, sent, count);
+
+      if (LIKELY (result >= 0))
+        {
+          if (UNLIKELY (log_debug_enable))
+            {
+              unsigned j;
+
+              for (j = sent; j < sent + result; ++j)
+                log_debug ("Forwarded %u bytes.",
+                           (unsigned)channel->iov[j].iov_len);
             }
+          count_sent (channel, sent, sent + result);
+          sent += result;
+          continue;
+        }
+      if (errno == EINTR)
+        continue;
+
+      /* Drop (or spool) the message which could not be sent and
+         continue with the next one. */
+      error = errno;
+      if (spool_enabled ())
+        spool_append (channel->target->spool, batch_record (channel, sent),
+                      channel->iov[sent].iov_len);
+      ++failed;
+      ++sent;
+    }
+
+  if (UNLIKELY (failed))
+    {
+      channel_count (&channel->records_failed, failed);
+      syslog (LOG_ERR, "could not write %u of %u packets to %s: %s",
+              failed, count, channel->target->name, strerror (error));
+      /* If nothing could be sent, the socket might be broken.
+         Recreate it, without blocking the capture path. */
+      if (failed == count)
+        forward_open (channel);
+    }
+}
+
+void
+forward_flush (forward_channel_t *channel)
+{
+  unsigned count = channel->count;
+
+  if (count == 0)
+    return;
+  channel->count = 0;
+
+  if (forward_over_tcp)
+    stream_flush (channel, count);
+  else
+    datagram_flush (channel, count);
+  batch_release (channel, count);
+}
+
+static void batch_commit (forward_channel_t *channel, forward_t *large,
+                          size_t fwd_length);
+
+/* Moves records from the spool to the batch of CHANNEL, as far as
+   the replay rate permits. */
+static void
+spool_drain (forward_channel_t *channel)
+{
+  forward_t *large;
+  size_t fwd_length;
+
+  if (channel->fd < 0 && !spool_reconnect (channel))
+    return;
+  while (channel->fd >= 0
+         && spool_replay (channel->target->spool, channel->batch + channel->count,
+                          &large, &fwd_length))
+    batch_commit (channel, large, fwd_length);
+}
+
+void
+forward_flush_expired (forward_channel_t *channel)
+{
+  if (channel->count > 0 && now_ms () >= channel->deadline)
+    forward_flush (channel);
+  if (channel->target->spool && spool_pending (channel->target->spool))
+    spool_drain (channel);
+}
+
+/* Makes the record of FWD_LENGTH bytes in the next free batch slot
+   of CHANNEL part of the batch, and flushes the batch if it is full
+   or its oldest record has expired.  LARGE is null, or the buffer of
+   a record which is too large for the slot (and which is released
+   with the batch). */
+static void
+batch_commit (forward_channel_t *channel, forward_t *large, size_t fwd_length)
+{
+  unsigned long now = now_ms ();
+
+  if (UNLIKELY (large != 0))
+    {
+      if (!forward_over_tcp && fwd_length > channel->datagram_limit)
+        {
+          log_debug_maybe (("Dropping record of %u bytes, which does not fit into a datagram to %s.",
+                            (unsigned)fwd_length, channel->target->name));
+          channel_count (&channel->records_failed, 1);
+          free (large);
+          return;
+        }
+      channel->large[channel->count] = large;
+    }
+
+  if (forward_over_tcp)
+    {
+      channel->prefix[channel->count] = htons (fwd_length);
+      stream_reset_record (channel, channel->count);
+    }
+  else
+    {
+      channel->iov[channel->count].iov_base = batch_record (channel, channel->count);
+      channel->iov[channel->count].iov_len = fwd_length;
+    }
+  if (channel->count++ == 0)
+    channel->deadline = now + forward_batch_latency;
+  if (channel->count == forward_batch_size || now >= channel->deadline)
+    forward_flush (channel);
+}
+
+#define LARGE_OR_NULL(RECORD, LENGTH) \
+  (UNLIKELY (FORWARD_RECORD_LARGE (LENGTH)) ? (RECORD) : 0)
+/* The LARGE argument of batch_commit and queue_push for RECORD, which
+   is LENGTH bytes long. */
+
+static __thread forward_t scratch;
+/* Record headers (and records which are queued for several targets)
+   are encoded here, so that there is no record buffer on the
+   stack. */
+
+/* Returns the copy of RECORD (LENGTH bytes) for the Jth of COUNT
+   targets.  The last target receives RECORD itself, so that large
+   records are only copied if there is more than one target. */
+static inline forward_t *
+record_for_target (forward_t *record, size_t length, unsigned j,
+                   unsigned count)
+{
+  if (FORWARD_RECORD_LARGE (length) && j + 1 < count)
+    return record_duplicate (record, length);
+  return record;
+}
+
+/* Sends the record made of HEADER (HEADER_LENGTH bytes) and PAYLOAD
+   (PAYLOAD_LENGTH bytes) over CHANNEL with a single system call.  The
+   payload is not copied; it usually points into the capture buffer.
+   Returns zero if the record has not been sent, and the caller has to
+   add it to the batch instead, so that the usual error handling
+   (reconnecting and spooling) applies. */
+static int
+send_direct (forward_channel_t *channel, const forward_t *header,
+             size_t header_length, const char *payload,
+             size_t payload_length)
+{
+  size_t fwd_length = header_length + payload_length;
+  uint16_t prefix = htons (fwd_length);
+  struct iovec iov[3];
+  ssize_t result;
+
+  if (UNLIKELY (channel->fd < 0) || channel->compressed)
+    return 0;
+
+  iov[0].iov_base = &prefix;
+  iov[0].iov_len = sizeof (prefix);
+  iov[1].iov_base = (void *)header;
+  iov[1].iov_len = header_length;
+  iov[2].iov_base = (void *)payload;
+  iov[2].iov_len = payload_length;
+
+  if (forward_over_tcp)
+    {
+      struct iovec *first = iov;
+      unsigned count = 3;
+      size_t written = 0;
 
-        retry:
-          /* We need a delay before the open call so that we won't
-             flood the dnslogger host with packets when the open
-             succeeds, but the first write fails immediately. */
-          sleep (5);
-          forceful_open ();
+      while (count > 0)
+        {
+          result = writev (channel->fd, first, count);
+          if (UNLIKELY (result < 0))
+            {
+              if (errno == EINTR)
+                continue;
+              if (written > 0)
+                {
+                  /* The collector has received part of the record, so
+                     the connection cannot be used any more. */
+                  syslog (LOG_ERR, "could not write packet to %s: %s",
+                          channel->target->name, strerror (errno));
+                  close (channel->fd);
+                  channel->fd = -1;
+                }
+              return 0;
+            }
+          written += result;
+          while (result > 0)
+            if ((size_t)result >= first->iov_len)
+              {
+                result -= first->iov_len;
+                ++first;
+                --count;
+              }
+            else
+              {
+                first->iov_base = (char *)first->iov_base + result;
+                first->iov_len -= result;
+                result = 0;
+              }
         }
     }
   else
+    {
+      struct msghdr message;
+
+      if (UNLIKELY (fwd_length > channel->datagram_limit))
+        return 0;
+      memset (&message, 0, sizeof (message));
+      message.msg_iov = iov + 1;
+      message.msg_iovlen = 2;
+      do
+        result = sendmsg (channel->fd, &message, 0);
+      while (UNLIKELY (result < 0) && errno == EINTR);
+      if (UNLIKELY (result < 0))
+        return 0;
+      log_debug_maybe (("Forwarded %u bytes.", (unsigned)fwd_length));
+    }
+
+  channel_count (&channel->records_sent, 1);
+  channel_count (&channel->bytes_sent, fwd_length);
+  return 1;
+}
+
+/* Forwards the record made of HEADER (HEADER_LENGTH bytes) and
+   PAYLOAD (PAYLOAD_LENGTH bytes) over CHANNEL.  Without batching,
+   the record is sent right away by send_direct.  Otherwise, it is
+   copied to the batch, because the capture buffer is reused once the
+   packet has been processed. */
+static void
+submit (forward_channel_t *channel, const forward_t *header,
+        size_t header_length, const char *payload, size_t payload_length)
+{
+  size_t fwd_length = header_length + payload_length;
+  forward_t *record;
+
+  if (forward_batch_size == 1
+      && LIKELY (send_direct (channel, header, header_length,
+                              payload, payload_length)))
+    return;
+
+  record = channel->batch + channel->count;
+  if (UNLIKELY (FORWARD_RECORD_LARGE (fwd_length)))
+    record = forward_record_allocate (fwd_length);
+  memcpy (record, header, header_length);
+  memcpy ((char *)record + header_length, payload, payload_length);
+  batch_commit (channel, LARGE_OR_NULL (record, fwd_length), fwd_length);
+}
+
+int
+forward_process (forward_channel_t *channels, const char *buffer, size_t length)
+{
+  unsigned indexes[FORWARD_MAX_TARGETS];
+  unsigned count, j;
+  const char *payload;
+  size_t header_length, payload_length;
+  ipv4_t source;
+  int forwarded = 0;
+
+  /* Only the header is encoded; the payload stays in the capture
+     buffer until it is sent or copied to a batch.  A TCP segment can
+     complete more than one message. */
+  for (payload = forward_decode (buffer, length, &scratch, &header_length,
+                                 &payload_length, &source);
+       payload != 0;
+       payload = forward_decode_next (&scratch, &header_length,
+                                      &payload_length, &source))
+    {
+      if (LIKELY (target_count == 1))
+        {
+          submit (channels, &scratch, header_length, payload, payload_length);
+          ++forwarded;
+          continue;
+        }
+
+      count = forward_select (payload, payload_length, source, indexes);
+      for (j = 0; j < count; ++j)
+        submit (channels + indexes[j], &scratch, header_length, payload,
+                payload_length);
+      forwarded += count > 0;
+    }
+  return forwarded;
+}
+
+/* Copies RECORD, which is FWD_LENGTH bytes long, to QUEUE.  A large
+   record is handed over to QUEUE instead.  Returns zero if it has
+   been dropped because QUEUE is full. */
+static int
+enqueue_record (queue_t *queue, forward_t *record, size_t fwd_length)
+{
+  forward_t *slot = queue_slot (queue);
+
+  if (LIKELY (slot != 0))
+    {
+      if (!FORWARD_RECORD_LARGE (fwd_length))
+        memcpy (slot, record, fwd_length);
+      queue_push (queue, LARGE_OR_NULL (record, fwd_length), fwd_length);
+      return 1;
+    }
+  return queue_push_full (queue, record, fwd_length);
+}
+
+/* Copies RECORD (FWD_LENGTH bytes, captured from SOURCE) to the
+   queues of the selected targets.  Returns zero if it has been
+   dropped. */
+static int
+enqueue_selected (queue_t **queues, forward_t *record, size_t fwd_length,
+                  ipv4_t source)
+{
+  unsigned indexes[FORWARD_MAX_TARGETS];
+  unsigned count, j;
+  const char *payload;
+  int queued = 0;
+
+  if (target_count == 1)
+    return enqueue_record (queues[0], record, fwd_length);
+
+  payload = record_payload (record);
+  count = forward_select (payload,
+                          fwd_length - (payload - (const char *)record),
+                          source, indexes);
+  for (j = 0; j < count; ++j)
+    queued |= enqueue_record (queues[indexes[j]],
+                              record_for_target (record, fwd_length, j, count),
+                              fwd_length);
+  if (count == 0 && FORWARD_RECORD_LARGE (fwd_length))
+    free (record);
+  return queued;
+}
+
+/* Queues the further messages of a TCP segment (see
+   forward_decode_next).  Returns the number of queued messages. */
+static int
+enqueue_next (queue_t **queues)
+{
+  forward_t *record;
+  const char *payload;
+  size_t header_length, payload_length, fwd_length;
+  ipv4_t source;
+  int queued = 0;
+
+  while ((payload = forward_decode_next (&scratch, &header_length,
+                                         &payload_length, &source)) != 0)
+    {
+      record = record_complete (&scratch, header_length, payload,
+                                payload_length, &fwd_length);
+      queued += enqueue_selected (queues, record, fwd_length, source);
+    }
+  return queued;
+}
+
+int
+forward_enqueue (queue_t **queues, const char *buffer, size_t length)
+{
+  forward_t *record;
+  size_t fwd_length = 0;
+  ipv4_t source;
+  int queued;
+
+  /* With a single target, encode the record directly into the queue
+     if there is room.  If the queue is full, the packet is still
+     decoded, so that only packets which would have been forwarded
+     count as dropped. */
+  if (LIKELY (target_count == 1))
+    {
+      forward_t *slot = queue_slot (queues[0]);
+
+      if (LIKELY (slot != 0))
+        {
+          record = forward_decode_encode (buffer, length, slot,
+                                          &fwd_length, &source);
+          if (LIKELY (record != 0))
+            {
+              queue_push (queues[0], LARGE_OR_NULL (record, fwd_length),
+                          fwd_length);
+              return 1 + enqueue_next (queues);
+            }
+          return 0;
+        }
+    }
+
+  /* Records in queues outlive the capture buffer, so the payload is
+     copied. */
+  record = forward_decode_encode (buffer, length, &scratch, &fwd_length,
+                                  &source);
+  if (record == 0)
     return 0;
+  queued = enqueue_selected (queues, record, fwd_length, source);
+  return queued + enqueue_next (queues);
+}
+
+unsigned
+forward_drain (forward_channel_t *channel, queue_t *queue, unsigned limit)
+{
+  unsigned moved = 0;
+  forward_t *large;
+  size_t fwd_length;
+
+  while (moved < limit
+         && queue_pop (queue, channel->batch + channel->count, &large,
+                       &fwd_length))
+    {
+      batch_commit (channel, large, fwd_length);
+      ++moved;
+    }
+  return moved;
 }
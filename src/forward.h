@@ -20,34 +20,261 @@
 #define FORWARD_H
 
 #include "config.h"
+#include "compress.h"
 #include "ipv4.h"
 
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 typedef struct
 {
   char signature[8];
   ipv4_t nameserver;            /* in network byte order */
   char payload[512];
+  char reserved[12];            /* room for forward6_t */
 } forward_t;
 /* The on-the-wire header.  When forwarding over TCP, a 16-bit
-   big-endian length field is added. */
+   big-endian length field is added.  Records are never longer than
+   the payload, so RESERVED is not sent; it makes forward_t large
+   enough to hold a forward6_t record. */
+
+typedef struct
+{
+  char signature[8];
+  unsigned char nameserver[16];
+  char payload[512];
+} forward6_t;
+/* The on-the-wire header for DNS responses captured over IPv6. */
 
 #define FORWARD_SIGNATURE "DNSXFR01"
+#define FORWARD6_SIGNATURE "DNSXFR02"
+
+#define FORWARD_LARGE_SIGNATURE "DNSXFR03"
+#define FORWARD6_LARGE_SIGNATURE "DNSXFR04"
+/* Records whose payload is longer than 512 bytes (see
+   forward_max_payload).  Apart from the signature and the length of
+   the payload, they are identical to DNSXFR01 and DNSXFR02 records. */
+
+#define FORWARD_MAX_RECORD 65535
+/* Upper limit for the length of a record, imposed by the 16-bit
+   length prefix in TCP mode. */
+
+#define FORWARD_MAX_PAYLOAD (FORWARD_MAX_RECORD - offsetof (forward6_t, payload))
+/* Upper limit for forward_max_payload. */
+
+#define FORWARD_RECORD_LARGE(LENGTH) ((LENGTH) > sizeof (forward_t))
+/* True if a record of LENGTH bytes does not fit into forward_t.  Such
+   records are stored in a separately allocated buffer, which is passed
+   along with the record (and released with free) by batches, queues
+   and the spool. */
+
+extern size_t forward_max_payload;
+/* The longest DNS payload which is forwarded.  The default is 512;
+   longer payloads are dropped as overlong. */
+
+void forward_set_max_payload (const char *spec);
+/* Sets forward_max_payload.  SPEC is the number of bytes (between 512
+   and FORWARD_MAX_PAYLOAD).  Terminates the program on error. */
+
+forward_t *forward_record_allocate (size_t length);
+/* Allocates a buffer for a record of LENGTH bytes, which is too large
+   for forward_t.  Terminates the program if there is not enough
+   memory. */
+
+#define FORWARD_MAX_TARGETS 16
+/* Upper limit for the number of forward targets. */
+
+typedef struct forward_target forward_target_t;
+/* A dnslogger server to which records are forwarded. */
 
 void forward_target (const char *hostname, uint16_t port);
-/* Sets the forward target to PORT at HOSTNAME.  Terminates on error
+/* Adds a forward target, PORT at HOSTNAME.  Terminates on error
    (e.g. if HOSTNAME cannot be parsed). */
 
+void forward_add_target (const char *spec);
+/* Adds a forward target.  SPEC is "HOST:PORT", optionally followed
+   by ",route=RULE", where RULE is "all" (the default), "aa"
+   (authoritative answers) or "non-aa".  Terminates on error. */
+
+void forward_set_policy (const char *spec);
+/* Selects how records are distributed among the targets.  SPEC is
+   "replicate" (every target receives every record; the default),
+   "shard" (optionally followed by ",key=nameserver" or ",key=qname"),
+   or "route" (the first target whose route matches).  Terminates the
+   program on error. */
+
+unsigned forward_target_count (void);
+/* Returns the number of forward targets. */
+
+void forward_set_compression (const char *spec);
+/* Enables compression in TCP mode.  SPEC is the zlib compression
+   level (between 1 and 9), optionally followed by ",flush=MS" (the
+   maximum delay of a frame, like the latency of forward_set_batching).
+   Unless the batch size is set explicitly, batches of up to 256
+   records are compressed into one frame.  Terminates the program on
+   error. */
+
 void forward_set_source (const char *ip);
 /* Sets the source IP address for forwarding packets. */
 
-int forward_open (void);
-/* Create the socket used for forwarding.  Returns 0 on sucess, -1 on
-   failure. */
+typedef struct forward_channel
+{
+  forward_target_t *target;
+  int fd;
+  /* File descriptor of the socket leading to the dnslogger server,
+     or -1. */
+
+  forward_t *batch;
+  forward_t **large;
+  uint16_t *prefix;
+  struct iovec *iov;
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr *messages;
+#endif
+  unsigned long retry;
+  /* If the spool is enabled, the time (in milliseconds) of the next
+     connection attempt. */
 
-int forward_process (const char *buffer, size_t length);
-/* Forwards a single DNS packet.  If the packet does not look like a
-   valid one, it is dropped.  Returns nonzero if the packet has actually
-   been forwarded, zero if it has been discarded. */
+  size_t datagram_limit;
+  /* In UDP mode, the longest record which fits into a datagram on the
+     path to the target.  Longer records are dropped. */
+
+  compress_t *compress;
+  int compressed;
+  /* If compression is enabled, the compressor of the channel, and
+     whether the collector has accepted compression on the current
+     connection. */
+
+  unsigned count;
+  unsigned long deadline;
+  /* Records waiting to be sent, and the time (in milliseconds) at
+     which they must be sent.  Records longer than forward_t are
+     stored in the buffer at the same index in LARGE (a null pointer
+     for other records).  In UDP mode, there is one iovec per record.
+     In TCP mode, each record has two iovecs, for the big-endian length
+     in PREFIX and for the record itself. */
+
+  unsigned long records_sent, bytes_sent, records_failed;
+  struct forward_channel *next_channel;
+  /* The counters of the records handled by this channel, and the next
+     channel which leads to the same target. */
+} forward_channel_t;
+/* A connection to a dnslogger server.  A channel is used by a single
+   thread only (the sender thread of the target, or a capture worker
+   if the queue is disabled), so that no locking is needed. */
+
+void forward_channel_init (forward_channel_t *channel, unsigned target);
+/* Initializes CHANNEL, leading to the forward target with index
+   TARGET.  The socket is not opened yet. */
+
+int forward_open (forward_channel_t *channel);
+/* Create the socket used for forwarding on CHANNEL.  Returns 0 on
+   sucess, -1 on failure. */
+
+const char *forward_decode (const char *buffer, size_t length,
+                            forward_t *header, size_t *header_length,
+                            size_t *payload_length, ipv4_t *source);
+/* Decodes the IPv4 or IPv6 packet at BUFFER (LENGTH bytes) and, if it
+   should be forwarded, encodes the record header (the signature and
+   the nameserver address) at the start of *HEADER, stores its length
+   in *HEADER_LENGTH and the IP source address in *SOURCE (for
+   sharding; IPv6 addresses are folded to 32 bits).  Returns a pointer
+   to the DNS payload, which is part of BUFFER (or of the reassembly
+   buffer, for fragments, or the stream buffer, for TCP), and stores
+   its length in *PAYLOAD_LENGTH.  Returns a null pointer if the packet
+   should not be forwarded.  A TCP segment can complete several DNS
+   messages; the others are returned by forward_decode_next. */
+
+const char *forward_decode_next (forward_t *header, size_t *header_length,
+                                 size_t *payload_length, ipv4_t *source);
+/* Returns the next DNS message of the TCP segment passed to
+   forward_decode, like forward_decode, or a null pointer if there are
+   no more messages.  The previous payload becomes invalid.  Must be
+   called until it returns a null pointer before the next packet is
+   decoded. */
+
+forward_t *forward_decode_encode (const char *buffer, size_t length, forward_t *forward, size_t *forward_length, ipv4_t *source);
+/* Like forward_decode, but copies the payload as well, so that *FORWARD
+   contains the complete record (a forward6_t record for IPv6), and
+   stores the record length in *FORWARD_LENGTH.  Returns FORWARD, or a
+   newly allocated buffer if the record is too large for FORWARD (see
+   FORWARD_RECORD_LARGE), or a null pointer if the packet should not
+   be forwarded. */
+
+int forward_process (forward_channel_t *channels, const char *buffer, size_t length);
+/* Forwards a single DNS packet over CHANNELS, an array with one
+   channel per target.  If the packet does not look like a valid one,
+   it is dropped.  Returns the number of DNS messages which have been
+   forwarded (a TCP segment can complete several), or zero if the
+   packet has been discarded.  Without batching, the
+   record is sent straight from BUFFER; BUFFER only has to remain
+   valid until the function returns. */
+
+struct queue;
+
+int forward_enqueue (struct queue **queues, const char *buffer, size_t length);
+/* Like forward_process, but copies the record to QUEUES (one queue
+   per target) instead of sending it.  Returns the number of DNS
+   messages which have been queued, or zero if the packet has been
+   discarded, either because it is not forwarded, or because the
+   queues are full. */
+
+unsigned forward_drain (forward_channel_t *channel, struct queue *queue,
+                        unsigned limit);
+/* Moves up to LIMIT records from QUEUE to the batch of CHANNEL,
+   flushing it as needed.  Returns the number of records moved. */
+
+void forward_set_batching (const char *spec);
+/* Enables batching.  SPEC is the maximum number of records per batch
+   (sent with sendmmsg in UDP mode, and writev in TCP mode),
+   optionally followed by ",latency=MS", the maximum time a record is
+   held back (default 10 milliseconds).  Terminates the program on
+   error. */
+
+void forward_flush (forward_channel_t *channel);
+/* Sends all pending records in CHANNEL.  Records which cannot be sent
+   are dropped, or written to the spool if it is enabled. */
+
+void forward_flush_expired (forward_channel_t *channel);
+/* Like forward_flush, but only if the oldest pending record has
+   reached the maximum latency.  Also replays spooled records.
+   Capture methods call this periodically while waiting for
+   packets. */
+
+int forward_idle_timeout (void);
+/* Returns the interval (in milliseconds) at which
+   forward_flush_expired has to be called, or -1 if no periodic calls
+   are needed. */
+
+enum
+  {
+    FORWARD_DROP_IP,            /* invalid or truncated IP header */
+    FORWARD_DROP_TUNNEL,        /* invalid tunnel header, see tunnel.h */
+    FORWARD_DROP_FRAGMENT,      /* fragment held for reassembly, or rejected */
+    FORWARD_DROP_STREAM,        /* TCP segment without a complete message */
+    FORWARD_DROP_PROTOCOL,      /* neither UDP nor TCP */
+    FORWARD_DROP_UDP,           /* invalid UDP header */
+    FORWARD_DROP_DNS,           /* invalid DNS header */
+    FORWARD_DROP_QUESTION,      /* not a DNS response */
+    FORWARD_DROP_NO_ANSWERS,    /* empty answer, see forward_without_answers */
+    FORWARD_DROP_NON_AUTHORITATIVE, /* see forward_authoritative_only */
+    FORWARD_DROP_OVERLONG,      /* payload exceeds forward_max_payload */
+    FORWARD_DROP_ZONE,          /* query name not in the zone lists, see zone.h */
+    FORWARD_DROP_RATE_LIMITED,  /* source over its rate, see ratelimit.h */
+    FORWARD_DROP_DUPLICATE,     /* repeated response, see dedup.h */
+    FORWARD_DROP_NO_TARGET,     /* no target selected by the policy */
+    FORWARD_DROP_REASONS
+  };
+/* Reasons why forward_process and forward_enqueue discard packets. */
+
+extern __thread unsigned forward_drops[FORWARD_DROP_REASONS];
+/* Number of packets discarded by the calling thread, per reason.
+   The counters are thread-local, so that they do not add contention
+   between capture workers. */
+
+const char *forward_drop_reason (unsigned reason);
+/* Returns a short description of REASON, for reports. */
 
 extern int forward_authoritative_only;
 /* If true, only forward authoritative answers.  (The default is
@@ -56,6 +283,14 @@ extern int forward_authoritative_only;
 extern int forward_without_answers;
 /* If true, forward packets without answers (the default). */
 
+const char *forward_filter (const char *filter);
+/* Returns the filter expression FILTER, restricted to the UDP packets
+   which pass the checks on the DNS header (the QR flag, and the AA
+   flag and the answer count if forward_authoritative_only or
+   !forward_without_answers), so that the capture filter discards
+   them before they are copied to user space.  The result is valid
+   until the next call. */
+
 extern int forward_over_tcp;
 /* If true, use TCP to forward data instead of UDP. */
 
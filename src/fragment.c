@@ -0,0 +1,483 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "fragment.h"
+#include "ansidecl.h"
+#include "checkpoint.h"
+#include "log.h"
+#include "option.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define WHEEL_SLOTS 64
+/* Number of slots in the timer wheel (one per second).  The timeout
+   must be smaller. */
+
+#define NONE UINT32_MAX
+/* End of a list of datagrams. */
+
+typedef struct
+{
+  uint32_t hash_next;           /* hash chain, or the free list */
+  uint32_t wheel_next;
+  uint32_t wheel_prev;          /* list of datagrams expiring in the same slot */
+  uint32_t expires;             /* in seconds */
+  uint32_t hash;
+  uint32_t source_hash;
+  uint32_t id;
+  uint8_t family;               /* 4 or 6 */
+  uint8_t protocol;             /* part of the key for IPv4 only */
+  uint8_t next;                 /* IPv6 next header of the first fragment */
+  uint16_t total;               /* length of the data, zero until known */
+  uint16_t received;            /* number of data bytes received */
+  unsigned char source[16];
+  unsigned char destination[16]; /* IPv4 addresses use the first four bytes */
+  uint64_t blocks[FRAGMENT_MAX_DATA / 8 / 64];
+  /* One bit per 8-byte block of data which has been received. */
+
+  char packet[40 + FRAGMENT_MAX_DATA];
+  /* The data starts at offset 40, so that the reassembled IP header
+     can be written in front of it. */
+} datagram_t;
+/* A datagram which is being reassembled. */
+
+#define DATA(D) ((D)->packet + 40)
+/* The data of datagram D. */
+
+typedef struct
+{
+  datagram_t *datagrams;
+  uint32_t *buckets;
+  uint16_t *sources;            /* datagrams in progress per source hash */
+  uint32_t mask;                /* of BUCKETS and SOURCES */
+  uint32_t free;
+  uint32_t wheel[WHEEL_SLOTS];
+  uint32_t time;                /* the time up to which the wheel has expired */
+} table_t;
+/* The reassembly state of a thread.  All memory is allocated on the
+   first fragment.  */
+
+static size_t fragment_memory = 4 << 20;
+static unsigned fragment_per_source = 16;
+static unsigned fragment_timeout = 30;
+/* Settings from the command line. */
+
+static __thread table_t *table;
+
+enum
+  {
+    STAT_REASSEMBLED,
+    STAT_TIMEOUTS,
+    STAT_EVICTIONS,
+    STAT_REJECTED,
+    STATS
+  };
+
+static checkpoint_counters_t counters;
+static __thread checkpoint_thread_t *local_counters;
+/* The counters of the calling thread, in COUNTERS. */
+
+void
+fragment_configure (const char *spec)
+{
+  char *copy = strdup (spec);
+  char *options = strchr (copy, ',');
+  char *name, *value;
+
+  if (options)
+    *options++ = 0;
+
+  fragment_memory = option_size ("-F", copy);
+  while (option_next (&options, &name, &value))
+    if (strcmp (name, "per-source") == 0)
+      fragment_per_source = option_unsigned (name, value);
+    else if (strcmp (name, "timeout") == 0)
+      fragment_timeout = option_unsigned (name, value);
+    else
+      option_unknown ("-F", name);
+  free (copy);
+
+  if (fragment_memory != 0 && fragment_memory < sizeof (datagram_t))
+    log_fatal ("Reassembly needs at least %u bytes of memory.",
+               (unsigned)sizeof (datagram_t));
+  if (fragment_per_source == 0 || fragment_per_source > 65535)
+    log_fatal ("The per-source limit must be between 1 and 65535.");
+  if (fragment_timeout == 0 || fragment_timeout >= WHEEL_SLOTS)
+    log_fatal ("The reassembly timeout must be between 1 and %u seconds.",
+               WHEEL_SLOTS - 1);
+}
+
+static void
+report (checkpoint_t *checkpoint)
+{
+  unsigned long deltas[STATS];
+
+  checkpoint_deltas (&counters, deltas, STATS);
+  checkpoint_printf (checkpoint, ", %lu datagrams reassembled, "
+                     "%lu fragment timeouts/%lu evictions/%lu rejected",
+                     deltas[STAT_REASSEMBLED], deltas[STAT_TIMEOUTS],
+                     deltas[STAT_EVICTIONS], deltas[STAT_REJECTED]);
+}
+
+void
+fragment_init (void)
+{
+  if (fragment_memory > 0)
+    checkpoint_register (report);
+}
+
+void
+fragment_statistics (unsigned long *reassembled, unsigned long *timeouts,
+                     unsigned long *evictions, unsigned long *rejected)
+{
+  *reassembled = checkpoint_counter (&counters, STAT_REASSEMBLED);
+  *timeouts = checkpoint_counter (&counters, STAT_TIMEOUTS);
+  *evictions = checkpoint_counter (&counters, STAT_EVICTIONS);
+  *rejected = checkpoint_counter (&counters, STAT_REJECTED);
+}
+
+/* Allocates the table of the calling thread.  Returns a null pointer
+   if reassembly is disabled. */
+static table_t *
+table_create (void)
+{
+  table_t *t;
+  uint32_t entries = fragment_memory / sizeof (datagram_t);
+  uint32_t size = 1;
+  uint32_t j;
+
+  if (entries == 0)
+    return 0;
+  while (size < entries)
+    size *= 2;
+
+  t = calloc (1, sizeof (*t));
+  if (t == 0
+      || (t->datagrams = calloc (entries, sizeof (*t->datagrams))) == 0
+      || (t->buckets = malloc (size * sizeof (*t->buckets))) == 0
+      || (t->sources = calloc (size, sizeof (*t->sources))) == 0)
+    log_fatal ("Out of memory.");
+  t->mask = size - 1;
+  for (j = 0; j < size; ++j)
+    t->buckets[j] = NONE;
+  for (j = 0; j < WHEEL_SLOTS; ++j)
+    t->wheel[j] = NONE;
+  for (j = 0; j < entries; ++j)
+    t->datagrams[j].hash_next = j + 1 < entries ? j + 1 : NONE;
+  t->free = 0;
+  t->time = checkpoint_seconds ();
+  return t;
+}
+
+/* Hashes LENGTH bytes at DATA, starting with HASH. */
+static inline uint32_t
+hash_bytes (uint32_t hash, const unsigned char *data, unsigned length)
+{
+  unsigned j;
+
+  for (j = 0; j < length; ++j)
+    hash = (hash ^ data[j]) * 16777619U;
+  return hash;
+}
+
+/* Removes datagram INDEX from the hash table and the timer wheel, and
+   puts it on the free list.  Its data is left intact. */
+static void
+release (table_t *t, uint32_t index)
+{
+  datagram_t *d = t->datagrams + index;
+  uint32_t *link = t->buckets + (d->hash & t->mask);
+
+  while (*link != index)
+    link = &t->datagrams[*link].hash_next;
+  *link = d->hash_next;
+
+  if (d->wheel_prev == NONE)
+    t->wheel[d->expires % WHEEL_SLOTS] = d->wheel_next;
+  else
+    t->datagrams[d->wheel_prev].wheel_next = d->wheel_next;
+  if (d->wheel_next != NONE)
+    t->datagrams[d->wheel_next].wheel_prev = d->wheel_prev;
+
+  --t->sources[d->source_hash & t->mask];
+  d->hash_next = t->free;
+  t->free = index;
+}
+
+/* Releases all datagrams in wheel slot SLOT, counting them as
+   timeouts. */
+static void
+expire_slot (table_t *t, unsigned slot)
+{
+  while (t->wheel[slot] != NONE)
+    {
+      release (t, t->wheel[slot]);
+      CHECKPOINT_COUNT (&counters, local_counters, STAT_TIMEOUTS);
+    }
+}
+
+/* Expires the datagrams whose timeout has passed at time NOW.  All
+   datagrams in a slot expire at the same time because the timeout is
+   shorter than the wheel. */
+static void
+advance (table_t *t, uint32_t now)
+{
+  unsigned j;
+
+  if (now - t->time >= WHEEL_SLOTS)
+    {
+      for (j = 0; j < WHEEL_SLOTS; ++j)
+        expire_slot (t, j);
+      t->time = now;
+      return;
+    }
+  while (t->time != now)
+    {
+      ++t->time;
+      expire_slot (t, t->time % WHEEL_SLOTS);
+    }
+}
+
+/* Returns a free datagram, evicting the one closest to expiry if
+   necessary. */
+static uint32_t
+allocate (table_t *t)
+{
+  uint32_t index;
+  unsigned j;
+
+  if (t->free == NONE)
+    for (j = 1; j <= WHEEL_SLOTS; ++j)
+      {
+        index = t->wheel[(t->time + j) % WHEEL_SLOTS];
+        if (index != NONE)
+          {
+            release (t, index);
+            CHECKPOINT_COUNT (&counters, local_counters, STAT_EVICTIONS);
+            break;
+          }
+      }
+  index = t->free;
+  t->free = t->datagrams[index].hash_next;
+  return index;
+}
+
+/* Rejects a fragment for REASON, and releases the datagram INDEX (if
+   not NONE). */
+static void *
+reject (table_t *t, uint32_t index, const char *reason)
+{
+  log_debug_maybe (("Discarding fragment (%s).", reason));
+  if (index != NONE)
+    release (t, index);
+  CHECKPOINT_COUNT (&counters, local_counters, STAT_REJECTED);
+  return 0;
+}
+
+/* Adds a fragment to the table of the calling thread.  KEY is a
+   datagram with the key fields (family, protocol, id and addresses)
+   and NEXT set.  The fragment carries LENGTH bytes of DATA, at byte offset
+   OFFSET.  MORE is the "more fragments" flag.  Returns the datagram if
+   it is complete, or a null pointer. */
+static datagram_t *
+add (const datagram_t *key, unsigned offset, unsigned length, int more,
+     const char *data)
+{
+  table_t *t = table;
+  uint32_t hash, source_hash, index;
+  unsigned block, last_block;
+  datagram_t *d;
+
+  if (UNLIKELY (t == 0))
+    {
+      if (fragment_memory == 0)
+        return reject (0, NONE, "reassembly disabled");
+      t = table = table_create ();
+    }
+  advance (t, checkpoint_seconds ());
+
+  source_hash = hash_bytes (2166136261U, key->source, sizeof (key->source));
+  hash = hash_bytes (source_hash, key->destination, sizeof (key->destination));
+  hash = hash_bytes (hash, (const unsigned char *)&key->id, sizeof (key->id));
+  hash = hash_bytes (hash, &key->protocol, 1);
+
+  for (index = t->buckets[hash & t->mask]; index != NONE;
+       index = t->datagrams[index].hash_next)
+    {
+      d = t->datagrams + index;
+      if (d->hash == hash && d->id == key->id && d->family == key->family
+          && d->protocol == key->protocol
+          && memcmp (d->source, key->source, sizeof (d->source)) == 0
+          && memcmp (d->destination, key->destination,
+                     sizeof (d->destination)) == 0)
+        break;
+    }
+
+  if (UNLIKELY (offset + length > FRAGMENT_MAX_DATA))
+    return reject (t, index, "too large");
+  if (UNLIKELY (more && (length == 0 || length % 8 != 0)))
+    return reject (t, index, "invalid length");
+
+  if (index == NONE)
+    {
+      if (UNLIKELY (t->sources[source_hash & t->mask] >= fragment_per_source))
+        return reject (t, NONE, "per-source limit");
+      index = allocate (t);
+      d = t->datagrams + index;
+      d->hash = hash;
+      d->source_hash = source_hash;
+      d->id = key->id;
+      d->family = key->family;
+      d->protocol = key->protocol;
+      memcpy (d->source, key->source, sizeof (d->source));
+      memcpy (d->destination, key->destination, sizeof (d->destination));
+      d->total = 0;
+      d->received = 0;
+      memset (d->blocks, 0, sizeof (d->blocks));
+
+      d->hash_next = t->buckets[hash & t->mask];
+      t->buckets[hash & t->mask] = index;
+      d->expires = t->time + fragment_timeout;
+      d->wheel_prev = NONE;
+      d->wheel_next = t->wheel[d->expires % WHEEL_SLOTS];
+      if (d->wheel_next != NONE)
+        t->datagrams[d->wheel_next].wheel_prev = index;
+      t->wheel[d->expires % WHEEL_SLOTS] = index;
+      ++t->sources[source_hash & t->mask];
+    }
+  d = t->datagrams + index;
+
+  /* The last fragment determines the length of the datagram. */
+  if (!more)
+    {
+      if (UNLIKELY ((d->total != 0 && d->total != offset + length)
+                    || offset + length < d->received))
+        return reject (t, index, "inconsistent length");
+      d->total = offset + length;
+    }
+  else if (UNLIKELY (d->total != 0 && offset + length > d->total))
+    return reject (t, index, "inconsistent length");
+
+  /* Overlapping fragments are discarded, together with the whole
+     datagram (as in RFC 5722). */
+  last_block = (offset + length + 7) / 8;
+  for (block = offset / 8; block < last_block; ++block)
+    {
+      if (UNLIKELY (d->blocks[block / 64] & (1ULL << (block % 64))))
+        return reject (t, index, "overlap");
+      d->blocks[block / 64] |= 1ULL << (block % 64);
+    }
+  memcpy (DATA (d) + offset, data, length);
+  d->received += length;
+  if (offset == 0)
+    d->next = key->next;
+
+  if (d->total == 0 || d->received != d->total)
+    return 0;
+
+  /* The datagram is complete.  It is released, but its data stays
+     valid until the next fragment is added. */
+  release (t, index);
+  CHECKPOINT_COUNT (&counters, local_counters, STAT_REASSEMBLED);
+  return d;
+}
+
+const char *
+fragment_ipv4 (const char *packet, const ipv4_header_t *header, size_t *length)
+{
+  datagram_t key;
+  datagram_t *d;
+  unsigned char *p;
+  unsigned header_length = IPV4_HEADER_LENGTH (*header);
+  uint32_t sum = 0;
+  unsigned j;
+
+  if (UNLIKELY (header_length < 20 || header->total_length < header_length))
+    return reject (table, NONE, "invalid header");
+
+  key.family = 4;
+  key.protocol = header->protocol;
+  key.next = 0;
+  key.id = header->id;
+  memset (key.source, 0, sizeof (key.source));
+  memset (key.destination, 0, sizeof (key.destination));
+  memcpy (key.source, packet + 12, 4);
+  memcpy (key.destination, packet + 16, 4);
+
+  d = add (&key, (header->fragmentation_offset & 0x1FFF) * 8,
+           header->total_length - header_length,
+           (header->fragmentation_offset & 0x2000) != 0,
+           packet + header_length);
+  if (d == 0)
+    return 0;
+
+  /* Build a header without options. */
+  p = (unsigned char *)DATA (d) - 20;
+  memcpy (p, packet, 20);
+  p[0] = 0x45;
+  p[2] = (20 + d->total) >> 8;
+  p[3] = (20 + d->total) & 0xFF;
+  p[6] = p[7] = 0;
+  p[10] = p[11] = 0;
+  memcpy (p + 12, d->source, 4);
+  memcpy (p + 16, d->destination, 4);
+  for (j = 0; j < 20; j += 2)
+    sum += (p[j] << 8) | p[j + 1];
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  p[10] = (~sum >> 8) & 0xFF;
+  p[11] = ~sum & 0xFF;
+
+  *length = 20 + d->total;
+  return (const char *)p;
+}
+
+const char *
+fragment_ipv6 (const char *packet, const ipv6_header_t *header, size_t *length)
+{
+  datagram_t key;
+  datagram_t *d;
+  unsigned char *p;
+  unsigned offset = header->fragment & 0xFFF8;
+
+  /* The next header value of the first fragment applies to the
+     reassembled packet (RFC 8200), so it is not part of the key. */
+  key.family = 6;
+  key.protocol = 0;
+  key.next = header->protocol;
+  key.id = header->fragment_id;
+  memcpy (key.source, header->source, sizeof (key.source));
+  memcpy (key.destination, header->destination, sizeof (key.destination));
+
+  d = add (&key, offset, IPV6_TOTAL_LENGTH (*header) - header->header_length,
+           header->fragment & 1, packet + header->header_length);
+
+  if (d == 0)
+    return 0;
+
+  p = (unsigned char *)DATA (d) - 40;
+  memcpy (p, packet, 8);
+  p[4] = d->total >> 8;
+  p[5] = d->total & 0xFF;
+  p[6] = d->next;
+  memcpy (p + 8, d->source, 16);
+  memcpy (p + 24, d->destination, 16);
+  *length = 40 + d->total;
+  return (const char *)p;
+}
@@ -0,0 +1,58 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef FRAGMENT_H
+#define FRAGMENT_H
+
+#include "config.h"
+#include "ipv4.h"
+#include "ipv6.h"
+
+#define FRAGMENT_MAX_DATA 4096
+/* Maximum size of a reassembled datagram, without the IP header.
+   (This covers the usual EDNS buffer sizes.) */
+
+void fragment_configure (const char *spec);
+/* Configures reassembly.  SPEC is the memory limit per capture
+   worker (zero disables reassembly), optionally followed by
+   ",per-source=N" (the maximum number of datagrams in progress per
+   source address) and ",timeout=SECS".  Terminates the program on
+   error. */
+
+void fragment_init (void);
+/* Registers the checkpoint reporter.  Must be called before the
+   capture workers are started. */
+
+const char *fragment_ipv4 (const char *packet, const ipv4_header_t *header, size_t *length);
+/* Adds the IPv4 fragment at PACKET to the reassembly table of the
+   calling thread.  HEADER is the decoded header of PACKET.  If the
+   fragment completes a datagram, returns the reassembled IPv4 packet
+   (with a header without options) and stores its length in *LENGTH.
+   The packet remains valid until the next call from the same thread.
+   Otherwise, returns a null pointer. */
+
+const char *fragment_ipv6 (const char *packet, const ipv6_header_t *header, size_t *length);
+/* Like fragment_ipv4, for IPv6 fragments.  The reassembled packet has
+   no extension headers in front of the fragmented part. */
+
+void fragment_statistics (unsigned long *reassembled, unsigned long *timeouts,
+                          unsigned long *evictions, unsigned long *rejected);
+/* Returns the counters since the start of the program (across all
+   threads).  For testing. */
+
+#endif /* FRAGMENT_H */
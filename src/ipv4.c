@@ -87,7 +87,7 @@ ipv4_pseudo_header_checksum (const ipv4_header_t * header, uint16_t length)
 }
 
 uint16_t
-ipv4_checksum (const char *buffer, size_t length, uint32_t start)
+ipv4_checksum_reference (const char *buffer, size_t length, uint32_t start)
 {
   /* We have to read the buffer as a sequence of unsigned bytes. */
   const unsigned char *p = (unsigned char *)buffer;
@@ -127,6 +127,226 @@ ipv4_checksum (const char *buffer, size_t length, uint32_t start)
   return ~((sum & 0xFFFF) + (sum >> 16));
 }
 
+/* The optimized implementations compute the sum of the big-endian
+   16-bit words in the buffer (a trailing odd byte is padded with
+   zero) exactly, in 64 bits.  The result is folded in the same way
+   as in ipv4_checksum_reference, so that the results are
+   bit-identical.  The sum is 256 times the sum of the bytes at even
+   offsets, plus the sum of the bytes at odd offsets. */
+
+typedef uint64_t (*checksum_sum_t) (const unsigned char *p, size_t length);
+
+/* Adds up the four 16-bit lanes of X. */
+static inline uint64_t
+fold_lanes (uint64_t x)
+{
+  x = (x & 0x0000FFFF0000FFFFULL) + ((x >> 16) & 0x0000FFFF0000FFFFULL);
+  return (x & 0xFFFFFFFFULL) + (x >> 32);
+}
+
+/* Portable version, which processes 64-bit words.  The bytes at even
+   and odd offsets are accumulated in separate 16-bit lanes, which
+   cannot overflow within 256 words. */
+static uint64_t
+sum_words64 (const unsigned char *p, size_t length)
+{
+  const uint64_t mask = 0x00FF00FF00FF00FFULL;
+  uint64_t even = 0;
+  uint64_t odd = 0;
+
+  while (length >= 8)
+    {
+      size_t words = length / 8;
+      uint64_t e = 0;
+      uint64_t o = 0;
+
+      if (words > 256)
+        words = 256;
+      length -= words * 8;
+      for (; words > 0; --words, p += 8)
+        {
+          uint64_t w;
+
+          memcpy (&w, p, sizeof (w));
+          e += w & mask;
+          o += (w >> 8) & mask;
+        }
+#if defined (__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      even += fold_lanes (o);
+      odd += fold_lanes (e);
+#else
+      even += fold_lanes (e);
+      odd += fold_lanes (o);
+#endif
+    }
+
+  /* The remaining bytes.  P is still at an even offset. */
+  for (; length >= 2; length -= 2, p += 2)
+    {
+      even += p[0];
+      odd += p[1];
+    }
+  if (length)
+    even += p[0];
+
+  return (even << 8) + odd;
+}
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+#define CHECKSUM_X86 1
+#include <immintrin.h>
+
+/* PSADBW against zero adds up eight bytes into a 64-bit lane.
+   Applied to all bytes, and to the bytes at even offsets only, this
+   gives both sums without any risk of overflow. */
+
+__attribute__ ((target ("sse2")))
+static uint64_t
+sum_words_sse2 (const unsigned char *p, size_t length)
+{
+  const __m128i even_mask = _mm_set1_epi16 (0x00FF);
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i all = zero;
+  __m128i even = zero;
+  uint64_t lanes[2];
+  uint64_t all_sum, even_sum;
+
+  for (; length >= 16; length -= 16, p += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *)p);
+
+      all = _mm_add_epi64 (all, _mm_sad_epu8 (v, zero));
+      even = _mm_add_epi64 (even,
+                            _mm_sad_epu8 (_mm_and_si128 (v, even_mask), zero));
+    }
+
+  _mm_storeu_si128 ((__m128i *)lanes, all);
+  all_sum = lanes[0] + lanes[1];
+  _mm_storeu_si128 ((__m128i *)lanes, even);
+  even_sum = lanes[0] + lanes[1];
+
+  /* 256 * even + odd, with odd = all - even. */
+  return 255 * even_sum + all_sum + sum_words64 (p, length);
+}
+
+__attribute__ ((target ("avx2")))
+static uint64_t
+sum_words_avx2 (const unsigned char *p, size_t length)
+{
+  const __m256i even_mask = _mm256_set1_epi16 (0x00FF);
+  const __m256i zero = _mm256_setzero_si256 ();
+  __m256i all = zero;
+  __m256i even = zero;
+  uint64_t lanes[4];
+  uint64_t all_sum, even_sum;
+
+  for (; length >= 32; length -= 32, p += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *)p);
+
+      all = _mm256_add_epi64 (all, _mm256_sad_epu8 (v, zero));
+      even = _mm256_add_epi64
+        (even, _mm256_sad_epu8 (_mm256_and_si256 (v, even_mask), zero));
+    }
+
+  _mm256_storeu_si256 ((__m256i *)lanes, all);
+  all_sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  _mm256_storeu_si256 ((__m256i *)lanes, even);
+  even_sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+  /* Avoid the AVX-SSE transition penalty in the (non-VEX) caller.
+     GCC does not always insert this on its own. */
+  _mm256_zeroupper ();
+
+  return 255 * even_sum + all_sum + sum_words64 (p, length);
+}
+
+static int
+cpu_has_sse2 (void)
+{
+  return __builtin_cpu_supports ("sse2");
+}
+
+static int
+cpu_has_avx2 (void)
+{
+  return __builtin_cpu_supports ("avx2");
+}
+#endif
+
+static const struct
+{
+  const char *name;
+  checksum_sum_t sum;
+  int (*supported) (void);
+} checksum_variants[] =
+  {
+    { "word64", sum_words64, 0 },
+#ifdef CHECKSUM_X86
+    { "sse2", sum_words_sse2, cpu_has_sse2 },
+    { "avx2", sum_words_avx2, cpu_has_avx2 },
+#endif
+  };
+/* In order of preference: the last supported variant is used. */
+
+#define CHECKSUM_VARIANTS (sizeof (checksum_variants) / sizeof (checksum_variants[0]))
+
+static uint64_t sum_words_select (const unsigned char *p, size_t length);
+
+static checksum_sum_t sum_words = sum_words_select;
+/* The selected implementation.  Initially, it points to a function
+   which performs the selection on the first call. */
+
+static uint64_t
+sum_words_select (const unsigned char *p, size_t length)
+{
+  checksum_sum_t selected = sum_words64;
+  unsigned j;
+
+  for (j = 0; j < CHECKSUM_VARIANTS; ++j)
+    if (checksum_variants[j].supported == 0
+        || checksum_variants[j].supported ())
+      selected = checksum_variants[j].sum;
+  __atomic_store_n (&sum_words, selected, __ATOMIC_RELAXED);
+  return selected (p, length);
+}
+
+/* Folds TOTAL exactly like ipv4_checksum_reference. */
+static inline uint16_t
+checksum_finish (uint64_t total, uint32_t start)
+{
+  uint32_t sum = (uint32_t)total + start;
+
+  return ~((sum & 0xFFFF) + (sum >> 16));
+}
+
+uint16_t
+ipv4_checksum (const char *buffer, size_t length, uint32_t start)
+{
+  checksum_sum_t sum = __atomic_load_n (&sum_words, __ATOMIC_RELAXED);
+
+  return checksum_finish (sum ((const unsigned char *)buffer, length), start);
+}
+
+const char *
+ipv4_checksum_variant (unsigned variant, int *supported)
+{
+  if (variant >= CHECKSUM_VARIANTS)
+    return 0;
+  *supported = checksum_variants[variant].supported == 0
+    || checksum_variants[variant].supported ();
+  return checksum_variants[variant].name;
+}
+
+uint16_t
+ipv4_checksum_with (unsigned variant, const char *buffer, size_t length,
+                    uint32_t start)
+{
+  return checksum_finish
+    (checksum_variants[variant].sum ((const unsigned char *)buffer, length),
+     start);
+}
+
 int
 udp_header_decode (const char *packet, size_t length, const ipv4_header_t *ip_header, udp_header_t *header)
 {
@@ -173,3 +393,49 @@ udp_header_decode (const char *packet, size_t length, const ipv4_header_t *ip_he
 
   return 1;
 }
+
+int
+tcp_header_decode (const char *packet, size_t length, const ipv4_header_t *ip_header, tcp_header_t *header)
+{
+  /* Check minimum header length. */
+  if (UNLIKELY (length < sizeof (*header)))
+    {
+      log_debug_maybe (("Truncated TCP header (" IPV4_FORMAT " -> " IPV4_FORMAT ").",
+                        IPV4_FORMAT_ARGS (ip_header->source),
+                        IPV4_FORMAT_ARGS (ip_header->destination)));
+      return 0;
+    }
+
+  /* Copy the header to the aligned struct. */
+  STATIC_MEMCPY(*header, packet);
+  header->source_port = ntohs (header->source_port);
+  header->destination_port = ntohs (header->destination_port);
+  header->sequence = ntohl (header->sequence);
+  header->acknowledgment = ntohl (header->acknowledgment);
+  header->window = ntohs (header->window);
+  header->checksum = ntohs (header->checksum);
+  header->urgent = ntohs (header->urgent);
+
+  if (UNLIKELY (TCP_HEADER_LENGTH (*header) < sizeof (*header)
+                || TCP_HEADER_LENGTH (*header) > length))
+    {
+      log_debug_maybe (("Invalid TCP header length (" IPV4_FORMAT " -> " IPV4_FORMAT
+                        ", header length %u, available %u).",
+                        IPV4_FORMAT_ARGS (ip_header->source),
+                        IPV4_FORMAT_ARGS (ip_header->destination),
+                        TCP_HEADER_LENGTH (*header), (unsigned)length));
+      return 0;
+    }
+
+  /* The checksum is mandatory in TCP. */
+  if (UNLIKELY (ipv4_checksum (packet, length, ipv4_pseudo_header_checksum (ip_header, length)) != 0))
+    {
+      log_debug_maybe (("TCP checksum mismatch (" IPV4_FORMAT " -> " IPV4_FORMAT
+                        ", TCP length %u).",
+                        IPV4_FORMAT_ARGS (ip_header->source),
+                        IPV4_FORMAT_ARGS (ip_header->destination), (unsigned)length));
+      return 0;
+    }
+
+  return 1;
+}
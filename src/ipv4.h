@@ -54,7 +54,22 @@ uint32_t ipv4_pseudo_header_checksum (const ipv4_header_t *header, uint16_t leng
 uint16_t ipv4_checksum (const char *buffer, size_t length, uint32_t start);
 /* Calculates the IPv4 checksum of BUFFER.  You can pass a pseudo
    header checksum in START (use zero if there is no pseudo
-   header). */
+   header).  Uses the fastest implementation supported by the CPU
+   (selected on the first call). */
+
+uint16_t ipv4_checksum_reference (const char *buffer, size_t length, uint32_t start);
+/* The original, byte-oriented implementation of ipv4_checksum.  All
+   other implementations must return identical results. */
+
+const char *ipv4_checksum_variant (unsigned variant, int *supported);
+/* Returns the name of the checksum implementation with index VARIANT
+   (starting at zero), or a null pointer if VARIANT is out of range.
+   *SUPPORTED is set to zero if the CPU cannot run it.  For
+   testing. */
+
+uint16_t ipv4_checksum_with (unsigned variant, const char *buffer, size_t length, uint32_t start);
+/* Like ipv4_checksum, but uses the implementation with index
+   VARIANT, which must be supported.  For testing. */
 
 int ipv4_header_decode (const char *packet, size_t length, ipv4_header_t *header);
 /* Decodes an IPv4 header and stores the result in HEADER.  Returns
@@ -84,4 +99,33 @@ int udp_header_decode (const char *packet, size_t length, const ipv4_header_t *i
    Returns zero on error.  IP_HEADER is used to construct the
    pseudo-header.  */
 
+typedef struct {
+  uint16_t source_port;
+  uint16_t destination_port;
+  uint32_t sequence;
+  uint32_t acknowledgment;
+  uint8_t offset;               /* data offset, in the upper four bits */
+  uint8_t flags;
+  uint16_t window;
+  uint16_t checksum;
+  uint16_t urgent;
+} tcp_header_t;
+/* A TCP header (without options).  All fields are in host byte
+   order. */
+
+#define TCP_HEADER_LENGTH(TCP) (((TCP).offset >> 4) * 4)
+/* Returns the length of the TCP header, including options. */
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_ACK 0x10
+/* Bits in the flags field of a TCP header. */
+
+int tcp_header_decode (const char *packet, size_t length, const ipv4_header_t *ip_header, tcp_header_t *header);
+/* Decodes the TCP header at PACKET (a segment of LENGTH bytes) and
+   stores the result in HEADER.  Returns zero on error, including a
+   checksum mismatch.  IP_HEADER is used to construct the
+   pseudo-header. */
+
 #endif /* IPV4_H */
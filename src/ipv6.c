@@ -0,0 +1,231 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "ipv6.h"
+#include "ansidecl.h"
+#include "log.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+
+const char *
+ipv6_format (const unsigned char *address, char *buffer)
+{
+  if (inet_ntop (AF_INET6, address, buffer, IPV6_FORMAT_LENGTH) == 0)
+    strcpy (buffer, "?");
+  return buffer;
+}
+
+int
+ipv6_header_decode (const char *packet, size_t length, ipv6_header_t *header)
+{
+  const unsigned char *p = (const unsigned char *)packet;
+  char source[IPV6_FORMAT_LENGTH], destination[IPV6_FORMAT_LENGTH];
+  unsigned next, offset;
+
+  if (UNLIKELY (length < IPV6_FIXED_HEADER_LENGTH))
+    {
+      log_debug_maybe (("Short IPv6 packet of length %u.", (unsigned)length));
+      return 0;
+    }
+  if (UNLIKELY ((p[0] & 0xf0) != 0x60))
+    {
+      log_debug_maybe (("Non-IPv6 packet, first byte is 0x%02x.", p[0]));
+      return 0;
+    }
+
+  header->payload_length = (p[4] << 8) | p[5];
+  header->hop_limit = p[7];
+  header->fragment = 0;
+  memcpy (header->source, p + 8, 16);
+  memcpy (header->destination, p + 24, 16);
+
+  /* Jumbograms (with a payload length of zero) are not supported. */
+  if (UNLIKELY (header->payload_length == 0
+                || IPV6_TOTAL_LENGTH (*header) > length))
+    {
+      log_debug_maybe (("Truncated IPv6 packet, indicated length is %u, available is %u.",
+                        IPV6_TOTAL_LENGTH (*header), (unsigned)length));
+      return 0;
+    }
+  length = IPV6_TOTAL_LENGTH (*header);
+
+  /* Walk the extension header chain.  Each header is at least eight
+     bytes long, so the loop terminates. */
+  next = p[6];
+  offset = IPV6_FIXED_HEADER_LENGTH;
+  for (;;)
+    switch (next)
+      {
+      case 0:                   /* hop-by-hop options */
+      case 43:                  /* routing */
+      case 60:                  /* destination options */
+        if (UNLIKELY (offset + 8 > length))
+          goto truncated;
+        next = p[offset];
+        offset += (p[offset + 1] + 1) * 8;
+        break;
+
+      case 51:                  /* authentication header */
+        if (UNLIKELY (offset + 8 > length))
+          goto truncated;
+        next = p[offset];
+        offset += (p[offset + 1] + 2) * 4;
+        break;
+
+      case 44:                  /* fragment */
+        if (UNLIKELY (offset + 8 > length))
+          goto truncated;
+        /* Atomic fragments (offset zero, no more fragments) contain
+           a complete upper-layer packet. */
+        header->fragment = ((p[offset + 2] << 8) | p[offset + 3]) & 0xFFF9;
+        if (UNLIKELY (header->fragment != 0))
+          {
+            header->fragment_id = ((uint32_t)p[offset + 4] << 24)
+              | (p[offset + 5] << 16) | (p[offset + 6] << 8) | p[offset + 7];
+            header->protocol = p[offset];
+            header->header_length = offset + 8;
+            return 1;
+          }
+        next = p[offset];
+        offset += 8;
+        break;
+
+      default:
+        if (UNLIKELY (offset > length))
+          goto truncated;
+        header->protocol = next;
+        header->header_length = offset;
+        return 1;
+      }
+
+ truncated:
+  log_debug_maybe (("Truncated IPv6 extension header (%s -> %s).",
+                    ipv6_format (header->source, source),
+                    ipv6_format (header->destination, destination)));
+  return 0;
+}
+
+uint32_t
+ipv6_pseudo_header_checksum (const ipv6_header_t *header, uint32_t length)
+{
+  uint32_t sum = header->protocol + (length >> 16) + (length & 0xFFFF);
+  unsigned j;
+
+  for (j = 0; j < 16; j += 2)
+    sum += ((header->source[j] << 8) | header->source[j + 1])
+      + ((header->destination[j] << 8) | header->destination[j + 1]);
+  return sum;
+}
+
+int
+ipv6_udp_header_decode (const char *packet, size_t length, const ipv6_header_t *ip_header, udp_header_t *header)
+{
+  char source[IPV6_FORMAT_LENGTH], destination[IPV6_FORMAT_LENGTH];
+
+  /* Check minimum header length. */
+  if (UNLIKELY (length < sizeof (*header)))
+    {
+      log_debug_maybe (("Truncated UDP header (%s -> %s).",
+                        ipv6_format (ip_header->source, source),
+                        ipv6_format (ip_header->destination, destination)));
+      return 0;
+    }
+
+  /* Copy the header to the aligned struct. */
+  STATIC_MEMCPY(*header, packet);
+  header->source_port = ntohs (header->source_port);
+  header->destination_port = ntohs (header->destination_port);
+  header->checksum = ntohs (header->checksum);
+  header->total_length = ntohs (header->total_length);
+
+  /* Check embedded length. */
+  if (UNLIKELY (header->total_length > length
+                || header->total_length < sizeof (*header)))
+    {
+      log_debug_maybe (("Truncated UDP packet (%s -> %s, UDP length %u, available %u).",
+                        ipv6_format (ip_header->source, source),
+                        ipv6_format (ip_header->destination, destination),
+                        header->total_length, (unsigned)length));
+      return 0;
+    }
+
+  /* Unlike in IPv4, the checksum is mandatory. */
+  if (UNLIKELY (header->checksum == 0
+                || ipv4_checksum (packet, header->total_length,
+                                  ipv6_pseudo_header_checksum
+                                  (ip_header, header->total_length)) != 0))
+    {
+      log_debug_maybe (("UDP checksum mismatch (%s -> %s, UDP length %u).",
+                        ipv6_format (ip_header->source, source),
+                        ipv6_format (ip_header->destination, destination),
+                        header->total_length));
+      return 0;
+    }
+
+  return 1;
+}
+
+int
+ipv6_tcp_header_decode (const char *packet, size_t length, const ipv6_header_t *ip_header, tcp_header_t *header)
+{
+  char source[IPV6_FORMAT_LENGTH], destination[IPV6_FORMAT_LENGTH];
+
+  /* Check minimum header length. */
+  if (UNLIKELY (length < sizeof (*header)))
+    {
+      log_debug_maybe (("Truncated TCP header (%s -> %s).",
+                        ipv6_format (ip_header->source, source),
+                        ipv6_format (ip_header->destination, destination)));
+      return 0;
+    }
+
+  /* Copy the header to the aligned struct. */
+  STATIC_MEMCPY(*header, packet);
+  header->source_port = ntohs (header->source_port);
+  header->destination_port = ntohs (header->destination_port);
+  header->sequence = ntohl (header->sequence);
+  header->acknowledgment = ntohl (header->acknowledgment);
+  header->window = ntohs (header->window);
+  header->checksum = ntohs (header->checksum);
+  header->urgent = ntohs (header->urgent);
+
+  if (UNLIKELY (TCP_HEADER_LENGTH (*header) < sizeof (*header)
+                || TCP_HEADER_LENGTH (*header) > length))
+    {
+      log_debug_maybe (("Invalid TCP header length (%s -> %s, header length %u, available %u).",
+                        ipv6_format (ip_header->source, source),
+                        ipv6_format (ip_header->destination, destination),
+                        TCP_HEADER_LENGTH (*header), (unsigned)length));
+      return 0;
+    }
+
+  if (UNLIKELY (ipv4_checksum (packet, length,
+                               ipv6_pseudo_header_checksum (ip_header, length)) != 0))
+    {
+      log_debug_maybe (("TCP checksum mismatch (%s -> %s, TCP length %u).",
+                        ipv6_format (ip_header->source, source),
+                        ipv6_format (ip_header->destination, destination),
+                        (unsigned)length));
+      return 0;
+    }
+
+  return 1;
+}
@@ -0,0 +1,73 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef IPV6_H
+#define IPV6_H
+
+#include "config.h"
+#include "ipv4.h"
+
+typedef struct
+{
+  unsigned char source[16];
+  unsigned char destination[16];
+  uint16_t payload_length;      /* after the fixed header */
+  uint8_t protocol;             /* after the extension headers */
+  uint8_t hop_limit;
+  unsigned header_length;       /* including the extension headers */
+  uint16_t fragment;            /* offset and M flag, or zero */
+  uint32_t fragment_id;
+} ipv6_header_t;
+/* A decoded IPv6 header.  PROTOCOL and HEADER_LENGTH describe the
+   upper-layer header, which follows the extension headers.  For a
+   fragment, FRAGMENT is the offset (in bytes) ORed with the "more
+   fragments" flag (bit 0), and PROTOCOL and HEADER_LENGTH describe
+   the fragment data. */
+
+#define IPV6_FIXED_HEADER_LENGTH 40
+/* Length of the IPv6 header without extension headers. */
+
+#define IPV6_TOTAL_LENGTH(IP) (IPV6_FIXED_HEADER_LENGTH + (IP).payload_length)
+/* Returns the length of the IPv6 packet, including all headers. */
+
+#define IPV6_FORMAT_LENGTH 46
+/* Size of the buffer for ipv6_format (INET6_ADDRSTRLEN). */
+
+const char *ipv6_format (const unsigned char *address, char *buffer);
+/* Formats the IPv6 ADDRESS in BUFFER, which must have room for
+   IPV6_FORMAT_LENGTH characters, and returns BUFFER.  Intended for
+   log messages. */
+
+int ipv6_header_decode (const char *packet, size_t length, ipv6_header_t *header);
+/* Decodes the IPv6 header at PACKET, skipping hop-by-hop, routing,
+   destination options and authentication headers, and stores the
+   result in HEADER.  The walk stops at a fragment header, unless the
+   fragment is atomic.  Returns zero on error. */
+
+uint32_t ipv6_pseudo_header_checksum (const ipv6_header_t *header, uint32_t length);
+/* Calculates the pseudo header checksum of HEADER, for an upper-layer
+   packet of LENGTH octets (see ipv4_checksum). */
+
+int ipv6_udp_header_decode (const char *packet, size_t length, const ipv6_header_t *ip_header, udp_header_t *header);
+/* Like udp_header_decode, for UDP over IPv6.  A zero checksum is an
+   error in IPv6. */
+
+int ipv6_tcp_header_decode (const char *packet, size_t length, const ipv6_header_t *ip_header, tcp_header_t *header);
+/* Like tcp_header_decode, for TCP over IPv6. */
+
+#endif /* IPV6_H */
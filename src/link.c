@@ -0,0 +1,178 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "link.h"
+#include "ansidecl.h"
+#include "log.h"
+
+#include <pcap.h>
+#include <stdio.h>
+
+/* Link types which older libpcap versions do not define. */
+#ifndef DLT_IPV4
+#define DLT_IPV4 228
+#endif
+#ifndef DLT_IPV6
+#define DLT_IPV6 229
+#endif
+#ifndef DLT_LINUX_SLL2
+#define DLT_LINUX_SLL2 276
+#endif
+
+/* Checks the ethertype at offset TYPE_OFFSET of the frame at PACKET,
+   skipping VLAN tags which follow the HEADER_LENGTH bytes of the link
+   layer header.  See link_decoder_t. */
+static inline const char *
+skip_ethertype (const char *packet, size_t *length,
+                unsigned type_offset, unsigned header_length)
+{
+  const unsigned char *p = (const unsigned char *)packet;
+  unsigned type, tags;
+
+  if (UNLIKELY (*length < header_length))
+    return 0;
+  type = (p[type_offset] << 8) | p[type_offset + 1];
+
+  /* 802.1Q, 802.1ad and the pre-standard QinQ ethertype.  Each tag
+     is followed by the inner ethertype. */
+  for (tags = 0;
+       UNLIKELY (type == 0x8100 || type == 0x88A8 || type == 0x9100);
+       ++tags)
+    {
+      if (tags == LINK_MAX_VLAN_TAGS || *length < header_length + 4)
+        return 0;
+      type = (p[header_length + 2] << 8) | p[header_length + 3];
+      header_length += 4;
+    }
+
+  if (LIKELY (type == 0x0800 || type == 0x86DD))
+    {
+      *length -= header_length;
+      return packet + header_length;
+    }
+  return 0;
+}
+
+/* DLT_EN10MB */
+static const char *
+decode_ethernet (const char *packet, size_t *length)
+{
+  return skip_ethertype (packet, length, 12, 14);
+}
+
+/* DLT_LINUX_SLL: the protocol field follows the 8-byte address. */
+static const char *
+decode_sll (const char *packet, size_t *length)
+{
+  return skip_ethertype (packet, length, 14, 16);
+}
+
+/* DLT_LINUX_SLL2: the protocol field comes first. */
+static const char *
+decode_sll2 (const char *packet, size_t *length)
+{
+  return skip_ethertype (packet, length, 0, 20);
+}
+
+/* Checks that PACKET (LENGTH bytes, after OFFSET bytes of link layer
+   header) starts with an IPv4 or IPv6 header. */
+static inline const char *
+skip_to_ip (const char *packet, size_t *length, unsigned offset)
+{
+  unsigned version;
+
+  if (UNLIKELY (*length <= offset))
+    return 0;
+  version = (unsigned char)packet[offset] >> 4;
+  if (UNLIKELY (version != 4 && version != 6))
+    return 0;
+  *length -= offset;
+  return packet + offset;
+}
+
+/* DLT_NULL and DLT_LOOP.  The address family is in host byte order
+   (of the capturing machine) or network byte order, and the values
+   for AF_INET6 differ between systems, so the IP version is checked
+   instead. */
+static const char *
+decode_null (const char *packet, size_t *length)
+{
+  return skip_to_ip (packet, length, 4);
+}
+
+/* DLT_RAW, DLT_IPV4, DLT_IPV6 */
+static const char *
+decode_raw (const char *packet, size_t *length)
+{
+  return skip_to_ip (packet, length, 0);
+}
+
+static const struct
+{
+  int link_type;
+  link_decoder_t decoder;
+} decoders[] =
+  {
+    { DLT_EN10MB, decode_ethernet },
+    { DLT_LINUX_SLL, decode_sll },
+    { DLT_LINUX_SLL2, decode_sll2 },
+    { DLT_NULL, decode_null },
+    { DLT_LOOP, decode_null },
+    { DLT_RAW, decode_raw },
+    { DLT_IPV4, decode_raw },
+    { DLT_IPV6, decode_raw },
+  };
+
+link_decoder_t
+link_decoder (int link_type)
+{
+  unsigned j;
+
+  for (j = 0; j < sizeof (decoders) / sizeof (decoders[0]); ++j)
+    if (decoders[j].link_type == link_type)
+      return decoders[j].decoder;
+  return 0;
+}
+
+const char *
+link_filter (int link_type, const char *filter)
+{
+  static char first[8192], second[8192];
+  char *previous = first, *current = second, *swap;
+  unsigned j;
+
+  if (link_type != DLT_EN10MB)
+    return filter;
+
+  /* Each "vlan" shifts the offsets of everything after it in the
+     expression, so the alternatives for deeper tag stacks are nested
+     inside the previous one. */
+  if (snprintf (previous, sizeof (first), "(%s)", filter)
+      >= (int)sizeof (first))
+    log_fatal ("Filter expression is too long.");
+  for (j = 0; j < LINK_MAX_VLAN_TAGS; ++j)
+    {
+      if (snprintf (current, sizeof (first), "(%s) or (vlan and (%s))",
+                    filter, previous) >= (int)sizeof (first))
+        log_fatal ("Filter expression is too long.");
+      swap = previous;
+      previous = current;
+      current = swap;
+    }
+  return previous;
+}
@@ -0,0 +1,48 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef LINK_H
+#define LINK_H
+
+#include "config.h"
+
+#include <stddef.h>
+
+#define LINK_MAX_VLAN_TAGS 4
+/* Maximum number of stacked 802.1Q/802.1ad tags which are skipped. */
+
+typedef const char *(*link_decoder_t) (const char *packet, size_t *length);
+/* Strips the link layer header from PACKET (*LENGTH bytes) and returns
+   a pointer to the IPv4 or IPv6 packet, whose length is stored in
+   *LENGTH.  Returns a null pointer if the frame is truncated or does
+   not carry IP. */
+
+link_decoder_t link_decoder (int link_type);
+/* Returns the decoder for the DLT_ link type LINK_TYPE, or a null
+   pointer if the link type is not supported.  The decoder is looked
+   up once per capture handle, so that the per-packet cost is a single
+   indirect call. */
+
+const char *link_filter (int link_type, const char *filter);
+/* Returns FILTER, extended so that it also matches frames of the link
+   type LINK_TYPE which carry up to LINK_MAX_VLAN_TAGS VLAN tags
+   (without that, "udp" does not match tagged frames).  Only Ethernet
+   frames are extended, because libpcap does not support "vlan" for
+   other link types.  The result is overwritten by the next call. */
+
+#endif /* LINK_H */
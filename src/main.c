@@ -19,8 +19,16 @@
 #include "log.h"
 #include "ansidecl.h"
 #include "forward.h"
+#include "fragment.h"
 #include "capture.h"
+#include "dedup.h"
+#include "ratelimit.h"
+#include "sender.h"
+#include "spool.h"
+#include "tcp.h"
 #include "test.h"
+#include "tunnel.h"
+#include "zone.h"
 
 #include "getopt.h"
 #include <signal.h>
@@ -35,14 +43,14 @@ main (int argc, char **argv)
 {
   int c;
   const char *opt_interface = 0;
-  const char *opt_filter = "udp and port 53";
+  const char *opt_filter = "(udp or tcp) and port 53";
   unsigned port;
   int opt_test_mode = 0;
 
   log_set_program (PACKAGE_NAME);
   opterr = 0;
 
-  while ((c = getopt (argc, argv, "Ab:Df:hi:L:tTv")) != -1)
+  while ((c = getopt (argc, argv, "Ab:B:c:De:f:F:hi:l:L:m:M:p:Q:r:R:S:tTu:vw:z:Z:")) != -1)
     switch (c)
       {
       case 'A':
@@ -53,17 +61,31 @@ main (int argc, char **argv)
         forward_set_source (optarg);
         break;
 
-    break;
+      case 'B':
+        forward_set_batching (optarg);
+        break;
+
+      case 'c':
+        forward_add_target (optarg);
+        break;
 
       case 'D':
         forward_without_answers = 0;
         break;
 
+      case 'e':
+        tunnel_configure (optarg);
+        break;
+
       case 'f':
         if (*optarg)
           opt_filter = optarg;
         break;
 
+      case 'F':
+        fragment_configure (optarg);
+        break;
+
       case 'h':
         usage ();
         break;
@@ -73,12 +95,44 @@ main (int argc, char **argv)
           opt_interface = optarg;
         break;
 
+      case 'l':
+        ratelimit_configure (optarg);
+        break;
+
       case 'L':
         capture_log_interval = atoi (optarg);
         if (optarg <= 0)
           log_fatal ("Argument to -L must be a positive number.");
         break;
 
+      case 'm':
+        capture_set_method (optarg);
+        break;
+
+      case 'M':
+        forward_set_max_payload (optarg);
+        break;
+
+      case 'p':
+        forward_set_policy (optarg);
+        break;
+
+      case 'Q':
+        sender_set_queue (optarg);
+        break;
+
+      case 'r':
+        capture_read_file (optarg);
+        break;
+
+      case 'R':
+        tcp_configure (optarg);
+        break;
+
+      case 'S':
+        spool_configure (optarg);
+        break;
+
       case 't':
         forward_over_tcp = 1;
         break;
@@ -87,17 +141,33 @@ main (int argc, char **argv)
         opt_test_mode = 1;
         break;
 
+      case 'u':
+        dedup_configure (optarg);
+        break;
+
       case 'v':
         log_debug_enable = 1;
         break;
 
+      case 'w':
+        capture_set_workers (optarg);
+        break;
+
+      case 'z':
+        forward_set_compression (optarg);
+        break;
+
+      case 'Z':
+        zone_configure (optarg);
+        break;
+
       default:
         log_fatal ("Unknown option '-%c'.  Use '-h' for help.", optopt);
       }
 
   if (opt_test_mode)
     {
-      test_run ();
+      test_run (argv + optind, argc - optind);
       return 0;
     }
 
@@ -118,10 +188,15 @@ main (int argc, char **argv)
 #endif
 
   signal (SIGPIPE, SIG_IGN);
+  zone_init ();
+  fragment_init ();
+  tcp_init ();
+  dedup_init ();
+  ratelimit_init ();
 
   /* Start capturing packets. */
 
-  capture_open (opt_interface, opt_filter);
+  capture_open (opt_interface, tunnel_filter (forward_filter (opt_filter)));
   capture_run ();
 
   return 0;
@@ -142,11 +217,28 @@ usage(void)
   puts ("");
   puts ("  -i INTERFACE    interface to capture packets on");
   puts ("  -f EXPRESSION   filter expression (BPF syntax)");
+  puts ("  -m METHOD       capture method: pcap (default), ring or xdp");
+  puts ("  -r FILE[,speed=S]  replay a pcap or pcapng file (S: max, or time factor)");
   puts ("  -A              forward authoritative answers only");
   puts ("  -D              do not forward empty answers");
+  puts ("  -e DEPTH[,vxlan=PORT]  strip up to DEPTH GRE, ERSPAN and VXLAN headers");
+  puts ("  -F MEM[,OPTS]   fragment reassembly memory per worker (0 disables)");
+  puts ("  -R MEM[,OPTS]   TCP stream reassembly memory per worker (0 disables)");
+  puts ("  -u SECS[,memory=BYTES]  forward repeated responses once per SECS seconds");
+  puts ("  -l RATE[,OPTS]  forward at most RATE responses/s per source and worker");
+  puts ("  -Z FILE         include or exclude zones listed in FILE (reloaded on SIGHUP)");
+  puts ("  -M BYTES        forward DNS payloads up to BYTES long (default 512)");
   puts ("  -t              forward data over TCP (default is UDP)");
+  puts ("  -z LEVEL[,flush=MS]  compress the TCP stream (LEVEL: 1 to 9)");
+  puts ("  -c HOST:PORT[,route=R]  forward to another target (R: all, aa, non-aa)");
+  puts ("  -p POLICY       distribute records among targets: replicate (default),");
+  puts ("                  shard[,key=nameserver|qname] or route");
+  puts ("  -B N[,latency=MS]  send up to N records at once, delaying at most MS");
+  puts ("  -Q N[,drop=P]   queue N records for the sender thread (P: newest, oldest)");
+  puts ("  -S DIR[,OPTS]   spool records to DIR while the target is unreachable");
   puts ("  -L SECS         write a checkpoint log entry every SECS seconds");
-  puts ("  -T              enable testing mode (reads from standard input)");
+  puts ("  -w N[,fanout=M]  use N capture workers (M: hash, cpu or rollover)");
+  puts ("  -T [FILE...]    enable testing mode (reads from standard input or FILEs)");
   puts ("  -v              verbose output, include debugging messages");
   puts ("");
   puts ("  -h              this help message");
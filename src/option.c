@@ -0,0 +1,111 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "option.h"
+#include "log.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+int
+option_next (char **list, char **name, char **value)
+{
+  char *p = *list;
+  char *end;
+  char *equals;
+
+  if (p == 0 || *p == 0)
+    return 0;
+
+  end = strchr (p, ',');
+  if (end)
+    {
+      *end = 0;
+      *list = end + 1;
+    }
+  else
+    *list = p + strlen (p);
+
+  equals = strchr (p, '=');
+  if (equals)
+    {
+      *equals = 0;
+      *value = equals + 1;
+    }
+  else
+    *value = 0;
+
+  *name = p;
+  return 1;
+}
+
+static unsigned long
+parse (const char *name, const char *value, int allow_suffix)
+{
+  char *end;
+  unsigned long result;
+
+  if (value == 0 || *value < '0' || *value > '9')
+    log_fatal ("Option '%s' requires a numeric argument.", name);
+
+  errno = 0;
+  result = strtoul (value, &end, 10);
+  if (errno != 0)
+    log_fatal ("Argument to '%s' is out of range: %s.", name, value);
+
+  if (allow_suffix && *end)
+    {
+      unsigned shift;
+
+      switch (*end)
+        {
+        case 'k': case 'K': shift = 10; break;
+        case 'm': case 'M': shift = 20; break;
+        case 'g': case 'G': shift = 30; break;
+        default: shift = 0;
+        }
+      if (shift == 0 || end[1] != 0)
+        log_fatal ("Invalid size suffix for '%s': %s.", name, value);
+      if (result > (~0UL >> shift))
+        log_fatal ("Argument to '%s' is out of range: %s.", name, value);
+      return result << shift;
+    }
+
+  if (*end)
+    log_fatal ("Invalid numeric argument for '%s': %s.", name, value);
+  return result;
+}
+
+unsigned long
+option_unsigned (const char *name, const char *value)
+{
+  return parse (name, value, 0);
+}
+
+unsigned long
+option_size (const char *name, const char *value)
+{
+  return parse (name, value, 1);
+}
+
+void
+option_unknown (const char *option, const char *name)
+{
+  log_fatal ("Unknown setting '%s' for option '%s'.", name, option);
+}
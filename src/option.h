@@ -0,0 +1,46 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef OPTION_H
+#define OPTION_H
+
+#include "config.h"
+#include "ansidecl.h"
+
+/* Helpers for options which take a comma-separated list of
+   NAME=VALUE pairs, such as "ring,blocks=64,block-size=1M". */
+
+int option_next (char **list, char **name, char **value);
+/* Splits off the next element of the comma-separated *LIST,
+   modifying *LIST in place.  Stores the name in *NAME, and the text
+   after the "=" sign in *VALUE (or a null pointer if there is no "="
+   sign).  Returns zero if *LIST is exhausted. */
+
+unsigned long option_unsigned (const char *name, const char *value);
+/* Parses VALUE as a non-negative decimal number.  NAME is used in
+   error messages.  Terminates the program on error. */
+
+unsigned long option_size (const char *name, const char *value);
+/* Like option_unsigned, but accepts a "k", "m" or "g" suffix (powers
+   of 1024). */
+
+void option_unknown (const char *option, const char *name) ATTRIBUTE_NORETURN;
+/* Reports that NAME is not a valid sub-option of OPTION, and
+   terminates the program. */
+
+#endif /* OPTION_H */
@@ -0,0 +1,185 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "queue.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_LINE 64
+
+typedef struct
+{
+  forward_t record;
+  size_t length;
+  forward_t *large;             /* for records longer than RECORD */
+} __attribute__ ((aligned (CACHE_LINE))) queue_slot_t;
+
+struct queue
+{
+  unsigned mask;
+  int drop_oldest;
+  queue_slot_t *slots;
+
+  /* Written by the producer. */
+  unsigned head __attribute__ ((aligned (CACHE_LINE)));
+  unsigned cached_tail;
+  unsigned dropped;
+
+  /* Written by the consumer (and by the producer if it discards the
+     oldest record). */
+  unsigned tail __attribute__ ((aligned (CACHE_LINE)));
+  unsigned cached_head;
+};
+
+queue_t *
+queue_new (unsigned size, int drop_oldest)
+{
+  queue_t *queue;
+
+  if (size < 2 || (size & (size - 1)) != 0)
+    log_fatal ("The queue size must be a power of two.");
+
+  if (posix_memalign ((void **)&queue, CACHE_LINE, sizeof (*queue)) != 0)
+    log_fatal ("Out of memory.");
+  memset (queue, 0, sizeof (*queue));
+  if (posix_memalign ((void **)&queue->slots, CACHE_LINE,
+                      size * sizeof (queue_slot_t)) != 0)
+    log_fatal ("Out of memory.");
+  queue->mask = size - 1;
+  queue->drop_oldest = drop_oldest;
+  return queue;
+}
+
+forward_t *
+queue_slot (queue_t *queue)
+{
+  unsigned head = queue->head;
+
+  if (UNLIKELY (head - queue->cached_tail > queue->mask))
+    {
+      /* Refresh our copy of the consumer index. */
+      queue->cached_tail = __atomic_load_n (&queue->tail, __ATOMIC_ACQUIRE);
+      if (head - queue->cached_tail > queue->mask)
+        return 0;
+    }
+  return &queue->slots[head & queue->mask].record;
+}
+
+void
+queue_push (queue_t *queue, forward_t *large, size_t length)
+{
+  unsigned head = queue->head;
+
+  queue->slots[head & queue->mask].length = length;
+  queue->slots[head & queue->mask].large = large;
+  __atomic_store_n (&queue->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int
+queue_push_full (queue_t *queue, forward_t *record, size_t length)
+{
+  unsigned head = queue->head;
+  unsigned tail;
+  int large = FORWARD_RECORD_LARGE (length);
+
+  if (!queue->drop_oldest)
+    {
+      __atomic_store_n (&queue->dropped, queue->dropped + 1, __ATOMIC_RELAXED);
+      if (large)
+        free (record);
+      return 0;
+    }
+
+  /* Discard the oldest record, unless the consumer has removed it
+     in the meantime.  Either way, its slot is free afterwards.  The
+     buffer of a large record belongs to whoever removes the record
+     from the queue; the consumer does not access it before. */
+  tail = __atomic_load_n (&queue->tail, __ATOMIC_ACQUIRE);
+  if (head - tail > queue->mask
+      && __atomic_compare_exchange_n (&queue->tail, &tail, tail + 1, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      __atomic_store_n (&queue->dropped, queue->dropped + 1, __ATOMIC_RELAXED);
+      free (queue->slots[tail & queue->mask].large);
+    }
+  queue->cached_tail = __atomic_load_n (&queue->tail, __ATOMIC_ACQUIRE);
+
+  if (!large)
+    memcpy (&queue->slots[head & queue->mask].record, record, length);
+  queue_push (queue, large ? record : 0, length);
+  return 1;
+}
+
+int
+queue_pop (queue_t *queue, forward_t *record, forward_t **large,
+           size_t *length)
+{
+  for (;;)
+    {
+      unsigned tail = __atomic_load_n (&queue->tail, __ATOMIC_RELAXED);
+      const queue_slot_t *slot;
+
+      /* If the producer discarded records, TAIL may have moved past
+         our copy of the producer index. */
+      if ((int)(queue->cached_head - tail) <= 0)
+        {
+          queue->cached_head = __atomic_load_n (&queue->head, __ATOMIC_ACQUIRE);
+          if (tail == queue->cached_head)
+            return 0;
+        }
+
+      slot = queue->slots + (tail & queue->mask);
+      *length = slot->length;
+      if (UNLIKELY (FORWARD_RECORD_LARGE (*length)))
+        *large = slot->large;
+      else
+        {
+          *large = 0;
+          memcpy (record, &slot->record, *length);
+        }
+
+      if (!queue->drop_oldest)
+        {
+          __atomic_store_n (&queue->tail, tail + 1, __ATOMIC_RELEASE);
+          return 1;
+        }
+
+      /* The producer may have discarded the record (and started to
+         overwrite the slot) while it was copied.  In this case, the
+         copy (or the pointer to the large record, which the producer
+         has freed) is discarded as well. */
+      if (__atomic_compare_exchange_n (&queue->tail, &tail, tail + 1, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return 1;
+    }
+}
+
+int
+queue_empty (queue_t *queue)
+{
+  return __atomic_load_n (&queue->tail, __ATOMIC_RELAXED)
+    == __atomic_load_n (&queue->head, __ATOMIC_ACQUIRE);
+}
+
+unsigned
+queue_dropped (const queue_t *queue)
+{
+  return __atomic_load_n (&queue->dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,70 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include "config.h"
+#include "forward.h"
+
+/* A bounded single-producer/single-consumer queue of forwarding
+   records.  The records are preallocated, and the producer encodes
+   directly into the free slot at the head of the queue.  The
+   producer and consumer indexes are kept in separate cache lines. */
+
+typedef struct queue queue_t;
+
+queue_t *queue_new (unsigned size, int drop_oldest);
+/* Allocates a queue with room for SIZE records (a power of two).  If
+   DROP_OLDEST is true, a full queue discards its oldest record to
+   make room for a new one; otherwise, the new record is discarded.
+   Terminates the program on error. */
+
+forward_t *queue_slot (queue_t *queue);
+/* Producer: Returns the free slot at the head of QUEUE, or a null
+   pointer if QUEUE is full.  The slot is not visible to the consumer
+   until queue_push is called. */
+
+void queue_push (queue_t *queue, forward_t *large, size_t length);
+/* Producer: Publishes the slot returned by queue_slot, which contains
+   a record of LENGTH bytes.  If the record is too large for the slot
+   (see FORWARD_RECORD_LARGE), LARGE is its buffer, which is handed
+   over to QUEUE; otherwise, LARGE is a null pointer. */
+
+int queue_push_full (queue_t *queue, forward_t *record, size_t length);
+/* Producer: Called instead of queue_push if queue_slot returned a
+   null pointer.  Applies the overflow policy to RECORD, of LENGTH
+   bytes, and returns nonzero if RECORD has been queued.  A large
+   RECORD is handed over to QUEUE (and freed if it is discarded). */
+
+int queue_pop (queue_t *queue, forward_t *record, forward_t **large,
+               size_t *length);
+/* Consumer: Copies the oldest record to RECORD and its length to
+   LENGTH, and removes it from QUEUE.  If the record is too large for
+   RECORD, its buffer is stored in *LARGE instead, and the caller has
+   to free it; otherwise, *LARGE is set to a null pointer.  Returns
+   zero if QUEUE is empty. */
+
+int queue_empty (queue_t *queue);
+/* Consumer: Returns nonzero if QUEUE contains no records. */
+
+unsigned queue_dropped (const queue_t *queue);
+/* Returns the number of records discarded because QUEUE was full.
+   The counter is never reset. */
+
+#endif /* QUEUE_H */
@@ -0,0 +1,215 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "ratelimit.h"
+#include "ansidecl.h"
+#include "checkpoint.h"
+#include "log.h"
+#include "option.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PROBES 8
+/* Number of consecutive slots searched for a source address.  A
+   source is evicted only if all of them are in use. */
+
+#define MAX_SOURCES (1U << 24)
+
+typedef struct
+{
+  uint32_t source[4];
+  uint64_t full;                /* time at which the bucket is full
+                                   again, or zero for an empty slot */
+} entry_t;
+/* A token bucket, in the form of the generic cell rate algorithm:
+   each forwarded response moves FULL one interval into the future,
+   and a response is dropped if that would exceed the burst. */
+
+typedef struct
+{
+  entry_t *entries;
+  uint32_t mask;
+} table_t;
+/* The open-addressed table of a thread, allocated on first use. */
+
+unsigned ratelimit_rate = 0;
+static unsigned ratelimit_burst = 0;
+static unsigned ratelimit_sources = 4096;
+/* Settings from the command line. */
+
+static uint64_t interval;
+/* Nanoseconds per token. */
+
+static uint64_t tolerance;
+/* Nanoseconds by which FULL may be ahead of the current time. */
+
+static __thread table_t *table;
+
+enum
+  {
+    STAT_LIMITED,
+    STAT_EVICTIONS,
+    STATS
+  };
+
+static checkpoint_counters_t counters;
+static __thread checkpoint_thread_t *local_counters;
+/* The counters of the calling thread, in COUNTERS. */
+
+void
+ratelimit_configure (const char *spec)
+{
+  char *copy = strdup (spec);
+  char *options = strchr (copy, ',');
+  char *name, *value;
+
+  if (options)
+    *options++ = 0;
+
+  ratelimit_rate = option_unsigned ("-l", copy);
+  ratelimit_burst = 0;
+  while (option_next (&options, &name, &value))
+    if (strcmp (name, "burst") == 0)
+      ratelimit_burst = option_unsigned (name, value);
+    else if (strcmp (name, "sources") == 0)
+      ratelimit_sources = option_unsigned (name, value);
+    else
+      option_unknown ("-l", name);
+  free (copy);
+
+  if (ratelimit_rate == 0 || ratelimit_rate > 1000000000)
+    log_fatal ("The rate must be between 1 and 1000000000 responses per second.");
+  if (ratelimit_burst == 0)
+    ratelimit_burst = ratelimit_rate;
+  if (ratelimit_burst > 1000000000)
+    log_fatal ("The burst must be at most 1000000000 responses.");
+  if (ratelimit_sources < PROBES || ratelimit_sources > MAX_SOURCES)
+    log_fatal ("The number of sources must be between %u and %u.",
+               PROBES, MAX_SOURCES);
+
+  interval = 1000000000ULL / ratelimit_rate;
+  tolerance = interval * ratelimit_burst;
+}
+
+static void
+report (checkpoint_t *checkpoint)
+{
+  unsigned long deltas[STATS];
+
+  checkpoint_deltas (&counters, deltas, STATS);
+  checkpoint_printf (checkpoint, ", %lu rate limited/%lu source evictions",
+                     deltas[STAT_LIMITED], deltas[STAT_EVICTIONS]);
+}
+
+void
+ratelimit_init (void)
+{
+  if (ratelimit_rate > 0)
+    checkpoint_register (report);
+}
+
+void
+ratelimit_statistics (unsigned long *limited, unsigned long *evictions)
+{
+  *limited = checkpoint_counter (&counters, STAT_LIMITED);
+  *evictions = checkpoint_counter (&counters, STAT_EVICTIONS);
+}
+
+/* Allocates the table of the calling thread, with the number of
+   sources rounded up to a power of two. */
+static table_t *
+table_create (void)
+{
+  table_t *t;
+  size_t size = PROBES;
+
+  while (size < ratelimit_sources)
+    size *= 2;
+
+  t = calloc (1, sizeof (*t));
+  if (t == 0 || (t->entries = calloc (size, sizeof (*t->entries))) == 0)
+    log_fatal ("Out of memory.");
+  t->mask = size - 1;
+  return t;
+}
+
+static inline uint32_t
+hash (const uint32_t source[4])
+{
+  uint64_t x = ((uint64_t)source[0] << 32 | source[1])
+    ^ ((uint64_t)source[2] << 32 | source[3]);
+
+  /* The splitmix64 finalizer. */
+  x ^= x >> 30;
+  x *= 0xBF58476D1CE4E5B9ULL;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EBULL;
+  x ^= x >> 31;
+  return x;
+}
+
+int
+ratelimit_check (const uint32_t source[4])
+{
+  table_t *t = table;
+  entry_t *e, *victim = 0;
+  uint64_t now, full;
+  uint32_t index;
+  unsigned j;
+
+  if (UNLIKELY (t == 0))
+    t = table = table_create ();
+  now = checkpoint_now ();
+
+  /* Slots are never emptied, so the search ends at an empty slot.
+     Without one, the source which has been idle for the longest time
+     is replaced. */
+  index = hash (source);
+  for (j = 0; j < PROBES; ++j)
+    {
+      e = t->entries + ((index + j) & t->mask);
+      if (e->full == 0)
+        {
+          victim = e;
+          break;
+        }
+      if (memcmp (e->source, source, sizeof (e->source)) == 0)
+        goto found;
+      if (victim == 0 || e->full < victim->full)
+        victim = e;
+    }
+
+  /* A source whose bucket is full again can be forgotten without
+     loss. */
+  e = victim;
+  if (e->full > now)
+    CHECKPOINT_COUNT (&counters, local_counters, STAT_EVICTIONS);
+  memcpy (e->source, source, sizeof (e->source));
+  e->full = now;
+
+ found:
+  full = e->full < now ? now : e->full;
+  if (full - now + interval > tolerance)
+    {
+      CHECKPOINT_COUNT (&counters, local_counters, STAT_LIMITED);
+      return 1;
+    }
+  e->full = full + interval;
+  return 0;
+}
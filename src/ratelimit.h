@@ -0,0 +1,52 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include "config.h"
+
+extern unsigned ratelimit_rate;
+/* The number of responses per second which are forwarded for each
+   source address, or zero if rate limiting is disabled (the
+   default).  Each capture worker has its own buckets, so the limit
+   applies per worker. */
+
+void ratelimit_configure (const char *spec);
+/* Enables rate limiting.  SPEC is the rate, optionally followed by
+   ",burst=N" (the bucket size, by default the rate) and ",sources=N"
+   (the number of source addresses tracked by each capture worker).
+   Terminates the program on error. */
+
+void ratelimit_init (void);
+/* Registers the checkpoint reporter.  Must be called before the
+   capture workers are started. */
+
+int ratelimit_check (const uint32_t source[4]);
+/* Takes a token from the bucket of the SOURCE address (an IPv6
+   address, or an IPv4-mapped address) in the table of the calling
+   thread.  Returns nonzero if the bucket is empty, that is, if the
+   response must be dropped.  Does not allocate memory, except for
+   the table on the first call. */
+
+void ratelimit_statistics (unsigned long *limited, unsigned long *evictions);
+/* Returns the counters since the start of the program (across all
+   threads).  For testing. */
+
+#endif /* RATELIMIT_H */
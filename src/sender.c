@@ -0,0 +1,269 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "checkpoint.h"
+#include "forward.h"
+#include "log.h"
+#include "option.h"
+#include "sender.h"
+#include "spool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SENDER_MAX_QUEUES 64
+/* Upper limit for the number of queues (one per capture worker). */
+
+#define DRAIN_LIMIT 256
+/* Maximum number of records taken from one queue before the next
+   queue is looked at. */
+
+static unsigned queue_size = 16384;
+static int queue_drop_oldest = 0;
+/* Set by sender_set_queue. */
+
+typedef struct
+{
+  pthread_t thread;
+
+  queue_t *queues[SENDER_MAX_QUEUES];
+  unsigned queue_count;
+  /* One queue per capture worker. */
+
+  forward_channel_t channel;
+  /* Only used by the sender thread. */
+
+  pthread_mutex_t wait_lock;
+  pthread_cond_t wait_cond;
+  int sleeping;
+  /* The sender thread sets SLEEPING while it waits on WAIT_COND. */
+} sender_t;
+/* Each forward target has its own sender thread, so that a slow
+   target does not hold up the others. */
+
+static sender_t senders[FORWARD_MAX_TARGETS];
+
+static int stopping;
+/* Set by sender_stop.  The sender threads exit once their queues
+   are empty. */
+
+void
+sender_set_queue (const char *spec)
+{
+  char *copy = strdup (spec);
+  char *options = strchr (copy, ',');
+  char *name, *value;
+
+  if (options)
+    *options++ = 0;
+
+  queue_size = option_unsigned ("-Q", copy);
+  if (queue_size != 0
+      && (queue_size < 2 || (queue_size & (queue_size - 1)) != 0))
+    log_fatal ("The queue size must be 0 or a power of two.");
+
+  while (option_next (&options, &name, &value))
+    if (strcmp (name, "drop") == 0)
+      {
+        if (value && strcmp (value, "newest") == 0)
+          queue_drop_oldest = 0;
+        else if (value && strcmp (value, "oldest") == 0)
+          queue_drop_oldest = 1;
+        else
+          log_fatal ("The drop policy must be 'newest' or 'oldest'.");
+      }
+    else
+      option_unknown ("-Q", name);
+  free (copy);
+}
+
+int
+sender_enabled (void)
+{
+  return queue_size != 0;
+}
+
+/* Adds the number of records dropped because of full queues to the
+   checkpoint line. */
+static void
+report_dropped (checkpoint_t *checkpoint)
+{
+  static unsigned last;
+  unsigned current = sender_dropped ();
+
+  checkpoint_printf (checkpoint, ", %u records dropped (queue full)",
+                     current - last);
+  last = current;
+}
+
+unsigned
+sender_dropped (void)
+{
+  unsigned result = 0;
+  unsigned j, k;
+
+  for (j = 0; j < forward_target_count (); ++j)
+    for (k = 0; k < senders[j].queue_count; ++k)
+      result += queue_dropped (senders[j].queues[k]);
+  return result;
+}
+
+queue_t *
+sender_attach (unsigned target)
+{
+  static int registered;
+  sender_t *sender = senders + target;
+
+  if (sender->queue_count == SENDER_MAX_QUEUES)
+    log_fatal ("Too many sender queues.");
+  if (!registered)
+    {
+      checkpoint_register (report_dropped);
+      registered = 1;
+    }
+  sender->queues[sender->queue_count]
+    = queue_new (queue_size, queue_drop_oldest);
+  return sender->queues[sender->queue_count++];
+}
+
+void
+sender_wake (void)
+{
+  unsigned j;
+
+  /* Pairs with the store to SLEEPING in wait_for_records: either the
+     sender thread sees the new record, or we see SLEEPING set. */
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  for (j = 0; j < forward_target_count (); ++j)
+    if (UNLIKELY (__atomic_load_n (&senders[j].sleeping, __ATOMIC_RELAXED)))
+      {
+        pthread_mutex_lock (&senders[j].wait_lock);
+        pthread_cond_signal (&senders[j].wait_cond);
+        pthread_mutex_unlock (&senders[j].wait_lock);
+      }
+}
+
+/* Returns nonzero if all queues of SENDER are empty. */
+static int
+all_empty (sender_t *sender)
+{
+  unsigned j;
+
+  for (j = 0; j < sender->queue_count; ++j)
+    if (!queue_empty (sender->queues[j]))
+      return 0;
+  return 1;
+}
+
+/* Blocks until a producer calls sender_wake, or until the batch
+   latency has passed (one second if no records are pending). */
+static void
+wait_for_records (sender_t *sender)
+{
+  struct timespec deadline;
+  int timeout = forward_idle_timeout ();
+
+  if ((sender->channel.count == 0 && !spool_enabled ()) || timeout < 0)
+    timeout = 1000;
+  clock_gettime (CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout / 1000;
+  deadline.tv_nsec += (timeout % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L)
+    {
+      ++deadline.tv_sec;
+      deadline.tv_nsec -= 1000000000L;
+    }
+
+  pthread_mutex_lock (&sender->wait_lock);
+  __atomic_store_n (&sender->sleeping, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (all_empty (sender) && !__atomic_load_n (&stopping, __ATOMIC_ACQUIRE))
+    pthread_cond_timedwait (&sender->wait_cond, &sender->wait_lock, &deadline);
+  __atomic_store_n (&sender->sleeping, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock (&sender->wait_lock);
+}
+
+static void *
+sender_run (void *closure)
+{
+  sender_t *sender = closure;
+
+  for (;;)
+    {
+      unsigned moved = 0;
+      unsigned j;
+
+      for (j = 0; j < sender->queue_count; ++j)
+        moved += forward_drain (&sender->channel, sender->queues[j],
+                                DRAIN_LIMIT);
+      forward_flush_expired (&sender->channel);
+      if (moved == 0)
+        {
+          if (__atomic_load_n (&stopping, __ATOMIC_ACQUIRE)
+              && all_empty (sender))
+            break;
+          wait_for_records (sender);
+        }
+    }
+  forward_flush (&sender->channel);
+  return 0;
+}
+
+void
+sender_start (void)
+{
+  pthread_condattr_t attr;
+  unsigned j;
+
+  /* The timeouts in wait_for_records use the monotonic clock. */
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+
+  for (j = 0; j < forward_target_count (); ++j)
+    {
+      sender_t *sender = senders + j;
+      int result;
+
+      pthread_mutex_init (&sender->wait_lock, 0);
+      pthread_cond_init (&sender->wait_cond, &attr);
+      forward_channel_init (&sender->channel, j);
+      result = pthread_create (&sender->thread, 0, sender_run, sender);
+      if (result != 0)
+        log_fatal ("Could not start sender thread: %s.", strerror (result));
+    }
+  pthread_condattr_destroy (&attr);
+}
+
+void
+sender_stop (void)
+{
+  unsigned j;
+
+  __atomic_store_n (&stopping, 1, __ATOMIC_RELEASE);
+  for (j = 0; j < forward_target_count (); ++j)
+    {
+      pthread_mutex_lock (&senders[j].wait_lock);
+      pthread_cond_signal (&senders[j].wait_cond);
+      pthread_mutex_unlock (&senders[j].wait_lock);
+    }
+  for (j = 0; j < forward_target_count (); ++j)
+    pthread_join (senders[j].thread, 0);
+}
@@ -0,0 +1,60 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef SENDER_H
+#define SENDER_H
+
+#include "config.h"
+#include "queue.h"
+
+/* Each forward target has a sender thread, which owns the
+   connection to the dnslogger server.  Capture workers encode
+   records into per-worker queues, and the sender thread moves them
+   to its forwarding channel, so that collector I/O (including
+   reconnects) never blocks capturing. */
+
+void sender_set_queue (const char *spec);
+/* Configures the queues.  SPEC is the number of records per queue (a
+   power of two, or 0 to disable the sender thread), optionally
+   followed by ",drop=newest" (the default) or ",drop=oldest", the
+   policy if a queue is full.  Terminates the program on error. */
+
+int sender_enabled (void);
+/* Returns nonzero if records are forwarded by sender threads. */
+
+queue_t *sender_attach (unsigned target);
+/* Creates a new queue which is drained by the sender thread of the
+   forward target with index TARGET.  Must be called before
+   sender_start. */
+
+void sender_start (void);
+/* Starts the sender threads.  Terminates the program on error. */
+
+void sender_wake (void);
+/* Called by producers after adding records to queues, to wake up
+   the sender threads which are waiting. */
+
+void sender_stop (void);
+/* Waits until the sender threads have sent all queued records, and
+   terminates them.  Producers must have stopped adding records. */
+
+unsigned sender_dropped (void);
+/* Returns the number of records dropped so far because a queue was
+   full. */
+
+#endif /* SENDER_H */
@@ -0,0 +1,578 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "checkpoint.h"
+#include "log.h"
+#include "option.h"
+#include "spool.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SPOOL_MAGIC "DNSSPL01"
+
+typedef struct
+{
+  char magic[8];
+  uint32_t size;                /* size of the segment file */
+  uint32_t read_offset;         /* next record to replay */
+  uint32_t write_offset;        /* end of the records */
+} spool_header_t;
+/* The start of each segment file.  The records follow at offset
+   SPOOL_DATA. */
+
+#define SPOOL_DATA 64
+
+typedef struct
+{
+  uint32_t time;                /* when the record was spooled */
+  uint32_t length;              /* length of the record */
+} spool_record_t;
+/* Precedes each record in a segment.  Records are padded to a
+   multiple of 8 bytes. */
+
+#define RECORD_SPACE(LENGTH) \
+  (sizeof (spool_record_t) + (((LENGTH) + 7) & ~(size_t)7))
+
+typedef struct
+{
+  unsigned number;
+  spool_header_t *header;       /* null if not mapped */
+} segment_t;
+
+static const char *spool_directory;
+static unsigned long spool_size = 1024UL * 1024 * 1024;
+static unsigned long segment_size = 16UL * 1024 * 1024;
+static unsigned long replay_rate = 5000;
+/* Set by spool_configure. */
+
+struct spool
+{
+  char *name;
+  char *path;
+  /* The target name, and the directory which contains the
+     segments. */
+
+  pthread_mutex_t lock;
+  /* Protects the members below. */
+
+  unsigned first_segment, next_segment;
+  /* The segment files which exist have numbers in the range
+     [first_segment, next_segment). */
+
+  segment_t reader, writer;
+  /* The oldest segment (from which records are replayed) and the
+     newest segment (to which records are appended).  They can refer
+     to the same file. */
+
+  unsigned pending_records;
+  unsigned long pending_bytes;
+  unsigned records_lost, last_lost;
+  /* Statistics for the checkpoint line. */
+
+  unsigned long tokens;
+  unsigned long last_refill;
+  /* Replay pacing: a token bucket, in thousandths of a record. */
+
+  spool_t *next;
+};
+
+static spool_t *spools;
+/* All spools, for the checkpoint reporter. */
+
+void
+spool_configure (const char *spec)
+{
+  char *copy = strdup (spec);
+  char *options = strchr (copy, ',');
+  char *name, *value;
+
+  if (options)
+    *options++ = 0;
+  if (*copy == 0)
+    log_fatal ("The spool directory must not be empty.");
+  spool_directory = copy;
+
+  while (option_next (&options, &name, &value))
+    if (strcmp (name, "size") == 0)
+      spool_size = option_size (name, value);
+    else if (strcmp (name, "segment") == 0)
+      segment_size = option_size (name, value);
+    else if (strcmp (name, "rate") == 0)
+      replay_rate = option_unsigned (name, value);
+    else
+      option_unknown ("-S", name);
+
+  /* An empty segment must hold the largest record (see -M). */
+  if (segment_size < 128 * 1024 || segment_size > UINT32_MAX)
+    log_fatal ("The spool segment size must be between 128k and 4g.");
+  if (spool_size < 2 * segment_size)
+    log_fatal ("The spool size must be at least two segments.");
+  if (replay_rate == 0)
+    log_fatal ("The spool replay rate must be positive.");
+}
+
+int
+spool_enabled (void)
+{
+  return spool_directory != 0;
+}
+
+/* Returns the value of the monotonic clock, in milliseconds. */
+static unsigned long
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/* Stores the file name of segment NUMBER of SPOOL in PATH. */
+static void
+segment_path (const spool_t *spool, char *path, size_t size, unsigned number)
+{
+  snprintf (path, size, "%s/%08x.spool", spool->path, number);
+}
+
+/* Maps segment NUMBER into SEGMENT.  If CREATE is true, a new segment
+   file is created.  Returns -1 on failure (after logging a
+   message). */
+static int
+segment_map (const spool_t *spool, segment_t *segment, unsigned number,
+             int create)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  void *memory;
+  int fd;
+
+  segment_path (spool, path, sizeof (path), number);
+  fd = open (path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0600);
+  if (fd < 0)
+    {
+      syslog (LOG_ERR, "could not open spool segment %s: %s",
+              path, strerror (errno));
+      return -1;
+    }
+  /* The blocks must be allocated now.  With a sparse file, a full
+     disk would raise SIGBUS when a record is written to the
+     mapping. */
+  if (create && (errno = posix_fallocate (fd, 0, segment_size)) != 0)
+    {
+      syslog (LOG_ERR, "could not allocate spool segment %s: %s",
+              path, strerror (errno));
+      goto error_out;
+    }
+  if (fstat (fd, &st) < 0 || st.st_size < SPOOL_DATA
+      || (unsigned long long)st.st_size > UINT32_MAX)
+    {
+      syslog (LOG_ERR, "spool segment %s has an invalid size", path);
+      goto error_out;
+    }
+
+  memory = mmap (0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (memory == MAP_FAILED)
+    {
+      syslog (LOG_ERR, "could not map spool segment %s: %s",
+              path, strerror (errno));
+      goto error_out;
+    }
+  close (fd);
+
+  segment->number = number;
+  segment->header = memory;
+  if (create)
+    {
+      segment->header->size = st.st_size;
+      segment->header->read_offset = SPOOL_DATA;
+      segment->header->write_offset = SPOOL_DATA;
+      STATIC_MEMCPY (segment->header->magic, SPOOL_MAGIC);
+    }
+  else if (memcmp (segment->header->magic, SPOOL_MAGIC, 8) != 0
+           || segment->header->size != st.st_size
+           || segment->header->read_offset < SPOOL_DATA
+           || segment->header->read_offset % 8 != 0
+           || segment->header->read_offset > segment->header->write_offset
+           || segment->header->write_offset > segment->header->size)
+    {
+      syslog (LOG_ERR, "spool segment %s is corrupted", path);
+      munmap (memory, st.st_size);
+      segment->header = 0;
+      return -1;
+    }
+  return 0;
+
+ error_out:
+  close (fd);
+  if (create)
+    unlink (path);
+  return -1;
+}
+
+static void
+segment_unmap (segment_t *segment)
+{
+  if (segment->header)
+    {
+      munmap (segment->header, segment->header->size);
+      segment->header = 0;
+    }
+}
+
+/* Returns the record at OFFSET (which must be less than the write
+   offset) in SEGMENT, or null if the record extends beyond the write
+   offset. */
+static const spool_record_t *
+segment_record (const spool_header_t *segment, uint32_t offset)
+{
+  const spool_record_t *record;
+
+  if (segment->write_offset - offset < sizeof (spool_record_t))
+    return 0;
+  record = (const spool_record_t *)((const char *)segment + offset);
+  if (RECORD_SPACE (record->length) > segment->write_offset - offset)
+    return 0;
+  return record;
+}
+
+/* Counts the records in SEGMENT which have not been replayed yet, and
+   adds them to *RECORDS and *BYTES.  Returns -1 if the segment is
+   corrupted (the records before the corruption are still counted). */
+static int
+segment_count (const segment_t *segment, unsigned *records,
+               unsigned long *bytes)
+{
+  uint32_t offset = segment->header->read_offset;
+
+  while (offset < segment->header->write_offset)
+    {
+      const spool_record_t *record = segment_record (segment->header, offset);
+
+      if (record == 0)
+        return -1;
+      ++*records;
+      *bytes += record->length;
+      offset += RECORD_SPACE (record->length);
+    }
+  return 0;
+}
+
+/* Unmaps and deletes the oldest segment of SPOOL.  Its remaining
+   records are counted as lost. */
+static void
+segment_discard_first (spool_t *spool)
+{
+  char path[PATH_MAX];
+  segment_t segment = {0, 0};
+
+  if (spool->reader.header && spool->reader.number == spool->first_segment)
+    {
+      segment = spool->reader;
+      spool->reader.header = 0;
+    }
+  else
+    segment_map (spool, &segment, spool->first_segment, 0);
+  if (spool->writer.header && spool->writer.number == spool->first_segment)
+    segment_unmap (&spool->writer);
+
+  if (segment.header)
+    {
+      unsigned records = 0;
+      unsigned long bytes = 0;
+
+      /* Only the records before a corruption have been counted as
+         pending. */
+      segment_count (&segment, &records, &bytes);
+      spool->pending_records -= records;
+      spool->pending_bytes -= bytes;
+      spool->records_lost += records;
+      segment_unmap (&segment);
+    }
+
+  segment_path (spool, path, sizeof (path), spool->first_segment);
+  unlink (path);
+  ++spool->first_segment;
+}
+
+/* Adds the statistics of all spools to the checkpoint line. */
+static void
+report (checkpoint_t *checkpoint)
+{
+  spool_t *spool;
+
+  for (spool = spools; spool; spool = spool->next)
+    {
+      unsigned long lag = 0;
+
+      pthread_mutex_lock (&spool->lock);
+      if (spool->pending_records > 0 && spool->reader.header
+          && spool->reader.header->read_offset
+             < spool->reader.header->write_offset)
+        {
+          const spool_record_t *record
+            = segment_record (spool->reader.header,
+                              spool->reader.header->read_offset);
+          time_t now = time (0);
+
+          if (record && (uint32_t)now > record->time)
+            lag = (uint32_t)now - record->time;
+        }
+      checkpoint_printf (checkpoint, ", spool %s: %u records/%lu bytes, "
+                         "replay lag %lu seconds, %u records lost",
+                         spool->name, spool->pending_records,
+                         spool->pending_bytes, lag,
+                         spool->records_lost - spool->last_lost);
+      spool->last_lost = spool->records_lost;
+      pthread_mutex_unlock (&spool->lock);
+    }
+}
+
+spool_t *
+spool_open (const char *name)
+{
+  spool_t *spool = calloc (1, sizeof (*spool));
+  DIR *dir;
+  struct dirent *entry;
+  unsigned count = 0;
+  unsigned number;
+
+  if (spool == 0)
+    log_fatal ("Out of memory.");
+  spool->name = strdup (name);
+  spool->path = malloc (strlen (spool_directory) + strlen (name) + 2);
+  if (spool->name == 0 || spool->path == 0)
+    log_fatal ("Out of memory.");
+  sprintf (spool->path, "%s/%s", spool_directory, name);
+  pthread_mutex_init (&spool->lock, 0);
+
+  if (mkdir (spool_directory, 0700) < 0 && errno != EEXIST)
+    log_fatal ("Could not create spool directory '%s': %s.",
+               spool_directory, strerror (errno));
+  if (mkdir (spool->path, 0700) < 0 && errno != EEXIST)
+    log_fatal ("Could not create spool directory '%s': %s.",
+               spool->path, strerror (errno));
+  dir = opendir (spool->path);
+  if (dir == 0)
+    log_fatal ("Could not open spool directory '%s': %s.",
+               spool->path, strerror (errno));
+
+  /* Determine the range of segment numbers left over from a previous
+     run. */
+  while ((entry = readdir (dir)) != 0)
+    {
+      char suffix[8];
+
+      if (strlen (entry->d_name) != 14
+          || sscanf (entry->d_name, "%8x.%6s", &number, suffix) != 2
+          || strcmp (suffix, "spool") != 0)
+        continue;
+      if (count == 0 || number < spool->first_segment)
+        spool->first_segment = number;
+      if (count == 0 || number >= spool->next_segment)
+        spool->next_segment = number + 1;
+      ++count;
+    }
+  closedir (dir);
+
+  /* Count the records which have not been replayed.  Missing
+     segments are skipped, and corrupted ones are deleted. */
+  for (number = spool->first_segment; number != spool->next_segment; ++number)
+    {
+      segment_t segment;
+      unsigned records = 0;
+      unsigned long bytes = 0;
+
+      if (segment_map (spool, &segment, number, 0) < 0)
+        continue;
+      if (segment_count (&segment, &records, &bytes) < 0)
+        {
+          char path[PATH_MAX];
+
+          segment_path (spool, path, sizeof (path), number);
+          syslog (LOG_ERR, "spool segment %s is corrupted, discarding it",
+                  path);
+          segment_unmap (&segment);
+          unlink (path);
+          continue;
+        }
+      spool->pending_records += records;
+      spool->pending_bytes += bytes;
+      segment_unmap (&segment);
+    }
+  if (spool->pending_records > 0)
+    syslog (LOG_NOTICE, "%u records in spool directory %s",
+            spool->pending_records, spool->path);
+
+  spool->last_refill = now_ms ();
+  if (spools == 0)
+    checkpoint_register (report);
+  spool->next = spools;
+  spools = spool;
+  return spool;
+}
+
+void
+spool_append (spool_t *spool, const forward_t *record, size_t length)
+{
+  size_t space = RECORD_SPACE (length);
+  spool_record_t *header;
+  segment_t *writer = &spool->writer;
+
+  pthread_mutex_lock (&spool->lock);
+
+  if (UNLIKELY (SPOOL_DATA + space > segment_size))
+    {
+      ++spool->records_lost;
+      pthread_mutex_unlock (&spool->lock);
+      return;
+    }
+
+  /* Start a new segment if the current one is full.  If there are
+     too many segments, discard the oldest one. */
+  if (writer->header == 0
+      || writer->header->write_offset + space > writer->header->size)
+    {
+      segment_unmap (writer);
+      while (spool->next_segment - spool->first_segment
+             >= spool_size / segment_size)
+        segment_discard_first (spool);
+      if (segment_map (spool, writer, spool->next_segment, 1) < 0)
+        {
+          ++spool->records_lost;
+          pthread_mutex_unlock (&spool->lock);
+          return;
+        }
+      ++spool->next_segment;
+    }
+
+  header = (spool_record_t *)((char *)writer->header
+                              + writer->header->write_offset);
+  header->time = time (0);
+  header->length = length;
+  memcpy (header + 1, record, length);
+  writer->header->write_offset += space;
+  ++spool->pending_records;
+  spool->pending_bytes += length;
+
+  pthread_mutex_unlock (&spool->lock);
+}
+
+/* Adds tokens to SPOOL for the time elapsed since the last call.  At
+   most 100 milliseconds worth of records can be replayed in a
+   burst. */
+static void
+refill (spool_t *spool)
+{
+  unsigned long now = now_ms ();
+  unsigned long limit = replay_rate * 100;
+
+  if (limit < 1000)
+    limit = 1000;
+  spool->tokens += (now - spool->last_refill) * replay_rate;
+  if (spool->tokens > limit)
+    spool->tokens = limit;
+  spool->last_refill = now;
+}
+
+int
+spool_replay (spool_t *spool, forward_t *record, forward_t **large,
+              size_t *length)
+{
+  segment_t *reader = &spool->reader;
+  int result = 0;
+
+  pthread_mutex_lock (&spool->lock);
+  if (spool->pending_records == 0)
+    goto out;
+  if (spool->tokens < 1000)
+    {
+      refill (spool);
+      if (spool->tokens < 1000)
+        goto out;
+    }
+
+  while (spool->first_segment != spool->next_segment)
+    {
+      spool_header_t *segment;
+
+      if (reader->header == 0 || reader->number != spool->first_segment)
+        {
+          segment_unmap (reader);
+          if (segment_map (spool, reader, spool->first_segment, 0) < 0)
+            {
+              /* Skip unusable segments. */
+              segment_discard_first (spool);
+              continue;
+            }
+        }
+
+      segment = reader->header;
+      if (segment->read_offset < segment->write_offset)
+        {
+          const spool_record_t *header
+            = segment_record (segment, segment->read_offset);
+
+          if (UNLIKELY (header == 0 || header->length > FORWARD_MAX_RECORD))
+            {
+              syslog (LOG_ERR, "spool segment %s/%08x is corrupted",
+                      spool->name, reader->number);
+              segment_discard_first (spool);
+              continue;
+            }
+          *length = header->length;
+          *large = 0;
+          if (UNLIKELY (FORWARD_RECORD_LARGE (*length)))
+            record = *large = forward_record_allocate (*length);
+          memcpy (record, header + 1, *length);
+          segment->read_offset += RECORD_SPACE (*length);
+          --spool->pending_records;
+          spool->pending_bytes -= *length;
+          spool->tokens -= 1000;
+          result = 1;
+          break;
+        }
+
+      /* Keep the newest segment, records are still appended to it. */
+      if (spool->first_segment + 1 == spool->next_segment)
+        break;
+      segment_discard_first (spool);
+    }
+
+ out:
+  pthread_mutex_unlock (&spool->lock);
+  return result;
+}
+
+int
+spool_pending (spool_t *spool)
+{
+  return __atomic_load_n (&spool->pending_records, __ATOMIC_RELAXED) > 0;
+}
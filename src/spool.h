@@ -0,0 +1,68 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include "config.h"
+#include "forward.h"
+
+/* The spool stores records which could not be sent to a dnslogger
+   server in a directory on disk, so that they can be replayed once
+   the server is reachable again.  The spool is a ring of
+   memory-mapped, append-only segment files, which survive a restart
+   of the program.  Each forward target has its own spool, in a
+   subdirectory of the spool directory.  All functions can be called
+   from multiple threads. */
+
+void spool_configure (const char *spec);
+/* Enables the spool.  SPEC is the spool directory, optionally
+   followed by a comma and a list of options: "size=BYTES" (the size
+   limit for each target), "segment=BYTES" (the size of a single
+   segment file) and "rate=N" (the number of records replayed per
+   second, for each target).
+   Terminates the program on error. */
+
+int spool_enabled (void);
+/* Returns nonzero if the spool has been configured. */
+
+typedef struct spool spool_t;
+/* The spool of a single forward target. */
+
+spool_t *spool_open (const char *name);
+/* Opens the subdirectory NAME of the spool directory (creating it if
+   necessary), and recovers the segments left over by a previous run.
+   Terminates the program on error. */
+
+void spool_append (spool_t *spool, const forward_t *record, size_t length);
+/* Appends RECORD, which is LENGTH bytes long, to SPOOL.  If SPOOL is
+   full, its oldest segment is discarded. */
+
+int spool_replay (spool_t *spool, forward_t *record, forward_t **large,
+                  size_t *length);
+/* Removes the oldest record from SPOOL and copies it to RECORD and
+   its length to *LENGTH.  A record which is too large for RECORD is
+   copied to a newly allocated buffer, which is stored in *LARGE (and
+   *LARGE is set to a null pointer for other records).  Returns zero
+   if SPOOL is empty, or if the replay rate does not permit another
+   record yet. */
+
+int spool_pending (spool_t *spool);
+/* Returns nonzero if SPOOL contains records. */
+
+#endif /* SPOOL_H */
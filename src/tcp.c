@@ -0,0 +1,694 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "tcp.h"
+#include "ansidecl.h"
+#include "checkpoint.h"
+#include "log.h"
+#include "option.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define WHEEL_SLOTS 64
+/* Number of slots in the timer wheel (one per second).  The timeout
+   must be smaller. */
+
+#define NONE UINT32_MAX
+/* End of a list of connections. */
+
+#define INITIAL_CAPACITY 1024
+/* Size of the first stream buffer of a connection. */
+
+typedef struct segment
+{
+  struct segment *next;
+  uint32_t sequence;
+  uint32_t length;
+  char data[];
+} segment_t;
+/* Data received ahead of a gap in the stream. */
+
+#define SEGMENT_SIZE(LENGTH) (sizeof (segment_t) + (LENGTH))
+/* Memory charged for a segment with LENGTH bytes of data. */
+
+typedef struct
+{
+  uint32_t hash_next;           /* hash chain, or the free list */
+  uint32_t wheel_next;
+  uint32_t wheel_prev;          /* list of connections expiring in the same slot */
+  uint32_t expires;             /* in seconds */
+  uint32_t hash;
+  uint32_t sequence;            /* sequence number of the next in-order byte */
+  uint8_t family;               /* 4 or 6 */
+  uint8_t closing;              /* FIN received, release after the last message */
+  uint16_t source_port;
+  uint16_t destination_port;
+  unsigned char source[16];
+  unsigned char destination[16]; /* IPv4 addresses use the first four bytes */
+
+  char *data;
+  uint32_t start;               /* offset of the first unconsumed byte */
+  uint32_t length;              /* offset of the end of the data */
+  uint32_t capacity;
+  /* The in-order stream data which has not been returned yet.  It
+     starts with the length prefix of a DNS message. */
+
+  segment_t *pending;           /* sorted by sequence number */
+  uint32_t pending_size;        /* memory charged for PENDING */
+} flow_t;
+/* A TCP connection, in the direction from the responder to the
+   initiator. */
+
+typedef struct
+{
+  flow_t *flows;
+  uint32_t *buckets;
+  uint32_t mask;                /* of BUCKETS */
+  uint32_t free;
+  uint32_t wheel[WHEEL_SLOTS];
+  uint32_t time;                /* the time up to which the wheel has expired */
+  size_t memory;                /* stream buffers and out-of-order segments */
+  uint32_t current;             /* the connection of the last segment, or NONE */
+} table_t;
+/* The stream state of a thread.  The connection table is allocated
+   on the first segment, stream data on demand.  */
+
+static size_t tcp_memory = 4 << 20;
+static unsigned tcp_flows = 1024;
+static unsigned tcp_timeout = 30;
+static size_t tcp_out_of_order = 16 << 10;
+/* Settings from the command line. */
+
+static __thread table_t *table;
+
+enum
+  {
+    STAT_MESSAGES,
+    STAT_TIMEOUTS,
+    STAT_EVICTIONS,
+    STAT_REJECTED,
+    STATS
+  };
+
+static checkpoint_counters_t counters;
+static __thread checkpoint_thread_t *local_counters;
+/* The counters of the calling thread, in COUNTERS. */
+
+void
+tcp_configure (const char *spec)
+{
+  char *copy = strdup (spec);
+  char *options = strchr (copy, ',');
+  char *name, *value;
+
+  if (options)
+    *options++ = 0;
+
+  tcp_memory = option_size ("-R", copy);
+  while (option_next (&options, &name, &value))
+    if (strcmp (name, "flows") == 0)
+      tcp_flows = option_unsigned (name, value);
+    else if (strcmp (name, "timeout") == 0)
+      tcp_timeout = option_unsigned (name, value);
+    else if (strcmp (name, "out-of-order") == 0)
+      tcp_out_of_order = option_size (name, value);
+    else
+      option_unknown ("-R", name);
+  free (copy);
+
+  if (tcp_flows == 0 || tcp_flows > (1U << 24))
+    log_fatal ("The number of TCP connections must be between 1 and %u.",
+               1U << 24);
+  if (tcp_timeout == 0 || tcp_timeout >= WHEEL_SLOTS)
+    log_fatal ("The TCP timeout must be between 1 and %u seconds.",
+               WHEEL_SLOTS - 1);
+}
+
+static void
+report (checkpoint_t *checkpoint)
+{
+  unsigned long deltas[STATS];
+
+  checkpoint_deltas (&counters, deltas, STATS);
+  checkpoint_printf (checkpoint, ", %lu TCP messages, "
+                     "%lu TCP timeouts/%lu evictions/%lu rejected",
+                     deltas[STAT_MESSAGES], deltas[STAT_TIMEOUTS],
+                     deltas[STAT_EVICTIONS], deltas[STAT_REJECTED]);
+}
+
+void
+tcp_init (void)
+{
+  if (tcp_memory > 0)
+    checkpoint_register (report);
+}
+
+void
+tcp_statistics (unsigned long *messages, unsigned long *timeouts,
+                unsigned long *evictions, unsigned long *rejected)
+{
+  *messages = checkpoint_counter (&counters, STAT_MESSAGES);
+  *timeouts = checkpoint_counter (&counters, STAT_TIMEOUTS);
+  *evictions = checkpoint_counter (&counters, STAT_EVICTIONS);
+  *rejected = checkpoint_counter (&counters, STAT_REJECTED);
+}
+
+/* Allocates the table of the calling thread. */
+static table_t *
+table_create (void)
+{
+  table_t *t;
+  uint32_t size = 1;
+  uint32_t j;
+
+  while (size < tcp_flows)
+    size *= 2;
+
+  t = calloc (1, sizeof (*t));
+  if (t == 0
+      || (t->flows = calloc (tcp_flows, sizeof (*t->flows))) == 0
+      || (t->buckets = malloc (size * sizeof (*t->buckets))) == 0)
+    log_fatal ("Out of memory.");
+  t->mask = size - 1;
+  for (j = 0; j < size; ++j)
+    t->buckets[j] = NONE;
+  for (j = 0; j < WHEEL_SLOTS; ++j)
+    t->wheel[j] = NONE;
+  for (j = 0; j < tcp_flows; ++j)
+    t->flows[j].hash_next = j + 1 < tcp_flows ? j + 1 : NONE;
+  t->free = 0;
+  t->current = NONE;
+  t->time = checkpoint_seconds ();
+  return t;
+}
+
+/* Hashes LENGTH bytes at DATA, starting with HASH. */
+static inline uint32_t
+hash_bytes (uint32_t hash, const unsigned char *data, unsigned length)
+{
+  unsigned j;
+
+  for (j = 0; j < length; ++j)
+    hash = (hash ^ data[j]) * 16777619U;
+  return hash;
+}
+
+/* Puts connection INDEX into the wheel slot of its expiry time. */
+static void
+wheel_link (table_t *t, uint32_t index)
+{
+  flow_t *f = t->flows + index;
+
+  f->wheel_prev = NONE;
+  f->wheel_next = t->wheel[f->expires % WHEEL_SLOTS];
+  if (f->wheel_next != NONE)
+    t->flows[f->wheel_next].wheel_prev = index;
+  t->wheel[f->expires % WHEEL_SLOTS] = index;
+}
+
+/* Removes connection INDEX from the timer wheel. */
+static void
+wheel_unlink (table_t *t, uint32_t index)
+{
+  flow_t *f = t->flows + index;
+
+  if (f->wheel_prev == NONE)
+    t->wheel[f->expires % WHEEL_SLOTS] = f->wheel_next;
+  else
+    t->flows[f->wheel_prev].wheel_next = f->wheel_next;
+  if (f->wheel_next != NONE)
+    t->flows[f->wheel_next].wheel_prev = f->wheel_prev;
+}
+
+/* Restarts the idle timeout of connection INDEX. */
+static void
+touch (table_t *t, uint32_t index)
+{
+  wheel_unlink (t, index);
+  t->flows[index].expires = t->time + tcp_timeout;
+  wheel_link (t, index);
+}
+
+/* Removes connection INDEX from the hash table and the timer wheel,
+   frees its buffers, and puts it on the free list. */
+static void
+release (table_t *t, uint32_t index)
+{
+  flow_t *f = t->flows + index;
+  uint32_t *link = t->buckets + (f->hash & t->mask);
+  segment_t *s;
+
+  while (*link != index)
+    link = &t->flows[*link].hash_next;
+  *link = f->hash_next;
+  wheel_unlink (t, index);
+
+  free (f->data);
+  while ((s = f->pending) != 0)
+    {
+      f->pending = s->next;
+      free (s);
+    }
+  t->memory -= f->capacity + f->pending_size;
+  f->data = 0;
+  f->start = f->length = f->capacity = 0;
+  f->pending_size = 0;
+  if (t->current == index)
+    t->current = NONE;
+
+  f->hash_next = t->free;
+  t->free = index;
+}
+
+/* Releases all connections in wheel slot SLOT, counting them as
+   timeouts. */
+static void
+expire_slot (table_t *t, unsigned slot)
+{
+  while (t->wheel[slot] != NONE)
+    {
+      release (t, t->wheel[slot]);
+      CHECKPOINT_COUNT (&counters, local_counters, STAT_TIMEOUTS);
+    }
+}
+
+/* Expires the connections which have been idle for the timeout at
+   time NOW. */
+static void
+advance (table_t *t, uint32_t now)
+{
+  unsigned j;
+
+  if (now - t->time >= WHEEL_SLOTS)
+    {
+      for (j = 0; j < WHEEL_SLOTS; ++j)
+        expire_slot (t, j);
+      t->time = now;
+      return;
+    }
+  while (t->time != now)
+    {
+      ++t->time;
+      expire_slot (t, t->time % WHEEL_SLOTS);
+    }
+}
+
+/* Returns the connection closest to expiry, other than EXCEPT.  If
+   BUFFERED, only connections which hold memory are considered.
+   Returns NONE if there is no such connection. */
+static uint32_t
+victim (table_t *t, uint32_t except, int buffered)
+{
+  uint32_t index;
+  unsigned j;
+
+  for (j = 1; j <= WHEEL_SLOTS; ++j)
+    for (index = t->wheel[(t->time + j) % WHEEL_SLOTS]; index != NONE;
+         index = t->flows[index].wheel_next)
+      if (index != except
+          && (!buffered
+              || t->flows[index].capacity + t->flows[index].pending_size > 0))
+        return index;
+  return NONE;
+}
+
+/* Reserves BYTES of buffer memory for connection INDEX, evicting
+   other connections if necessary.  Returns zero if the memory limit
+   cannot be met. */
+static int
+charge (table_t *t, uint32_t index, size_t bytes)
+{
+  flow_t *f = t->flows + index;
+  uint32_t other;
+
+  if (bytes + f->capacity + f->pending_size > tcp_memory)
+    return 0;
+  while (t->memory + bytes > tcp_memory)
+    {
+      other = victim (t, index, 1);
+      if (other == NONE)
+        return 0;
+      release (t, other);
+      CHECKPOINT_COUNT (&counters, local_counters, STAT_EVICTIONS);
+    }
+  t->memory += bytes;
+  return 1;
+}
+
+/* Rejects a segment for REASON, and releases the connection INDEX (if
+   not NONE). */
+static void *
+reject (table_t *t, uint32_t index, const char *reason)
+{
+  log_debug_maybe (("Discarding TCP segment (%s).", reason));
+  if (index != NONE)
+    release (t, index);
+  CHECKPOINT_COUNT (&counters, local_counters, STAT_REJECTED);
+  return 0;
+}
+
+/* Initializes KEY with the addresses and ports of a connection. */
+static void
+make_key (flow_t *key, unsigned family, const unsigned char *source,
+          const unsigned char *destination, uint16_t source_port,
+          uint16_t destination_port)
+{
+  unsigned size = family == 4 ? 4 : 16;
+
+  key->family = family;
+  key->source_port = source_port;
+  key->destination_port = destination_port;
+  memset (key->source, 0, sizeof (key->source));
+  memset (key->destination, 0, sizeof (key->destination));
+  memcpy (key->source, source, size);
+  memcpy (key->destination, destination, size);
+  key->hash = hash_bytes (2166136261U, key->source, sizeof (key->source));
+  key->hash = hash_bytes (key->hash, key->destination,
+                          sizeof (key->destination));
+  key->hash = hash_bytes (key->hash, (const unsigned char *)&key->source_port,
+                          sizeof (key->source_port));
+  key->hash = hash_bytes (key->hash,
+                          (const unsigned char *)&key->destination_port,
+                          sizeof (key->destination_port));
+}
+
+/* Returns the connection matching KEY, or NONE. */
+static uint32_t
+lookup (table_t *t, const flow_t *key)
+{
+  uint32_t index;
+  flow_t *f;
+
+  for (index = t->buckets[key->hash & t->mask]; index != NONE;
+       index = f->hash_next)
+    {
+      f = t->flows + index;
+      if (f->hash == key->hash && f->family == key->family
+          && f->source_port == key->source_port
+          && f->destination_port == key->destination_port
+          && memcmp (f->source, key->source, sizeof (f->source)) == 0
+          && memcmp (f->destination, key->destination,
+                     sizeof (f->destination)) == 0)
+        return index;
+    }
+  return NONE;
+}
+
+/* Adds a connection for KEY, whose next byte has sequence number
+   SEQUENCE, evicting the one closest to expiry if the table is
+   full. */
+static void
+insert (table_t *t, const flow_t *key, uint32_t sequence)
+{
+  uint32_t index;
+  flow_t *f;
+
+  if (t->free == NONE)
+    {
+      release (t, victim (t, NONE, 0));
+      CHECKPOINT_COUNT (&counters, local_counters, STAT_EVICTIONS);
+    }
+  index = t->free;
+  f = t->flows + index;
+  t->free = f->hash_next;
+
+  f->hash = key->hash;
+  f->family = key->family;
+  f->source_port = key->source_port;
+  f->destination_port = key->destination_port;
+  memcpy (f->source, key->source, sizeof (f->source));
+  memcpy (f->destination, key->destination, sizeof (f->destination));
+  f->sequence = sequence;
+  f->closing = 0;
+  f->pending = 0;
+
+  f->hash_next = t->buckets[key->hash & t->mask];
+  t->buckets[key->hash & t->mask] = index;
+  f->expires = t->time + tcp_timeout;
+  wheel_link (t, index);
+}
+
+/* Appends LENGTH bytes of in-order DATA to the stream buffer of
+   connection INDEX.  Returns zero if the memory limit does not
+   permit it. */
+static int
+append (table_t *t, uint32_t index, const char *data, uint32_t length)
+{
+  flow_t *f = t->flows + index;
+  uint32_t capacity;
+  char *buffer;
+
+  /* Messages which have been returned are discarded first. */
+  if (f->start > 0)
+    {
+      memmove (f->data, f->data + f->start, f->length - f->start);
+      f->length -= f->start;
+      f->start = 0;
+    }
+
+  if (f->length + length > f->capacity)
+    {
+      capacity = f->capacity ? f->capacity : INITIAL_CAPACITY;
+      while (capacity < f->length + length)
+        capacity *= 2;
+      if (!charge (t, index, capacity - f->capacity))
+        return 0;
+      buffer = realloc (f->data, capacity);
+      if (buffer == 0)
+        log_fatal ("Out of memory.");
+      f->data = buffer;
+      f->capacity = capacity;
+    }
+
+  memcpy (f->data + f->length, data, length);
+  f->length += length;
+  f->sequence += length;
+  return 1;
+}
+
+/* Keeps LENGTH bytes of DATA at SEQUENCE, which is ahead of the next
+   in-order byte of connection INDEX, until the gap has been
+   filled. */
+static void
+store (table_t *t, uint32_t index, uint32_t sequence, const char *data,
+       uint32_t length)
+{
+  flow_t *f = t->flows + index;
+  segment_t *s, **link;
+
+  if (f->pending_size + SEGMENT_SIZE (length) > tcp_out_of_order
+      || sequence - f->sequence > tcp_out_of_order
+      || !charge (t, index, SEGMENT_SIZE (length)))
+    {
+      reject (t, NONE, "out of order");
+      return;
+    }
+
+  s = malloc (SEGMENT_SIZE (length));
+  if (s == 0)
+    log_fatal ("Out of memory.");
+  s->sequence = sequence;
+  s->length = length;
+  memcpy (s->data, data, length);
+  for (link = &f->pending;
+       *link != 0 && (int32_t)((*link)->sequence - sequence) <= 0;
+       link = &(*link)->next)
+    ;
+  s->next = *link;
+  *link = s;
+  f->pending_size += SEGMENT_SIZE (length);
+}
+
+/* Appends the out-of-order segments of connection INDEX which are no
+   longer ahead of the stream.  Returns zero if the connection has
+   been released. */
+static int
+merge (table_t *t, uint32_t index)
+{
+  flow_t *f = t->flows + index;
+  segment_t *s;
+  uint32_t behind;
+  int ok;
+
+  while (f->pending != 0
+         && (int32_t)(f->pending->sequence - f->sequence) <= 0)
+    {
+      s = f->pending;
+      f->pending = s->next;
+      f->pending_size -= SEGMENT_SIZE (s->length);
+      t->memory -= SEGMENT_SIZE (s->length);
+
+      /* Retransmissions overlap data which has already arrived. */
+      behind = f->sequence - s->sequence;
+      ok = behind >= s->length
+        || append (t, index, s->data + behind, s->length - behind);
+      free (s);
+      if (!ok)
+        {
+          reject (t, index, "memory limit");
+          return 0;
+        }
+    }
+  return 1;
+}
+
+/* Returns the next complete message of the current connection, or a
+   null pointer. */
+static const char *
+next_message (table_t *t, size_t *message_length)
+{
+  flow_t *f;
+  const unsigned char *p;
+  uint32_t length;
+
+  if (t->current == NONE)
+    return 0;
+  f = t->flows + t->current;
+  if (f->length - f->start < 2)
+    return 0;
+  p = (const unsigned char *)f->data + f->start;
+  length = (p[0] << 8) | p[1];
+  if (f->length - f->start < 2 + length)
+    return 0;
+
+  /* The message stays in the buffer until the next segment is
+     appended. */
+  f->start += 2 + length;
+  *message_length = length;
+  CHECKPOINT_COUNT (&counters, local_counters, STAT_MESSAGES);
+  return (const char *)p + 2;
+}
+
+/* Ends the processing of the current connection, once all messages
+   have been returned.  A closed connection is released, and an empty
+   stream buffer is freed, so that idle connections do not hold
+   memory. */
+static void
+finish (table_t *t)
+{
+  flow_t *f;
+
+  if (t->current == NONE)
+    return;
+  f = t->flows + t->current;
+  if (f->closing)
+    release (t, t->current);
+  else if (f->start == f->length && f->data != 0)
+    {
+      free (f->data);
+      t->memory -= f->capacity;
+      f->data = 0;
+      f->start = f->length = f->capacity = 0;
+    }
+  t->current = NONE;
+}
+
+const char *
+tcp_segment (unsigned family, const unsigned char *source,
+             const unsigned char *destination, const tcp_header_t *header,
+             const char *data, size_t length, size_t *message_length)
+{
+  table_t *t = table;
+  flow_t key;
+  uint32_t index, behind;
+  const char *message;
+  flow_t *f;
+
+  if (UNLIKELY (t == 0))
+    {
+      if (tcp_memory == 0)
+        return reject (0, NONE, "reassembly disabled");
+      t = table = table_create ();
+    }
+  finish (t);
+  advance (t, checkpoint_seconds ());
+
+  make_key (&key, family, source, destination,
+            header->source_port, header->destination_port);
+  index = lookup (t, &key);
+
+  /* A reset from either side ends the connection. */
+  if (UNLIKELY (header->flags & TCP_RST))
+    {
+      if (index == NONE)
+        {
+          make_key (&key, family, destination, source,
+                    header->destination_port, header->source_port);
+          index = lookup (t, &key);
+        }
+      if (index != NONE)
+        release (t, index);
+      return 0;
+    }
+
+  /* The SYN+ACK segment of the responder starts tracking (a SYN
+     alone does not, so that a SYN flood does not fill the table).
+     The sequence number of the SYN is not part of the stream. */
+  if ((header->flags & (TCP_SYN | TCP_ACK)) == (TCP_SYN | TCP_ACK))
+    {
+      if (index != NONE)
+        {
+          if (t->flows[index].sequence == header->sequence + 1)
+            return 0;
+          release (t, index);
+        }
+      insert (t, &key, header->sequence + 1);
+      return 0;
+    }
+  if (index == NONE || UNLIKELY (header->flags & TCP_SYN))
+    return 0;
+
+  f = t->flows + index;
+  touch (t, index);
+  behind = f->sequence - header->sequence;
+  if (UNLIKELY (length > 65535))
+    return reject (t, index, "too large");
+  if (length == 0 || (behind < (1U << 31) && behind >= length))
+    ;                           /* no new data */
+  else if (UNLIKELY (behind >= (1U << 31)))
+    store (t, index, header->sequence, data, length);
+  else if (!append (t, index, data + behind, length - behind))
+    return reject (t, index, "memory limit");
+  else if (!merge (t, index))
+    return 0;
+
+  if ((header->flags & TCP_FIN)
+      && (int32_t)(f->sequence - (header->sequence + length)) >= 0)
+    f->closing = 1;
+
+  t->current = index;
+  message = next_message (t, message_length);
+  if (message == 0)
+    finish (t);
+  return message;
+}
+
+const char *
+tcp_next (size_t *message_length)
+{
+  table_t *t = table;
+  const char *message;
+
+  if (t == 0)
+    return 0;
+  message = next_message (t, message_length);
+  if (message == 0)
+    finish (t);
+  return message;
+}
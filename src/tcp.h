@@ -0,0 +1,63 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef TCP_H
+#define TCP_H
+
+#include "config.h"
+#include "ipv4.h"
+
+void tcp_configure (const char *spec);
+/* Configures TCP stream reassembly.  SPEC is the memory limit for
+   buffered stream data per capture worker (zero disables
+   reassembly), optionally followed by ",flows=N" (the number of
+   connections tracked per worker), ",timeout=SECS" (the idle
+   timeout) and ",out-of-order=BYTES" (the data buffered per
+   connection ahead of a gap).  Terminates the program on error. */
+
+void tcp_init (void);
+/* Registers the checkpoint reporter.  Must be called before the
+   capture workers are started. */
+
+const char *tcp_segment (unsigned family, const unsigned char *source,
+                         const unsigned char *destination,
+                         const tcp_header_t *header, const char *data,
+                         size_t length, size_t *message_length);
+/* Adds the TCP segment with the decoded HEADER and LENGTH bytes of
+   DATA to the stream table of the calling thread.  FAMILY is 4 or 6,
+   and SOURCE and DESTINATION are the IP addresses (4 or 16 bytes, in
+   network byte order).  Connections are tracked from the SYN+ACK
+   segment on, in the direction of the responder.  If the segment
+   completes a DNS message (which is preceded by its length on the
+   stream), returns a pointer to it and stores its length in
+   *MESSAGE_LENGTH.  The message remains valid until the next call
+   from the same thread.  Otherwise, returns a null pointer. */
+
+const char *tcp_next (size_t *message_length);
+/* Returns the next DNS message completed by the last segment passed
+   to tcp_segment, like tcp_segment, or a null pointer if there are no
+   more messages.  A message remains valid until the next call from
+   the same thread. */
+
+void tcp_statistics (unsigned long *messages, unsigned long *timeouts,
+                     unsigned long *evictions, unsigned long *rejected);
+/* Returns the counters since the start of the program (across all
+   threads).  For testing. */
+
+#endif /* TCP_H */
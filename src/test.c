@@ -17,38 +17,66 @@
  */
 
 #include "test.h"
+#include "capture_file.h"
+#include "compress.h"
 #include "forward.h"
 #include "log.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <unistd.h>
 
+#define RESULT_TIMEOUT 1000
+/* Time (in milliseconds) to wait for a forwarded record to arrive at
+   the test server. */
+
 static unsigned server_port;
 static void start_server (void);
 static void process_stdin (void);
-static void read_result (int fd);
-static void tcp_server (void);
+static void process_file (const char *path);
+static void run_case (const char *name, const char *packet, size_t length);
+static void read_result (int forwarded);
+static void *tcp_server (void *);
 
 static int server_fd;
+static int client_fd = -1;
+static pthread_t server_thread;
+/* The test server.  In TCP mode, CLIENT_FD is the accepted
+   connection. */
+
+static forward_channel_t channel;
+
+static decompress_t *decompress;
+static const char *pending;
+static size_t pending_length;
+/* After the client has requested compression, its decompressor, and
+   the records of the last frame which have not been read yet. */
 
 void
-test_run (void)
+test_run (char **files, unsigned count)
 {
+  unsigned j;
+
   log_debug_enable = 1;
   start_server ();
   forward_target ("127.0.0.1", server_port);
-  forward_open ();
-  process_stdin ();
+  forward_channel_init (&channel, 0);
+  forward_open (&channel);
   if (forward_over_tcp)
-    wait (0);
-  else
-    read_result (server_fd);
+    pthread_join (server_thread, 0);
+
+  if (count == 0)
+    process_stdin ();
+  for (j = 0; j < count; ++j)
+    process_file (files[j]);
 }
 
 static void
@@ -56,7 +84,6 @@ start_server (void)
 {
   struct sockaddr_in sin;
   socklen_t sin_size;
-  int flags;
 
   memset (&sin, 0, sizeof (sin));
   sin.sin_family = AF_INET;
@@ -82,26 +109,14 @@ start_server (void)
       if (listen (server_fd, 0) < 0)
         log_fatal ("could not listen on server socket: %s", strerror (errno));
 
-      result = fork ();
-      if (result < 0)
-        log_fatal ("could not fork TCP server: %s", strerror (errno));
-      if (result == 0)
-        {
-          tcp_server ();
-          _exit (0);
-        }
+      /* forward_open blocks until it has read the banner, so the
+         connection has to be accepted by another thread. */
+      result = pthread_create (&server_thread, 0, tcp_server, 0);
+      if (result != 0)
+        log_fatal ("could not start TCP server: %s", strerror (result));
     }
   else
-    {
-      /* UDP server.  Set non-blocking mode. */
-      flags = fcntl (server_fd, F_GETFL, 0);
-      if (flags == -1)
-        log_fatal ("Could not retrieve UDP server socker flags: %s.",
-                   strerror (errno));
-      if (fcntl (server_fd, F_SETFL, flags | O_NONBLOCK) == -1)
-        log_fatal ("Could not make UDP server socket non-blocking: %s.",
-                   strerror (errno));
-    }
+    client_fd = server_fd;
 }
 
 static void
@@ -115,49 +130,227 @@ process_stdin (void)
   if (length == sizeof (buffer))
     log_fatal ("Buffer full when reading from standard input.");
 
-  forward_process (buffer, length);
+  run_case (0, buffer, length);
 }
 
+typedef struct
+{
+  const char *name;
+  unsigned index;
+} pcap_case_t;
+/* Names the test cases taken from a pcap file. */
+
+/* Runs a test case for a packet from a pcap file (a
+   capture_file_callback_t). */
 static void
-read_result (int fd)
+pcap_case (void *closure, const char *packet, size_t length)
 {
-  char buffer[4096];
+  pcap_case_t *pcap = closure;
+  char name[512];
+
+  snprintf (name, sizeof (name), "%s#%u", pcap->name, ++pcap->index);
+  run_case (name, packet, length);
+}
+
+/* Runs the test cases in the file at PATH.  The file is either a
+   single raw IP packet, or a pcap or pcapng file with one test case
+   per packet.  Test cases are named after the file, without the
+   directory and the ".in" suffix. */
+static void
+process_file (const char *path)
+{
+  static char buffer[65536];
+  char name[256];
+  const char *base = strrchr (path, '/');
+  size_t name_length;
+  int fd, length;
+
+  base = base ? base + 1 : path;
+  name_length = strlen (base);
+  if (name_length > 3 && strcmp (base + name_length - 3, ".in") == 0)
+    name_length -= 3;
+  if (name_length >= sizeof (name))
+    log_fatal ("Test file name '%s' is too long.", path);
+  memcpy (name, base, name_length);
+  name[name_length] = 0;
+
+  fd = open (path, O_RDONLY);
+  if (fd < 0)
+    log_fatal ("Cannot open test file '%s': %s.", path, strerror (errno));
+  length = read (fd, buffer, sizeof (buffer));
+  if (length < 0)
+    log_fatal ("Cannot read test file '%s': %s.", path, strerror (errno));
+  close (fd);
+
+  if (capture_file_detect (buffer, length))
+    {
+      pcap_case_t pcap;
+
+      pcap.name = name;
+      pcap.index = 0;
+      capture_file_each (path, pcap_case, &pcap);
+    }
+  else
+    {
+      if (length == sizeof (buffer))
+        log_fatal ("Test packet '%s' is too long.", path);
+      run_case (name, buffer, length);
+    }
+}
+
+/* Forwards the PACKET and prints the results.  Unless NAME is a null
+   pointer, the results are preceded by a line naming the test
+   case. */
+static void
+run_case (const char *name, const char *packet, size_t length)
+{
+  int forwarded;
+
+  if (name)
+    fprintf (stderr, "==> %s <==\n", name);
+  forwarded = forward_process (&channel, packet, length);
+  forward_flush (&channel);
+  read_result (forwarded);
+  while (--forwarded > 0)
+    read_result (1);
+}
+
+/* Reads LENGTH bytes from the test server connection into BUFFER.
+   Returns the number of bytes read, which is less than LENGTH if
+   nothing more arrives within the timeout.  In UDP mode, a single
+   datagram is read. */
+static size_t
+receive (char *buffer, size_t length, int timeout)
+{
+  size_t received = 0;
+
+  while (received < length)
+    {
+      struct pollfd pfd;
+      ssize_t result;
+
+      pfd.fd = client_fd;
+      pfd.events = POLLIN;
+      if (poll (&pfd, 1, timeout) <= 0)
+        break;
+      result = recv (client_fd, buffer + received, length - received, 0);
+      if (result < 0)
+        log_fatal ("could not receive test packet: %s", strerror (errno));
+      if (result == 0)
+        break;
+      received += result;
+      if (!forward_over_tcp)
+        break;
+    }
+  return received;
+}
+
+/* Reads the next length-prefixed record from the TCP connection into
+   BUFFER (SIZE bytes).  Returns the number of bytes read (including
+   the prefix), which is less than the record length if nothing more
+   arrives within the timeout.  Compressed frames are decoded, so that
+   records are printed as they were before compression. */
+static size_t
+receive_record (char *buffer, size_t size, int timeout)
+{
+  static char *frame;
   size_t length;
-  int result = read (fd, buffer, sizeof (buffer));
 
-  if (result < 0)
+  for (;;)
     {
-      if (LIKELY (errno == EAGAIN || errno == EWOULDBLOCK))
+      if (decompress)
         {
-          log_debug_maybe(("No data received."));
-          return;
+          if (pending_length == 0)
+            {
+              unsigned char prefix[4];
+
+              if (receive ((char *)prefix, 4, timeout) < 4)
+                return 0;
+              length = ((size_t)prefix[0] << 24) | (prefix[1] << 16)
+                | (prefix[2] << 8) | prefix[3];
+              if (length > COMPRESS_MAX_FRAME)
+                log_fatal ("Frame of %u bytes is too long.", (unsigned)length);
+              frame = realloc (frame, length ? length : 1);
+              if (frame == 0)
+                log_fatal ("Out of memory.");
+              if (receive (frame, length, timeout) < length)
+                log_fatal ("Truncated frame.");
+              pending = decompress_frame (decompress, frame, length,
+                                          &pending_length);
+              if (pending == 0)
+                log_fatal ("Invalid compressed frame.");
+              continue;
+            }
+
+          /* Frames contain complete records. */
+          if (pending_length < 2)
+            log_fatal ("Truncated record in frame.");
+          length = 2 + (((unsigned char)pending[0] << 8)
+                        | (unsigned char)pending[1]);
+          if (length > pending_length || length > size)
+            log_fatal ("Invalid record length in frame.");
+          memcpy (buffer, pending, length);
+          pending += length;
+          pending_length -= length;
+          return length;
+        }
+
+      /* Read the length prefix, and then the record. */
+      length = receive (buffer, 2, timeout);
+      if (length == 2)
+        length += receive (buffer + 2,
+                           ((unsigned char)buffer[0] << 8)
+                           | (unsigned char)buffer[1], timeout);
+
+      /* The request for compression is not printed. */
+      if (length == 2 + strlen (COMPRESS_SIGNATURE)
+          && memcmp (buffer + 2, COMPRESS_SIGNATURE, length - 2) == 0)
+        {
+          decompress = decompress_new ();
+          continue;
         }
-      else
-        log_fatal ("Cannot read from standard input: %s.",
-                   strerror (errno));
+      return length;
     }
+}
 
-  length = result;
-  /* If only very few bytes have been received, try again. */
-  if (length < 12)
-    if (read (fd, buffer + length, sizeof (buffer) - length) < 0)
-      log_fatal ("could not receive tet packet: %s", strerror (errno));
+/* Prints the record received by the test server.  If FORWARDED is
+   zero, no record is expected, and the server is not waited for. */
+static void
+read_result (int forwarded)
+{
+  static char buffer[2 + FORWARD_MAX_RECORD + 1];
+  /* The length prefix, the record, and one more byte, so that a full
+     buffer indicates an overlong datagram. */
+  size_t length;
+  int timeout = forwarded ? RESULT_TIMEOUT : 0;
+
+  if (forward_over_tcp)
+    length = receive_record (buffer, sizeof (buffer), timeout);
+  else
+    length = receive (buffer, sizeof (buffer), timeout);
 
+  if (length == 0)
+    {
+      log_debug_maybe(("No data received."));
+      return;
+    }
   if (length == sizeof (buffer))
     log_fatal ("Buffer full when reading from socket.");
 
   log_buffer ("Received data", buffer, length);
 }
 
-static void
-tcp_server (void)
+static void *
+tcp_server (void *closure)
 {
-  static const char banner[] = "dnslogger test server\r\n";
-  int client_fd = accept (server_fd, 0, 0);
+  static const char banner[] = "dnslogger test server "
+    COMPRESS_BANNER_TOKEN "\r\n";
 
+  (void)closure;
+  client_fd = accept (server_fd, 0, 0);
   if (client_fd < 0)
     log_fatal ("could not accept TCP connection: %s", strerror (errno));
   if (write (client_fd, banner, sizeof (banner) - 1) != sizeof (banner) - 1)
     log_fatal ("could not write server banner");
-  read_result (client_fd);
+  return 0;
 }
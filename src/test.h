@@ -19,7 +19,13 @@
 #ifndef TEST_H
 #define TEST_H
 
-void test_run (void);
-/* Reads a test packet from standard input and prints the results. */
+void test_run (char **files, unsigned count);
+/* Forwards test packets to a local test server and prints the
+   results.  If COUNT is zero, a single raw IP packet is read from
+   standard input.  Otherwise, the COUNT FILES are processed in order,
+   within the same process and with the same server connection.  Each
+   file contains a raw IP packet, or it is a pcap or pcapng file with
+   many packets.  The results for each packet are preceded by a line
+   "==> NAME <==". */
 
 #endif /* TEST_H */
@@ -0,0 +1,241 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "tunnel.h"
+#include "ansidecl.h"
+#include "ipv6.h"
+#include "link.h"
+#include "log.h"
+#include "option.h"
+
+#include <pcap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+unsigned tunnel_depth = 0;
+
+static unsigned vxlan_port = 4789;
+/* UDP destination port of VXLAN packets. */
+
+static link_decoder_t ethernet;
+/* Decoder for encapsulated Ethernet frames. */
+
+void
+tunnel_configure (const char *spec)
+{
+  char *copy = strdup (spec);
+  char *options = strchr (copy, ',');
+  char *name, *value;
+
+  if (options)
+    *options++ = 0;
+
+  tunnel_depth = option_unsigned ("-e", copy);
+  if (tunnel_depth > 8)
+    log_fatal ("The tunnel nesting depth must be at most 8.");
+
+  while (option_next (&options, &name, &value))
+    if (strcmp (name, "vxlan") == 0)
+      {
+        vxlan_port = option_unsigned (name, value);
+        if (vxlan_port == 0 || vxlan_port > 65535)
+          log_fatal ("Invalid VXLAN port %u.", vxlan_port);
+      }
+    else
+      option_unknown ("-e", name);
+  free (copy);
+
+  ethernet = link_decoder (DLT_EN10MB);
+}
+
+const char *
+tunnel_filter (const char *filter)
+{
+  static char buffer[1024];
+
+  if (tunnel_depth == 0)
+    return filter;
+  if (snprintf (buffer, sizeof (buffer), "(%s) or proto gre or (udp and dst port %u)",
+                filter, vxlan_port) >= (int)sizeof (buffer))
+    log_fatal ("Filter expression is too long.");
+  return buffer;
+}
+
+/* Returns the payload of the outer IP packet at PACKET (*LENGTH
+   bytes), and stores the payload length in *LENGTH and the protocol
+   in *PROTOCOL.  Returns a null pointer if the packet cannot carry a
+   tunnel (it is not IP, or truncated, or a fragment). */
+static const char *
+ip_payload (const char *packet, size_t *length, unsigned *protocol)
+{
+  const unsigned char *p = (const unsigned char *)packet;
+  unsigned header_length, total_length;
+
+  if (UNLIKELY (*length < 20))
+    return 0;
+
+  if ((p[0] >> 4) == 4)
+    {
+      header_length = (p[0] & 0x0F) * 4;
+      total_length = (p[2] << 8) | p[3];
+      /* Fragments (more fragments, or a nonzero offset) are not
+         reassembled. */
+      if (UNLIKELY (header_length < 20 || total_length < header_length
+                    || total_length > *length
+                    || (((p[6] << 8) | p[7]) & 0x3FFF) != 0))
+        return 0;
+      *protocol = p[9];
+      *length = total_length - header_length;
+      return packet + header_length;
+    }
+
+  if ((p[0] >> 4) == 6)
+    {
+      ipv6_header_t header;
+
+      if (!ipv6_header_decode (packet, *length, &header) || header.fragment)
+        return 0;
+      *protocol = header.protocol;
+      *length = IPV6_TOTAL_LENGTH (header) - header.header_length;
+      return packet + header.header_length;
+    }
+
+  return 0;
+}
+
+/* Strips the GRE header (and the ERSPAN header, if any) at PACKET
+   (*LENGTH bytes).  See tunnel_decapsulate. */
+static const char *
+decapsulate_gre (const char *packet, size_t *length)
+{
+  const unsigned char *p = (const unsigned char *)packet;
+  unsigned flags, protocol, header_length = 4;
+
+  if (UNLIKELY (*length < 4))
+    return 0;
+  flags = (p[0] << 8) | p[1];
+  protocol = (p[2] << 8) | p[3];
+
+  /* Only version 0 without source routing is supported.  The
+     checksum, key and sequence number fields are optional. */
+  if (UNLIKELY ((flags & 0x4007) != 0))
+    return 0;
+  if (flags & 0x8000)
+    header_length += 4;
+  if (flags & 0x2000)
+    header_length += 4;
+  if (flags & 0x1000)
+    header_length += 4;
+
+  switch (protocol)
+    {
+    case 0x0800:                /* IPv4 */
+    case 0x86DD:                /* IPv6 */
+      if (UNLIKELY (*length < header_length))
+        return 0;
+      *length -= header_length;
+      return packet + header_length;
+
+    case 0x6558:                /* transparent Ethernet bridging */
+      break;
+
+    case 0x88BE:
+      /* ERSPAN type II has a sequence number and an 8-byte header,
+         type I has neither. */
+      if (flags & 0x1000)
+        header_length += 8;
+      break;
+
+    case 0x22EB:
+      /* ERSPAN type III, with a 12-byte header, and an optional 8-byte
+         platform specific subheader.  Only Ethernet frames (frame type
+         zero) are supported. */
+      if (UNLIKELY (*length < header_length + 12
+                    || ((p[header_length + 10] >> 2) & 0x1F) != 0))
+        return 0;
+      if (p[header_length + 11] & 0x01)
+        header_length += 8;
+      header_length += 12;
+      break;
+
+    default:
+      return 0;
+    }
+
+  if (UNLIKELY (*length < header_length))
+    return 0;
+  *length -= header_length;
+  return ethernet (packet + header_length, length);
+}
+
+/* Strips the UDP and VXLAN headers at PACKET (*LENGTH bytes).  See
+   tunnel_decapsulate. */
+static const char *
+decapsulate_vxlan (const char *packet, size_t *length)
+{
+  const unsigned char *p = (const unsigned char *)packet;
+  unsigned udp_length;
+
+  /* The UDP checksum is not verified; it is usually zero. */
+  if (UNLIKELY (*length < 16))
+    return 0;
+  udp_length = (p[4] << 8) | p[5];
+  if (UNLIKELY (udp_length < 16 || udp_length > *length))
+    return 0;
+
+  /* The I flag indicates a valid VXLAN network identifier. */
+  if (UNLIKELY ((p[8] & 0x08) == 0))
+    return 0;
+  *length = udp_length - 16;
+  return ethernet (packet + 16, length);
+}
+
+const char *
+tunnel_decapsulate (const char *packet, size_t *length)
+{
+  unsigned depth;
+
+  for (depth = 0; depth < tunnel_depth; ++depth)
+    {
+      size_t inner_length = *length;
+      unsigned protocol;
+      const char *inner = ip_payload (packet, &inner_length, &protocol);
+      const unsigned char *p = (const unsigned char *)inner;
+
+      if (inner == 0)
+        break;
+      if (protocol == 47)
+        inner = decapsulate_gre (inner, &inner_length);
+      else if (protocol == 17 && inner_length >= 8
+               && ((p[2] << 8) | p[3]) == vxlan_port)
+        inner = decapsulate_vxlan (inner, &inner_length);
+      else
+        break;
+
+      if (UNLIKELY (inner == 0))
+        {
+          log_debug_maybe (("Invalid tunnel header (protocol %u, depth %u).",
+                            protocol, depth + 1));
+          return 0;
+        }
+      packet = inner;
+      *length = inner_length;
+    }
+  return packet;
+}
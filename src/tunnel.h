@@ -0,0 +1,48 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef TUNNEL_H
+#define TUNNEL_H
+
+#include "config.h"
+
+#include <stddef.h>
+
+extern unsigned tunnel_depth;
+/* Maximum number of tunnel headers which are stripped from a packet.
+   Zero (the default) disables decapsulation. */
+
+void tunnel_configure (const char *spec);
+/* Enables decapsulation.  SPEC is the maximum nesting depth,
+   optionally followed by ",vxlan=PORT" (the VXLAN UDP port, default
+   4789).  Terminates the program on error. */
+
+const char *tunnel_filter (const char *filter);
+/* Returns FILTER, extended so that it also matches tunneled packets
+   (GRE and VXLAN). */
+
+const char *tunnel_decapsulate (const char *packet, size_t *length);
+/* Strips up to tunnel_depth GRE, ERSPAN (type I, II and III) and
+   VXLAN headers (and the outer IPv4 or IPv6 headers) from the IP
+   packet at PACKET, which is *LENGTH bytes long.  Returns a pointer to
+   the inner IP packet and stores its length in *LENGTH.  Packets which
+   are not tunneled are returned unchanged.  Returns a null pointer if
+   a tunnel header is invalid, or if the encapsulated frame does not
+   carry IP. */
+
+#endif /* TUNNEL_H */
@@ -0,0 +1,543 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "zone.h"
+#include "ansidecl.h"
+#include "checkpoint.h"
+#include "dns.h"
+#include "log.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+/* The zones are stored as a trie over the labels of the names, from
+   the root downwards.  The nodes are kept in an open-addressed hash
+   table keyed by the hash of the label sequence, so that looking up
+   the next label is a single probe in the common case, and no
+   pointers need to be chased.  A node exists for every suffix of a
+   listed zone, which allows the search to stop at the first missing
+   suffix. */
+
+enum
+  {
+    ACTION_NONE,                /* only a suffix of a listed zone */
+    ACTION_INCLUDE,
+    ACTION_EXCLUDE
+  };
+
+typedef struct
+{
+  uint64_t hash;                /* zero for an empty slot */
+  uint32_t name;                /* offset of the suffix in NAMES */
+  uint8_t length;               /* length of the suffix in wire format */
+  uint8_t action;
+} node_t;
+
+typedef struct
+{
+  node_t *nodes;
+  uint32_t mask;
+  unsigned char *names;         /* the zones in lower-case wire format */
+  unsigned zones;
+  unsigned root;                /* action for the root zone */
+  int includes;                 /* nonzero if some zone is included */
+  unsigned references;          /* protected by LOCK */
+} set_t;
+/* The compiled zone lists.  A set is never modified after it has been
+   published. */
+
+const char *zone_file = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static set_t *current_set;
+/* The set used for new lookups, protected by LOCK.  It holds one
+   reference. */
+
+static unsigned generation;
+/* Incremented (under LOCK) whenever CURRENT_SET changes. */
+
+enum
+  {
+    STAT_INCLUDED,
+    STAT_EXCLUDED,
+    STAT_UNLISTED,
+    STATS
+  };
+
+static checkpoint_counters_t counters;
+static __thread checkpoint_thread_t *local_counters;
+/* The counters of the calling thread, in COUNTERS. */
+
+static __thread set_t *local;
+static __thread unsigned local_generation;
+/* The set used by this thread and the version it corresponds to. */
+
+static char error[256];
+/* The description of the last error of set_load. */
+
+#define FNV_OFFSET 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+/* Extends the hash H (of the labels closer to the root) by the label
+   at LABEL, which is in lower case.  Never returns zero. */
+static inline uint64_t
+hash_label (uint64_t h, const unsigned char *label)
+{
+  unsigned j;
+
+  for (j = 0; j <= label[0]; ++j)
+    h = (h ^ label[j]) * FNV_PRIME;
+  return h | 1;
+}
+
+/* Stores the offsets of the labels of the wire-format NAME in
+   STARTS, and returns their number (excluding the root label). */
+static unsigned
+label_starts (const unsigned char *name, unsigned char *starts)
+{
+  unsigned count = 0, p = 0;
+
+  while (name[p] != 0)
+    {
+      starts[count++] = p;
+      p += name[p] + 1;
+    }
+  return count;
+}
+
+static void
+set_free (set_t *set)
+{
+  if (set)
+    {
+      free (set->nodes);
+      free (set->names);
+      free (set);
+    }
+}
+
+/* Returns the node for the suffix of LENGTH bytes at NAME with hash
+   HASH in SET, or a null pointer if there is none.  NAMES is the base
+   of the suffix. */
+static inline node_t *
+set_lookup (const set_t *set, uint64_t hash, const unsigned char *name,
+            unsigned length)
+{
+  uint32_t index = hash;
+
+  for (;; ++index)
+    {
+      node_t *node = set->nodes + (index & set->mask);
+
+      if (node->hash == 0)
+        return 0;
+      if (node->hash == hash && node->length == length
+          && memcmp (set->names + node->name, name, length) == 0)
+        return node;
+    }
+}
+
+/* Converts the domain name TEXT (modified in place) to lower-case
+   wire format in NAME.  Returns the length, or zero if TEXT is not a
+   valid domain name. */
+static unsigned
+name_parse (char *text, unsigned char *name)
+{
+  unsigned length = 0;
+  char *label;
+
+  if (strcmp (text, ".") == 0)
+    {
+      name[0] = 0;
+      return 1;
+    }
+  while (text)
+    {
+      size_t label_length;
+
+      label = text;
+      text = strchr (text, '.');
+      if (text)
+        *text++ = 0;
+      label_length = strlen (label);
+      if (label_length == 0)
+        {
+          /* Only the trailing dot may be followed by an empty
+             label. */
+          if (text || length == 0)
+            return 0;
+          break;
+        }
+      if (label_length > 63 || length + label_length + 2 > DNS_NAME_MAX)
+        return 0;
+      name[length++] = label_length;
+      while (*label)
+        name[length++] = tolower ((unsigned char)*label++);
+    }
+  name[length++] = 0;
+  return length;
+}
+
+typedef struct
+{
+  uint32_t name;
+  uint8_t length;
+  uint8_t action;
+} zone_t;
+/* A line of the zone file. */
+
+/* Reads the zone file.  Returns the set, or a null pointer (and
+   stores the reason in ERROR) on error. */
+static set_t *
+set_load (const char *path)
+{
+  FILE *file = fopen (path, "r");
+  char line[1024];
+  unsigned line_number = 0, j;
+  zone_t *zones = 0;
+  size_t zone_count = 0, zone_size = 0, names_length = 0, names_size = 0;
+  size_t labels = 0, size;
+  set_t *set;
+
+  if (file == 0)
+    {
+      snprintf (error, sizeof (error), "Cannot open zone file '%s': %s.",
+                path, strerror (errno));
+      return 0;
+    }
+
+  set = calloc (1, sizeof (*set));
+  if (set == 0)
+    log_fatal ("Out of memory.");
+
+  while (fgets (line, sizeof (line), file))
+    {
+      char *keyword, *text, *rest, *comment;
+      unsigned char name[DNS_NAME_MAX], starts[DNS_NAME_MAX / 2];
+      unsigned length, action;
+
+      ++line_number;
+      comment = strchr (line, '#');
+      if (comment)
+        *comment = 0;
+      keyword = strtok_r (line, " \t\r\n", &rest);
+      if (keyword == 0)
+        continue;
+      text = strtok_r (0, " \t\r\n", &rest);
+      if (strcmp (keyword, "include") == 0)
+        action = ACTION_INCLUDE;
+      else if (strcmp (keyword, "exclude") == 0)
+        action = ACTION_EXCLUDE;
+      else
+        {
+          snprintf (error, sizeof (error),
+                    "%s:%u: expected 'include' or 'exclude'.",
+                    path, line_number);
+          goto fail;
+        }
+      if (text == 0 || strtok_r (0, " \t\r\n", &rest) != 0
+          || (length = name_parse (text, name)) == 0)
+        {
+          snprintf (error, sizeof (error), "%s:%u: invalid domain name.",
+                    path, line_number);
+          goto fail;
+        }
+
+      if (zone_count == zone_size)
+        {
+          zone_size = zone_size ? 2 * zone_size : 256;
+          zones = realloc (zones, zone_size * sizeof (*zones));
+          if (zones == 0)
+            log_fatal ("Out of memory.");
+        }
+      if (names_length + length > names_size)
+        {
+          names_size = names_size ? 2 * names_size : 4096;
+          set->names = realloc (set->names, names_size);
+          if (set->names == 0)
+            log_fatal ("Out of memory.");
+        }
+      if (names_length > UINT32_MAX - DNS_NAME_MAX)
+        {
+          snprintf (error, sizeof (error), "%s: too many zones.", path);
+          goto fail;
+        }
+      zones[zone_count].name = names_length;
+      zones[zone_count].length = length;
+      zones[zone_count].action = action;
+      ++zone_count;
+      memcpy (set->names + names_length, name, length);
+      names_length += length;
+      labels += label_starts (name, starts);
+    }
+  if (ferror (file))
+    {
+      snprintf (error, sizeof (error), "Cannot read zone file '%s': %s.",
+                path, strerror (errno));
+      goto fail;
+    }
+  fclose (file);
+  file = 0;
+
+  /* At most half of the slots are used. */
+  for (size = 16; size < 2 * labels; size *= 2)
+    ;
+  set->nodes = calloc (size, sizeof (*set->nodes));
+  if (set->nodes == 0)
+    log_fatal ("Out of memory.");
+  set->mask = size - 1;
+  set->zones = zone_count;
+
+  /* Later lines override earlier ones for the same zone. */
+  for (j = 0; j < zone_count; ++j)
+    {
+      const unsigned char *name = set->names + zones[j].name;
+      unsigned char starts[DNS_NAME_MAX / 2];
+      unsigned count = label_starts (name, starts);
+      uint64_t hash = FNV_OFFSET;
+
+      if (zones[j].action == ACTION_INCLUDE)
+        set->includes = 1;
+      if (count == 0)
+        set->root = zones[j].action;
+      while (count > 0)
+        {
+          unsigned start = starts[--count];
+          unsigned length = zones[j].length - start;
+          node_t *node;
+
+          hash = hash_label (hash, name + start);
+          node = set_lookup (set, hash, name + start, length);
+          if (node == 0)
+            {
+              uint32_t index = hash;
+
+              while (set->nodes[index & set->mask].hash != 0)
+                ++index;
+              node = set->nodes + (index & set->mask);
+              node->hash = hash;
+              node->name = zones[j].name + start;
+              node->length = length;
+            }
+          if (count == 0)
+            node->action = zones[j].action;
+        }
+    }
+
+  free (zones);
+  return set;
+
+ fail:
+  if (file)
+    fclose (file);
+  free (zones);
+  set_free (set);
+  return 0;
+}
+
+/* Makes SET the current set. */
+static void
+set_publish (set_t *set)
+{
+  set_t *old;
+
+  set->references = 1;
+  pthread_mutex_lock (&lock);
+  old = current_set;
+  current_set = set;
+  __atomic_store_n (&generation, generation + 1, __ATOMIC_RELEASE);
+  if (old && --old->references == 0)
+    set_free (old);
+  pthread_mutex_unlock (&lock);
+}
+
+/* Switches the calling thread to the current set, and releases the
+   previous one. */
+static void
+set_acquire (void)
+{
+  set_t *old;
+
+  pthread_mutex_lock (&lock);
+  old = local;
+  local = current_set;
+  ++local->references;
+  local_generation = generation;
+  if (old && --old->references == 0)
+    set_free (old);
+  pthread_mutex_unlock (&lock);
+}
+
+void
+zone_configure (const char *path)
+{
+  set_t *set = set_load (path);
+
+  if (set == 0)
+    log_fatal ("%s", error);
+  zone_file = path;
+  set_publish (set);
+}
+
+int
+zone_reload (void)
+{
+  set_t *set = set_load (zone_file);
+
+  if (set == 0)
+    {
+      log_warn ("%s  Keeping the previous zone lists.", error);
+      syslog (LOG_ERR, "%s  Keeping the previous zone lists.", error);
+      return 0;
+    }
+  set_publish (set);
+  syslog (LOG_INFO, "Loaded %u zones from '%s'.", set->zones, zone_file);
+  return 1;
+}
+
+static void
+report (checkpoint_t *checkpoint)
+{
+  unsigned long deltas[STATS];
+
+  checkpoint_deltas (&counters, deltas, STATS);
+  checkpoint_printf (checkpoint, ", zones %lu included/%lu excluded/%lu unlisted",
+                     deltas[STAT_INCLUDED], deltas[STAT_EXCLUDED],
+                     deltas[STAT_UNLISTED]);
+}
+
+void
+zone_statistics (unsigned long *included, unsigned long *excluded,
+                 unsigned long *unlisted)
+{
+  *included = checkpoint_counter (&counters, STAT_INCLUDED);
+  *excluded = checkpoint_counter (&counters, STAT_EXCLUDED);
+  *unlisted = checkpoint_counter (&counters, STAT_UNLISTED);
+}
+
+/* Waits for SIGHUP (which is blocked in all threads) and reloads the
+   zone lists.  The capture workers continue to use the previous lists
+   while the file is being loaded.  Without -Z, the signal is only
+   logged, so that a reload does not terminate the program. */
+static void *
+reload_thread (void *arg)
+{
+  sigset_t signals;
+  int number;
+
+  (void)arg;
+  sigemptyset (&signals);
+  sigaddset (&signals, SIGHUP);
+  for (;;)
+    if (sigwait (&signals, &number) == 0)
+      {
+        if (zone_file == 0)
+          log_warn ("Ignoring SIGHUP because no zone list file is set (-Z).");
+        else
+          zone_reload ();
+      }
+  return 0;
+}
+
+void
+zone_init (void)
+{
+  sigset_t signals;
+  pthread_t thread;
+  int result;
+
+  if (zone_file != 0)
+    checkpoint_register (report);
+
+  /* Threads inherit the signal mask, so SIGHUP is only received by
+     sigwait in the reload thread. */
+  sigemptyset (&signals);
+  sigaddset (&signals, SIGHUP);
+  pthread_sigmask (SIG_BLOCK, &signals, 0);
+  result = pthread_create (&thread, 0, reload_thread, 0);
+  if (result != 0)
+    log_fatal ("Could not create zone reload thread: %s.", strerror (result));
+  pthread_detach (thread);
+}
+
+int
+zone_check (const char *message, size_t length)
+{
+  const set_t *set;
+  unsigned char name[DNS_NAME_MAX], starts[DNS_NAME_MAX / 2];
+  size_t offset = sizeof (dns_header_t), name_length = 0;
+  unsigned labels = 0, action, j;
+  uint64_t hash = FNV_OFFSET;
+
+  if (UNLIKELY (__atomic_load_n (&generation, __ATOMIC_ACQUIRE)
+                != local_generation))
+    set_acquire ();
+  set = local;
+  action = set->root;
+
+  /* QDCOUNT is non-zero. */
+  if (LIKELY (message[4] != 0 || message[5] != 0))
+    name_length = dns_name_decode (message, length, &offset, name);
+  if (LIKELY (name_length != 0))
+    {
+      /* Length bytes are below 'A', so they are not changed. */
+      for (j = 0; j < name_length; ++j)
+        if (name[j] >= 'A' && name[j] <= 'Z')
+          name[j] += 'a' - 'A';
+      labels = label_starts (name, starts);
+    }
+
+  /* Walk down the trie, from the top-level domain.  The deepest zone
+     which is listed wins. */
+  while (labels > 0)
+    {
+      unsigned start = starts[--labels];
+      const node_t *node;
+
+      hash = hash_label (hash, name + start);
+      node = set_lookup (set, hash, name + start, name_length - start);
+      if (node == 0)
+        break;
+      if (node->action != ACTION_NONE)
+        action = node->action;
+    }
+
+  switch (action)
+    {
+    case ACTION_INCLUDE:
+      CHECKPOINT_COUNT (&counters, local_counters, STAT_INCLUDED);
+      return 0;
+    case ACTION_EXCLUDE:
+      CHECKPOINT_COUNT (&counters, local_counters, STAT_EXCLUDED);
+      return 1;
+    default:
+      if (set->includes)
+        {
+          CHECKPOINT_COUNT (&counters, local_counters, STAT_UNLISTED);
+          return 1;
+        }
+      return 0;
+    }
+}
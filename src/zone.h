@@ -0,0 +1,61 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef ZONE_H
+#define ZONE_H
+
+#include "config.h"
+
+extern const char *zone_file;
+/* The file with the zone lists, or a null pointer if there are none
+   (the default). */
+
+void zone_configure (const char *path);
+/* Loads the zone lists from the file PATH.  Each line consists of
+   "include" or "exclude" and a domain name.  A response is dropped if
+   the longest zone which contains its query name is excluded, or if
+   there is no such zone, but some zone is included.  Terminates the
+   program on error. */
+
+void zone_init (void);
+/* Registers the checkpoint reporter (if zone_file is set), and starts
+   a thread which reloads the zone lists on SIGHUP.  Without zone_file,
+   SIGHUP is logged and otherwise ignored.  Must be called before any
+   other thread is started, because it blocks SIGHUP. */
+
+int zone_reload (void);
+/* Loads the zone lists again, and replaces the current ones if
+   successful.  Capture workers switch to the new lists when they
+   process their next response.  Returns zero (after logging the
+   error) if the file cannot be loaded, in which case the current
+   lists are kept. */
+
+int zone_check (const char *message, size_t length);
+/* Matches the query name of the DNS MESSAGE (LENGTH bytes, at least a
+   valid header) against the zone lists.  Returns nonzero if the
+   response must be dropped.  Does not allocate memory, except when
+   the calling thread first sees a new version of the lists. */
+
+void zone_statistics (unsigned long *included, unsigned long *excluded,
+                      unsigned long *unlisted);
+/* Returns the number of responses which matched an included zone, an
+   excluded zone, and no zone while some zone is included, since the
+   start of the program (across all threads).  For testing. */
+
+#endif /* ZONE_H */
@@ -0,0 +1,108 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Compares all checksum implementations supported by the CPU against
+   the reference implementation, on random buffers of every length
+   from 0 to 1500 bytes.  Exits with a non-zero status on mismatch. */
+
+#include "config.h"
+#include "ipv4.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_LENGTH 1500
+#define ROUNDS 20
+#define LONG_LENGTH 65536
+
+/* Small linear congruential generator, so that the test is
+   reproducible everywhere. */
+static unsigned long random_state = 1;
+
+static unsigned
+next_random (void)
+{
+  random_state = random_state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (unsigned)(random_state >> 32);
+}
+
+static char buffer[LONG_LENGTH + 64];
+
+static int
+compare (unsigned variant, const char *name, const char *data, size_t length,
+         uint32_t start)
+{
+  uint16_t expected = ipv4_checksum_reference (data, length, start);
+  uint16_t actual = ipv4_checksum_with (variant, data, length, start);
+
+  if (expected == actual)
+    return 0;
+  fprintf (stderr, "checksum: %s: length %u, offset %u, start 0x%08x: "
+           "got 0x%04x, expected 0x%04x\n",
+           name, (unsigned)length, (unsigned)(data - buffer),
+           (unsigned)start, (unsigned)actual, (unsigned)expected);
+  return 1;
+}
+
+int
+main (void)
+{
+  unsigned variant;
+  const char *name;
+  int supported;
+  int failed = 0;
+
+  for (variant = 0;
+       (name = ipv4_checksum_variant (variant, &supported)) != 0; ++variant)
+    {
+      size_t length;
+      unsigned round;
+
+      if (!supported)
+        continue;
+
+      for (length = 0; length <= MAX_LENGTH; ++length)
+        for (round = 0; round < ROUNDS; ++round)
+          {
+            const char *data = buffer + next_random () % 64;
+            uint32_t start;
+            size_t j;
+
+            for (j = 0; j < length; ++j)
+              ((char *)data)[j] = next_random ();
+
+            /* Pseudo header sums are small, but arbitrary values must
+               be handled as well. */
+            start = round & 1 ? next_random () : next_random () % 0x40000;
+            failed |= compare (variant, name, data, length, start);
+          }
+
+      /* Saturated and long buffers stress the lane accumulators. */
+      for (round = 0; round < 4; ++round)
+        {
+          size_t j;
+
+          for (j = 0; j < sizeof (buffer); ++j)
+            buffer[j] = round & 1 ? 0xFF : next_random ();
+          failed |= compare (variant, name, buffer + round, LONG_LENGTH - round,
+                             round & 2 ? 0xFFFFFFFF : 0);
+        }
+    }
+
+  return failed;
+}
@@ -0,0 +1,60 @@
+# Splits the output of "dnslogger-forward -T FILE..." at the
+# "==> NAME <==" lines into testsuite/NAME.out files, and compares
+# them with the NAME.expected files in the source directory.
+#
+# Variables: srcdir (the source directory), group (the name of the
+# test group, used for the FAILED marker), cases (the space-separated
+# names of all test cases which must be present).  The cases from a
+# pcap file NAME.in are named NAME#1, NAME#2 and so on; NAME counts as
+# present if at least one of them is.
+
+function finish() {
+    if (name == "")
+        return
+    close(out)
+    file = srcdir "/testsuite/" name ".expected"
+    expected = ""
+    while ((getline line < file) > 0)
+        expected = expected line "\n"
+    close(file)
+    if (expected != text) {
+        print "FAILED test case: " name
+        failed = 1
+    }
+    seen[name] = 1
+    sub(/#[0-9]+$/, "", name)
+    seen[name] = 1
+    name = ""
+}
+
+/^==> .* <==$/ {
+    finish()
+    name = substr($0, 5, length($0) - 8)
+    out = "testsuite/" name ".out"
+    text = ""
+    printf "" > out
+    next
+}
+
+{
+    if (name == "") {
+        # Output before the first test case, e.g. a fatal error.
+        print "FAILED test group: " group ": " $0
+        failed = 1
+        next
+    }
+    text = text $0 "\n"
+    print > out
+}
+
+END {
+    finish()
+    count = split(cases, list, " ")
+    for (j = 1; j <= count; ++j)
+        if (!(list[j] in seen)) {
+            print "FAILED test case: " list[j] " (no output)"
+            failed = 1
+        }
+    if (failed)
+        printf "" > ("testsuite/FAILED-" group)
+}
@@ -0,0 +1,161 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/* Exercises the deduplication table: normalization of equivalent
+   responses, the window and eviction.  Each scenario runs in a
+   separate thread, so that it starts with an empty table.  Exits
+   with a non-zero status on failure. */
+
+#include "config.h"
+#include "dedup.h"
+#include "harness.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define HEADER "\x12\x34\x84\x00\x00\x01\x00\x02\x00\x00\x00\x00"
+/* ID 0x1234, authoritative response, one question and two answers. */
+
+#define QUESTION "\x07" "example" "\x03" "com" "\x00" "\x00\x01\x00\x01"
+/* example.com IN A, at offset 12. */
+
+#define A1 "\xc0\x0c\x00\x01\x00\x01\x00\x00\x0e\x10\x00\x04\xc0\x00\x02\x01"
+#define A2 "\xc0\x0c\x00\x01\x00\x01\x00\x00\x0e\x10\x00\x04\xc0\x00\x02\x02"
+/* Two A records for example.com (192.0.2.1 and 192.0.2.2), with a TTL
+   of 3600. */
+
+static const char response[] = HEADER QUESTION A1 A2;
+
+static int
+check (const char *message)
+{
+  return dedup_check (message, sizeof (response) - 1);
+}
+
+/* Returns a copy of RESPONSE with the byte at OFFSET replaced by C. */
+static const char *
+patch (unsigned offset, char c)
+{
+  static char buffer[sizeof (response)];
+
+  memcpy (buffer, response, sizeof (response));
+  buffer[offset] = c;
+  return buffer;
+}
+
+#define ANSWERS (12 + sizeof (QUESTION) - 1)
+/* Offset of the first answer record. */
+
+static void *
+normalization (void *closure)
+{
+  static const char reordered[] = HEADER QUESTION A2 A1;
+  static const char uncompressed[] =
+    HEADER QUESTION
+    "\x07" "EXAMPLE" "\x03" "com" "\x00" "\x00\x01\x00\x01\x00\x00\x00\x01\x00\x04\xc0\x00\x02\x02"
+    A1;
+  static const char truncated[] = HEADER QUESTION A1 "\xc0\x0c\x00\x01";
+  static const char loop[] = HEADER "\xc0\x0c\x00\x01\x00\x01" A1 A2;
+
+  (void)closure;
+  CHECK (check (response) == 0);
+  CHECK (check (response) == 1);
+
+  /* The ID, the TTL, the order of the records, and the case and
+     compression of names do not matter. */
+  CHECK (check (patch (0, 0x56)) == 1);
+  CHECK (check (patch (ANSWERS + 9, 0x20)) == 1);
+  CHECK (check (reordered) == 1);
+  CHECK (dedup_check (uncompressed, sizeof (uncompressed) - 1) == 1);
+
+  /* The question, the AA flag, the RCODE and the records do. */
+  CHECK (check (patch (13, 'E')) == 1);
+  CHECK (check (patch (14, 'y')) == 0);
+  CHECK (check (patch (2, 0x80)) == 0);
+  CHECK (check (patch (3, 0x03)) == 0);
+  CHECK (check (patch (ANSWERS + 15, 0x03)) == 0);
+
+  /* Invalid messages are never duplicates. */
+  CHECK (dedup_check (truncated, sizeof (truncated) - 1) == 0);
+  CHECK (dedup_check (truncated, sizeof (truncated) - 1) == 0);
+  CHECK (dedup_check (loop, sizeof (loop) - 1) == 0);
+  CHECK (dedup_check (loop, sizeof (loop) - 1) == 0);
+  return 0;
+}
+
+static void *
+window (void *closure)
+{
+  unsigned long hits, misses, evictions, hits0, misses0, evictions0;
+
+  (void)closure;
+  dedup_statistics (&hits0, &misses0, &evictions0);
+  fake_time = 100 * SECOND;
+  CHECK (check (response) == 0);
+  fake_time = 159 * SECOND;
+  CHECK (check (response) == 1);
+
+  /* The window starts again with the next forwarded copy. */
+  fake_time = 160 * SECOND;
+  CHECK (check (response) == 0);
+  fake_time = 219 * SECOND;
+  CHECK (check (response) == 1);
+  dedup_statistics (&hits, &misses, &evictions);
+  CHECK (hits == hits0 + 2);
+  CHECK (misses == misses0 + 2);
+  CHECK (evictions == evictions0);
+  return 0;
+}
+
+static void *
+eviction (void *closure)
+{
+  unsigned long hits, misses, evictions, hits0, misses0, evictions0;
+  unsigned j;
+
+  (void)closure;
+  dedup_statistics (&hits0, &misses0, &evictions0);
+
+  /* The table has a single bucket of 8 entries.  The oldest entry is
+     replaced. */
+  for (j = 0; j < 9; ++j)
+    {
+      fake_time = (1000 + j) * SECOND;
+      CHECK (check (patch (ANSWERS + 15, j)) == 0);
+    }
+  for (j = 1; j < 9; ++j)
+    CHECK (check (patch (ANSWERS + 15, j)) == 1);
+  CHECK (check (patch (ANSWERS + 15, 0)) == 0);
+
+  dedup_statistics (&hits, &misses, &evictions);
+  CHECK (hits == hits0 + 8);
+  CHECK (misses == misses0 + 10);
+  CHECK (evictions == evictions0 + 2);
+  return 0;
+}
+
+int
+main (void)
+{
+  harness_init ("dedup");
+  run (dedup_configure, "60", normalization);
+  run (dedup_configure, "60", window);
+  run (dedup_configure, "60,memory=64", eviction);
+  return failed;
+}
@@ -0,0 +1,275 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/* Exercises the DNS message parser: a typical response, malformed
+   names, and random mutations of the response (which must never make
+   the parser read outside the message).  Exits with a non-zero status
+   on failure. */
+
+#include "config.h"
+#include "dns.h"
+#include "harness.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char response[] =
+  "\x12\x34\x85\x80\x00\x01\x00\x03\x00\x01\x00\x01"
+  /* 12: www.example.com IN A */
+  "\x03" "www" "\x07" "example" "\x03" "com" "\x00" "\x00\x01\x00\x01"
+  /* 33: www.example.com CNAME web.example.com */
+  "\xc0\x0c" "\x00\x05\x00\x01\x00\x00\x0e\x10\x00\x06" "\x03" "web" "\xc0\x10"
+  /* 51: web.example.com A 192.0.2.1 and 192.0.2.2 */
+  "\xc0\x2d" "\x00\x01\x00\x01\x00\x00\x00\x3c\x00\x04" "\xc0\x00\x02\x01"
+  "\xc0\x2d" "\x00\x01\x00\x01\x00\x00\x00\x3c\x00\x04" "\xc0\x00\x02\x02"
+  /* 83: example.com NS ns1.example.com */
+  "\xc0\x10" "\x00\x02\x00\x01\x00\x01\x51\x80\x00\x06" "\x03" "ns1" "\xc0\x10"
+  /* 101: ns1.example.com A 192.0.2.53 */
+  "\xc0\x5f" "\x00\x01\x00\x01\x00\x01\x51\x80\x00\x04" "\xc0\x00\x02\x35";
+
+#define RESPONSE_LENGTH (sizeof (response) - 1)
+
+/* Returns nonzero if NAME (LENGTH bytes) is a valid uncompressed name
+   in wire format. */
+static int
+valid_name (const unsigned char *name, size_t length)
+{
+  size_t p = 0;
+
+  if (length == 0 || length > DNS_NAME_MAX)
+    return 0;
+  while (p < length && name[p] != 0)
+    {
+      if (name[p] >= 0x40)
+        return 0;
+      p += name[p] + 1;
+    }
+  return p == length - 1;
+}
+
+/* Decodes the name at OFFSET in MESSAGE (LENGTH bytes) and compares it
+   with EXPECTED (a dotted name, with a trailing dot). */
+static int
+name_is (const char *message, size_t length, size_t offset,
+         const char *expected)
+{
+  unsigned char name[DNS_NAME_MAX];
+  char text[DNS_NAME_MAX + 1];
+  size_t name_length = dns_name_decode (message, length, &offset, name);
+  size_t p = 0, q = 0;
+
+  if (name_length == 0)
+    return 0;
+  while (name[p] != 0)
+    {
+      memcpy (text + q, name + p + 1, name[p]);
+      q += name[p];
+      text[q++] = '.';
+      p += name[p] + 1;
+    }
+  text[q] = 0;
+  return strcmp (text, expected) == 0;
+}
+
+static void
+typical (void)
+{
+  static const struct
+  {
+    unsigned section;
+    const char *name;
+    uint16_t type;
+    uint32_t ttl;
+  } expected[] =
+    {
+      { DNS_SECTION_QUESTION, "www.example.com.", 1, 0 },
+      { DNS_SECTION_ANSWER, "www.example.com.", 5, 3600 },
+      { DNS_SECTION_ANSWER, "web.example.com.", 1, 60 },
+      { DNS_SECTION_ANSWER, "web.example.com.", 1, 60 },
+      { DNS_SECTION_AUTHORITY, "example.com.", 2, 86400 },
+      { DNS_SECTION_ADDITIONAL, "ns1.example.com.", 1, 86400 },
+    };
+  dns_header_t header;
+  dns_parser_t parser;
+  dns_rr_t rr;
+  unsigned j;
+  size_t offset;
+
+  CHECK (dns_header_decode (response, RESPONSE_LENGTH, &header));
+  dns_parser_init (&parser, response, RESPONSE_LENGTH, &header);
+  for (j = 0; j < sizeof (expected) / sizeof (expected[0]); ++j)
+    {
+      CHECK (dns_parser_next (&parser, &rr) == 1);
+      CHECK (rr.section == expected[j].section);
+      CHECK (rr.type == expected[j].type);
+      CHECK (rr.class == 1);
+      CHECK (rr.ttl == expected[j].ttl);
+      CHECK (name_is (response, RESPONSE_LENGTH, rr.name, expected[j].name));
+    }
+  CHECK (dns_parser_next (&parser, &rr) == 0);
+  CHECK (dns_parser_next (&parser, &rr) == 0);
+
+  /* RDATA names, and the offset after a compressed name. */
+  CHECK (name_is (response, RESPONSE_LENGTH, 45, "web.example.com."));
+  CHECK (name_is (response, RESPONSE_LENGTH, 95, "ns1.example.com."));
+  offset = 45;
+  {
+    unsigned char name[DNS_NAME_MAX];
+
+    CHECK (dns_name_decode (response, RESPONSE_LENGTH, &offset, name) == 17);
+    CHECK (offset == 51);
+  }
+
+  /* Every truncation is detected. */
+  for (j = 12; j < RESPONSE_LENGTH; ++j)
+    {
+      int result;
+
+      dns_parser_init (&parser, response, j, &header);
+      while ((result = dns_parser_next (&parser, &rr)) > 0)
+        ;
+      CHECK (result == -1);
+      CHECK (dns_parser_next (&parser, &rr) == -1);
+    }
+}
+
+static void
+malformed_names (void)
+{
+  static const char forward[] = "\x00\x00\xc0\x04\x01" "a" "\x00";
+  static const char self[] = "\x01" "a" "\xc0\x02";
+  static const char label_type[] = "\x01" "a" "\x80\x00";
+  unsigned char name[DNS_NAME_MAX];
+  char message[4 * 64 + 8];
+  size_t offset, j;
+
+  offset = 2;
+  CHECK (dns_name_decode (forward, sizeof (forward) - 1, &offset, name) == 0);
+  offset = 0;
+  CHECK (dns_name_decode (self, sizeof (self) - 1, &offset, name) == 0);
+  offset = 0;
+  CHECK (dns_name_decode (label_type, sizeof (label_type) - 1, &offset, name) == 0);
+
+  /* Four labels of 63 bytes and the root label are 257 bytes, three
+     labels and the root label are 193 bytes. */
+  memset (message, 'x', sizeof (message));
+  for (j = 0; j < 4; ++j)
+    message[j * 64] = 63;
+  message[4 * 64] = 0;
+  offset = 0;
+  CHECK (dns_name_decode (message, 4 * 64 + 1, &offset, name) == 0);
+  offset = 64;
+  CHECK (dns_name_decode (message, 4 * 64 + 1, &offset, name) == 193);
+  CHECK (offset == 4 * 64 + 1);
+  CHECK (valid_name (name, 193));
+}
+
+static uint32_t random_state = 1;
+
+/* Returns a pseudo-random number (xorshift32), so that failures can
+   be reproduced. */
+static uint32_t
+next_random (void)
+{
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state;
+}
+
+#define MUTATIONS 200000
+
+static void
+mutations (void)
+{
+  char message[RESPONSE_LENGTH];
+  unsigned char name[DNS_NAME_MAX];
+  unsigned long entries = 0;
+  unsigned j, k;
+
+  for (j = 0; j < MUTATIONS; ++j)
+    {
+      size_t length = RESPONSE_LENGTH;
+      unsigned count = 1 + next_random () % 4;
+      dns_header_t header;
+      dns_parser_t parser;
+      dns_rr_t rr;
+      size_t offset, name_length;
+      int result;
+
+      memcpy (message, response, RESPONSE_LENGTH);
+      for (k = 0; k < count; ++k)
+        {
+          uint32_t r = next_random ();
+
+          switch (r % 4)
+            {
+            case 0:
+              message[(r >> 8) % length] = r >> 16;
+              break;
+            case 1:
+              message[(r >> 8) % length] ^= 1 << ((r >> 16) % 8);
+              break;
+            case 2:
+              /* A compression pointer to a random place. */
+              offset = (r >> 8) % (length - 1);
+              message[offset] = 0xC0;
+              message[offset + 1] = (r >> 16) % length;
+              break;
+            case 3:
+              length = 12 + (r >> 8) % (length - 11);
+              break;
+            }
+        }
+
+      if (!dns_header_decode (message, length, &header))
+        continue;
+      dns_parser_init (&parser, message, length, &header);
+      while ((result = dns_parser_next (&parser, &rr)) > 0)
+        {
+          ++entries;
+          CHECK (rr.section < DNS_SECTIONS);
+          CHECK (rr.name < rr.rdata);
+          CHECK (rr.rdata + rr.rdlength <= length);
+          offset = rr.name;
+          name_length = dns_name_decode (message, length, &offset, name);
+          CHECK (name_length == 0 || valid_name (name, name_length));
+          CHECK (name_length == 0 || offset < rr.rdata);
+          offset = rr.rdata;
+          name_length = dns_name_decode (message, rr.rdata + rr.rdlength,
+                                         &offset, name);
+          CHECK (name_length == 0 || valid_name (name, name_length));
+          CHECK (name_length == 0 || offset <= rr.rdata + rr.rdlength);
+        }
+    }
+
+  /* Most mutations leave some entries intact. */
+  CHECK (entries > MUTATIONS);
+}
+
+int
+main (void)
+{
+  harness_init ("dns");
+  typical ();
+  malformed_names ();
+  mutations ();
+  return failed;
+}
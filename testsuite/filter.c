@@ -0,0 +1,208 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Compiles the expression of forward_filter for Ethernet (as the
+   capture code does, including the VLAN alternatives) and runs it on
+   questions, answers with and without the AA flag, empty and
+   truncated answers, TCP segments and non-first fragments, over IPv4
+   and IPv6, with zero to two VLAN tags.  Each combination of -A and
+   -D is tested.  Exits with a non-zero status on failure. */
+
+#include "config.h"
+#include "capture.h"
+#include "forward.h"
+#include "log.h"
+
+#include <pcap.h>
+#include <stdio.h>
+#include <string.h>
+
+enum kind
+  {
+    KIND_ANSWER,                /* AA answer with one record */
+    KIND_QUESTION,
+    KIND_NON_AA,                /* answer without the AA flag */
+    KIND_EMPTY,                 /* AA answer without records */
+    KIND_TRUNCATED,             /* like KIND_EMPTY, with the TC flag */
+    KIND_TCP,                   /* TCP segment carrying a question */
+    KIND_FRAGMENT,              /* non-first fragment of a question */
+    KINDS
+  };
+
+static const char *const kind_names[KINDS] =
+  {
+    "answer", "question", "non-AA answer", "empty answer",
+    "truncated answer", "TCP segment", "non-first fragment"
+  };
+
+/* Returns nonzero if a packet of KIND must pass the filter, with
+   forward_authoritative_only and forward_without_answers set as for
+   AUTHORITATIVE_ONLY and WITHOUT_ANSWERS. */
+static int
+expected (enum kind kind, int authoritative_only, int without_answers)
+{
+  switch (kind)
+    {
+    case KIND_QUESTION:
+      return 0;
+    case KIND_NON_AA:
+      return !authoritative_only;
+    case KIND_EMPTY:
+      return without_answers;
+    default:
+      return 1;
+    }
+}
+
+/* Stores the 12-byte DNS header of a packet of KIND at DNS.  TCP
+   segments and fragments carry a question, which the filter must not
+   look at. */
+static void
+dns_header (unsigned char *dns, enum kind kind)
+{
+  memset (dns, 0, 12);
+  dns[5] = 1;                   /* one question */
+  switch (kind)
+    {
+    case KIND_ANSWER:
+      dns[2] = 0x84;
+      dns[7] = 1;
+      break;
+    case KIND_NON_AA:
+      dns[2] = 0x80;
+      dns[7] = 1;
+      break;
+    case KIND_EMPTY:
+      dns[2] = 0x84;
+      break;
+    case KIND_TRUNCATED:
+      dns[2] = 0x86;
+      break;
+    default:
+      break;
+    }
+}
+
+/* Stores an Ethernet frame with TAGS VLAN tags which carries a packet
+   of KIND over IP version FAMILY in FRAME, and returns its length. */
+static size_t
+build (unsigned char *frame, unsigned tags, unsigned family, enum kind kind)
+{
+  unsigned char *p = frame;
+  unsigned j;
+
+  memset (frame, 0, 256);
+  memcpy (p, "\x00\x00\x5e\x00\x53\x01\x00\x00\x5e\x00\x53\x02", 12);
+  p += 12;
+  for (j = 0; j < tags; ++j)
+    {
+      memcpy (p, j + 1 < tags ? "\x88\xa8" : "\x81\x00", 2);
+      p[3] = 42;
+      p += 4;
+    }
+
+  if (family == 4)
+    {
+      memcpy (p, "\x08\x00\x45", 3);
+      p += 2;
+      p[3] = 60;                /* total length */
+      p[8] = 64;
+      p[9] = kind == KIND_TCP ? 6 : 17;
+      if (kind == KIND_FRAGMENT)
+        p[7] = 0xb9;            /* fragment offset 1480 */
+      memcpy (p + 12, "\xc0\x00\x02\x01\xc0\x00\x02\x02", 8);
+      p += 20;
+    }
+  else
+    {
+      memcpy (p, "\x86\xdd\x60", 3);
+      p += 2;
+      p[5] = 40;                /* payload length */
+      p[6] = kind == KIND_TCP ? 6 : kind == KIND_FRAGMENT ? 44 : 17;
+      p[7] = 64;
+      memcpy (p + 8, "\x20\x01\x0d\xb8", 4);
+      p[23] = 1;
+      memcpy (p + 24, "\x20\x01\x0d\xb8", 4);
+      p[39] = 2;
+      p += 40;
+      if (kind == KIND_FRAGMENT)
+        {
+          p[0] = 17;
+          p[3] = 0xb9;
+          p += 8;
+        }
+    }
+
+  /* The source port is 53, for both UDP and TCP. */
+  p[1] = 53;
+  p[2] = 0x80;
+  p[3] = 0x00;
+  if (kind == KIND_TCP)
+    {
+      p[12] = 0x50;             /* data offset */
+      p[13] = 0x18;             /* ACK, PSH */
+      p += 20;
+    }
+  else
+    p += 8;
+  dns_header (p, kind);
+  return p + 12 - frame;
+}
+
+int
+main (void)
+{
+  unsigned mode;
+  int failed = 0;
+
+  log_set_program ("filter");
+  for (mode = 0; mode < 4; ++mode)
+    {
+      struct bpf_program program;
+      unsigned family, tags;
+      enum kind kind;
+
+      forward_authoritative_only = (mode & 1) != 0;
+      forward_without_answers = (mode & 2) == 0;
+      capture_compile (&program, DLT_EN10MB, forward_filter ("ip or ip6"), 1);
+
+      for (family = 4; family <= 6; family += 2)
+        for (tags = 0; tags <= 2; ++tags)
+          for (kind = 0; kind < KINDS; ++kind)
+            {
+              unsigned char frame[256];
+              size_t length = build (frame, tags, family, kind);
+              int pass = bpf_filter (program.bf_insns, frame,
+                                     length, length) != 0;
+
+              if (pass != expected (kind, forward_authoritative_only,
+                                    forward_without_answers))
+                {
+                  fprintf (stderr, "filter:%s%s IPv%u, %u VLAN tags: "
+                           "%s %s\n",
+                           forward_authoritative_only ? " -A" : "",
+                           forward_without_answers ? "" : " -D",
+                           family, tags, kind_names[kind],
+                           pass ? "passed" : "rejected");
+                  failed = 1;
+                }
+            }
+      pcap_freecode (&program);
+    }
+  return failed;
+}
@@ -0,0 +1,232 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Exercises the reassembly table: fragment order, expiry, eviction,
+   the per-source limit and rejected fragments.  Each scenario runs in
+   a separate thread, so that it starts with an empty table.  Exits
+   with a non-zero status on failure. */
+
+#include "config.h"
+#include "fragment.h"
+#include "harness.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define PAYLOAD 3000
+
+static char payload[PAYLOAD];
+/* Adds the fragment of datagram ID from SOURCE with LENGTH bytes of
+   the payload at OFFSET.  Returns the result of fragment_ipv4, and
+   checks the reassembled packet if there is one. */
+static const char *
+add (uint32_t source, uint16_t id, unsigned offset, unsigned length, int more)
+{
+  static char packet[20 + PAYLOAD];
+  unsigned char *p = (unsigned char *)packet;
+  ipv4_header_t header;
+  ipv4_header_t decoded;
+  const char *result;
+  size_t result_length;
+
+  memset (&header, 0, sizeof (header));
+  header.version_length = 0x45;
+  header.total_length = 20 + length;
+  header.id = id;
+  header.fragmentation_offset = (more ? 0x2000 : 0) | offset / 8;
+  header.ttl = 64;
+  header.protocol = 17;
+  header.source = source;
+  header.destination = 0xC0000201;
+
+  memset (p, 0, 20);
+  p[0] = 0x45;
+  p[4] = id >> 8;
+  p[5] = id;
+  p[8] = 64;
+  p[9] = 17;
+  p[12] = source >> 24;
+  p[13] = source >> 16;
+  p[14] = source >> 8;
+  p[15] = source;
+  memcpy (p + 16, "\xC0\x00\x02\x01", 4);
+  memcpy (packet + 20, payload + offset, length);
+
+  result = fragment_ipv4 (packet, &header, &result_length);
+  if (result)
+    {
+      CHECK (result_length == 20 + PAYLOAD);
+      CHECK (ipv4_header_decode (result, result_length, &decoded));
+      CHECK (decoded.total_length == 20 + PAYLOAD);
+      CHECK (decoded.id == id && decoded.fragmentation_offset == 0);
+      CHECK (decoded.source == source);
+      CHECK (memcmp (result + 20, payload, PAYLOAD) == 0);
+    }
+  return result;
+}
+
+/* The three fragments of a datagram. */
+static const unsigned offsets[3] = { 0, 1200, 2400 };
+static const unsigned lengths[3] = { 1200, 1200, 600 };
+
+static const char *
+add_part (uint32_t source, uint16_t id, unsigned part)
+{
+  return add (source, id, offsets[part], lengths[part], part < 2);
+}
+
+static void *
+order (void *closure)
+{
+  static const unsigned permutations[6][3] =
+    { { 0, 1, 2 }, { 0, 2, 1 }, { 1, 0, 2 }, { 1, 2, 0 }, { 2, 0, 1 }, { 2, 1, 0 } };
+  unsigned j;
+
+  (void)closure;
+  for (j = 0; j < 6; ++j)
+    {
+      CHECK (add_part (0x0A000001, j, permutations[j][0]) == 0);
+      CHECK (add_part (0x0A000001, j, permutations[j][1]) == 0);
+      CHECK (add_part (0x0A000001, j, permutations[j][2]) != 0);
+    }
+  return 0;
+}
+
+static void *
+expiry (void *closure)
+{
+  unsigned long reassembled, timeouts, evictions, rejected, before;
+
+  (void)closure;
+  fragment_statistics (&reassembled, &before, &evictions, &rejected);
+
+  /* Completed just before the timeout. */
+  fake_time = 1000 * SECOND;
+  CHECK (add_part (0x0A000002, 1, 0) == 0);
+  CHECK (add_part (0x0A000002, 1, 1) == 0);
+  fake_time = 1029 * SECOND;
+  CHECK (add_part (0x0A000002, 1, 2) != 0);
+
+  /* The first fragment expires. */
+  CHECK (add_part (0x0A000002, 2, 0) == 0);
+  fake_time = 1059 * SECOND;
+  CHECK (add_part (0x0A000002, 2, 1) == 0);
+  CHECK (add_part (0x0A000002, 2, 2) == 0);
+  fragment_statistics (&reassembled, &timeouts, &evictions, &rejected);
+  CHECK (timeouts == before + 1);
+
+  /* After a long pause, everything expires. */
+  fake_time = 5000 * SECOND;
+  CHECK (add_part (0x0A000002, 2, 0) == 0);
+  fragment_statistics (&reassembled, &timeouts, &evictions, &rejected);
+  CHECK (timeouts == before + 2);
+  return 0;
+}
+
+static void *
+per_source (void *closure)
+{
+  unsigned long reassembled, timeouts, evictions, rejected, before;
+
+  (void)closure;
+  fragment_statistics (&reassembled, &timeouts, &evictions, &before);
+  CHECK (add_part (0x0A000003, 1, 0) == 0);
+  CHECK (add_part (0x0A000003, 2, 0) == 0);
+  CHECK (add_part (0x0A000003, 3, 0) == 0);
+  fragment_statistics (&reassembled, &timeouts, &evictions, &rejected);
+  CHECK (rejected == before + 1);
+
+  /* Other sources are not affected, and completed datagrams no longer
+     count. */
+  CHECK (add_part (0x0A000004, 1, 0) == 0);
+  CHECK (add_part (0x0A000003, 1, 1) == 0);
+  CHECK (add_part (0x0A000003, 1, 2) != 0);
+  CHECK (add_part (0x0A000003, 3, 0) == 0);
+  fragment_statistics (&reassembled, &timeouts, &evictions, &rejected);
+  CHECK (rejected == before + 1);
+  return 0;
+}
+
+static void *
+eviction (void *closure)
+{
+  unsigned long reassembled, timeouts, evictions, rejected, before;
+
+  (void)closure;
+  fragment_statistics (&reassembled, &timeouts, &before, &rejected);
+
+  /* The table holds two datagrams.  The oldest one is evicted. */
+  fake_time = 100 * SECOND;
+  CHECK (add_part (0x0A000005, 1, 0) == 0);
+  fake_time = 101 * SECOND;
+  CHECK (add_part (0x0A000006, 2, 0) == 0);
+  fake_time = 102 * SECOND;
+  CHECK (add_part (0x0A000007, 3, 0) == 0);
+  fragment_statistics (&reassembled, &timeouts, &evictions, &rejected);
+  CHECK (evictions == before + 1);
+
+  CHECK (add_part (0x0A000006, 2, 1) == 0);
+  CHECK (add_part (0x0A000006, 2, 2) != 0);
+  CHECK (add_part (0x0A000007, 3, 1) == 0);
+  CHECK (add_part (0x0A000007, 3, 2) != 0);
+  return 0;
+}
+
+static void *
+invalid (void *closure)
+{
+  unsigned long reassembled, timeouts, evictions, rejected, before;
+
+  (void)closure;
+  fragment_statistics (&reassembled, &timeouts, &evictions, &before);
+
+  /* Overlapping fragments discard the datagram. */
+  CHECK (add (0x0A000008, 1, 0, 1200, 1) == 0);
+  CHECK (add (0x0A000008, 1, 800, 1200, 1) == 0);
+  CHECK (add_part (0x0A000008, 1, 1) == 0);
+  CHECK (add_part (0x0A000008, 1, 2) == 0);
+
+  /* Too large, and not a multiple of eight bytes. */
+  CHECK (add (0x0A000008, 2, FRAGMENT_MAX_DATA, 8, 0) == 0);
+  CHECK (add (0x0A000008, 3, 0, 1201, 1) == 0);
+
+  /* Two different lengths. */
+  CHECK (add_part (0x0A000008, 4, 2) == 0);
+  CHECK (add (0x0A000008, 4, 1200, 8, 0) == 0);
+
+  fragment_statistics (&reassembled, &timeouts, &evictions, &rejected);
+  CHECK (rejected == before + 4);
+  return 0;
+}
+
+int
+main (void)
+{
+  unsigned j;
+
+  for (j = 0; j < PAYLOAD; ++j)
+    payload[j] = j * 7 + (j >> 8);
+  harness_init ("fragment");
+
+  run (fragment_configure, "1m", order);
+  run (fragment_configure, "1m", expiry);
+  run (fragment_configure, "1m,per-source=2", per_source);
+  run (fragment_configure, "12k", eviction);
+  run (fragment_configure, "1m", invalid);
+  return failed;
+}
@@ -174,6 +174,29 @@ for (my $length = 40; $length < 100; ++$length) {
     close OUT;
 }
 
+# A total length below the header length must not underflow the
+# payload length, for UDP and TCP.
+for my $protocol (17, 6) {
+    for my $total_length (0, 19) {
+	my $name = sprintf "default_auto-short-total-length-%s-%02d",
+	    $protocol == 6 ? "tcp" : "udp", $total_length;
+	my $data = join ("", map chr, @data[0 .. 39]);
+	substr ($data, 9, 1) = chr $protocol;
+	substr ($data, 2, 2) = pack ("n", $total_length);
+	substr ($data, 32, 1) = "\x50"; # TCP data offset 5
+	fix_ip_checksum $data;
+
+	open IN, "> $name.in";
+	print IN $data;
+	close IN;
+
+	open OUT, "> $name.expected";
+	print OUT "dnslogger-forward: debug: IP total length $total_length shorter than the header (81.91.161.5 -> 212.9.189.171).\n";
+	print OUT "dnslogger-forward: debug: No data received.\n";
+	close OUT;
+    }
+}
+
 for (my $length = 1; $length <= 5; ++$length) {
     my $header_length = 20 + 8;
     my $name = sprintf "default_auto-overlong-%03d", $header_length + $length;
@@ -237,7 +260,7 @@ for (my $length = 1; $length <= 5; ++$length) {
 				65 00 00 01 00 01);
     fix_udp_checksum $data;	# fix broken checksum (kernel bug?)
     
-    for my $flag qw(default A D) {
+    for my $flag (qw(default A D)) {
 	my $name = "${flag}_auto-real-question";
 	open IN, "> $name.in";
 	print IN $data;
@@ -260,7 +283,7 @@ for (my $length = 1; $length <= 5; ++$length) {
 			  77 74 29 fa 00 00 2a 30 00 00 1c 20 00 36 ee
 			  80 00 01 51 80);
 
-    for my $flag qw(default A D) {
+    for my $flag (qw(default A D)) {
 	my $name = "${flag}_auto-real-nxdomain";
 	open IN, "> $name.in";
 	print IN $data;
@@ -271,7 +294,7 @@ for (my $length = 1; $length <= 5; ++$length) {
     my $expected = sprintf 
 	("dnslogger-forward: debug: Forwarded %d bytes.\ndnslogger-forward: Received data: %s\n",
 	 length ($udp_data) + 8 + 4, bin2hex "DNSXFR01\x51\x5b\xa1\x05$udp_data");
-    for my $flag qw(default A) {
+    for my $flag (qw(default A)) {
 	my $name = "${flag}_auto-real-nxdomain";
 	open OUT, "> $name.expected";
 	print OUT $expected;
@@ -322,7 +345,7 @@ for (my $length = 1; $length <= 5; ++$length) {
 			  6e 73 2d 30 37 c0 2c c0 0c 00 02 00 01 00 00
 			  0d f8 00 02 c0 25);
 
-    for my $flag qw(default A D) {
+    for my $flag (qw(default A D)) {
 	my $name = "${flag}_auto-TC";
 	open IN, "> $name.in";
 	print IN $data;
@@ -337,3 +360,617 @@ for (my $length = 1; $length <= 5; ++$length) {
 	close OUT;
     }
 }
+
+# IPv6
+
+sub ipv6_udp ($$$) {
+    my ($headers, $next, $udp_data) = @_;
+    my $source = hex2bin qw(20 01 0d b8 00 00 00 00 00 00 00 00 00 00 00 53);
+    my $destination = hex2bin qw(20 01 0d b8 00 00 00 00 00 00 00 00 00 00 00 01);
+    my $udp = pack ("nnnn", 53, 32800, 8 + length $udp_data, 0) . $udp_data;
+    my $cksum = checksum ($source . $destination . pack ("N", length $udp)
+			  . "\000\000\000\021" . $udp) || 0xFFFF;
+    substr $udp, 6, 2, pack ("S", $cksum);
+    return pack ("NnCC", 0x60000000, length ($headers) + length ($udp), $next, 64)
+	. $source . $destination . $headers . $udp;
+}
+
+{
+    my $answer = udp_data join ("", map chr, @data);
+    my $nameserver = hex2bin qw(20 01 0d b8 00 00 00 00 00 00 00 00 00 00 00 53);
+    my $addresses = "(2001:db8::53 -> 2001:db8::1";
+    my $no_data = "dnslogger-forward: debug: No data received.\n";
+
+    sub ipv6_case ($$$) {
+	my ($name, $data, $expected) = @_;
+	open IN, "> $name.in";
+	print IN $data;
+	close IN;
+	open OUT, "> $name.expected";
+	print OUT $expected;
+	close OUT;
+    }
+
+    sub ipv6_forwarded ($$) {
+	my ($nameserver, $udp_data) = @_;
+	return sprintf ("dnslogger-forward: debug: Forwarded %d bytes.\ndnslogger-forward: Received data: %s\n",
+			length ($udp_data) + 8 + 16, bin2hex "DNSXFR02$nameserver$udp_data");
+    }
+
+    ipv6_case "default_auto-ipv6-answer", ipv6_udp ("", 17, $answer),
+    ipv6_forwarded $nameserver, $answer;
+
+    # Hop-by-hop and destination options headers, with PadN options.
+    ipv6_case "default_auto-ipv6-extension-headers",
+    ipv6_udp (hex2bin (qw(3c 00 01 04 00 00 00 00 11 00 01 04 00 00 00 00)),
+	      0, $answer),
+    ipv6_forwarded $nameserver, $answer;
+
+    ipv6_case "default_auto-ipv6-atomic-fragment",
+    ipv6_udp (hex2bin (qw(11 00 00 00 12 34 56 78)), 44, $answer),
+    ipv6_forwarded $nameserver, $answer;
+
+    # A non-final fragment whose length is not a multiple of eight.
+    ipv6_case "default_auto-ipv6-fragment",
+    ipv6_udp (hex2bin (qw(11 00 00 01 12 34 56 78)), 44, $answer),
+    "dnslogger-forward: debug: Discarding fragment (invalid length).\n$no_data";
+
+    ipv6_case "default_auto-ipv6-truncated-extension-header",
+    ipv6_udp (hex2bin (qw(11 ff 00 00 00 00 00 00)), 60, $answer),
+    "dnslogger-forward: debug: Truncated IPv6 extension header $addresses).\n$no_data";
+
+    my $data = ipv6_udp ("", 17, $answer);
+    ipv6_case "default_auto-ipv6-short", substr ($data, 0, 39),
+    "dnslogger-forward: debug: Short IPv6 packet of length 39.\n$no_data";
+
+    ipv6_case "default_auto-ipv6-truncated", substr ($data, 0, 100),
+    sprintf ("dnslogger-forward: debug: Truncated IPv6 packet, indicated length is %d, available is 100.\n$no_data",
+	     length $data);
+
+    my $udp_length = 8 + length $answer;
+    substr $data, 60, 1, "\377";
+    ipv6_case "default_auto-ipv6-bad-udp-checksum", $data,
+    "dnslogger-forward: debug: UDP checksum mismatch $addresses, UDP length $udp_length).\n$no_data";
+
+    $data = ipv6_udp ("", 17, $answer);
+    substr $data, 46, 2, "\000\000";
+    ipv6_case "default_auto-ipv6-zero-udp-checksum", $data,
+    "dnslogger-forward: debug: UDP checksum mismatch $addresses, UDP length $udp_length).\n$no_data";
+
+    ipv6_case "default_auto-ipv6-icmp", ipv6_udp ("", 58, $answer),
+    "dnslogger-forward: debug: Unexpected IP protocol 58 $addresses).\n$no_data";
+
+    my $question = $answer;
+    substr $question, 2, 1, "\001";
+    ipv6_case "default_auto-ipv6-question", ipv6_udp ("", 17, $question),
+    "dnslogger-forward: debug: Dropping question packet $addresses).\n$no_data";
+
+    # Without the AA bit, the nameserver address is suppressed.
+    my $non_aa = $answer;
+    substr $non_aa, 2, 1, "\201";
+    $data = ipv6_udp ("", 17, $non_aa);
+    ipv6_case "default_auto-ipv6-non-authoritative", $data,
+    ipv6_forwarded "\000" x 16, $non_aa;
+    ipv6_case "A_auto-ipv6-non-authoritative", $data,
+    "dnslogger-forward: debug: Dropping non-authoritative DNS packet $addresses).\n$no_data";
+}
+
+# Link layer decoding, with pcap files.  Each packet in a pcap file is
+# a separate test case, NAME#INDEX.  Frames which do not carry IP are
+# skipped and do not count.
+
+sub pcap_file ($$@) {
+    my ($name, $link_type, @frames) = @_;
+    open IN, "> $name.in";
+    print IN pack ("LSSlLLL", 0xa1b2c3d4, 2, 4, 0, 0, 65535, $link_type);
+    for my $frame (@frames) {
+	print IN pack ("LLLL", 0, 0, length $frame, length $frame), $frame;
+    }
+    close IN;
+}
+
+{
+    my $ipv4 = join ("", map chr, @data);
+    my $ipv4_expected = sprintf
+	("dnslogger-forward: debug: Forwarded %d bytes.\ndnslogger-forward: Received data: %s\n",
+	 length (udp_data $ipv4) + 8 + 4, bin2hex ("DNSXFR01\x51\x5b\xa1\x05" . udp_data $ipv4));
+    my $answer = udp_data $ipv4;
+    my $ipv6 = ipv6_udp ("", 17, $answer);
+    my $ipv6_expected = ipv6_forwarded
+	(hex2bin (qw(20 01 0d b8 00 00 00 00 00 00 00 00 00 00 00 53)), $answer);
+    my $ethernet = hex2bin qw(00 00 5e 00 53 01 00 00 5e 00 53 02);
+    my $arp = $ethernet . hex2bin (qw(08 06 00 01 08 00 06 04 00 01))
+	. "\000" x 18;
+
+    sub link_case ($$$@) {
+	my ($name, $expected, $link_type, @frames) = @_;
+	pcap_file $name, $link_type, @frames;
+	open OUT, "> $name#1.expected";
+	print OUT $expected;
+	close OUT;
+    }
+
+    link_case "default_link-ethernet", $ipv4_expected, 1,
+    $arp, $ethernet . "\x08\x00" . $ipv4;
+    link_case "default_link-ethernet-ipv6", $ipv6_expected, 1,
+    $ethernet . "\x86\xdd" . $ipv6;
+    link_case "default_link-vlan", $ipv4_expected, 1,
+    $ethernet . hex2bin (qw(81 00 00 2a 08 00)) . $ipv4;
+    link_case "default_link-qinq", $ipv6_expected, 1,
+    $ethernet . hex2bin (qw(88 a8 00 64 81 00 00 2a 86 dd)) . $ipv6;
+    link_case "default_link-vlan-arp", $ipv4_expected, 1,
+    $ethernet . hex2bin (qw(81 00 00 2a)) . substr ($arp, 12),
+    $ethernet . hex2bin (qw(81 00 00 2a 08 00)) . $ipv4;
+
+    # Replayed with -r, so that the capture filter applies.  The tagged
+    # question and the tagged ARP frame are filtered out.
+    my $question = $ipv4;
+    my $flags = ip_header_length ($question) + 10;
+    substr $question, $flags, 1, chr (ord (substr $question, $flags, 1) & 0x7f);
+    pcap_file "replay-vlan", 1,
+    $ethernet . "\x08\x00" . $ipv4,
+    $ethernet . hex2bin (qw(81 00 00 2a 08 00)) . $ipv4,
+    $ethernet . hex2bin (qw(88 a8 00 64 81 00 00 2a 86 dd)) . $ipv6,
+    $ethernet . hex2bin (qw(81 00 00 2a 08 00)) . $question,
+    $ethernet . hex2bin (qw(81 00 00 2a)) . substr ($arp, 12);
+    # DLT_LINUX_SLL
+    link_case "default_link-sll", $ipv4_expected, 113,
+    hex2bin (qw(00 00 00 01 00 06 00 00 5e 00 53 01 00 00 08 00)) . $ipv4;
+    # DLT_LINUX_SLL2
+    link_case "default_link-sll2", $ipv6_expected, 276,
+    hex2bin (qw(86 dd 00 00 00 00 00 02 00 01 00 06 00 00 5e 00 53 01 00 00))
+	. $ipv6;
+    # DLT_NULL, with the address family in either byte order
+    link_case "default_link-null", $ipv4_expected, 0,
+    pack ("V", 2) . $ipv4;
+    link_case "default_link-loop", $ipv6_expected, 108,
+    pack ("N", 24) . $ipv6;
+    # LINKTYPE_RAW
+    link_case "default_link-raw", $ipv6_expected, 101, $ipv6;
+}
+
+# Tunnel decapsulation (the "tunnel" group runs with "-e 2").
+
+sub outer_ipv4 ($$) {
+    my ($protocol, $payload) = @_;
+    my $packet = hex2bin (qw(45 00 00 00 00 00 40 00 40), sprintf ("%02x", $protocol),
+			  qw(00 00 c0 00 02 01 c0 00 02 02)) . $payload;
+    fix_ip_length $packet;
+    return $packet;
+}
+
+sub vxlan ($) {
+    my $frame = shift;
+    return outer_ipv4 17, pack ("nnnn", 49152, 4789, 16 + length $frame, 0)
+	. hex2bin (qw(08 00 00 00 00 01 00 00)) . $frame;
+}
+
+{
+    my $ipv4 = join ("", map chr, @data);
+    my $ipv4_expected = sprintf
+	("dnslogger-forward: debug: Forwarded %d bytes.\ndnslogger-forward: Received data: %s\n",
+	 length (udp_data $ipv4) + 8 + 4, bin2hex ("DNSXFR01\x51\x5b\xa1\x05" . udp_data $ipv4));
+    my $answer = udp_data $ipv4;
+    my $ipv6 = ipv6_udp ("", 17, $answer);
+    my $ipv6_expected = ipv6_forwarded
+	(hex2bin (qw(20 01 0d b8 00 00 00 00 00 00 00 00 00 00 00 53)), $answer);
+    my $ethernet = hex2bin qw(00 00 5e 00 53 01 00 00 5e 00 53 02);
+    my $no_data = "dnslogger-forward: debug: No data received.\n";
+
+    sub tunnel_case ($$$) {
+	my ($name, $data, $expected) = @_;
+	open IN, "> tunnel_$name.in";
+	print IN $data;
+	close IN;
+	open OUT, "> tunnel_$name.expected";
+	print OUT $expected;
+	close OUT;
+    }
+
+    tunnel_case "plain", $ipv4, $ipv4_expected;
+    tunnel_case "gre-ipv4", outer_ipv4 (47, hex2bin (qw(00 00 08 00)) . $ipv4),
+    $ipv4_expected;
+    # Checksum, key and sequence number present.
+    tunnel_case "gre-options-ipv6",
+    outer_ipv4 (47, hex2bin (qw(b0 00 86 dd 00 00 00 00 00 00 00 2a 00 00 00 07))
+		. $ipv6),
+    $ipv6_expected;
+    tunnel_case "gre-ethernet",
+    outer_ipv4 (47, hex2bin (qw(00 00 65 58)) . $ethernet . "\x08\x00" . $ipv4),
+    $ipv4_expected;
+    tunnel_case "erspan1",
+    outer_ipv4 (47, hex2bin (qw(00 00 88 be)) . $ethernet . "\x08\x00" . $ipv4),
+    $ipv4_expected;
+    tunnel_case "erspan2",
+    outer_ipv4 (47, hex2bin (qw(10 00 88 be 00 00 00 01 10 2a 00 00 00 00 00 01))
+		. $ethernet . hex2bin (qw(81 00 00 2a 08 00)) . $ipv4),
+    $ipv4_expected;
+    tunnel_case "erspan3",
+    outer_ipv4 (47, hex2bin (qw(10 00 22 eb 00 00 00 01 20 2a 00 00
+				12 34 56 78 00 00 00 00))
+		. $ethernet . "\x86\xdd" . $ipv6),
+    $ipv6_expected;
+    # With the platform specific subheader.
+    tunnel_case "erspan3-subheader",
+    outer_ipv4 (47, hex2bin (qw(10 00 22 eb 00 00 00 01 20 2a 00 00
+				12 34 56 78 00 00 00 01 00 00 00 00 00 00 00 00))
+		. $ethernet . "\x08\x00" . $ipv4),
+    $ipv4_expected;
+    # Frame type 2 (IP) is not supported.
+    tunnel_case "erspan3-frame-type",
+    outer_ipv4 (47, hex2bin (qw(10 00 22 eb 00 00 00 01 20 2a 00 00
+				12 34 56 78 00 00 08 00))
+		. $ipv4),
+    "dnslogger-forward: debug: Invalid tunnel header (protocol 47, depth 1).\n$no_data";
+    tunnel_case "gre-version", outer_ipv4 (47, hex2bin (qw(00 01 08 00)) . $ipv4),
+    "dnslogger-forward: debug: Invalid tunnel header (protocol 47, depth 1).\n$no_data";
+    tunnel_case "gre-truncated", outer_ipv4 (47, hex2bin (qw(b0 00 08 00 00 00))),
+    "dnslogger-forward: debug: Invalid tunnel header (protocol 47, depth 1).\n$no_data";
+    tunnel_case "vxlan", vxlan ($ethernet . "\x08\x00" . $ipv4), $ipv4_expected;
+    tunnel_case "vxlan-qinq",
+    vxlan ($ethernet . hex2bin (qw(88 a8 00 64 81 00 00 2a 86 dd)) . $ipv6),
+    $ipv6_expected;
+    tunnel_case "vxlan-in-gre",
+    outer_ipv4 (47, hex2bin (qw(00 00 08 00)) . vxlan ($ethernet . "\x08\x00" . $ipv4)),
+    $ipv4_expected;
+    my $flags = vxlan ($ethernet . "\x08\x00" . $ipv4);
+    substr $flags, 28, 1, "\000";
+    tunnel_case "vxlan-flags", $flags,
+    "dnslogger-forward: debug: Invalid tunnel header (protocol 17, depth 1).\n$no_data";
+    tunnel_case "vxlan-arp",
+    vxlan ($ethernet . hex2bin (qw(08 06 00 01 08 00 06 04 00 01)) . "\000" x 18),
+    "dnslogger-forward: debug: Invalid tunnel header (protocol 17, depth 1).\n$no_data";
+    # Only two levels are stripped.
+    tunnel_case "nesting-limit",
+    outer_ipv4 (47, hex2bin (qw(00 00 08 00))
+		. outer_ipv4 (47, hex2bin (qw(00 00 08 00))
+			      . outer_ipv4 (47, hex2bin (qw(00 00 08 00)) . $ipv4))),
+    "dnslogger-forward: debug: Unexpected IP protocol 47 (192.0.2.1 -> 192.0.2.2).\n$no_data";
+    my $ipv6_gre = ipv6_udp ("", 17, "");
+    $ipv6_gre = substr ($ipv6_gre, 0, 40) . hex2bin (qw(00 00 08 00)) . $ipv4;
+    substr $ipv6_gre, 4, 2, pack ("n", length ($ipv6_gre) - 40);
+    substr $ipv6_gre, 6, 1, "\x2f";
+    tunnel_case "ipv6-gre", $ipv6_gre, $ipv4_expected;
+}
+
+# Fragment reassembly.  The fragments are stored in pcap files (with
+# raw IP), so that each fragment is a separate test case.
+
+sub ipv4_fragment ($$$$) {
+    my ($packet, $id, $offset, $length) = @_;
+    my $payload = substr $packet, 20;
+    my $more = $offset + $length < length ($payload) ? 0x2000 : 0;
+    my $fragment = substr ($packet, 0, 20) . substr ($payload, $offset, $length);
+    substr $fragment, 4, 2, pack ("n", $id);
+    substr $fragment, 6, 2, pack ("n", $more | ($offset / 8));
+    fix_ip_length $fragment;
+    return $fragment;
+}
+
+sub ipv6_fragment ($$$$) {
+    my ($packet, $id, $offset, $length) = @_;
+    my $payload = substr $packet, 40;
+    my $more = $offset + $length < length ($payload) ? 1 : 0;
+    my $fragment = substr ($packet, 0, 40) . pack ("CCnN", 17, 0, $offset | $more, $id)
+	. substr ($payload, $offset, $length);
+    substr $fragment, 4, 2, pack ("n", length ($fragment) - 40);
+    substr $fragment, 6, 1, "\x2c";
+    return $fragment;
+}
+
+{
+    my $ipv4 = join ("", map chr, @data);
+    fix_ip_length $ipv4;
+    my $ipv4_expected = sprintf
+	("dnslogger-forward: debug: Forwarded %d bytes.\ndnslogger-forward: Received data: %s\n",
+	 length (udp_data $ipv4) + 8 + 4, bin2hex ("DNSXFR01\x51\x5b\xa1\x05" . udp_data $ipv4));
+    my $answer = udp_data $ipv4;
+    my $ipv6 = ipv6_udp ("", 17, $answer);
+    my $ipv6_expected = ipv6_forwarded
+	(hex2bin (qw(20 01 0d b8 00 00 00 00 00 00 00 00 00 00 00 53)), $answer);
+    my $no_data = "dnslogger-forward: debug: No data received.\n";
+
+    # EXPECTED holds the output for each fragment.
+    sub fragment_case ($$$) {
+	my ($name, $fragments, $expected) = @_;
+	pcap_file $name, 101, @$fragments;
+	for my $j (0 .. $#$expected) {
+	    open OUT, "> $name#" . ($j + 1) . ".expected";
+	    print OUT $expected->[$j];
+	    close OUT;
+	}
+    }
+
+    my $rest = length ($ipv4) - 20 - 256;
+    fragment_case "default_fragment-ipv4",
+    [ipv4_fragment ($ipv4, 1, 0, 128), ipv4_fragment ($ipv4, 1, 128, 128),
+     ipv4_fragment ($ipv4, 1, 256, $rest)],
+    [$no_data, $no_data, $ipv4_expected];
+    fragment_case "default_fragment-ipv4-reverse",
+    [ipv4_fragment ($ipv4, 2, 256, $rest), ipv4_fragment ($ipv4, 2, 128, 128),
+     ipv4_fragment ($ipv4, 2, 0, 128)],
+    [$no_data, $no_data, $ipv4_expected];
+    fragment_case "default_fragment-ipv4-interleaved",
+    [ipv4_fragment ($ipv4, 3, 0, 128), ipv4_fragment ($ipv4, 4, 256, $rest),
+     ipv4_fragment ($ipv4, 3, 256, $rest), ipv4_fragment ($ipv4, 4, 0, 256),
+     ipv4_fragment ($ipv4, 3, 128, 128)],
+    [$no_data, $no_data, $no_data, $ipv4_expected, $ipv4_expected];
+    fragment_case "default_fragment-ipv4-overlap",
+    [ipv4_fragment ($ipv4, 5, 0, 128), ipv4_fragment ($ipv4, 5, 64, 128),
+     ipv4_fragment ($ipv4, 5, 256, $rest)],
+    [$no_data, "dnslogger-forward: debug: Discarding fragment (overlap).\n$no_data",
+     $no_data];
+    fragment_case "default_fragment-ipv4-too-large",
+    [ipv4_fragment ($ipv4 . ' ' x 4096, 6, 4096, 64)],
+    ["dnslogger-forward: debug: Discarding fragment (too large).\n$no_data"];
+
+    # Reassembled, but too long for a record.
+    my $long = $ipv4 . ' ' x 400;
+    fix_ip_length $long;
+    fix_udp_length $long;
+    fragment_case "default_fragment-ipv4-overlong",
+    [ipv4_fragment ($long, 7, 0, 512), ipv4_fragment ($long, 7, 512, length ($long) - 532)],
+    [$no_data,
+     sprintf ("dnslogger-forward: debug: Dropping overlong packet (81.91.161.5 -> 212.9.189.171, %u bytes).\n$no_data",
+	      length ($long) - 28)];
+
+    my $ipv6_rest = length ($ipv6) - 40 - 168;
+    fragment_case "default_fragment-ipv6",
+    [ipv6_fragment ($ipv6, 0x1001, 168, $ipv6_rest), ipv6_fragment ($ipv6, 0x1001, 0, 168)],
+    [$no_data, $ipv6_expected];
+}
+
+# Long payloads (with -M 1000), in DNSXFR03 and DNSXFR04 records.
+
+{
+    my $no_data = "dnslogger-forward: debug: No data received.\n";
+
+    # An IPv4 response with a DNS payload of LENGTH bytes.
+    sub long_ipv4 ($) {
+	my ($length) = @_;
+	my $data = join ("", map chr, @data);
+	$data .= ' ' x (28 + $length - length ($data));
+	fix_ip_length $data;
+	fix_udp_length $data;
+	return $data;
+    }
+
+    sub long_ipv4_forwarded ($$) {
+	my ($signature, $data) = @_;
+	my $udp_data = udp_data $data;
+	return sprintf ("dnslogger-forward: debug: Forwarded %d bytes.\ndnslogger-forward: Received data: %s\n",
+			length ($udp_data) + 8 + 4,
+			bin2hex "$signature\x51\x5b\xa1\x05$udp_data");
+    }
+
+    for my $length (512, 513, 524, 525, 1000) {
+	my $data = long_ipv4 $length;
+	ipv6_case "M_auto-long-$length", $data,
+	long_ipv4_forwarded $length > 512 ? "DNSXFR03" : "DNSXFR01", $data;
+    }
+
+    ipv6_case "M_auto-long-1001", long_ipv4 (1001),
+    "dnslogger-forward: debug: Dropping overlong packet (81.91.161.5 -> 212.9.189.171, 1001 bytes).\n$no_data";
+
+    my $answer = udp_data (join ("", map chr, @data)) . ' ' x 300;
+    ipv6_case "M_auto-long-ipv6", ipv6_udp ("", 17, $answer),
+    sprintf ("dnslogger-forward: debug: Forwarded %d bytes.\ndnslogger-forward: Received data: %s\n",
+	     length ($answer) + 8 + 16,
+	     bin2hex ("DNSXFR04" . hex2bin (qw(20 01 0d b8 00 00 00 00 00 00 00 00 00 00 00 53))
+		      . $answer));
+
+    # Reassembled from fragments.
+    my $long = long_ipv4 900;
+    fragment_case "M_fragment-long",
+    [ipv4_fragment ($long, 8, 0, 512), ipv4_fragment ($long, 8, 512, length ($long) - 532)],
+    [$no_data, long_ipv4_forwarded "DNSXFR03", $long];
+}
+
+# DNS over TCP.  The segments of a connection are stored in a pcap
+# file, so that each segment is a separate test case.  Connections are
+# tracked from the SYN+ACK segment of the nameserver on.
+
+sub ipv4_tcp ($$$$) {
+    my ($port, $sequence, $flags, $data) = @_;
+    my $tcp = pack ("nnNNCCnnn", 53, $port, $sequence, 1, 0x50, $flags, 65535, 0, 0)
+	. $data;
+    my $packet = hex2bin (qw(45 00 00 00 00 00 40 00 40 06 00 00 51 5b a1 05
+			     d4 09 bd ab)) . $tcp;
+    fix_ip_length $packet;
+    substr $packet, 36, 2,
+    pack ("S", checksum (pseudo_header ($packet, pack ("n", length $tcp)) . $tcp));
+    return $packet;
+}
+
+sub ipv6_tcp ($$$$) {
+    my ($port, $sequence, $flags, $data) = @_;
+    my $source = hex2bin qw(20 01 0d b8 00 00 00 00 00 00 00 00 00 00 00 53);
+    my $destination = hex2bin qw(20 01 0d b8 00 00 00 00 00 00 00 00 00 00 00 01);
+    my $tcp = pack ("nnNNCCnnn", 53, $port, $sequence, 1, 0x50, $flags, 65535, 0, 0)
+	. $data;
+    my $cksum = checksum ($source . $destination . pack ("N", length $tcp)
+			  . "\000\000\000\006" . $tcp);
+    substr $tcp, 16, 2, pack ("S", $cksum);
+    return pack ("NnCC", 0x60000000, length $tcp, 6, 64)
+	. $source . $destination . $tcp;
+}
+
+{
+    my $answer = udp_data join ("", map chr, @data);
+    my $question = $answer;
+    substr $question, 2, 1, "\001";
+    my $ipv4_expected = sprintf
+	("dnslogger-forward: debug: Forwarded %d bytes.\ndnslogger-forward: Received data: %s\n",
+	 length ($answer) + 8 + 4, bin2hex ("DNSXFR01\x51\x5b\xa1\x05" . $answer));
+    my $forwarded = "dnslogger-forward: debug: Forwarded " . (length ($answer) + 12) . " bytes.\n";
+    my $received = substr $ipv4_expected, length $forwarded;
+    my $no_data = "dnslogger-forward: debug: No data received.\n";
+    my ($syn, $fin, $rst, $ack) = (0x12, 0x11, 0x14, 0x10);
+
+    # Messages are preceded by their length.
+    my $message = pack ("n", length $answer) . $answer;
+    my $question_message = pack ("n", length $question) . $question;
+    my $length = length $message;
+    my $start = 1001;
+
+    fragment_case "default_tcp-ipv4",
+    [ipv4_tcp (40001, 1000, $syn, ""),
+     ipv4_tcp (40001, $start, $ack, substr ($message, 0, 100)),
+     ipv4_tcp (40001, $start + 100, $ack, substr ($message, 100)),
+     # Several messages in one segment.
+     ipv4_tcp (40001, $start + $length, $ack,
+	       $message . $question_message . $message),
+     ipv4_tcp (40001, $start + 3 * $length + length $question_message, $ack, ""),
+     ipv4_tcp (40001, $start + 3 * $length + length $question_message, $fin, ""),
+     # Not tracked after the FIN.
+     ipv4_tcp (40001, $start + 3 * $length + length $question_message, $ack,
+	       $message)],
+    [$no_data, $no_data, $ipv4_expected,
+     $forwarded . "dnslogger-forward: debug: Dropping question packet (81.91.161.5 -> 212.9.189.171).\n"
+     . $forwarded . $received . $received,
+     $no_data, $no_data, $no_data];
+
+    fragment_case "default_tcp-out-of-order",
+    [ipv4_tcp (40002, 1000, $syn, ""),
+     ipv4_tcp (40002, $start + 200, $ack, substr ($message, 200) . $message),
+     ipv4_tcp (40002, $start + 100, $ack, substr ($message, 100, 100)),
+     ipv4_tcp (40002, $start, $ack, substr ($message, 0, 150)),
+     # A retransmission of data which has been received.
+     ipv4_tcp (40002, $start + 100, $ack, substr ($message, 100, 50))],
+    [$no_data, $no_data, $no_data,
+     $forwarded . $forwarded . $received . $received, $no_data];
+
+    fragment_case "default_tcp-reset",
+    [ipv4_tcp (40003, 1000, $syn, ""),
+     ipv4_tcp (40003, $start, $ack, substr ($message, 0, 100)),
+     ipv4_tcp (40003, $start + 100, $rst, ""),
+     ipv4_tcp (40003, $start + 100, $ack, substr ($message, 100))],
+    [$no_data, $no_data, $no_data, $no_data];
+
+    my $bad_checksum = ipv4_tcp (40004, 1000, $syn, "");
+    substr $bad_checksum, 36, 1, "\377";
+    fragment_case "default_tcp-untracked",
+    [ipv4_tcp (40004, $start, $ack, $message), $bad_checksum],
+    [$no_data,
+     "dnslogger-forward: debug: TCP checksum mismatch (81.91.161.5 -> 212.9.189.171, TCP length 20).\n$no_data"];
+
+    fragment_case "default_tcp-ipv6",
+    [ipv6_tcp (40005, 1000, $syn, ""), ipv6_tcp (40005, $start, $fin, $message)],
+    [$no_data,
+     ipv6_forwarded (hex2bin (qw(20 01 0d b8 00 00 00 00 00 00 00 00 00 00 00 53)),
+		     $answer)];
+
+    # A long message (with -M 1000) spanning several segments.
+    my $long = udp_data long_ipv4 1000;
+    $message = pack ("n", length $long) . $long;
+    fragment_case "M_tcp-long",
+    [ipv4_tcp (40006, 1000, $syn, ""),
+     ipv4_tcp (40006, $start, $ack, substr ($message, 0, 536)),
+     ipv4_tcp (40006, $start + 536, $ack, substr ($message, 536))],
+    [$no_data, $no_data, long_ipv4_forwarded "DNSXFR03", long_ipv4 1000];
+}
+
+# Deduplication (the "u" group runs with "-u 60").
+
+{
+    my $no_data = "dnslogger-forward: debug: No data received.\n";
+
+    # PATCHES maps offsets in the IPv4 packet to replacement bytes.
+    sub dedup_ipv4 (%) {
+	my (%patches) = @_;
+	my $data = join ("", map chr, @data);
+	substr ($data, $_, 1) = chr $patches{$_} for keys %patches;
+	fix_ip_length $data;
+	fix_udp_length $data;
+	return $data;
+    }
+
+    sub dedup_forwarded ($) {
+	my $answer = udp_data shift;
+	return sprintf
+	    ("dnslogger-forward: debug: Forwarded %d bytes.\ndnslogger-forward: Received data: %s\n",
+	     length ($answer) + 8 + 4, bin2hex ("DNSXFR01\x51\x5b\xa1\x05" . $answer));
+    }
+
+    my $duplicate = "dnslogger-forward: debug: Dropping duplicate DNS packet (81.91.161.5 -> 212.9.189.171).\n$no_data";
+    my $original = dedup_ipv4;
+    # Another message ID, and another TTL in the first answer.
+    my $renewed = dedup_ipv4 (28 => 0x12, 29 => 0x34, 56 => 0x42);
+    # Another name server in the first answer.  The additional section
+    # does not matter.
+    my $changed = dedup_ipv4 (61 => 0x78);
+    my $additional = dedup_ipv4 (length ($original) - 1 => 0x06);
+
+    fragment_case "u_repeated",
+    [$original, $renewed, $changed, $original, $additional],
+    [dedup_forwarded $original, $duplicate, dedup_forwarded $changed, $duplicate,
+     $duplicate];
+}
+
+# Rate limiting (the "l" group runs with "-l 1,burst=2").
+
+{
+    my $no_data = "dnslogger-forward: debug: No data received.\n";
+    my $ipv4 = dedup_ipv4;
+    my $answer = udp_data $ipv4;
+
+    fragment_case "l_burst",
+    [$ipv4, $ipv4, $ipv4, ipv6_udp ("", 17, $answer)],
+    [dedup_forwarded $ipv4, dedup_forwarded $ipv4,
+     "dnslogger-forward: debug: Dropping rate-limited DNS packet (81.91.161.5 -> 212.9.189.171).\n$no_data",
+     ipv6_forwarded (hex2bin (qw(20 01 0d b8 00 00 00 00 00 00 00 00 00 00 00 53)), $answer)];
+}
+
+# Compressed TCP streams (the "z" group runs with "-t -z 6").  The
+# test server decompresses the frames and prints the records.
+
+{
+    my $answer = udp_data join ("", map chr, @data);
+    my $message = pack ("n", length $answer) . $answer;
+    my $record = "DNSXFR01\x51\x5b\xa1\x05" . $answer;
+    my $received = "dnslogger-forward: Received data: "
+	. bin2hex (pack ("n", length $record) . $record) . "\n";
+    my $no_data = "dnslogger-forward: debug: No data received.\n";
+    my ($syn, $ack) = (0x12, 0x10);
+
+    # Several records in one frame.
+    fragment_case "z_tcp-messages",
+    [ipv4_tcp (40001, 1000, $syn, ""),
+     ipv4_tcp (40001, 1001, $ack, $message x 3),
+     ipv4_tcp (40001, 1001 + 3 * length $message, $ack, $message)],
+    [$no_data, $received x 3, $received];
+}
+
+# Zone lists (the "zones" group runs with "-Z testsuite/zones.list",
+# which includes de but excludes nic.de).
+
+{
+    my $no_data = "dnslogger-forward: debug: No data received.\n";
+    my $nameserver = hex2bin qw(20 01 0d b8 00 00 00 00 00 00 00 00 00 00 00 53);
+
+    # Replaces the query name "de" with the wire-format NAME.
+    sub zone_ipv4 ($) {
+	my $name = shift;
+	my $data = join ("", map chr, @data);
+	substr ($data, 40, 4) = $name;
+	fix_ip_length $data;
+	fix_udp_length $data;
+	return $data;
+    }
+
+    sub zone_dropped ($) {
+	return "dnslogger-forward: debug: Dropping DNS packet because of the zone lists ("
+	    . shift () . ").\n$no_data";
+    }
+
+    my $ipv4 = "81.91.161.5 -> 212.9.189.171";
+    my $original = zone_ipv4 "\x02de\x00";
+    my $upper = zone_ipv4 "\x02DE\x00";
+    my $other = udp_data zone_ipv4 "\x02nl\x00";
+
+    fragment_case "zones_qname",
+    [$original, $upper, zone_ipv4 "\x03nic\x02de\x00",
+     zone_ipv4 "\x02nl\x00", ipv6_udp ("", 17, $other)],
+    [dedup_forwarded $original, dedup_forwarded $upper, zone_dropped $ipv4,
+     zone_dropped $ipv4, zone_dropped "2001:db8::53 -> 2001:db8::1"];
+}
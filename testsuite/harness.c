@@ -0,0 +1,69 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "harness.h"
+#include "checkpoint.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+int failed;
+uint64_t fake_time;
+const char *harness_name;
+
+static uint64_t
+fake_clock (void)
+{
+  return fake_time;
+}
+
+void
+harness_init (const char *name)
+{
+  harness_name = name;
+  checkpoint_set_clock (fake_clock);
+}
+
+void
+run_workers (void (*configure) (const char *spec), const char *spec,
+             void *(*scenario) (void *), unsigned workers)
+{
+  pthread_t threads[8];
+  unsigned j;
+
+  configure (spec);
+  for (j = 0; j < workers; ++j)
+    if (pthread_create (threads + j, 0, scenario, 0) != 0)
+      {
+        fprintf (stderr, "%s: could not run thread\n", harness_name);
+        exit (1);
+      }
+  for (j = 0; j < workers; ++j)
+    if (pthread_join (threads[j], 0) != 0)
+      {
+        fprintf (stderr, "%s: could not run thread\n", harness_name);
+        exit (1);
+      }
+}
+
+void
+run (void (*configure) (const char *spec), const char *spec,
+     void *(*scenario) (void *))
+{
+  run_workers (configure, spec, scenario, 1);
+}
@@ -0,0 +1,60 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Helpers shared by the unit tests of the per-thread tables. */
+
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include "config.h"
+
+#include <stdio.h>
+
+#define SECOND 1000000000ULL
+
+extern const char *harness_name;
+/* The name of the test, for messages. */
+
+extern int failed;
+/* Set by CHECK if a check fails. */
+
+extern uint64_t fake_time;
+/* The time returned by the clock of checkpoint_now, in nanoseconds,
+   after harness_init. */
+
+#define CHECK(COND) \
+  do { if (!(COND)) { fprintf (stderr, "%s: %s:%d: check failed: %s\n", \
+                               harness_name, __FILE__, __LINE__, #COND); \
+      failed = 1; } } while (0)
+
+void harness_init (const char *name);
+/* Sets harness_name to NAME, and replaces the monotonic clock with
+   the fake clock. */
+
+void run (void (*configure) (const char *spec), const char *spec,
+          void *(*scenario) (void *));
+/* Passes SPEC to CONFIGURE, and runs SCENARIO in a new thread, so
+   that it starts with empty per-thread tables.  Terminates the
+   program if the thread cannot be run. */
+
+void run_workers (void (*configure) (const char *spec), const char *spec,
+                  void *(*scenario) (void *), unsigned workers);
+/* Like run, but runs SCENARIO in WORKERS threads at the same time, as
+   the capture workers do.  WORKERS must be at most 8. */
+
+#endif /* HARNESS_H */
@@ -0,0 +1,139 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/* Exercises the rate limiting table: bursts, refilling, independent
+   sources, eviction and a flood handled by concurrent workers.  Each
+   scenario runs in a separate thread, so that it starts with an empty
+   table.  Exits with a non-zero status on failure. */
+
+#include "config.h"
+#include "harness.h"
+#include "ratelimit.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* Returns the number of responses from SOURCE which are forwarded out
+   of COUNT. */
+static unsigned
+send (uint32_t source, unsigned count)
+{
+  uint32_t key[4] = { 0, 0, 0xFFFF, source };
+  unsigned forwarded = 0;
+
+  while (count-- > 0)
+    if (!ratelimit_check (key))
+      ++forwarded;
+  return forwarded;
+}
+
+static void *
+bucket (void *closure)
+{
+  unsigned long limited, evictions, limited0, evictions0;
+
+  (void)closure;
+  ratelimit_statistics (&limited0, &evictions0);
+
+  /* 10 per second, with a burst of 20. */
+  fake_time = 1000 * SECOND;
+  CHECK (send (1, 30) == 20);
+
+  /* Sources are independent. */
+  CHECK (send (2, 5) == 5);
+
+  /* One token per 100 milliseconds. */
+  fake_time += SECOND / 10;
+  CHECK (send (1, 5) == 1);
+  fake_time += SECOND / 2;
+  CHECK (send (1, 10) == 5);
+
+  /* The bucket does not hold more than the burst. */
+  fake_time += 100 * SECOND;
+  CHECK (send (1, 30) == 20);
+
+  ratelimit_statistics (&limited, &evictions);
+  CHECK (limited == limited0 + 10 + 4 + 5 + 10);
+  CHECK (evictions == evictions0);
+  return 0;
+}
+
+static void *
+eviction (void *closure)
+{
+  unsigned long limited, evictions, limited0, evictions0;
+  uint32_t j;
+
+  (void)closure;
+  ratelimit_statistics (&limited0, &evictions0);
+
+  /* The table has 8 slots.  After 9 sources, one has been forgotten,
+     which starts again with a full bucket. */
+  fake_time = 2000 * SECOND;
+  for (j = 0; j < 9; ++j)
+    {
+      CHECK (send (j, 3) == 2);
+      fake_time += SECOND / 1000;
+    }
+  ratelimit_statistics (&limited, &evictions);
+  CHECK (evictions == evictions0 + 1);
+  CHECK (send (0, 3) == 2);
+
+  /* Sources whose bucket is full again are replaced silently. */
+  fake_time += 10 * SECOND;
+  for (j = 100; j < 108; ++j)
+    CHECK (send (j, 1) == 1);
+  ratelimit_statistics (&limited, &evictions);
+  CHECK (evictions == evictions0 + 2);
+  CHECK (limited == limited0 + 10);
+  return 0;
+}
+
+static void *
+flood_worker (void *closure)
+{
+  (void)closure;
+  CHECK (send (1, 1000) == 20);
+  return 0;
+}
+
+/* Floods the workers with responses from one source, at the same
+   time.  Each worker has its own bucket, and the responses which are
+   limited in all workers are summed. */
+static void
+flood (void)
+{
+  unsigned long limited, evictions, limited0, evictions0;
+
+  ratelimit_statistics (&limited0, &evictions0);
+  fake_time = 3000 * SECOND;
+  run_workers (ratelimit_configure, "10,burst=20", flood_worker, 4);
+  ratelimit_statistics (&limited, &evictions);
+  CHECK (limited == limited0 + 4 * 980);
+}
+
+int
+main (void)
+{
+  harness_init ("ratelimit");
+  run (ratelimit_configure, "10,burst=20", bucket);
+  run (ratelimit_configure, "1,burst=2,sources=8", eviction);
+  flood ();
+  return failed;
+}
@@ -0,0 +1,144 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Exercises the spool at the segment size limit: segments smaller
+   than the largest record must be rejected, and records of the
+   maximum length must be stored and replayed intact, one per segment
+   of the minimum size.  Exits with a non-zero status on failure. */
+
+#include "config.h"
+#include "forward.h"
+#include "harness.h"
+#include "log.h"
+#include "spool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static char directory[] = "/tmp/spool-test-XXXXXX";
+
+/* Returns nonzero if spool_configure accepts SEGMENT as the segment
+   size.  The check runs in a child process, because a rejected size
+   terminates the program. */
+static int
+segment_accepted (const char *segment)
+{
+  char spec[128];
+  pid_t pid;
+  int status;
+
+  snprintf (spec, sizeof (spec), "%s,segment=%s", directory, segment);
+  pid = fork ();
+  if (pid == 0)
+    {
+      /* Do not print the expected error message. */
+      if (freopen ("/dev/null", "w", stderr) == 0)
+        _exit (2);
+      spool_configure (spec);
+      _exit (0);
+    }
+  if (pid < 0 || waitpid (pid, &status, 0) != pid)
+    {
+      perror ("spool: fork");
+      exit (1);
+    }
+  return WIFEXITED (status) && WEXITSTATUS (status) == 0;
+}
+
+/* Fills RECORD (FORWARD_MAX_RECORD bytes) with a pattern derived from
+   INDEX. */
+static void
+fill (char *record, unsigned index)
+{
+  unsigned j;
+
+  for (j = 0; j < FORWARD_MAX_RECORD; ++j)
+    record[j] = j * 7 + index;
+}
+
+/* Appends three records of the maximum length to a spool of two
+   segments of the minimum size.  The first segment is discarded for
+   the third record, and the other two records are replayed. */
+static void
+largest_records (void)
+{
+  static char record[FORWARD_MAX_RECORD], expected[FORWARD_MAX_RECORD];
+  char spec[128];
+  spool_t *spool;
+  unsigned j, replayed = 0, attempts;
+
+  snprintf (spec, sizeof (spec),
+            "%s,segment=128k,size=256k,rate=1000000", directory);
+  spool_configure (spec);
+  spool = spool_open ("largest");
+  for (j = 0; j < 3; ++j)
+    {
+      fill (record, j);
+      spool_append (spool, (const forward_t *)record, sizeof (record));
+    }
+
+  /* Replay is paced by the real clock. */
+  for (attempts = 0; attempts < 1000 && spool_pending (spool); ++attempts)
+    {
+      forward_t small, *large;
+      size_t length;
+
+      if (!spool_replay (spool, &small, &large, &length))
+        {
+          usleep (1000);
+          continue;
+        }
+      CHECK (length == FORWARD_MAX_RECORD);
+      CHECK (large != 0);
+      if (large != 0 && length == FORWARD_MAX_RECORD)
+        {
+          fill (expected, replayed + 1);
+          CHECK (memcmp (large, expected, length) == 0);
+        }
+      free (large);
+      ++replayed;
+    }
+  CHECK (replayed == 2);
+}
+
+int
+main (void)
+{
+  char command[64];
+
+  harness_init ("spool");
+  log_set_program ("spool");
+  if (mkdtemp (directory) == 0)
+    {
+      perror ("mkdtemp");
+      return 1;
+    }
+
+  CHECK (!segment_accepted ("64k"));
+  CHECK (!segment_accepted ("131071"));
+  CHECK (segment_accepted ("128k"));
+  largest_records ();
+
+  snprintf (command, sizeof (command), "rm -rf %s", directory);
+  if (system (command) != 0)
+    failed = 1;
+  return failed;
+}
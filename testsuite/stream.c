@@ -0,0 +1,220 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/* Exercises the TCP stream table: message extraction, expiry,
+   eviction under a SYN flood, the memory limits and the counters of
+   concurrent workers.  Each scenario runs in a separate thread, so
+   that it starts with an empty table.  Exits with a non-zero status
+   on failure. */
+
+#include "config.h"
+#include "harness.h"
+#include "tcp.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define MESSAGE 3000
+
+static char stream[2 + MESSAGE];
+/* A DNS message (arbitrary bytes), preceded by its length. */
+
+#define ISN 1000
+/* Initial sequence number of the responder. */
+
+/* Adds a segment of the connection to client port PORT, with FLAGS
+   and LENGTH bytes of STREAM at OFFSET.  Returns the number of
+   complete messages, and checks them. */
+static unsigned
+add (uint16_t port, unsigned flags, unsigned offset, unsigned length)
+{
+  static const unsigned char server[4] = { 192, 0, 2, 53 };
+  static const unsigned char client[4] = { 192, 0, 2, 1 };
+  tcp_header_t header;
+  const char *message;
+  size_t message_length;
+  unsigned count = 0;
+
+  memset (&header, 0, sizeof (header));
+  header.source_port = 53;
+  header.destination_port = port;
+  header.sequence = ISN + 1 + offset;
+  header.offset = 0x50;
+  header.flags = flags;
+
+  for (message = tcp_segment (4, server, client, &header,
+                              stream + offset % sizeof (stream), length,
+                              &message_length);
+       message != 0; message = tcp_next (&message_length))
+    {
+      CHECK (message_length == MESSAGE);
+      CHECK (memcmp (message, stream + 2, MESSAGE) == 0);
+      ++count;
+    }
+  return count;
+}
+
+/* Starts tracking the connection to client port PORT. */
+static void
+open_connection (uint16_t port)
+{
+  tcp_header_t header;
+  size_t message_length;
+  static const unsigned char server[4] = { 192, 0, 2, 53 };
+  static const unsigned char client[4] = { 192, 0, 2, 1 };
+
+  memset (&header, 0, sizeof (header));
+  header.source_port = 53;
+  header.destination_port = port;
+  header.sequence = ISN;
+  header.offset = 0x50;
+  header.flags = TCP_SYN | TCP_ACK;
+  CHECK (tcp_segment (4, server, client, &header, 0, 0, &message_length) == 0);
+}
+
+static void *
+messages (void *closure)
+{
+  (void)closure;
+  open_connection (1);
+  CHECK (add (1, TCP_ACK, 0, 1000) == 0);
+  CHECK (add (1, TCP_ACK, 1000, 1000) == 0);
+  CHECK (add (1, TCP_ACK, 2000, sizeof (stream) - 2000) == 1);
+
+  /* Out of order, and retransmitted. */
+  CHECK (add (1, TCP_ACK, sizeof (stream) + 1500, 1502) == 0);
+  CHECK (add (1, TCP_ACK, sizeof (stream), 1000) == 0);
+  CHECK (add (1, TCP_ACK, sizeof (stream), 1000) == 0);
+  CHECK (add (1, TCP_ACK, sizeof (stream) + 500, 1000) == 1);
+
+  /* Untracked connections are ignored. */
+  CHECK (add (2, TCP_ACK, 0, sizeof (stream)) == 0);
+  return 0;
+}
+
+static void *
+expiry (void *closure)
+{
+  unsigned long messages, timeouts, evictions, rejected, before;
+
+  (void)closure;
+  tcp_statistics (&messages, &before, &evictions, &rejected);
+
+  /* The idle timeout is restarted by each segment. */
+  fake_time = 1000 * SECOND;
+  open_connection (1);
+  fake_time = 1029 * SECOND;
+  CHECK (add (1, TCP_ACK, 0, 1000) == 0);
+  fake_time = 1058 * SECOND;
+  CHECK (add (1, TCP_ACK, 1000, sizeof (stream) - 1000) == 1);
+  tcp_statistics (&messages, &timeouts, &evictions, &rejected);
+  CHECK (timeouts == before);
+
+  fake_time = 1088 * SECOND;
+  CHECK (add (1, TCP_ACK, sizeof (stream), sizeof (stream)) == 0);
+  tcp_statistics (&messages, &timeouts, &evictions, &rejected);
+  CHECK (timeouts == before + 1);
+  return 0;
+}
+
+static void *
+flood (void *closure)
+{
+  unsigned long messages, timeouts, evictions, rejected, before;
+  unsigned j;
+
+  (void)closure;
+  tcp_statistics (&messages, &timeouts, &before, &rejected);
+
+  /* The table holds four connections.  An established connection
+     survives the flood if it is younger than the flood
+     connections. */
+  fake_time = 100 * SECOND;
+  for (j = 0; j < 100; ++j)
+    open_connection (1000 + j);
+  fake_time = 101 * SECOND;
+  open_connection (1);
+  for (j = 0; j < 3; ++j)
+    open_connection (2000 + j);
+  tcp_statistics (&messages, &timeouts, &evictions, &rejected);
+  CHECK (evictions == before + 100);
+  CHECK (add (1, TCP_ACK, 0, sizeof (stream)) == 1);
+  return 0;
+}
+
+static void *
+memory (void *closure)
+{
+  unsigned long messages, timeouts, evictions, rejected, before;
+
+  (void)closure;
+  tcp_statistics (&messages, &timeouts, &before, &rejected);
+
+  /* Partial messages of two connections do not fit into 6k, so the
+     older one is evicted. */
+  fake_time = 100 * SECOND;
+  open_connection (1);
+  CHECK (add (1, TCP_ACK, 0, 2500) == 0);
+  fake_time = 101 * SECOND;
+  open_connection (2);
+  CHECK (add (2, TCP_ACK, 0, 2500) == 0);
+  tcp_statistics (&messages, &timeouts, &evictions, &rejected);
+  CHECK (evictions == before + 1);
+  CHECK (add (1, TCP_ACK, 2500, sizeof (stream) - 2500) == 0);
+  CHECK (add (2, TCP_ACK, 2500, sizeof (stream) - 2500) == 1);
+
+  /* The out-of-order limit is 1k. */
+  tcp_statistics (&messages, &timeouts, &evictions, &before);
+  CHECK (add (2, TCP_ACK, sizeof (stream) + 100, 2000) == 0);
+  tcp_statistics (&messages, &timeouts, &evictions, &rejected);
+  CHECK (rejected == before + 1);
+  return 0;
+}
+
+/* Extracts the messages of the "messages" scenario in several threads
+   at the same time.  The counters of all threads are summed. */
+static void
+workers (void)
+{
+  unsigned long before, after, timeouts, evictions, rejected;
+
+  tcp_statistics (&before, &timeouts, &evictions, &rejected);
+  run_workers (tcp_configure, "1m", messages, 4);
+  tcp_statistics (&after, &timeouts, &evictions, &rejected);
+  CHECK (after == before + 4 * 2);
+}
+
+int
+main (void)
+{
+  unsigned j;
+
+  stream[0] = MESSAGE >> 8;
+  stream[1] = MESSAGE & 0xFF;
+  for (j = 2; j < sizeof (stream); ++j)
+    stream[j] = j * 7 + (j >> 8);
+  harness_init ("stream");
+
+  run (tcp_configure, "1m", messages);
+  workers ();
+  run (tcp_configure, "1m", expiry);
+  run (tcp_configure, "1m,flows=4", flood);
+  run (tcp_configure, "6k,out-of-order=1k", memory);
+  return failed;
+}
@@ -0,0 +1,235 @@
+/* dnslogger-forward - Forward DNS traffic for analysis
+ * Copyright (C) 2005 Florian Weimer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/* Exercises the zone lists: longest-match semantics, case folding,
+   the root zone, reloading (including a file with an error, which
+   must keep the previous lists), a reload seen by another thread, and
+   a large list.  Exits with a non-zero status on failure. */
+
+#include "config.h"
+#include "harness.h"
+#include "log.h"
+#include "zone.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char path[] = "/tmp/zone-test-XXXXXX";
+
+/* Replaces the contents of the zone file with TEXT. */
+static void
+write_zones (const char *text)
+{
+  FILE *file = fopen (path, "w");
+
+  if (file == 0 || fputs (text, file) < 0 || fclose (file) != 0)
+    {
+      perror (path);
+      exit (1);
+    }
+}
+
+/* Returns nonzero if a response for the dotted NAME is forwarded. */
+static int
+forwarded (const char *name)
+{
+  char message[512], copy[256];
+  size_t length = 12;
+  char *label, *rest;
+
+  memset (message, 0, 12);
+  message[2] = 0x84;            /* QR, AA */
+  message[5] = 1;               /* QDCOUNT */
+  strcpy (copy, name);
+  for (label = strtok_r (copy, ".", &rest); label;
+       label = strtok_r (0, ".", &rest))
+    {
+      message[length++] = strlen (label);
+      memcpy (message + length, label, strlen (label));
+      length += strlen (label);
+    }
+  memcpy (message + length, "\0\0\1\0\1", 5);
+  length += 5;
+  return !zone_check (message, length);
+}
+
+static void
+longest_match (void)
+{
+  static const char empty[] = "\x12\x34\x84\x00\x00\x00\x00\x00\x00\x00\x00\x00";
+  static const char compressed[] =
+    "\x12\x34\x84\x00\x00\x01\x00\x00\x00\x00\x00\x00\xc0\x0c\x00\x01\x00\x01";
+  unsigned long included, excluded, unlisted;
+  unsigned long included0, excluded0, unlisted0;
+
+  zone_statistics (&included0, &excluded0, &unlisted0);
+  write_zones ("# Only German names, but not NIC.DE.\n"
+               "include de\n"
+               "exclude NIC.de.   # except for\n"
+               "\n"
+               "include www.nic.de\n");
+  CHECK (zone_reload ());
+  CHECK (forwarded ("de"));
+  CHECK (forwarded ("a.de"));
+  CHECK (forwarded ("A.DE"));
+  CHECK (!forwarded ("nic.de"));
+  CHECK (!forwarded ("x.Nic.de"));
+  CHECK (forwarded ("www.nic.de"));
+  CHECK (forwarded ("a.www.nic.de"));
+  CHECK (forwarded ("xnic.de"));
+  CHECK (!forwarded ("com"));
+  CHECK (!forwarded ("de.com"));
+
+  /* Responses without a (valid) query name match no zone. */
+  CHECK (zone_check (empty, sizeof (empty) - 1));
+  CHECK (zone_check (compressed, sizeof (compressed) - 1));
+
+  zone_statistics (&included, &excluded, &unlisted);
+  CHECK (included - included0 == 6);
+  CHECK (excluded - excluded0 == 2);
+  CHECK (unlisted - unlisted0 == 4);
+
+  /* Without included zones, other names are forwarded. */
+  write_zones ("exclude internal.example\nexclude cdn.net\n");
+  CHECK (zone_reload ());
+  CHECK (!forwarded ("internal.example"));
+  CHECK (!forwarded ("www.internal.example"));
+  CHECK (forwarded ("example"));
+  CHECK (forwarded ("net"));
+  CHECK (!forwarded ("a.b.CDN.net"));
+  CHECK (zone_check (empty, sizeof (empty) - 1) == 0);
+
+  /* The root zone. */
+  write_zones ("exclude .\ninclude com\nexclude a.b.c.d.com\n");
+  CHECK (zone_reload ());
+  CHECK (forwarded ("example.com"));
+  CHECK (!forwarded ("example.org"));
+  CHECK (!forwarded ("a.b.c.d.com"));
+  CHECK (forwarded ("b.c.d.com"));
+}
+
+static void
+errors (void)
+{
+  static const char *const files[] =
+    {
+      "allow example.com\n",
+      "include\n",
+      "include a..b\n",
+      "include .a\n",
+      "include a b\n",
+      "include a234567890123456789012345678901234567890123456789012345678901234\n",
+    };
+  unsigned j;
+
+  write_zones ("exclude example.com\n");
+  CHECK (zone_reload ());
+  for (j = 0; j < sizeof (files) / sizeof (files[0]); ++j)
+    {
+      write_zones (files[j]);
+      CHECK (!zone_reload ());
+      CHECK (!forwarded ("example.com"));
+      CHECK (forwarded ("example.org"));
+    }
+}
+
+static volatile int reloaded;
+
+static void *
+other_thread (void *closure)
+{
+  (void)closure;
+  CHECK (!forwarded ("example.com"));
+  while (!__atomic_load_n (&reloaded, __ATOMIC_ACQUIRE))
+    ;
+  CHECK (forwarded ("example.com"));
+  CHECK (!forwarded ("example.org"));
+  return 0;
+}
+
+/* A thread switches to the new lists on its next lookup. */
+static void
+reload_in_other_thread (void)
+{
+  pthread_t thread;
+
+  write_zones ("exclude example.com\n");
+  CHECK (zone_reload ());
+  reloaded = 0;
+  if (pthread_create (&thread, 0, other_thread, 0) != 0)
+    abort ();
+  sleep (1);
+  write_zones ("exclude example.org\n");
+  CHECK (zone_reload ());
+  __atomic_store_n (&reloaded, 1, __ATOMIC_RELEASE);
+  pthread_join (thread, 0);
+}
+
+#define LARGE 100000
+
+static void
+large (void)
+{
+  FILE *file = fopen (path, "w");
+  char name[64];
+  unsigned j;
+
+  if (file == 0)
+    abort ();
+  for (j = 0; j < LARGE; ++j)
+    fprintf (file, "%s zone%u.%s.example\n", j % 2 ? "include" : "exclude",
+             j, j % 3 ? "cdn" : "corp");
+  if (fclose (file) != 0)
+    abort ();
+  CHECK (zone_reload ());
+  for (j = 0; j < LARGE; j += 997)
+    {
+      sprintf (name, "www.zone%u.%s.example", j, j % 3 ? "cdn" : "corp");
+      CHECK (forwarded (name) == (j % 2 != 0));
+      sprintf (name, "www.zone%u.%s.example", j, j % 3 ? "corp" : "cdn");
+      CHECK (!forwarded (name));
+    }
+}
+
+int
+main (void)
+{
+  int fd = mkstemp (path);
+
+  if (fd < 0)
+    {
+      perror ("mkstemp");
+      return 1;
+    }
+  close (fd);
+  harness_init ("zone");
+  log_set_program ("zone");
+  write_zones ("include .\n");
+  zone_configure (path);
+
+  longest_match ();
+  errors ();
+  reload_in_other_thread ();
+  large ();
+  unlink (path);
+  return failed;
+}